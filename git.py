@@ -25,11 +25,16 @@ PACKED = 2
 # Current emphasis is on read-only operations.
 class Git(object):
     repo = None # path to .git dir
-    head = None # name (ie. master)
+    head = None # name (ie. master), or None if HEAD is detached
     headSha1 = None
     headObj = None # GitObject for the head commit
+    odb = None # gitutil.Repo; objects and refs
     
-    def __init__(self, repo=None):
+    # With verify, every object read is checked against its id, and one that
+    # doesn't match raises gitutil.CorruptObjectError. The pack list is
+    # rescanned at most every refresh seconds, so a long-lived Git picks up
+    # pushes and repacks.
+    def __init__(self, repo=None, verify=False, refresh=1):
         # make sure we have the repo dir right
         if not repo:
             if os.getcwd().split('/')[-1:] == '.git':
@@ -45,30 +50,44 @@ class Git(object):
                 self.repo = os.path.join(repo, '.git')
             else:
                 raise Exception, "Could not location .git directory"
+        self.odb = gitutil.Repo(self.repo, refresh=refresh, verify=verify)
         
-        # find current head
-        f = open(os.path.join(self.repo, 'HEAD'))
-        f.seek(5) # "ref: "
-        headPath = os.path.join(self.repo, f.read()[:-1]) # ignore trailing \n
-        f.close()
-        
-        f = open(headPath)
-        self.head = headPath.split('/').pop()
-        self.headSha1 = f.read()[:-1] # ignore trailing \n
-        f.close()
-        self.headObj = GitObject(self.headSha1, self.repo)
+        # find current head; HEAD may be detached, and the branch may be packed
+        headRef, self.headSha1 = self.odb.head()
+        if headRef and headRef.startswith('refs/heads/'):
+            self.head = headRef[len('refs/heads/'):]
+        else:
+            self.head = headRef
+        if self.headSha1:
+            self.headObj = GitObject(self.headSha1, self.repo)
     
     # git branch
     #
     # Returns: list of (branch name, current)
     def list_branches(self):
         branches = []
-        for branch in os.listdir(os.path.join(self.repo, "refs/heads")):
-            if branch is self.head:
-                branches.append( (branch, True) )
-            else:
-                branches.append( (branch, False) )
+        for ref, sha1 in self.odb.refs('refs/heads/'):
+            branch = ref[len('refs/heads/'):]
+            branches.append( (branch, branch == self.head) )
         return branches
+    
+    # git show-ref --tags -d
+    #
+    # Tags are peeled from packed-refs where possible, so annotated tags
+    # don't have to be read.
+    #
+    # Returns: list of (tag name, sha1, sha1 of the object it finally points to)
+    def list_tags(self):
+        return [(ref[len('refs/tags/'):], sha1, peeled)
+                for ref, sha1, peeled in self.odb.refs('refs/tags/', peel=True)]
+    
+    # git rev-parse <name>
+    #
+    # Accepts the same short names git does (master, v1.0, origin/master).
+    #
+    # Returns: the sha1, or None if there's no such ref
+    def resolve(self, name):
+        return self.odb.resolve_ref(name)
 
     # git rev-list [--maxcount=x] <commit> [<path>]
     #
@@ -99,44 +118,24 @@ class Git(object):
             
             return commits
         else:
-            # The idea here is find the last time the path was changed.
-            #
-            # 1) Start by finding its (and any parent trees it's in) sha1 for the
-            #    given commit.
-            # 2) Compare those sha1's--starting with the top-most level--with the parent commit.
-            # 3) Update upper-level sha1's as needed until the bottom-most sha1 (the actual blob)
-            #    changes.
-            # 4) Go forward one commit and return it.
-            
-            def build_tree(path, tree):
-                #print "building a tree"
-                pathSha1s = []
-                for i in range(len(path)):
-                    for mode, sha1, name in tree:
-                        if i != len(path) - 1:
-                            # then we are looking for directories
-                            if mode == 40000 and name == path[i]:
-                                pathSha1s.append(sha1)
-                                break
-                        else:
-                            # then we are looking for a file
-                            if mode != 40000 and name == path[i]:
-                                pathSha1s.append(sha1)
-                                break
-                    if i + 1 == len(pathSha1s) and i + 1 < len(path):
-                        # we need another tree to dig down
-                        tree = GitObject(sha1, self.repo).entries
-                    else:
-                        break
-                return pathSha1s
+            # The idea here is find the last time the path was changed: go back
+            # through first parents until the blob at the path differs from the
+            # one in the given commit, then go forward one commit and return it.
+            # Resolving the path reads only the trees along it, and trees already
+            # seen by earlier commits aren't read again.
             
             # prep path if needed (we just want the path within the rep, not a full path)
             if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
                 path = path[len(self.repo[:-4]):]
-            path = path.split('/')
-                        
-            initialSha1Tree = build_tree(path, GitObject(workingCommit.tree, self.repo).entries)
-            if len(path) != len(initialSha1Tree):
+            
+            def path_sha1(commit):
+                found = self.odb.resolve_path(commit.tree, path)
+                if found is None or found[0] == 40000:
+                    return None # only files count
+                return found[1]
+            
+            initialSha1 = path_sha1(workingCommit)
+            if initialSha1 is None:
                 raise Exception, "That path does not exist within the provided commit"
                 return None
             if workingCommit.parent == None:
@@ -145,17 +144,142 @@ class Git(object):
             
             previousCommit = workingCommit
             workingCommit = GitObject(workingCommit.parent, self.repo)
-            sha1Tree = build_tree(path, GitObject(workingCommit.tree, self.repo).entries)
-            while len(sha1Tree) == len(initialSha1Tree) and sha1Tree[-1:] == initialSha1Tree[-1:] and workingCommit.parent != None:
+            while path_sha1(workingCommit) == initialSha1 and workingCommit.parent != None:
                 previousCommit = workingCommit
                 workingCommit = GitObject(workingCommit.parent, self.repo)
                 if workingCommit.tree == None:
                     raise Exception, "there is a problem in the function!!!"
                     return None
-                sha1Tree = build_tree(path, GitObject(workingCommit.tree, self.repo).entries)
             
             return previousCommit
     
+    # git log --first-parent -1 <commit> -- <path>/<entry>, for every entry of a directory
+    #
+    # If commit is left as None, then the current head is used. One walk of
+    # the history covers the whole directory. With budget_ms, gives up after
+    # that long; entries it didn't get to have None for their commit.
+    #
+    # Returns: list of (name, mode, sha1, commit sha1) in tree order, or None
+    #          if there's no such directory
+    def last_modified(self, path='', commit=None, budget_ms=0):
+        if commit is None:
+            commit = self.headSha1
+        if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
+            path = path[len(self.repo[:-4]):]
+        return self.odb.last_modified(commit, path, budget_ms)
+
+    # git blame --porcelain [-L <start>,<end>] <commit> -- <path>
+    #
+    # If commit is left as None, then the current head is used. Renames aren't
+    # followed. With budget_ms, gives up after that long; lines it didn't get
+    # to the bottom of have None for their commit.
+    #
+    # Returns: list of (commit sha1, orig line, final line, line count) in file
+    #          order, lines numbered from 1, or None if there's no such file
+    def blame(self, path, commit=None, start=1, end=0, budget_ms=0):
+        if commit is None:
+            commit = self.headSha1
+        if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
+            path = path[len(self.repo[:-4]):]
+        return self.odb.blame(commit, path, start, end, budget_ms)
+
+    # git grep -I -n [-F|-E] [-i] [-m <limit>] <pattern> <commit> -- <path>
+    #
+    # If commit is left as None, then the current head is used. Files are
+    # searched in parallel; stopping the iteration early stops the search.
+    #
+    # Returns: iterator of (path, line number, line), or None if there's no
+    #          such path
+    def grep(self, pattern, commit=None, path='', fixed=False, extended=False, ignore_case=False, limit=0):
+        if commit is None:
+            commit = self.headSha1
+        if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
+            path = path[len(self.repo[:-4]):]
+        return self.odb.grep(commit, pattern, path, fixed, extended, ignore_case, limit)
+
+    # git archive --format=<format> [--prefix=<prefix>] <commit> [<path>]
+    #
+    # If commit is left as None, then the current head is used. out can be a
+    # file descriptor, a file, or a function to call with each piece of the
+    # archive in turn. It's written as it's made, so it needn't fit in memory.
+    #
+    # Returns: True, or None if there's no such path
+    def archive(self, out, commit=None, format='tar', path='', prefix=''):
+        if commit is None:
+            commit = self.headSha1
+        if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
+            path = path[len(self.repo[:-4]):]
+        if hasattr(out, 'fileno'):
+            out.flush()
+            out = out.fileno()
+        return self.odb.archive(commit, out, format, path, prefix)
+
+    # git merge-base --is-ancestor <ancestor> <commit>
+    #
+    # If commit is left as None, then the current head is used. Either may be
+    # a sha1 or a ref name.
+    #
+    # Returns: True or False
+    def is_ancestor(self, ancestor, commit=None):
+        if commit is None:
+            commit = self.headSha1
+        return self.odb.is_ancestor(ancestor, commit)
+
+    # git merge-base --all <commit> <other>...
+    #
+    # Returns: list of sha1s; empty if the histories are unrelated
+    def merge_base(self, commit, *others):
+        return self.odb.merge_bases(commit, others)
+
+    # git rev-list --left-right --count <commit>...<other>
+    #
+    # If other is left as None, then the current head is used.
+    #
+    # Returns: (commits only in commit, commits only in other)
+    def ahead_behind(self, commit, other=None):
+        if other is None:
+            other = self.headSha1
+        return self.odb.ahead_behind(commit, other)
+
+    # git rev-list --objects <include>... ^<exclude>...
+    #
+    # Walks everything reachable from the include sha1s that isn't reachable
+    # from the exclude ones, without re-reading shared subtrees.
+    #
+    # Returns: an iterator of (sha1, type, path) tuples
+    def rev_list_objects(self, include=None, exclude=()):
+        if include is None:
+            include = [self.headSha1]
+        return self.odb.walk(include, exclude)
+
+    # git cat-file --batch
+    # Reads the objects in pack order rather than in the order given, which is
+    # much quicker for big batches; the results still line up with sha1s.
+    #
+    # Returns: a list of (type, size, data) tuples, with None for missing objects
+    def cat_file_batch(self, sha1s):
+        return self.odb.read_many(sha1s)
+
+    # git cat-file blob <sha1> | tail -c +<offset+1> | head -c <length>
+    #
+    # Only inflates what it has to; big objects are remembered at points
+    # along the way, so later reads near the end don't start from the top.
+    #
+    # Returns: (type, whole size, data), or None if there's no such object
+    def read_range(self, sha1, offset, length):
+        return self.odb.read_range(sha1, offset, length)
+
+    # git diff --no-indent-heuristic [--histogram] <old> <new>
+    # Either blob may be None, for an empty file. Past max_bytes the blobs
+    # aren't read, and past budget_ms the rest is shown as one change.
+    #
+    # Returns: (kind, added, removed, hunks), where kind is 'text',
+    #          'approximate', 'binary' or 'too big', and hunks is the diff text
+    #          if unified, or else a list of (old_start, old_count, new_start,
+    #          new_count, function, [(tag, line), ...]); None if a blob is missing
+    def diff(self, old, new, algorithm='myers', context=3, unified=False, **limits):
+        return self.odb.diff(old, new, algorithm, context, unified, **limits)
+
     # git ls-tree <tree|commit>
     # Returns: a list of tree entries where each entry is a tuple: (mode, filename, sha1)
     #          or None on error.
@@ -174,6 +298,21 @@ class Git(object):
         #del tree # doesn't this also happen automatically? :P
         return entries
 
+    # git ls-tree -r [-t] [-l] <commit> [<path>]
+    #
+    # If commit is left as None, then the current head is used. depth > 0
+    # stops that many levels below path. Subtrees are read in parallel.
+    #
+    # Returns: list of (path, mode, sha1) tuples, or (path, mode, sha1, size)
+    #          with sizes (size is None for trees and submodules), or None if
+    #          there's no such path
+    def ls_tree_recursive(self, commit=None, path='', depth=0, trees=False, sizes=False):
+        if commit is None:
+            commit = self.headSha1
+        if self.repo[:-4] == path[:len(self.repo)-4]: # compare without "/.git"
+            path = path[len(self.repo[:-4]):]
+        return self.odb.ls_tree(commit, path, depth, trees, sizes)
+
 class GitObject(object):
     location = None # LOOSE or PACKED
     kind = None # aka: type
@@ -185,13 +324,19 @@ class GitObject(object):
     
     entries = None # only for trees
     
-    message = None # only for commits
-    parent = None
+    message = None # only for commits and tags
+    parent = None # the first parent
+    parents = None
     tree = None
     committer = None
     author = None
     commitTime = None
     
+    object = None # only for tags
+    objectType = None
+    tag = None
+    tagger = None
+    
     def __init__(self, sha1, gitDir, lazy=True):
         #print "######## " + sha1
         self.dir = gitDir
@@ -226,7 +371,7 @@ class GitObject(object):
             packDir = os.path.join(self.dir, 'objects/pack')
             idxFiles = [packDir + '/' + x for x in os.listdir(packDir) if x[-3:] == 'idx']
             for idx in idxFiles:
-                offset, fullSha1 = gitutil.pack_idx_read(idx, self.sha1)
+                offset, fullSha1 = gitutil.pack_idx_read(gitutil.PackIdx(idx), self.sha1)
                 if offset != 0:
                     self.location = PACKED
                     self.path = idx[:-3] + 'pack'
@@ -266,24 +411,32 @@ class GitObject(object):
         
         # begin loading
         if not self.message and self.kind is COMMIT:
-            self.tree = self.raw[5:45]
-            if self.raw[46:53] == "parent ":
-                self.parent = self.raw[53:93]
-            else:
-                # initial commit; there is no parent
-                self.parent = None
-            
-            #self.raw.seek(self.raw.tell() + 8) # "\nauthor "
-            #line = self.raw.readline()
-            #self.author = line[:line.index('>')+1] # include the email address
-            
-            #self.raw.seek(self.raw.tell() + 10) # "comitter "
-            #line = self.raw.readline()
-            #self.comitter = line[:line.index('>')+1]
-            #self.commitTime = line[line.index('>')+2:len(line)-1]
-            
-            #self.raw.seek(self.raw.tell() + 1) # "\n"
-            self.message = self.raw # get the rest
+            commit = gitutil.parse_commit(self.raw)
+            self.tree = commit.tree
+            self.parents = commit.parents
+            self.parent = self.parents[0] if self.parents else None # None for an initial commit
+            if commit.author_email is not None:
+                self.author = '%s <%s>' % (commit.author_name, commit.author_email)
+            if commit.committer_email is not None:
+                self.committer = '%s <%s>' % (commit.committer_name, commit.committer_email)
+            self.commitTime = commit.committer_time
+            self.message = commit.message
         
     def loadTag(self):
-        pass
\ No newline at end of file
+        # quick error check
+        if not self.location:
+            raise Exception, "This is an involid object"
+            return
+        
+        if not self.message and self.kind is TAG:
+            header, _, self.message = self.raw[:].partition('\n\n')
+            for line in header.split('\n'):
+                field, _, value = line.partition(' ')
+                if field == 'object':
+                    self.object = value
+                elif field == 'type':
+                    self.objectType = value
+                elif field == 'tag':
+                    self.tag = value
+                elif field == 'tagger':
+                    self.tagger = value
\ No newline at end of file
@@ -0,0 +1,602 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "oidmap.h"
+#include "commit.h"
+#include "commitgraph.h"
+#include "ancestry.h"
+
+// Ancestry queries (is-ancestor, merge bases, ahead/behind), as in git's
+// commit-reach.c.
+//
+// All three paint the history: commits reachable from one side get PARENT1,
+// from the other PARENT2, walking back in a queue ordered by generation
+// number, then date. A commit with both is common to the two sides, and
+// everything behind it is marked STALE; once nothing left in the queue is
+// still interesting, the walk is over.
+//
+// With a commit-graph, commits come out of it without being read, and
+// generation numbers bound the walk: nothing with a lower generation than a
+// commit can reach it. Commits the graph doesn't have are read from the object
+// store and treated as newer than all of it, which they are. Without a graph
+// everything is ordered by commit date, which is only as good as the clocks
+// of whoever made the commits; git has the same weakness.
+//
+// A context keeps the commits it has loaded, so asking several questions of
+// it is cheaper than asking each of a new one. It isn't thread safe.
+
+#define ANCESTRY_PARENT1 1
+#define ANCESTRY_PARENT2 2
+#define ANCESTRY_STALE   4
+#define ANCESTRY_RESULT  8
+#define ANCESTRY_DONE    16 // popped from the queue
+
+#define ANCESTRY_CACHE_BYTES (8 << 20)
+#define ANCESTRY_SLOP 5 // as in git's revision.c
+
+struct ancestry_commit {
+    unsigned char sha1[20];
+    uint32_t generation;   // GRAPH_GENERATION_INFINITY if the graph doesn't have it
+    uint64_t date;
+    uint32_t parents;      // index of the first parent in parent_ids
+    uint32_t nparents;
+    int flags;
+    uint32_t queued;       // how many times it's in the queue right now
+};
+
+struct ancestry_spread {
+    uint32_t commit;
+    int flags;
+};
+
+struct ancestry {
+    const struct odb *odb;
+    const struct commit_graph *graph;
+    struct base_cache *cache;
+
+    struct oid_map commit_map;      // id -> index in commits
+    struct ancestry_commit *commits;
+    uint32_t ncommits, commits_alloc;
+    unsigned char (*parent_ids)[20];
+    uint32_t nparent_ids, parent_ids_alloc;
+
+    uint32_t *queue;                // a max-heap on generation, then date
+    uint32_t nqueue, queue_alloc;
+    uint32_t nonstale;              // queue entries that aren't STALE
+    uint32_t *touched;              // commits with flags to clear before the next query
+    uint32_t ntouched, touched_alloc;
+    uint32_t *results;
+    uint32_t nresults, results_alloc;
+    struct ancestry_spread *spread;
+    uint32_t spread_alloc;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+// Neither must be freed before the context is.
+struct ancestry *ancestry_new(const struct odb *odb, const struct commit_graph *graph)
+{
+    struct ancestry *a;
+
+    if(!(a = calloc(1, sizeof(struct ancestry))))
+        return NULL;
+    if(!(a->cache = base_cache_new(ANCESTRY_CACHE_BYTES))) {
+        free(a);
+        return NULL;
+    }
+    a->odb = odb;
+    a->graph = graph;
+    return a;
+}
+
+void ancestry_free(struct ancestry *a)
+{
+    if(!a)
+        return;
+    base_cache_free(a->cache);
+    oid_map_free(&a->commit_map);
+    free(a->commits);
+    free(a->parent_ids);
+    free(a->queue);
+    free(a->touched);
+    free(a->results);
+    free(a->spread);
+    free(a);
+}
+
+static int add_parent_id(struct ancestry *a, const unsigned char *sha1)
+{
+    void *grown;
+
+    if(!(grown = grow(a->parent_ids, &a->parent_ids_alloc, a->nparent_ids + 1, 20)))
+        return -1;
+    a->parent_ids = grown;
+    memcpy(a->parent_ids[a->nparent_ids++], sha1, 20);
+    return 0;
+}
+
+static int load_from_graph(struct ancestry *a, struct ancestry_commit *commit, uint32_t pos)
+{
+    struct graph_commit gc;
+    uint32_t n, parent;
+    int ret;
+
+    if(commit_graph_commit(a->graph, pos, &gc) != 0)
+        return -1;
+    commit->generation = gc.generation;
+    commit->date = gc.date;
+    for(n = 0; (ret = commit_graph_parent(a->graph, &gc, n, &parent)) == 0; n++) {
+        if(add_parent_id(a, commit_graph_sha1(a->graph, parent)) != 0)
+            return -1;
+    }
+    commit->nparents = n;
+    return (ret < 0) ? -1 : 0;
+}
+
+static int load_from_odb(struct ancestry *a, struct ancestry_commit *commit)
+{
+    struct git_object g_obj;
+    struct commit parsed;
+    unsigned char sha1[20];
+    unsigned int i;
+    int ret = -1;
+
+    if(odb_read(a->odb, commit->sha1, &g_obj, a->cache) != 0)
+        return -1;
+    if(g_obj.type == COMMIT && commit_parse(g_obj.mem_data, g_obj.size, &parsed) == 0) {
+        commit->generation = GRAPH_GENERATION_INFINITY;
+        commit->date = parsed.committer.time > 0 ? parsed.committer.time : 0;
+        commit->nparents = parsed.nparents;
+        for(i = 0, ret = 0; ret == 0 && i < parsed.nparents; i++) {
+            if((ret = commit_parent(&parsed, i, sha1)) == 0)
+                ret = add_parent_id(a, sha1);
+        }
+    }
+    free(g_obj.mem_data);
+    return ret;
+}
+
+// Returns the index of a commit, loading it if we haven't yet; -1 if it's
+// missing or not a commit.
+static int64_t load_commit(struct ancestry *a, const unsigned char *id)
+{
+    struct ancestry_commit *commit;
+    uint32_t c, pos;
+    void *grown;
+    int ret;
+
+    if(oid_map_get(&a->commit_map, id, &c) == 0)
+        return c;
+    if(!(grown = grow(a->commits, &a->commits_alloc, a->ncommits + 1, sizeof(struct ancestry_commit))))
+        return -1;
+    a->commits = grown;
+    c = a->ncommits;
+    commit = &a->commits[c];
+    memcpy(commit->sha1, id, 20); // id may point into parent_ids, which loading can move
+    commit->flags = 0;
+    commit->queued = 0;
+    commit->parents = a->nparent_ids;
+
+    if(a->graph && commit_graph_find(a->graph, commit->sha1, &pos) == 0)
+        ret = load_from_graph(a, commit, pos);
+    else
+        ret = load_from_odb(a, commit);
+    if(ret != 0 || oid_map_put(&a->commit_map, commit->sha1, c) != 0) {
+        a->nparent_ids = commit->parents;
+        return -1;
+    }
+    a->ncommits++;
+    return c;
+}
+
+/////////////////////////////////////////////////////////////////////
+// painting                                                        //
+/////////////////////////////////////////////////////////////////////
+
+static inline int queue_before(const struct ancestry *a, uint32_t x, uint32_t y)
+{
+    const struct ancestry_commit *cx = &a->commits[x], *cy = &a->commits[y];
+
+    if(cx->generation != cy->generation)
+        return cx->generation > cy->generation;
+    return cx->date > cy->date;
+}
+
+static int queue_push(struct ancestry *a, uint32_t c)
+{
+    uint32_t i, parent, tmp;
+    void *grown;
+
+    if(!(grown = grow(a->queue, &a->queue_alloc, a->nqueue + 1, sizeof(uint32_t))))
+        return -1;
+    a->queue = grown;
+    i = a->nqueue++;
+    a->queue[i] = c;
+    while(i > 0) {
+        parent = (i - 1) / 2;
+        if(!queue_before(a, a->queue[i], a->queue[parent]))
+            break;
+        tmp = a->queue[i];
+        a->queue[i] = a->queue[parent];
+        a->queue[parent] = tmp;
+        i = parent;
+    }
+
+    a->commits[c].queued++;
+    if(!(a->commits[c].flags & ANCESTRY_STALE))
+        a->nonstale++;
+    return 0;
+}
+
+static uint32_t queue_pop(struct ancestry *a)
+{
+    uint32_t top = a->queue[0], i = 0, child, tmp;
+
+    a->queue[0] = a->queue[--a->nqueue];
+    for(;;) {
+        child = 2 * i + 1;
+        if(child >= a->nqueue)
+            break;
+        if(child + 1 < a->nqueue && queue_before(a, a->queue[child + 1], a->queue[child]))
+            child++;
+        if(!queue_before(a, a->queue[child], a->queue[i]))
+            break;
+        tmp = a->queue[i];
+        a->queue[i] = a->queue[child];
+        a->queue[child] = tmp;
+        i = child;
+    }
+
+    a->commits[top].queued--;
+    if(!(a->commits[top].flags & ANCESTRY_STALE))
+        a->nonstale--;
+    return top;
+}
+
+static int add_flags(struct ancestry *a, uint32_t c, int flags)
+{
+    struct ancestry_commit *commit = &a->commits[c];
+    void *grown;
+
+    if(!commit->flags) {
+        if(!(grown = grow(a->touched, &a->touched_alloc, a->ntouched + 1, sizeof(uint32_t))))
+            return -1;
+        a->touched = grown;
+        a->touched[a->ntouched++] = c;
+    }
+    if((flags & ANCESTRY_STALE) && !(commit->flags & ANCESTRY_STALE))
+        a->nonstale -= commit->queued;
+    commit->flags |= flags;
+    return 0;
+}
+
+static void reset(struct ancestry *a)
+{
+    uint32_t i;
+
+    for(i = 0; i < a->ntouched; i++) {
+        a->commits[a->touched[i]].flags = 0;
+        a->commits[a->touched[i]].queued = 0;
+    }
+    a->ntouched = 0;
+    a->nqueue = 0;
+    a->nonstale = 0;
+    a->nresults = 0;
+}
+
+// Paints a commit the walk is already past, and whatever it has passed on
+// to, rather than waiting for them to come round in the queue again; git's
+// mark_parents_uninteresting() does the same.
+static int spread_flags(struct ancestry *a, uint32_t start, int flags)
+{
+    struct ancestry_commit *commit;
+    uint32_t nspread = 0, c, i;
+    int64_t p;
+    void *grown;
+
+    if(!(grown = grow(a->spread, &a->spread_alloc, 1, sizeof(struct ancestry_spread))))
+        return -1;
+    a->spread = grown;
+    a->spread[nspread].commit = start;
+    a->spread[nspread++].flags = flags;
+    while(nspread) {
+        c = a->spread[--nspread].commit;
+        flags = a->spread[nspread].flags;
+        commit = &a->commits[c];
+        if((commit->flags & flags) == flags)
+            continue;
+        if(add_flags(a, c, flags) != 0)
+            return -1;
+        if(!(commit->flags & ANCESTRY_DONE)) {
+            if(queue_push(a, c) != 0)
+                return -1;
+            continue;
+        }
+
+        flags = commit->flags & (ANCESTRY_PARENT1 | ANCESTRY_PARENT2 | ANCESTRY_STALE);
+        if((flags & (ANCESTRY_PARENT1 | ANCESTRY_PARENT2)) == (ANCESTRY_PARENT1 | ANCESTRY_PARENT2))
+            flags |= ANCESTRY_STALE;
+        if(!(grown = grow(a->spread, &a->spread_alloc, nspread + commit->nparents + 1,
+                          sizeof(struct ancestry_spread))))
+            return -1;
+        a->spread = grown;
+        for(i = 0; i < a->commits[c].nparents; i++) {
+            // walked past, so its parents are loaded (or missing)
+            if((p = load_commit(a, a->parent_ids[a->commits[c].parents + i])) < 0)
+                continue;
+            a->spread[nspread].commit = p;
+            a->spread[nspread++].flags = flags;
+        }
+    }
+    return 0;
+}
+
+// git's paint_down_to_common(). Commits with a generation below
+// min_generation aren't walked past. With collect, commits found to be
+// common are gathered in a->results. Stops early if stop_at (when not -1)
+// gets painted from the twos side.
+//
+// With settle, every commit painted from only one side really is only
+// reachable from that side once it's done. Generation numbers guarantee that
+// by the time nothing interesting is left; dates don't, as a commit older
+// than its parent may be popped before it and so miss being marked STALE.
+// So flags reaching a commit already walked past are spread on at once, and
+// while commits without a generation number are left, the walk keeps going as
+// long as the dates coming out are out of order, and a few commits past that,
+// as git's limit_list() does.
+static int paint_down(struct ancestry *a, uint32_t one, const uint32_t *twos, int ntwos,
+                      uint32_t min_generation, int collect, int64_t stop_at, int settle)
+{
+    uint32_t c, i, top;
+    uint64_t last_date = 0;
+    int64_t p;
+    int flags, slop = ANCESTRY_SLOP;
+    void *grown;
+
+    reset(a);
+    if(add_flags(a, one, ANCESTRY_PARENT1) != 0 || queue_push(a, one) != 0)
+        return -1;
+    for(i = 0; i < (uint32_t) ntwos; i++) {
+        if(add_flags(a, twos[i], ANCESTRY_PARENT2) != 0 || queue_push(a, twos[i]) != 0)
+            return -1;
+    }
+
+    while(a->nqueue) {
+        if(!a->nonstale) {
+            top = a->queue[0];
+            if(!settle || a->commits[top].generation != GRAPH_GENERATION_INFINITY)
+                break;
+            if(a->commits[top].date >= last_date)
+                slop = ANCESTRY_SLOP;
+            else if(--slop <= 0)
+                break;
+        }
+        c = queue_pop(a);
+        a->commits[c].flags |= ANCESTRY_DONE;
+        last_date = a->commits[c].date;
+        if(a->commits[c].generation < min_generation)
+            break;
+        flags = a->commits[c].flags & (ANCESTRY_PARENT1 | ANCESTRY_PARENT2 | ANCESTRY_STALE);
+        if(flags == (ANCESTRY_PARENT1 | ANCESTRY_PARENT2)) {
+            if(collect && !(a->commits[c].flags & ANCESTRY_RESULT)) {
+                a->commits[c].flags |= ANCESTRY_RESULT;
+                if(!(grown = grow(a->results, &a->results_alloc, a->nresults + 1, sizeof(uint32_t))))
+                    return -1;
+                a->results = grown;
+                a->results[a->nresults++] = c;
+            }
+            flags |= ANCESTRY_STALE;
+        }
+
+        for(i = 0; i < a->commits[c].nparents; i++) {
+            // commits can be reallocated while loading, so look them up each time
+            p = load_commit(a, a->parent_ids[a->commits[c].parents + i]);
+            if(p < 0)
+                continue; // a missing parent (a shallow clone, say) ends the history there
+            if((a->commits[p].flags & flags) == flags)
+                continue;
+            if(settle && (a->commits[p].flags & ANCESTRY_DONE)) {
+                if(spread_flags(a, p, flags) != 0)
+                    return -1;
+                continue;
+            }
+            if(add_flags(a, p, flags) != 0 || queue_push(a, p) != 0)
+                return -1;
+            if(p == stop_at && (flags & ANCESTRY_PARENT2))
+                return 0;
+        }
+    }
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// queries                                                         //
+/////////////////////////////////////////////////////////////////////
+
+// Whether ancestor is reachable from descendant (a commit is its own
+// ancestor), as in "git merge-base --is-ancestor". Returns 1 or 0, or -1 if
+// either is missing or something fails.
+int ancestry_is_ancestor(struct ancestry *a, const unsigned char *ancestor, const unsigned char *descendant)
+{
+    int64_t anc, desc;
+    uint32_t d;
+
+    if((anc = load_commit(a, ancestor)) < 0 || (desc = load_commit(a, descendant)) < 0)
+        return -1;
+    if(anc == desc)
+        return 1;
+    // an ancestor's generation is always lower, and one the graph has can't
+    // reach one it hasn't
+    if(a->commits[anc].generation >= a->commits[desc].generation &&
+       a->commits[desc].generation != GRAPH_GENERATION_INFINITY)
+        return 0;
+
+    d = desc;
+    if(paint_down(a, anc, &d, 1, a->commits[anc].generation, 0, anc, 0) != 0)
+        return -1;
+    return (a->commits[anc].flags & ANCESTRY_PARENT2) ? 1 : 0;
+}
+
+// Takes out the candidates that are ancestors of other candidates, as git's
+// remove_redundant() does.
+static int remove_redundant(struct ancestry *a, uint32_t *list, int *count)
+{
+    uint32_t *others, min_generation = GRAPH_GENERATION_INFINITY;
+    char *redundant;
+    int i, j, nothers, kept;
+
+    others = malloc(sizeof(uint32_t) * *count);
+    redundant = calloc(*count, 1);
+    if(!others || !redundant) {
+        free(others);
+        free(redundant);
+        return -1;
+    }
+    for(i = 0; i < *count; i++) {
+        if(a->commits[list[i]].generation < min_generation)
+            min_generation = a->commits[list[i]].generation;
+    }
+
+    for(i = 0; i < *count; i++) {
+        if(redundant[i])
+            continue;
+        for(j = 0, nothers = 0; j < *count; j++) {
+            if(j != i && !redundant[j])
+                others[nothers++] = list[j];
+        }
+        if(paint_down(a, list[i], others, nothers, min_generation, 0, -1, 0) != 0) {
+            free(others);
+            free(redundant);
+            return -1;
+        }
+        if(a->commits[list[i]].flags & ANCESTRY_PARENT2)
+            redundant[i] = 1;
+        for(j = 0; j < *count; j++) {
+            if(j != i && (a->commits[list[j]].flags & ANCESTRY_PARENT1))
+                redundant[j] = 1;
+        }
+    }
+
+    for(i = 0, kept = 0; i < *count; i++) {
+        if(!redundant[i])
+            list[kept++] = list[i];
+    }
+    *count = kept;
+    free(others);
+    free(redundant);
+    return 0;
+}
+
+// The best common ancestors of one and all of twos, as in "git merge-base
+// --all one twos...". *bases is malloc()'d; there may be none. Returns -1 if a
+// commit is missing or something fails.
+int ancestry_merge_bases(struct ancestry *a, const unsigned char *one, const unsigned char (*twos)[20], int ntwos,
+                         unsigned char (**bases)[20], int *nbases)
+{
+    uint32_t *two_list, *found;
+    int64_t c, one_c;
+    int i, nfound = 0;
+
+    *bases = NULL;
+    *nbases = 0;
+    if((one_c = load_commit(a, one)) < 0 || !(two_list = malloc(sizeof(uint32_t) * (ntwos ? ntwos : 1))))
+        return -1;
+    for(i = 0; i < ntwos; i++) {
+        if((c = load_commit(a, twos[i])) < 0) {
+            free(two_list);
+            return -1;
+        }
+        two_list[i] = c;
+    }
+
+    if(!(found = malloc(sizeof(uint32_t) * (ntwos ? ntwos : 1) + sizeof(uint32_t)))) {
+        free(two_list);
+        return -1;
+    }
+    for(i = 0; i < ntwos; i++) {
+        if(two_list[i] == one_c) { // one is the answer
+            found[nfound++] = one_c;
+            break;
+        }
+    }
+    if(!nfound && ntwos) {
+        if(paint_down(a, one_c, two_list, ntwos, 0, 1, -1, 0) != 0) {
+            free(two_list);
+            free(found);
+            return -1;
+        }
+        free(found);
+        if(!(found = malloc(sizeof(uint32_t) * (a->nresults ? a->nresults : 1)))) {
+            free(two_list);
+            return -1;
+        }
+        // results that turned out to be behind other results are stale
+        for(i = 0; i < (int) a->nresults; i++) {
+            if(!(a->commits[a->results[i]].flags & ANCESTRY_STALE))
+                found[nfound++] = a->results[i];
+        }
+        if(nfound > 1 && remove_redundant(a, found, &nfound) != 0) {
+            free(two_list);
+            free(found);
+            return -1;
+        }
+    }
+    free(two_list);
+
+    if(nfound && !(*bases = malloc(20 * nfound))) {
+        free(found);
+        return -1;
+    }
+    for(i = 0; i < nfound; i++)
+        memcpy((*bases)[i], a->commits[found[i]].sha1, 20);
+    *nbases = nfound;
+    free(found);
+    return 0;
+}
+
+// Counts the commits reachable from one but not two (ahead) and from two but
+// not one (behind), as in "git rev-list --left-right --count one...two".
+int ancestry_ahead_behind(struct ancestry *a, const unsigned char *one, const unsigned char *two,
+                          uint32_t *ahead, uint32_t *behind)
+{
+    int64_t one_c, two_c;
+    uint32_t t, i;
+    int flags;
+
+    *ahead = *behind = 0;
+    if((one_c = load_commit(a, one)) < 0 || (two_c = load_commit(a, two)) < 0)
+        return -1;
+    if(one_c == two_c)
+        return 0;
+
+    t = two_c;
+    if(paint_down(a, one_c, &t, 1, 0, 0, -1, 1) != 0)
+        return -1;
+    for(i = 0; i < a->ntouched; i++) {
+        flags = a->commits[a->touched[i]].flags & (ANCESTRY_PARENT1 | ANCESTRY_PARENT2);
+        if(flags == ANCESTRY_PARENT1)
+            (*ahead)++;
+        else if(flags == ANCESTRY_PARENT2)
+            (*behind)++;
+    }
+    return 0;
+}
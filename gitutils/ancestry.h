@@ -0,0 +1,20 @@
+#ifndef ANCESTRY_H
+#define ANCESTRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct commit_graph;
+struct ancestry;
+
+struct ancestry *ancestry_new(const struct odb *odb, const struct commit_graph *graph);
+void ancestry_free(struct ancestry *a);
+int ancestry_is_ancestor(struct ancestry *a, const unsigned char *ancestor, const unsigned char *descendant);
+int ancestry_merge_bases(struct ancestry *a, const unsigned char *one, const unsigned char (*twos)[20], int ntwos,
+                         unsigned char (**bases)[20], int *nbases);
+int ancestry_ahead_behind(struct ancestry *a, const unsigned char *one, const unsigned char *two,
+                          uint32_t *ahead, uint32_t *behind);
+
+
+#endif
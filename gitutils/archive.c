@@ -0,0 +1,1161 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "commit.h"
+#include "tree.h"
+#include "lstree.h"
+#include "range.h"
+#include "archive.h"
+
+// A tar or zip of a tree, byte for byte what "git archive" makes of it
+// (without .gitattributes: nothing is export-ignored or substituted).
+//
+// The tree is listed with lstree_walk(), and a pool of threads reads the
+// blobs in listing order, along with, for zip, their checksums and deflated
+// forms. The caller's thread writes the entries out in order as they're
+// ready, and the threads never get more than ARCHIVE_WINDOW files or
+// window_bytes of data ahead of it. Blobs over stream_bytes that aren't
+// deltas aren't read whole at all; they're read a piece at a time when their
+// turn comes, and written out as they go. So however big the tree, what's
+// held at once is its listing (and for zip, its central directory) plus the
+// window, or one big deltified blob.
+
+#define TAR_BLOCK 512
+#define TAR_RECORD (TAR_BLOCK * 20)       // tar's blocking factor; git pads to whole records
+#define TAR_MAX_OCTAL 077777777777ULL     // the most an 11 digit size or mtime holds
+
+#define ZIP_STREAM (1 << 3)               // the sizes and crc come after the data
+#define ZIP_UTF8 (1 << 11)
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+#define ZIP_MAX32 0xffffffffULL
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag[1];
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct archive_file {
+    uint32_t entry;              // in the listing; LSTREE_NONE for the --prefix directory
+    int read;                    // a thread reads it; not directories, or blobs that are streamed
+    int big;                     // over stream_bytes, so it's written as for a streamed blob, read or not
+    int done;
+    int failed;
+    uint64_t size;               // the blob's
+    unsigned char *data;         // what's written for it: the blob, or for zip maybe its deflated form
+    uint64_t data_len;
+    int method;                  // zip's
+    uint32_t crc;
+    int binary;
+};
+
+struct archive {
+    const struct odb *odb;
+    struct archive_options opts;
+    struct lstree ls;
+    struct archive_file *files;
+    uint32_t nfiles, files_alloc;
+
+    uint32_t next_file;          // the next one a thread may read
+    uint32_t write_file;         // the one being written
+    uint64_t held;               // bytes read and not yet written
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;         // for the threads: something was written, or stop
+    pthread_cond_t ready;        // for the writer: a file was read
+    pthread_t *workers;
+    int nworkers;
+
+    archive_write_fn fn;
+    void *cb_data;
+    unsigned char *buf;          // output not yet passed on
+    size_t buf_len;
+    uint64_t offset;             // output so far
+    int write_failed;
+
+    int64_t time;                // of the commit, or now
+    int has_commit;
+    unsigned char commit[20];
+    char *path;
+    size_t path_alloc;
+
+    unsigned char *dir;          // zip's central directory
+    uint32_t dir_len, dir_alloc;
+    uint64_t dir_entries;
+    unsigned int zip_date, zip_time;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+/////////////////////////////////////////////////////////////////////
+// output                                                          //
+/////////////////////////////////////////////////////////////////////
+
+static int flush(struct archive *a)
+{
+    if(a->buf_len && !a->write_failed && a->fn(a->buf, a->buf_len, a->cb_data) != 0)
+        a->write_failed = 1;
+    a->buf_len = 0;
+    return a->write_failed ? -1 : 0;
+}
+
+// Passes data on in ARCHIVE_BUFFER pieces, or as it is if it's that big.
+static int emit(struct archive *a, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    size_t n;
+
+    a->offset += len;
+    while(len && !a->write_failed) {
+        if(!a->buf_len && len >= ARCHIVE_BUFFER) {
+            if(a->fn(p, len, a->cb_data) != 0)
+                a->write_failed = 1;
+            break;
+        }
+        n = ARCHIVE_BUFFER - a->buf_len < len ? ARCHIVE_BUFFER - a->buf_len : len;
+        memcpy(a->buf + a->buf_len, p, n);
+        a->buf_len += n;
+        p += n;
+        len -= n;
+        if(a->buf_len == ARCHIVE_BUFFER)
+            flush(a);
+    }
+    return a->write_failed ? -1 : 0;
+}
+
+static int emit_zeros(struct archive *a, size_t len)
+{
+    static const unsigned char zeros[TAR_BLOCK];
+    size_t n;
+
+    for(; len; len -= n) {
+        n = len < TAR_BLOCK ? len : TAR_BLOCK;
+        if(emit(a, zeros, n) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void put_le16(unsigned char *p, unsigned int v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    put_le16(p, v & 0xffff);
+    put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    put_le32(p, v & 0xffffffff);
+    put_le32(p + 4, v >> 32);
+}
+
+// The blob's contents, a piece at a time, for blobs too big to read whole.
+typedef int (*chunk_fn)(struct archive *a, const unsigned char *data, size_t len, void *cb_data);
+
+static int stream_blob(struct archive *a, const unsigned char *sha1, uint64_t size, chunk_fn fn, void *cb_data)
+{
+    struct range_reader *r;
+    unsigned char *chunk;
+    unsigned int type;
+    uint64_t pos, got, real_size;
+    int ret = 0;
+
+    if(range_open(a->odb, sha1, NULL, &r, &type, &real_size) != 0)
+        return -1;
+    if(type != BLOB || real_size != size || !(chunk = malloc(ARCHIVE_BUFFER))) {
+        range_close(r);
+        return -1;
+    }
+    for(pos = 0; pos < size && ret == 0; pos += got) {
+        if(range_read(r, pos, ARCHIVE_BUFFER, chunk, &got) != 0 || !got)
+            ret = -1;
+        else
+            ret = fn(a, chunk, got, cb_data);
+    }
+    free(chunk);
+    range_close(r);
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////
+// tar                                                             //
+/////////////////////////////////////////////////////////////////////
+
+// A pax extended header record: "<length> <keyword>=<value>\n", where the
+// length counts its own digits.
+static int add_pax_record(char **ext, size_t *ext_len, const char *keyword, const char *value, size_t value_len)
+{
+    size_t len = 1 + 1 + strlen(keyword) + 1 + value_len + 1, digits;
+    char *grown;
+    int n;
+
+    for(digits = 1; len / 10 >= digits; digits *= 10)
+        len++;
+    if(!(grown = realloc(*ext, *ext_len + len + 1)))
+        return -1;
+    *ext = grown;
+    n = sprintf(grown + *ext_len, "%zu %s=", len, keyword);
+    memcpy(grown + *ext_len + n, value, value_len);
+    grown[*ext_len + len - 1] = '\n';
+    *ext_len += len;
+    return 0;
+}
+
+static int add_pax_number(char **ext, size_t *ext_len, const char *keyword, uint64_t value)
+{
+    char digits[24];
+
+    return add_pax_record(ext, ext_len, keyword, digits, sprintf(digits, "%llu", (unsigned long long) value));
+}
+
+static void tar_finish_header(const struct archive *a, struct tar_header *h, unsigned int mode, uint64_t size)
+{
+    const unsigned char *p = (const unsigned char *) h;
+    unsigned int sum = 0;
+    size_t i;
+
+    sprintf(h->mode, "%07o", mode & 07777);
+    sprintf(h->size, "%011llo", (mode & S_IFMT) == S_IFREG ? (unsigned long long) size : 0ULL);
+    sprintf(h->mtime, "%011llo", (unsigned long long) a->time);
+    sprintf(h->uid, "%07o", 0);
+    sprintf(h->gid, "%07o", 0);
+    strcpy(h->uname, "root");
+    strcpy(h->gname, "root");
+    sprintf(h->devmajor, "%07o", 0);
+    sprintf(h->devminor, "%07o", 0);
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for(i = 0; i < sizeof(struct tar_header); i++)
+        sum += p[i];
+    sprintf(h->chksum, "%07o", sum);
+}
+
+static int emit_blocked(struct archive *a, const void *data, uint64_t len)
+{
+    if(emit(a, data, len) != 0)
+        return -1;
+    return emit_zeros(a, (TAR_BLOCK - a->offset % TAR_BLOCK) % TAR_BLOCK);
+}
+
+static int emit_pax_header(struct archive *a, char type, const char *name, const char *ext, size_t ext_len)
+{
+    struct tar_header h;
+
+    memset(&h, 0, sizeof(h));
+    h.typeflag[0] = type;
+    strcpy(h.name, name);
+    tar_finish_header(a, &h, 0100666, ext_len);
+    if(emit(a, &h, sizeof(h)) != 0)
+        return -1;
+    return emit_blocked(a, ext, ext_len);
+}
+
+// The comment git uses to say which commit an archive is of, and the mtime
+// if it's too big for the headers, in a pax global header.
+static int tar_start(struct archive *a)
+{
+    char *ext = NULL;
+    size_t ext_len = 0;
+    int ret = 0;
+
+    if(a->has_commit && add_pax_record(&ext, &ext_len, "comment", sha1_to_hex(a->commit), 40) != 0)
+        ret = -1;
+    if(ret == 0 && (uint64_t) a->time > TAR_MAX_OCTAL) {
+        if(add_pax_number(&ext, &ext_len, "mtime", a->time) != 0)
+            ret = -1;
+        a->time = TAR_MAX_OCTAL;
+    }
+    if(ret == 0 && ext_len)
+        ret = emit_pax_header(a, 'g', "pax_global_header", ext, ext_len);
+    free(ext);
+    return ret;
+}
+
+static int tar_chunk(struct archive *a, const unsigned char *data, size_t len, void *cb_data)
+{
+    (void) cb_data;
+    return emit(a, data, len);
+}
+
+// Where to split a path too long for the name field between it and prefix:
+// at a slash, with up to max bytes before it.
+static size_t tar_split(const char *path, size_t len, size_t max)
+{
+    size_t i = len;
+
+    if(i > 1 && path[i - 1] == '/')
+        i--;
+    if(i > max)
+        i = max;
+    do {
+        i--;
+    } while(i > 0 && path[i] != '/');
+    return i;
+}
+
+static int tar_entry(struct archive *a, const char *path, size_t len, unsigned int mode, const unsigned char *sha1,
+                     const struct archive_file *f)
+{
+    struct tar_header h;
+    char *ext = NULL, hex[64];   // and room for ".paxheader" after it
+    size_t ext_len = 0, split;
+    uint64_t size = f->size;
+    int ret = 0;
+
+    memset(&h, 0, sizeof(h));
+    if((mode & S_IFMT) == S_IFTREE || (mode & S_IFMT) == S_IFGITLINK) {
+        h.typeflag[0] = '5';
+        mode = (mode | 0777) & ~ARCHIVE_TAR_UMASK;
+    } else if((mode & S_IFMT) == S_IFLNK) {
+        h.typeflag[0] = '2';
+        mode |= 0777;
+    } else {
+        h.typeflag[0] = '0';
+        mode = (mode | ((mode & 0100) ? 0777 : 0666)) & ~ARCHIVE_TAR_UMASK;
+    }
+
+    strcpy(hex, sha1_to_hex(sha1));
+    if(len > sizeof(h.name)) {
+        split = tar_split(path, len, sizeof(h.prefix));
+        if(split > 0 && len - split - 1 <= sizeof(h.name)) {
+            memcpy(h.prefix, path, split);
+            memcpy(h.name, path + split + 1, len - split - 1);
+        } else {
+            sprintf(h.name, "%s.data", hex);
+            ret = add_pax_record(&ext, &ext_len, "path", path, len);
+        }
+    } else {
+        memcpy(h.name, path, len);
+    }
+
+    if(ret == 0 && (mode & S_IFMT) == S_IFLNK) {
+        if(size > sizeof(h.linkname)) {
+            sprintf(h.linkname, "see %s.paxheader", hex);
+            ret = add_pax_record(&ext, &ext_len, "linkpath", (const char *) f->data, size);
+        } else {
+            memcpy(h.linkname, f->data, size);
+        }
+    }
+    if(ret == 0 && (mode & S_IFMT) == S_IFREG && size > TAR_MAX_OCTAL) {
+        ret = add_pax_number(&ext, &ext_len, "size", size);
+        size = 0;
+    }
+    if(ret == 0 && ext_len) {
+        strcat(hex, ".paxheader");
+        ret = emit_pax_header(a, 'x', hex, ext, ext_len);
+    }
+    free(ext);
+    if(ret != 0)
+        return -1;
+
+    tar_finish_header(a, &h, mode, size);
+    if(emit(a, &h, sizeof(h)) != 0)
+        return -1;
+    if((mode & S_IFMT) != S_IFREG || !f->size)
+        return 0;
+    if(f->read)
+        return emit_blocked(a, f->data, f->data_len);
+    if(stream_blob(a, sha1, f->size, tar_chunk, NULL) != 0)
+        return -1;
+    return emit_blocked(a, NULL, 0);
+}
+
+// At least two zero blocks, then to the end of a record.
+static int tar_finish(struct archive *a)
+{
+    size_t tail = TAR_RECORD - a->offset % TAR_RECORD;
+
+    if(tail < 2 * TAR_BLOCK)
+        tail += TAR_RECORD;
+    return emit_zeros(a, tail);
+}
+
+/////////////////////////////////////////////////////////////////////
+// zip                                                             //
+/////////////////////////////////////////////////////////////////////
+
+// crc32(), for more than zlib's 32 bit lengths can take at once.
+static uint32_t crc(uint32_t sum, const unsigned char *data, uint64_t len)
+{
+    uInt n;
+
+    for(; len; data += n, len -= n) {
+        n = len < (1U << 30) ? len : (1U << 30);
+        sum = crc32(sum, data, n);
+    }
+    return sum;
+}
+
+// Git's check for binary files, without the attributes that can override it.
+static int is_binary(const unsigned char *data, uint64_t len)
+{
+    return len && memchr(data, 0, len < 8000 ? len : 8000) != NULL;
+}
+
+static int deflate_init(const struct archive *a, z_stream *zst)
+{
+    memset(zst, 0, sizeof(*zst));
+    return deflateInit2(zst, a->opts.level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+}
+
+// Deflates a blob a thread has read, keeping it stored if that's no
+// smaller, as git does.
+static int zip_prepare(const struct archive *a, struct archive_file *f, unsigned int mode)
+{
+    unsigned char *out;
+    uLong bound;
+    z_stream zst;
+    int ret;
+
+    f->crc = crc(crc32(0, NULL, 0), f->data, f->size);
+    f->binary = is_binary(f->data, f->size);
+    if((mode & S_IFMT) != S_IFREG || a->opts.level == 0 || !f->size)
+        return 0;
+
+    if(deflate_init(a, &zst) != 0)
+        return -1;
+    bound = deflateBound(&zst, f->size);
+    if(!(out = malloc(bound))) {
+        deflateEnd(&zst);
+        return -1;
+    }
+    zst.next_in = f->data;
+    zst.avail_in = f->size;
+    zst.next_out = out;
+    zst.avail_out = bound;
+    do {
+        ret = deflate(&zst, Z_FINISH);
+    } while(ret == Z_OK);
+    deflateEnd(&zst);
+    if(ret != Z_STREAM_END || zst.total_out >= f->size) {
+        free(out);
+        return 0;
+    }
+    free(f->data);
+    f->data = out;
+    f->data_len = zst.total_out;
+    f->method = ZIP_DEFLATED;
+    return 0;
+}
+
+// Git marks names that aren't ASCII as UTF-8 when they are.
+static int is_utf8(const unsigned char *p, size_t len)
+{
+    size_t i = 0, n, k;
+    uint32_t c;
+
+    while(i < len) {
+        if(p[i] < 0x80) {
+            i++;
+            continue;
+        }
+        if((p[i] & 0xe0) == 0xc0) {
+            n = 1;
+            c = p[i] & 0x1f;
+        } else if((p[i] & 0xf0) == 0xe0) {
+            n = 2;
+            c = p[i] & 0x0f;
+        } else if((p[i] & 0xf8) == 0xf0) {
+            n = 3;
+            c = p[i] & 0x07;
+        } else {
+            return 0;
+        }
+        for(k = 1; k <= n; k++) {
+            if(i + k >= len || (p[i + k] & 0xc0) != 0x80)
+                return 0;
+            c = (c << 6) | (p[i + k] & 0x3f);
+        }
+        // overlong forms, surrogates and past the last code point
+        if((n == 1 && c < 0x80) || (n == 2 && c < 0x800) || (n == 3 && c < 0x10000) ||
+           (c >= 0xd800 && c <= 0xdfff) || c > 0x10ffff)
+            return 0;
+        i += n + 1;
+    }
+    return 1;
+}
+
+static int is_ascii(const char *p, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        if((unsigned char) p[i] >= 0x80)
+            return 0;
+    }
+    return 1;
+}
+
+// What deflating a streamed blob needs between pieces.
+struct zip_stream {
+    z_stream zst;
+    int deflating;
+    uint32_t crc;
+    int binary;                  // -1 until the first piece
+    uint64_t out;                // bytes written
+    unsigned char *buf;
+};
+
+static int zip_chunk(struct archive *a, const unsigned char *data, size_t len, void *cb_data)
+{
+    struct zip_stream *s = cb_data;
+    int ret;
+
+    s->crc = crc(s->crc, data, len);
+    if(s->binary < 0)
+        s->binary = is_binary(data, len);
+    if(!s->deflating) {
+        s->out += len;
+        return emit(a, data, len);
+    }
+
+    s->zst.next_in = (unsigned char *) data;
+    s->zst.avail_in = len;
+    while(s->zst.avail_in) {
+        s->zst.next_out = s->buf;
+        s->zst.avail_out = ARCHIVE_BUFFER;
+        if((ret = deflate(&s->zst, Z_NO_FLUSH)) != Z_OK && ret != Z_BUF_ERROR)
+            return -1;
+        s->out += ARCHIVE_BUFFER - s->zst.avail_out;
+        if(emit(a, s->buf, ARCHIVE_BUFFER - s->zst.avail_out) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int zip_stream_finish(struct archive *a, struct zip_stream *s)
+{
+    int ret = Z_OK;
+
+    while(s->deflating && ret == Z_OK) {
+        s->zst.next_out = s->buf;
+        s->zst.avail_out = ARCHIVE_BUFFER;
+        ret = deflate(&s->zst, Z_FINISH);
+        if(ret != Z_OK && ret != Z_STREAM_END)
+            return -1;
+        s->out += ARCHIVE_BUFFER - s->zst.avail_out;
+        if(emit(a, s->buf, ARCHIVE_BUFFER - s->zst.avail_out) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Writes a big blob, streamed or not, then the data descriptor with what
+// the local header couldn't say.
+static int zip_stream(struct archive *a, const unsigned char *sha1, struct archive_file *f, int method)
+{
+    unsigned char desc[24];
+    struct zip_stream s;
+    int ret;
+
+    memset(&s, 0, sizeof(s));
+    s.crc = crc32(0, NULL, 0);
+    s.binary = -1;
+    if(!(s.buf = malloc(ARCHIVE_BUFFER)))
+        return -1;
+    if(method == ZIP_DEFLATED) {
+        if(deflate_init(a, &s.zst) != 0) {
+            free(s.buf);
+            return -1;
+        }
+        s.deflating = 1;
+    }
+    if(f->read)
+        ret = zip_chunk(a, f->data, f->size, &s);
+    else
+        ret = stream_blob(a, sha1, f->size, zip_chunk, &s);
+    if(ret == 0)
+        ret = zip_stream_finish(a, &s);
+    if(s.deflating)
+        deflateEnd(&s.zst);
+    free(s.buf);
+    if(ret != 0)
+        return -1;
+
+    f->crc = s.crc;
+    f->binary = s.binary > 0;
+    f->data_len = s.out;
+    put_le32(desc, 0x08074b50);
+    put_le32(desc + 4, s.crc);
+    if(f->size >= ZIP_MAX32 || s.out >= ZIP_MAX32) {
+        put_le64(desc + 8, s.out);
+        put_le64(desc + 16, f->size);
+        return emit(a, desc, 24);
+    }
+    put_le32(desc + 8, s.out);
+    put_le32(desc + 12, f->size);
+    return emit(a, desc, 16);
+}
+
+static int zip_entry(struct archive *a, const char *path, size_t len, unsigned int mode, const unsigned char *sha1,
+                     struct archive_file *f)
+{
+    unsigned char local[30], extra[9], extra64[28], *p;
+    unsigned int flags = 0, creator = 0, version = 10, method = ZIP_STORED, type = mode & S_IFMT;
+    uint64_t offset = a->offset, size = 0, csize = 0;
+    uint32_t attr = 0, extra64_len = 0;
+    int streamed = 0, text = 0;
+
+    if(len > 0xffff)
+        return -1;
+    if(!is_ascii(path, len) && is_utf8((const unsigned char *) path, len))
+        flags |= ZIP_UTF8;
+
+    if(type == S_IFTREE || type == S_IFGITLINK) {
+        attr = 16; // MS-DOS's directory attribute
+    } else {
+        if(type == S_IFLNK)
+            attr = (mode | 0777) << 16;
+        else if(mode & 0111)
+            attr = mode << 16;
+        if(type == S_IFLNK || (mode & 0111))
+            creator = 0x0317; // Unix, zip 2.3
+        size = f->size;
+        if(!f->big) {
+            method = f->method;
+            csize = f->data_len;
+            text = !f->binary;
+        } else {
+            streamed = 1;
+            flags |= ZIP_STREAM;
+            method = a->opts.level == 0 ? ZIP_STORED : ZIP_DEFLATED;
+            csize = method == ZIP_STORED ? size : 0;
+        }
+    }
+    if(size >= ZIP_MAX32 || csize >= ZIP_MAX32 || (streamed && size > 0x7fffffff))
+        version = 45;
+
+    put_le32(local, 0x04034b50);
+    put_le16(local + 4, version);
+    put_le16(local + 6, flags);
+    put_le16(local + 8, method);
+    put_le16(local + 10, a->zip_time);
+    put_le16(local + 12, a->zip_date);
+    put_le32(local + 14, streamed ? 0 : f->crc);
+    put_le32(local + 18, version == 45 ? ZIP_MAX32 : csize);
+    put_le32(local + 22, version == 45 ? ZIP_MAX32 : size);
+    put_le16(local + 26, len);
+    put_le16(local + 28, sizeof(extra) + (version == 45 ? 20 : 0));
+
+    // the mtime, as Info-ZIP's "UT" extra field
+    put_le16(extra, 0x5455);
+    put_le16(extra + 2, 5);
+    extra[4] = 1;
+    put_le32(extra + 5, a->time);
+
+    if(emit(a, local, sizeof(local)) != 0 || emit(a, path, len) != 0 || emit(a, extra, sizeof(extra)) != 0)
+        return -1;
+    if(version == 45) {
+        put_le16(extra64, 0x0001);
+        put_le16(extra64 + 2, 16);
+        put_le64(extra64 + 4, size);
+        put_le64(extra64 + 12, csize);
+        if(emit(a, extra64, 20) != 0)
+            return -1;
+    }
+    if(streamed) {
+        if(zip_stream(a, sha1, f, method) != 0)
+            return -1;
+        csize = f->data_len;
+        text = !f->binary;
+    } else if(csize && emit(a, f->data, csize) != 0) {
+        return -1;
+    }
+
+    // the central directory's copy, with zip64 sizes for whatever doesn't fit
+    p = extra64 + 4;
+    if(size >= ZIP_MAX32) {
+        put_le64(p, size);
+        p += 8;
+    }
+    if(csize >= ZIP_MAX32) {
+        put_le64(p, csize);
+        p += 8;
+    }
+    if(offset >= ZIP_MAX32) {
+        put_le64(p, offset);
+        p += 8;
+    }
+    if(p > extra64 + 4) {
+        extra64_len = p - extra64;
+        put_le16(extra64, 0x0001);
+        put_le16(extra64 + 2, extra64_len - 4);
+    }
+
+    if((uint64_t) a->dir_len + 46 + len + sizeof(extra) + extra64_len > 0xffffffffULL ||
+       !(p = grow(a->dir, &a->dir_alloc, a->dir_len + 46 + len + sizeof(extra) + extra64_len, 1)))
+        return -1;
+    a->dir = p;
+    p += a->dir_len;
+    put_le32(p, 0x02014b50);
+    put_le16(p + 4, creator);
+    put_le16(p + 6, version);
+    put_le16(p + 8, flags);
+    put_le16(p + 10, method);
+    put_le16(p + 12, a->zip_time);
+    put_le16(p + 14, a->zip_date);
+    put_le32(p + 16, f->crc);
+    put_le32(p + 20, csize >= ZIP_MAX32 ? ZIP_MAX32 : csize);
+    put_le32(p + 24, size >= ZIP_MAX32 ? ZIP_MAX32 : size);
+    put_le16(p + 28, len);
+    put_le16(p + 30, sizeof(extra) + extra64_len);
+    put_le16(p + 32, 0);         // comment
+    put_le16(p + 34, 0);         // disk
+    put_le16(p + 36, text);      // internal attributes
+    put_le32(p + 38, attr);
+    put_le32(p + 42, offset >= ZIP_MAX32 ? ZIP_MAX32 : offset);
+    memcpy(p + 46, path, len);
+    memcpy(p + 46 + len, extra, sizeof(extra));
+    memcpy(p + 46 + len + sizeof(extra), extra64, extra64_len);
+    a->dir_len += 46 + len + sizeof(extra) + extra64_len;
+    a->dir_entries++;
+    return 0;
+}
+
+// The central directory and the end records, with zip64 ones first if
+// there's more than the plain one can count, and the commit as the comment.
+static int zip_finish(struct archive *a)
+{
+    unsigned char end[22], end64[56 + 20];
+    uint64_t offset = a->offset;
+    int big;
+
+    if(emit(a, a->dir, a->dir_len) != 0)
+        return -1;
+    big = a->dir_entries > 0xffff || offset >= ZIP_MAX32;
+    if(big) {
+        put_le32(end64, 0x06064b50);
+        put_le64(end64 + 4, 44);
+        put_le16(end64 + 12, 0);  // version made by; git leaves it 0
+        put_le16(end64 + 14, 45);
+        put_le32(end64 + 16, 0);
+        put_le32(end64 + 20, 0);
+        put_le64(end64 + 24, a->dir_entries);
+        put_le64(end64 + 32, a->dir_entries);
+        put_le64(end64 + 40, a->dir_len);
+        put_le64(end64 + 48, offset);
+        put_le32(end64 + 56, 0x07064b50);
+        put_le32(end64 + 60, 0);
+        put_le64(end64 + 64, offset + a->dir_len);
+        put_le32(end64 + 72, 1);
+        if(emit(a, end64, sizeof(end64)) != 0)
+            return -1;
+    }
+    put_le32(end, 0x06054b50);
+    put_le16(end + 4, 0);
+    put_le16(end + 6, 0);
+    put_le16(end + 8, a->dir_entries > 0xffff ? 0xffff : a->dir_entries);
+    put_le16(end + 10, a->dir_entries > 0xffff ? 0xffff : a->dir_entries);
+    put_le32(end + 12, a->dir_len);
+    put_le32(end + 16, offset >= ZIP_MAX32 ? ZIP_MAX32 : offset);
+    put_le16(end + 20, a->has_commit ? 40 : 0);
+    if(emit(a, end, sizeof(end)) != 0)
+        return -1;
+    return a->has_commit ? emit(a, sha1_to_hex(a->commit), 40) : 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// threads                                                         //
+/////////////////////////////////////////////////////////////////////
+
+static int read_file(const struct archive *a, struct base_cache *cache, const unsigned char *sha1, unsigned int mode,
+                     struct archive_file *f)
+{
+    struct git_object g_obj;
+
+    if(odb_read(a->odb, sha1, &g_obj, cache) != 0)
+        return -1;
+    if(g_obj.type != BLOB || g_obj.size != f->size) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+    f->data = g_obj.mem_data;
+    f->data_len = g_obj.size;
+    f->method = ZIP_STORED;
+    if(a->opts.format == ARCHIVE_ZIP && !f->big && zip_prepare(a, f, mode) != 0) {
+        free(f->data);
+        f->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void *archive_worker(void *data)
+{
+    struct archive *a = data;
+    struct base_cache *cache;
+    struct archive_file result;
+    struct lstree_entry *e;
+    unsigned char sha1[20];
+    unsigned int mode;
+    uint32_t n;
+    int ret;
+
+    cache = base_cache_new(ARCHIVE_CACHE_BYTES);
+    pthread_mutex_lock(&a->lock);
+    for(;;) {
+        while(a->next_file < a->nfiles && !a->files[a->next_file].read)
+            a->next_file++;
+        if(a->stop || a->next_file >= a->nfiles)
+            break;
+        // anything fits when nothing else is held, so the writer can't be kept waiting
+        if(a->next_file >= a->write_file + ARCHIVE_WINDOW ||
+           (a->held && a->held + a->files[a->next_file].size > a->opts.window_bytes)) {
+            pthread_cond_wait(&a->wake, &a->lock);
+            continue;
+        }
+        n = a->next_file++;
+        a->held += a->files[n].size;
+        e = &a->ls.entries[a->files[n].entry];
+        memcpy(sha1, e->sha1, 20);
+        mode = e->mode;
+        result = a->files[n];
+        pthread_mutex_unlock(&a->lock);
+
+        ret = cache ? read_file(a, cache, sha1, mode, &result) : -1;
+
+        // only what reading it fills in; the writer looks at the rest without the lock
+        pthread_mutex_lock(&a->lock);
+        a->files[n].data = result.data;
+        a->files[n].data_len = result.data_len;
+        a->files[n].method = result.method;
+        a->files[n].crc = result.crc;
+        a->files[n].binary = result.binary;
+        a->files[n].failed = (ret != 0);
+        a->files[n].done = 1;
+        pthread_cond_broadcast(&a->ready);
+    }
+    pthread_mutex_unlock(&a->lock);
+
+    if(cache)
+        base_cache_free(cache);
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// the archive                                                     //
+/////////////////////////////////////////////////////////////////////
+
+// The commit start is, or is a tag of, if it's not a tree.
+static int peel_commit(struct archive *a, const unsigned char *start)
+{
+    struct git_object g_obj;
+    struct commit commit;
+    unsigned char sha1[20];
+    int depth;
+
+    memcpy(sha1, start, 20);
+    for(depth = 0; depth < TREE_MAX_TAG_DEPTH; depth++) {
+        if(odb_read(a->odb, sha1, &g_obj, NULL) != 0)
+            return -1;
+        if(g_obj.type == TAG) {
+            if(g_obj.size < 48 || memcmp(g_obj.mem_data, "object ", 7) != 0 ||
+               hex_to_sha1((const char *) g_obj.mem_data + 7, sha1) != 0) {
+                free(g_obj.mem_data);
+                return -1;
+            }
+            free(g_obj.mem_data);
+            continue;
+        }
+        if(g_obj.type == COMMIT) {
+            if(commit_parse(g_obj.mem_data, g_obj.size, &commit) != 0) {
+                free(g_obj.mem_data);
+                return -1;
+            }
+            a->has_commit = 1;
+            memcpy(a->commit, sha1, 20);
+            a->time = commit.committer.time;
+        }
+        free(g_obj.mem_data);
+        return 0;
+    }
+    return -1;
+}
+
+// Whether a blob can be streamed: range reads of a delta jump about in its
+// base, so deltas are read whole, as git's streaming does too.
+static int is_whole(const struct archive *a, const unsigned char *sha1)
+{
+    struct odb_location loc;
+    struct pack_entry entry;
+
+    if(odb_find(a->odb, sha1, &loc) != 0)
+        return 0;
+    if(loc.pack < 0)
+        return 1;
+    if(pack_entry_header(a->odb->packs[loc.pack], loc.offset, &entry) != 0)
+        return 0;
+    return entry.type != OFS_DELTA && entry.type != REF_DELTA;
+}
+
+static int add_file(struct archive *a, uint32_t entry)
+{
+    struct archive_file *f;
+    unsigned int type;
+
+    if(!(f = grow(a->files, &a->files_alloc, a->nfiles + 1, sizeof(struct archive_file))))
+        return -1;
+    a->files = f;
+    f = &a->files[a->nfiles++];
+    memset(f, 0, sizeof(struct archive_file));
+    f->entry = entry;
+    if(entry == LSTREE_NONE)
+        return 0;
+    type = a->ls.entries[entry].mode & S_IFMT;
+    if(type == S_IFREG || type == S_IFLNK) {
+        f->size = a->ls.entries[entry].size;
+        // symlinks are always read, since their target goes in the header
+        f->big = type == S_IFREG && f->size > a->opts.stream_bytes;
+        f->read = !f->big || !is_whole(a, a->ls.entries[entry].sha1);
+    }
+    return 0;
+}
+
+// The path an entry goes under: base, then its path in the tree, with a
+// slash after directories.
+static int entry_path(struct archive *a, uint32_t entry, size_t *len)
+{
+    size_t base_len = strlen(a->opts.base), path_len = 0, need;
+    unsigned int type;
+    char *grown;
+
+    if(entry == LSTREE_NONE) {
+        // just the base, without the repeats of its last slash
+        for(*len = base_len; *len > 1 && a->opts.base[*len - 2] == '/'; (*len)--)
+            ;
+        need = *len + 1;
+    } else {
+        path_len = lstree_path(&a->ls, entry, NULL, 0);
+        type = a->ls.entries[entry].mode & S_IFMT;
+        *len = base_len + path_len + (type == S_IFTREE || type == S_IFGITLINK);
+        need = *len + 1;
+    }
+    if(need > a->path_alloc) {
+        if(!(grown = realloc(a->path, need)))
+            return -1;
+        a->path = grown;
+        a->path_alloc = need;
+    }
+    memcpy(a->path, a->opts.base, entry == LSTREE_NONE ? *len : base_len);
+    if(entry != LSTREE_NONE) {
+        lstree_path(&a->ls, entry, a->path + base_len, path_len + 1);
+        a->path[base_len + path_len] = '/'; // cut off below if it's not a directory
+    }
+    a->path[*len] = '\0';
+    return 0;
+}
+
+static int write_entries(struct archive *a)
+{
+    const unsigned char *sha1;
+    struct archive_file *f;
+    unsigned int mode;
+    uint32_t i;
+    size_t len;
+    int ret = 0;
+
+    for(i = 0; i < a->nfiles && ret == 0; i++) {
+        f = &a->files[i];
+        if(f->read) {
+            pthread_mutex_lock(&a->lock);
+            while(!f->done)
+                pthread_cond_wait(&a->ready, &a->lock);
+            pthread_mutex_unlock(&a->lock);
+            if(f->failed)
+                ret = -1;
+        }
+
+        if(f->entry == LSTREE_NONE) {
+            sha1 = a->ls.entries[0].sha1;
+            mode = 040777;
+        } else {
+            sha1 = a->ls.entries[f->entry].sha1;
+            mode = a->ls.entries[f->entry].mode;
+        }
+        if(ret == 0 && (ret = entry_path(a, f->entry, &len)) == 0) {
+            if(a->opts.format == ARCHIVE_ZIP)
+                ret = zip_entry(a, a->path, len, mode, sha1, f);
+            else
+                ret = tar_entry(a, a->path, len, mode, sha1, f);
+        }
+
+        pthread_mutex_lock(&a->lock);
+        free(f->data);
+        f->data = NULL;
+        if(f->read)
+            a->held -= f->size;
+        a->write_file = i + 1;
+        pthread_cond_broadcast(&a->wake);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return ret;
+}
+
+void archive_options_init(struct archive_options *opts)
+{
+    opts->format = ARCHIVE_TAR;
+    opts->base = "";
+    opts->level = Z_DEFAULT_COMPRESSION;
+    opts->threads = 0;
+    opts->window_bytes = ARCHIVE_WINDOW_BYTES;
+    opts->stream_bytes = ARCHIVE_STREAM_BYTES;
+}
+
+// Writes an archive of what's under prefix ("" for everything) in start, a
+// commit, tree or tag, passing it to fn a piece at a time. Paths are as in
+// start's tree, so the directories along prefix are in it too, as with
+// "git archive <commit> <prefix>". Returns 0, 1 if there's no such path, 2
+// if fn stopped it, and -1 if an object is missing or malformed.
+int archive_write(const struct odb *odb, struct tree_resolver *paths, const unsigned char *start,
+                  const char *prefix, const struct archive_options *opts, archive_write_fn fn, void *cb_data)
+{
+    struct archive a;
+    struct tm tm;
+    time_t t;
+    uint32_t i, nread = 0;
+    int ret, threads;
+
+    memset(&a, 0, sizeof(a));
+    a.odb = odb;
+    a.opts = *opts;
+    a.fn = fn;
+    a.cb_data = cb_data;
+    a.time = time(NULL);
+    if((ret = peel_commit(&a, start)) != 0)
+        return ret;
+    if((ret = lstree_walk(odb, paths, start, prefix, 0, LSTREE_TREES | LSTREE_SIZES, opts->threads, &a.ls)) != 0)
+        return ret;
+    if(!(a.buf = malloc(ARCHIVE_BUFFER))) {
+        lstree_release(&a.ls);
+        return -1;
+    }
+
+    ret = 0;
+    if(a.opts.base[0] && a.opts.base[strlen(a.opts.base) - 1] == '/')
+        ret = add_file(&a, LSTREE_NONE);
+    for(i = 0; i < a.ls.norder && ret == 0; i++)
+        ret = add_file(&a, a.ls.order[i]);
+    for(i = 0; i < a.nfiles; i++)
+        nread += a.files[i].read;
+
+    t = a.time;
+    localtime_r(&t, &tm);
+    a.zip_date = tm.tm_mday + (tm.tm_mon + 1) * 32 + (tm.tm_year + 1900 - 1980) * 512;
+    a.zip_time = tm.tm_sec / 2 + tm.tm_min * 32 + tm.tm_hour * 2048;
+
+    threads = opts->threads;
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    if((uint32_t) threads > nread)
+        threads = nread;
+    pthread_mutex_init(&a.lock, NULL);
+    pthread_cond_init(&a.wake, NULL);
+    pthread_cond_init(&a.ready, NULL);
+    if(ret == 0 && threads && !(a.workers = malloc(sizeof(pthread_t) * threads)))
+        ret = -1;
+    for(; ret == 0 && a.nworkers < threads; a.nworkers++) {
+        if(pthread_create(&a.workers[a.nworkers], NULL, archive_worker, &a) != 0)
+            break;
+    }
+    if(ret == 0 && threads && !a.nworkers)
+        ret = -1;
+
+    if(ret == 0 && a.opts.format == ARCHIVE_TAR)
+        ret = tar_start(&a);
+    if(ret == 0)
+        ret = write_entries(&a);
+    if(ret == 0)
+        ret = a.opts.format == ARCHIVE_ZIP ? zip_finish(&a) : tar_finish(&a);
+    if(ret == 0)
+        ret = flush(&a);
+    if(a.write_failed)
+        ret = 2;
+
+    pthread_mutex_lock(&a.lock);
+    a.stop = 1;
+    pthread_cond_broadcast(&a.wake);
+    pthread_mutex_unlock(&a.lock);
+    while(a.nworkers-- > 0)
+        pthread_join(a.workers[a.nworkers], NULL);
+
+    for(i = 0; i < a.nfiles; i++)
+        free(a.files[i].data);
+    pthread_cond_destroy(&a.ready);
+    pthread_cond_destroy(&a.wake);
+    pthread_mutex_destroy(&a.lock);
+    lstree_release(&a.ls);
+    free(a.files);
+    free(a.workers);
+    free(a.buf);
+    free(a.path);
+    free(a.dir);
+    return ret;
+}
+
+// An archive_write_fn for writing to a file descriptor; cb_data points to
+// it. Leaves errno set if a write fails.
+int archive_fd_write(const void *data, size_t len, void *cb_data)
+{
+    const char *p = data;
+    ssize_t n;
+
+    while(len) {
+        n = write(*(int *) cb_data, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct tree_resolver;
+
+#define ARCHIVE_TAR 0
+#define ARCHIVE_ZIP 1
+
+#define ARCHIVE_WINDOW 256                // files read ahead of the one being written
+#define ARCHIVE_WINDOW_BYTES (32 << 20)   // and how much of them may be held at once
+#define ARCHIVE_STREAM_BYTES (16 << 20)   // bigger blobs are streamed, not read whole
+#define ARCHIVE_CACHE_BYTES (8 << 20)     // per thread
+#define ARCHIVE_BUFFER (1 << 16)          // output is passed on in pieces this big
+#define ARCHIVE_TAR_UMASK 002             // git's default tar.umask
+
+struct archive_options {
+    int format;                  // ARCHIVE_TAR or ARCHIVE_ZIP
+    const char *base;            // put in front of every path, as with "git archive --prefix"
+    int level;                   // zip's deflate level, 0 (stored) to 9, or -1 for zlib's default
+    int threads;                 // one per CPU if <= 0
+    size_t window_bytes;
+    uint64_t stream_bytes;       // git's core.bigFileThreshold
+};
+
+// Gets the archive a piece at a time, in order. Returns 0, or anything else
+// to stop.
+typedef int (*archive_write_fn)(const void *data, size_t len, void *cb_data);
+
+void archive_options_init(struct archive_options *opts);
+int archive_write(const struct odb *odb, struct tree_resolver *paths, const unsigned char *start,
+                  const char *prefix, const struct archive_options *opts, archive_write_fn fn, void *cb_data);
+int archive_fd_write(const void *data, size_t len, void *cb_data);
+
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "basecache.h"
+#include "stats.h"
+
+#define BASE_CACHE_MIN_BUCKETS 256
+
+static inline unsigned int base_cache_hash(const void *pack, uint64_t offset)
+{
+    uint64_t h = offset ^ ((uintptr_t) pack >> 4);
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (unsigned int) h;
+}
+
+struct base_cache *base_cache_new(size_t max_bytes)
+{
+    struct base_cache *cache;
+
+    if(!(cache = calloc(1, sizeof(struct base_cache))))
+        return NULL;
+    cache->nbuckets = BASE_CACHE_MIN_BUCKETS;
+    if(!(cache->buckets = calloc(cache->nbuckets, sizeof(struct base_cache_entry *)))) {
+        free(cache);
+        return NULL;
+    }
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+struct base_cache *base_cache_new_shared(size_t max_bytes)
+{
+    struct base_cache *cache;
+
+    if(!(cache = base_cache_new(max_bytes)))
+        return NULL;
+    if(pthread_mutex_init(&cache->lock, NULL) != 0) {
+        base_cache_free(cache);
+        return NULL;
+    }
+    cache->shared = 1;
+    return cache;
+}
+
+// Nobody may be holding entries of a shared cache any more.
+void base_cache_free(struct base_cache *cache)
+{
+    struct base_cache_entry *entry, *next;
+
+    if(!cache)
+        return;
+    for(entry = cache->lru_head; entry; entry = next) {
+        next = entry->lru_next;
+        free(entry->data);
+        free(entry);
+    }
+    if(cache->shared)
+        pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+static inline void cache_lock(struct base_cache *cache)
+{
+    if(cache->shared)
+        pthread_mutex_lock(&cache->lock);
+}
+
+static inline void cache_unlock(struct base_cache *cache)
+{
+    if(cache->shared)
+        pthread_mutex_unlock(&cache->lock);
+}
+
+static void lru_unlink(struct base_cache *cache, struct base_cache_entry *entry)
+{
+    if(entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if(entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+}
+
+static void lru_push_front(struct base_cache *cache, struct base_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if(cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if(!cache->lru_tail)
+        cache->lru_tail = entry;
+}
+
+// Entries that are still held are only unlinked; the last release frees them.
+static void remove_entry(struct base_cache *cache, struct base_cache_entry *entry)
+{
+    struct base_cache_entry **link;
+
+    link = &cache->buckets[base_cache_hash(entry->pack, entry->offset) & (cache->nbuckets - 1)];
+    while(*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+
+    lru_unlink(cache, entry);
+    cache->bytes -= entry->size;
+    cache->count--;
+    if(entry->refs) {
+        entry->evicted = 1;
+        return;
+    }
+    free(entry->data);
+    free(entry);
+}
+
+// keep the load factor under one so chains stay short
+static void grow(struct base_cache *cache)
+{
+    struct base_cache_entry **buckets, *entry;
+    unsigned int nbuckets = cache->nbuckets * 2, i;
+
+    if(!(buckets = calloc(nbuckets, sizeof(struct base_cache_entry *))))
+        return; // stay at the old size; lookups still work
+    for(entry = cache->lru_head; entry; entry = entry->lru_next) {
+        i = base_cache_hash(entry->pack, entry->offset) & (nbuckets - 1);
+        entry->hash_next = buckets[i];
+        buckets[i] = entry;
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+static void drop_locked(struct base_cache *cache, const void *pack, uint64_t offset)
+{
+    struct base_cache_entry *entry;
+
+    entry = cache->buckets[base_cache_hash(pack, offset) & (cache->nbuckets - 1)];
+    for(; entry; entry = entry->hash_next) {
+        if(entry->offset == offset && entry->pack == pack) {
+            remove_entry(cache, entry);
+            return;
+        }
+    }
+}
+
+// In a private cache the returned entry stays valid until the next put(),
+// add() or drop(). In a shared one it is held until base_cache_release().
+struct base_cache_entry *base_cache_get(struct base_cache *cache, const void *pack, uint64_t offset)
+{
+    struct base_cache_entry *entry;
+
+    cache_lock(cache);
+    entry = cache->buckets[base_cache_hash(pack, offset) & (cache->nbuckets - 1)];
+    for(; entry; entry = entry->hash_next) {
+        if(entry->offset == offset && entry->pack == pack) {
+            lru_unlink(cache, entry);
+            lru_push_front(cache, entry);
+            if(cache->shared)
+                entry->refs++;
+            cache_unlock(cache);
+            STATS_INC(base_cache_hits);
+            return entry;
+        }
+    }
+    cache_unlock(cache);
+    STATS_INC(base_cache_misses);
+    return NULL;
+}
+
+// Like base_cache_put(), but returns the new entry, which is valid (and in a
+// shared cache, held) just as if it had come from base_cache_get(). Returns
+// NULL, leaving data with the caller, on failure.
+struct base_cache_entry *base_cache_add(struct base_cache *cache, const void *pack, uint64_t offset,
+                                       unsigned int type, unsigned char *data, unsigned long size)
+{
+    struct base_cache_entry *entry;
+    unsigned int i;
+
+    if(size > cache->max_bytes)
+        return NULL;
+    if(!(entry = malloc(sizeof(struct base_cache_entry))))
+        return NULL;
+    entry->pack = pack;
+    entry->offset = offset;
+    entry->type = type;
+    entry->size = size;
+    entry->data = data;
+    entry->refs = cache->shared ? 1 : 0;
+    entry->evicted = 0;
+
+    cache_lock(cache);
+    drop_locked(cache, pack, offset);
+    while(cache->lru_tail && cache->bytes + size > cache->max_bytes)
+        remove_entry(cache, cache->lru_tail);
+
+    if(cache->count >= cache->nbuckets)
+        grow(cache);
+    i = base_cache_hash(pack, offset) & (cache->nbuckets - 1);
+    entry->hash_next = cache->buckets[i];
+    cache->buckets[i] = entry;
+    lru_push_front(cache, entry);
+    cache->bytes += size;
+    cache->count++;
+    cache_unlock(cache);
+    return entry;
+}
+
+// On success the cache owns data. Returns -1 (and leaves data with the caller)
+// if it is too big to ever fit or we are out of memory.
+int base_cache_put(struct base_cache *cache, const void *pack, uint64_t offset,
+                   unsigned int type, unsigned char *data, unsigned long size)
+{
+    struct base_cache_entry *entry;
+
+    if(!(entry = base_cache_add(cache, pack, offset, type, data, size)))
+        return -1;
+    base_cache_release(cache, entry);
+    return 0;
+}
+
+// Lets go of an entry from get() or add(). Does nothing for private caches.
+void base_cache_release(struct base_cache *cache, struct base_cache_entry *entry)
+{
+    if(!cache->shared)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    if(--entry->refs == 0 && entry->evicted) {
+        free(entry->data);
+        free(entry);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void base_cache_drop(struct base_cache *cache, const void *pack, uint64_t offset)
+{
+    cache_lock(cache);
+    drop_locked(cache, pack, offset);
+    cache_unlock(cache);
+}
+
+// Drops everything from one pack, before the pack is closed and its address
+// can be reused for another.
+void base_cache_drop_pack(struct base_cache *cache, const void *pack)
+{
+    struct base_cache_entry *entry, *next;
+
+    cache_lock(cache);
+    for(entry = cache->lru_head; entry; entry = next) {
+        next = entry->lru_next;
+        if(entry->pack == pack)
+            remove_entry(cache, entry);
+    }
+    cache_unlock(cache);
+}
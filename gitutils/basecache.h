@@ -0,0 +1,52 @@
+#ifndef BASECACHE_H
+#define BASECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+// A byte-bounded LRU of inflated pack entries, keyed by (pack, offset). It is
+// used to avoid re-inflating the same delta bases over and over. A cache from
+// base_cache_new() is not thread safe; give each thread its own. One from
+// base_cache_new_shared() takes a lock and reference counts its entries, so
+// many threads can use it at once.
+
+struct base_cache_entry {
+    const void *pack;
+    uint64_t offset;
+    unsigned int type;
+    unsigned long size;
+    unsigned char *data;
+    struct base_cache_entry *hash_next;
+    struct base_cache_entry *lru_prev;
+    struct base_cache_entry *lru_next;
+    unsigned int refs;   // shared caches: threads still using data
+    int evicted;         // shared caches: freed by the last release
+};
+
+struct base_cache {
+    struct base_cache_entry **buckets;
+    unsigned int nbuckets;
+    unsigned int count;
+    size_t bytes;
+    size_t max_bytes;
+    struct base_cache_entry *lru_head; // most recently used
+    struct base_cache_entry *lru_tail;
+    int shared;
+    pthread_mutex_t lock;
+};
+
+struct base_cache *base_cache_new(size_t max_bytes);
+struct base_cache *base_cache_new_shared(size_t max_bytes);
+void base_cache_free(struct base_cache *cache);
+struct base_cache_entry *base_cache_get(struct base_cache *cache, const void *pack, uint64_t offset);
+int base_cache_put(struct base_cache *cache, const void *pack, uint64_t offset,
+                   unsigned int type, unsigned char *data, unsigned long size);
+struct base_cache_entry *base_cache_add(struct base_cache *cache, const void *pack, uint64_t offset,
+                                       unsigned int type, unsigned char *data, unsigned long size);
+void base_cache_release(struct base_cache *cache, struct base_cache_entry *entry);
+void base_cache_drop(struct base_cache *cache, const void *pack, uint64_t offset);
+void base_cache_drop_pack(struct base_cache *cache, const void *pack);
+
+
+#endif
@@ -0,0 +1,1057 @@
+// Benchmark driver for libgitread.
+//
+// It generates a small synthetic repository (loose objects, a pack with
+// delta chains of a known depth, a very wide tree, a very deep tree and a
+// linear commit history) and then times the library against it. Everything
+// is derived from the seed, so two runs with the same options produce
+// byte-identical repositories and comparable numbers.
+//
+// Results are written to stdout as one JSON object per line:
+//  {"bench":"pack_read","depth":3,"ops":5000,"seconds":0.0123,"ops_per_sec":...,
+//   "bytes_per_sec":...,"p50_us":...,"p90_us":...,"p99_us":...,"max_us":...}
+//
+// Build with "make bench"; "make run-bench" writes bench_output.json.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h> // for htonl(), etc
+#include <zlib.h>
+
+#include "libgitread.h"
+#include "sha1.h"
+#include "diff.h"
+
+struct bench_options {
+    const char *dir;
+    int pack_objects;
+    int delta_depth;
+    int loose_objects;
+    int wide_entries;
+    int deep_levels;
+    int commits;
+    int blob_size;
+    int iterations;
+    uint64_t seed;
+    int generate_only;
+};
+
+struct bench_obj {
+    unsigned char sha1[20];
+    int type;
+    unsigned int offset;
+    unsigned int size;
+    int depth;
+};
+
+struct pack_writer {
+    FILE *fp;
+    struct sha1_ctx ctx;
+    unsigned int offset;
+    struct bench_obj *objs;
+    int count;
+};
+
+// everything the benchmarks need to know about the generated repository
+struct bench_repo {
+    char pack_location[1024];
+    char idx_location[1024];
+    struct bench_obj *packed;
+    int npacked;
+    unsigned char (*loose)[20];
+    int nloose;
+    unsigned char wide_tree[20];
+    unsigned char deep_tree[20];
+    unsigned char head[20];
+};
+
+static const char *type_names[] = { "", "commit", "tree", "blob", "tag" };
+
+/////////////////////////////////////////////////////////////////////
+// deterministic input generation
+/////////////////////////////////////////////////////////////////////
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static unsigned int rng_range(unsigned int n)
+{
+    return (unsigned int) (rng_next() % n);
+}
+
+// Source-code-ish text: compresses and deltas roughly like real files do.
+static void random_text(unsigned char *buf, size_t len)
+{
+    static const char *words[] = {
+        "int", "return", "struct", "if", "else", "while", "for", "static", "const",
+        "char", "unsigned", "void", "size", "data", "offset", "object", "pack",
+        "idx", "tree", "blob", "commit", "=", "+", "(", ")", "{", "}", ";", "->"
+    };
+    size_t pos = 0, wlen;
+    const char *word;
+
+    while(pos < len) {
+        if(rng_range(10) == 0) {
+            buf[pos++] = '\n';
+            continue;
+        }
+        word = words[rng_range(sizeof(words) / sizeof(words[0]))];
+        wlen = strlen(word);
+        if(pos + wlen + 1 > len)
+            wlen = len - pos - 1;
+        memcpy(buf + pos, word, wlen);
+        pos += wlen;
+        if(pos < len)
+            buf[pos++] = ' ';
+    }
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/////////////////////////////////////////////////////////////////////
+// object writing
+/////////////////////////////////////////////////////////////////////
+
+static int object_header(int type, size_t size, char *hdr)
+{
+    return sprintf(hdr, "%s %lu", type_names[type], (unsigned long) size) + 1; // include the \0
+}
+
+static void hash_object(int type, const unsigned char *data, size_t len, unsigned char *sha1)
+{
+    struct sha1_ctx ctx;
+    char hdr[32];
+    int hdr_len = object_header(type, len, hdr);
+
+    sha1_init(&ctx);
+    sha1_update(&ctx, hdr, hdr_len);
+    sha1_update(&ctx, data, len);
+    sha1_final(sha1, &ctx);
+}
+
+static unsigned char *deflate_buffer(const unsigned char *data, size_t len, unsigned long *out_len)
+{
+    unsigned char *out;
+
+    *out_len = compressBound(len);
+    if(!(out = malloc(*out_len)))
+        return NULL;
+    if(compress(out, out_len, data, len) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int write_loose(const char *dir, int type, const unsigned char *data, size_t len, unsigned char *sha1)
+{
+    char path[1200], hdr[32];
+    unsigned char *raw, *compressed;
+    unsigned long compressed_len;
+    int hdr_len;
+    char *hex;
+    FILE *fp;
+
+    hash_object(type, data, len, sha1);
+    hex = sha1_to_hex(sha1);
+
+    hdr_len = object_header(type, len, hdr);
+    if(!(raw = malloc(hdr_len + len)))
+        return -1;
+    memcpy(raw, hdr, hdr_len);
+    memcpy(raw + hdr_len, data, len);
+    compressed = deflate_buffer(raw, hdr_len + len, &compressed_len);
+    free(raw);
+    if(!compressed)
+        return -1;
+
+    snprintf(path, sizeof(path), "%s/objects/%.2s", dir, hex);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/objects/%.2s/%s", dir, hex, hex + 2);
+    if(!(fp = fopen(path, "wb"))) {
+        free(compressed);
+        return -1;
+    }
+    fwrite(compressed, 1, compressed_len, fp);
+    fclose(fp);
+    free(compressed);
+    return 0;
+}
+
+static void pw_write(struct pack_writer *pw, const void *buf, size_t len)
+{
+    fwrite(buf, 1, len, pw->fp);
+    sha1_update(&pw->ctx, buf, len);
+    pw->offset += len;
+}
+
+// Writes the pack entry header: type in bits 4-6 of the first byte, then the
+// size in little-endian groups of 7 bits.
+static void pw_entry_header(struct pack_writer *pw, int type, size_t size)
+{
+    unsigned char hdr[16];
+    int n = 0;
+
+    hdr[n] = (type << 4) | (size & 0xf);
+    size >>= 4;
+    while(size) {
+        hdr[n++] |= 0x80;
+        hdr[n] = size & 0x7f;
+        size >>= 7;
+    }
+    pw_write(pw, hdr, n + 1);
+}
+
+static struct bench_obj *pw_next(struct pack_writer *pw)
+{
+    struct bench_obj *obj = &pw->objs[pw->count++];
+
+    obj->offset = pw->offset;
+    return obj;
+}
+
+static int pw_add_object(struct pack_writer *pw, int type, const unsigned char *data, size_t len, unsigned char *sha1)
+{
+    struct bench_obj *obj = pw_next(pw);
+    unsigned char *compressed;
+    unsigned long compressed_len;
+
+    hash_object(type, data, len, obj->sha1);
+    obj->type = type;
+    obj->size = len;
+    obj->depth = 0;
+    if(sha1)
+        memcpy(sha1, obj->sha1, 20);
+
+    if(!(compressed = deflate_buffer(data, len, &compressed_len)))
+        return -1;
+    pw_entry_header(pw, type, len);
+    pw_write(pw, compressed, compressed_len);
+    free(compressed);
+    return 0;
+}
+
+static int pw_add_ofs_delta(struct pack_writer *pw, const struct bench_obj *base,
+                            const unsigned char *delta, size_t delta_len,
+                            const unsigned char *result, size_t result_len)
+{
+    struct bench_obj *obj = pw_next(pw);
+    unsigned char *compressed, ofs[16];
+    unsigned long compressed_len;
+    unsigned int distance = obj->offset - base->offset;
+    int pos = sizeof(ofs) - 1;
+
+    hash_object(base->type, result, result_len, obj->sha1);
+    obj->type = base->type;
+    obj->size = result_len;
+    obj->depth = base->depth + 1;
+
+    // the base distance is big-endian with an off-by-one per continuation byte
+    ofs[pos] = distance & 0x7f;
+    while(distance >>= 7)
+        ofs[--pos] = 0x80 | (--distance & 0x7f);
+
+    if(!(compressed = deflate_buffer(delta, delta_len, &compressed_len)))
+        return -1;
+    pw_entry_header(pw, OFS_DELTA, delta_len);
+    pw_write(pw, ofs + pos, sizeof(ofs) - pos);
+    pw_write(pw, compressed, compressed_len);
+    free(compressed);
+    return 0;
+}
+
+static size_t delta_varint(unsigned char *out, size_t size)
+{
+    size_t n = 0;
+
+    out[n] = size & 0x7f;
+    while(size >>= 7) {
+        out[n++] |= 0x80;
+        out[n] = size & 0x7f;
+    }
+    return n + 1;
+}
+
+static size_t delta_copy(unsigned char *out, size_t offset, size_t size)
+{
+    size_t n = 0, chunk;
+    unsigned char *cmd;
+
+    while(size) {
+        chunk = size > 0x10000 ? 0x10000 : size;
+        cmd = &out[n++];
+        *cmd = 0x80;
+        if(offset & 0xff) { out[n++] = offset & 0xff; *cmd |= 0x01; }
+        if(offset & 0xff00) { out[n++] = (offset >> 8) & 0xff; *cmd |= 0x02; }
+        if(offset & 0xff0000) { out[n++] = (offset >> 16) & 0xff; *cmd |= 0x04; }
+        if(offset & 0xff000000) { out[n++] = (offset >> 24) & 0xff; *cmd |= 0x08; }
+        if(chunk != 0x10000) {
+            if(chunk & 0xff) { out[n++] = chunk & 0xff; *cmd |= 0x10; }
+            if(chunk & 0xff00) { out[n++] = (chunk >> 8) & 0xff; *cmd |= 0x20; }
+        }
+        offset += chunk;
+        size -= chunk;
+    }
+    return n;
+}
+
+static size_t delta_insert(unsigned char *out, const unsigned char *data, size_t size)
+{
+    size_t n = 0, chunk;
+
+    while(size) {
+        chunk = size > 127 ? 127 : size;
+        out[n++] = chunk;
+        memcpy(out + n, data, chunk);
+        n += chunk;
+        data += chunk;
+        size -= chunk;
+    }
+    return n;
+}
+
+// Produces a new version of base with one region rewritten, along with the
+// delta that turns base into it. *hdr_len is set to the length of the two size
+// headers at the front of the delta (patch_delta() is handed what follows).
+static unsigned char *mutate(const unsigned char *base, size_t base_len,
+                             size_t *result_len, unsigned char **delta, size_t *delta_len,
+                             size_t *hdr_len)
+{
+    size_t cut = rng_range(base_len), removed, added, tail, n;
+    unsigned char *result;
+
+    removed = rng_range(64);
+    if(cut + removed > base_len)
+        removed = base_len - cut;
+    added = 16 + rng_range(64);
+    tail = base_len - cut - removed;
+
+    *result_len = cut + added + tail;
+    if(!(result = malloc(*result_len)))
+        return NULL;
+    memcpy(result, base, cut);
+    random_text(result + cut, added);
+    memcpy(result + cut + added, base + cut + removed, tail);
+
+    if(!(*delta = malloc(32 + 2 * (base_len / 0x10000 + 1) * 8 + added + added / 127 + 1))) {
+        free(result);
+        return NULL;
+    }
+    n = delta_varint(*delta, base_len);
+    n += delta_varint(*delta + n, *result_len);
+    *hdr_len = n;
+    n += delta_copy(*delta + n, 0, cut);
+    n += delta_insert(*delta + n, result + cut, added);
+    n += delta_copy(*delta + n, cut + removed, tail);
+    *delta_len = n;
+    return result;
+}
+
+static size_t tree_entry(unsigned char *out, const char *mode, const char *name, const unsigned char *sha1)
+{
+    size_t n = sprintf((char *) out, "%s %s", mode, name) + 1;
+
+    memcpy(out + n, sha1, 20);
+    return n + 20;
+}
+
+static int compare_objs(const void *a, const void *b)
+{
+    return memcmp(((const struct bench_obj *) a)->sha1, ((const struct bench_obj *) b)->sha1, 20);
+}
+
+// version 1 idx: 256 entry fan-out, (offset, sha1) entries sorted by sha1, then
+// the pack checksum and the idx checksum
+static int write_idx_v1(const char *location, struct bench_obj *objs, int count, const unsigned char *pack_sha1)
+{
+    struct bench_obj *sorted;
+    struct sha1_ctx ctx;
+    unsigned char checksum[20];
+    uint32_t fanout[256], word;
+    FILE *fp;
+    int i, j;
+
+    if(!(sorted = malloc(sizeof(struct bench_obj) * count)))
+        return -1;
+    memcpy(sorted, objs, sizeof(struct bench_obj) * count);
+    qsort(sorted, count, sizeof(struct bench_obj), compare_objs);
+
+    for(i = 0, j = 0; i < 256; i++) {
+        while(j < count && sorted[j].sha1[0] <= i)
+            j++;
+        fanout[i] = htonl(j);
+    }
+
+    if(!(fp = fopen(location, "wb"))) {
+        free(sorted);
+        return -1;
+    }
+    sha1_init(&ctx);
+    fwrite(fanout, 4, 256, fp);
+    sha1_update(&ctx, fanout, sizeof(fanout));
+    for(i = 0; i < count; i++) {
+        word = htonl(sorted[i].offset);
+        fwrite(&word, 4, 1, fp);
+        fwrite(sorted[i].sha1, 1, 20, fp);
+        sha1_update(&ctx, &word, 4);
+        sha1_update(&ctx, sorted[i].sha1, 20);
+    }
+    fwrite(pack_sha1, 1, 20, fp);
+    sha1_update(&ctx, pack_sha1, 20);
+    sha1_final(checksum, &ctx);
+    fwrite(checksum, 1, 20, fp);
+    fclose(fp);
+    free(sorted);
+    return 0;
+}
+
+static int write_file(const char *dir, const char *name, const char *contents)
+{
+    char path[1200];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if(!(fp = fopen(path, "w")))
+        return -1;
+    fputs(contents, fp);
+    fclose(fp);
+    return 0;
+}
+
+static int generate_repo(const struct bench_options *opts, struct bench_repo *repo)
+{
+    struct pack_writer pw;
+    unsigned char *blob = NULL, *next, *delta, *tree, *commit;
+    unsigned char pack_sha1[20], sha1[20], parent[20], file_sha1[20];
+    size_t blob_len, next_len, delta_len, hdr_len, tree_len;
+    char path[1200], tmp_location[1200], hdr[64];
+    int total, i, level, chain_pos;
+    struct bench_obj *base = NULL;
+    uint32_t word;
+
+    rng_state = opts->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    mkdir(opts->dir, 0755);
+    snprintf(path, sizeof(path), "%s/objects", opts->dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/objects/pack", opts->dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/refs", opts->dir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/refs/heads", opts->dir);
+    mkdir(path, 0755);
+
+    // loose objects
+    repo->nloose = opts->loose_objects;
+    if(!(repo->loose = malloc(20 * (repo->nloose + 1))))
+        return -1;
+    if(!(blob = malloc(opts->blob_size * 2 + 1)))
+        return -1;
+    for(i = 0; i < repo->nloose; i++) {
+        blob_len = 1 + rng_range(opts->blob_size * 2);
+        random_text(blob, blob_len);
+        if(write_loose(opts->dir, BLOB, blob, blob_len, repo->loose[i]) != 0) {
+            fprintf(stderr, "failed to write a loose object: %s\n", strerror(errno));
+            free(blob);
+            return -1;
+        }
+    }
+    free(blob);
+
+    // the pack: delta chained blobs, a wide tree, a deep tree, a root tree and the commits
+    total = opts->pack_objects + 1 + opts->deep_levels + 1 + opts->commits;
+    memset(&pw, 0, sizeof(pw));
+    if(!(pw.objs = calloc(total, sizeof(struct bench_obj))))
+        return -1;
+    snprintf(tmp_location, sizeof(tmp_location), "%s/objects/pack/tmp_pack", opts->dir);
+    if(!(pw.fp = fopen(tmp_location, "wb"))) {
+        free(pw.objs);
+        return -1;
+    }
+    sha1_init(&pw.ctx);
+    pw_write(&pw, "PACK", 4);
+    word = htonl(2);
+    pw_write(&pw, &word, 4);
+    word = htonl(total);
+    pw_write(&pw, &word, 4);
+
+    blob = NULL;
+    blob_len = 0;
+    for(i = 0, chain_pos = 0; i < opts->pack_objects; i++, chain_pos++) {
+        if(chain_pos > opts->delta_depth)
+            chain_pos = 0;
+        if(chain_pos == 0) {
+            free(blob);
+            blob_len = opts->blob_size / 2 + rng_range(opts->blob_size) + 1;
+            if(!(blob = malloc(blob_len)))
+                return -1;
+            random_text(blob, blob_len);
+            base = &pw.objs[pw.count];
+            if(pw_add_object(&pw, BLOB, blob, blob_len, NULL) != 0)
+                return -1;
+            continue;
+        }
+        if(!(next = mutate(blob, blob_len, &next_len, &delta, &delta_len, &hdr_len)))
+            return -1;
+        if(pw_add_ofs_delta(&pw, base, delta, delta_len, next, next_len) != 0)
+            return -1;
+        base = &pw.objs[pw.count - 1];
+        free(delta);
+        free(blob);
+        blob = next;
+        blob_len = next_len;
+    }
+    free(blob);
+
+    // wide tree: one entry per blob, cycling through the pack
+    if(!(tree = malloc((size_t) opts->wide_entries * 64 + 64)))
+        return -1;
+    for(i = 0, tree_len = 0; i < opts->wide_entries; i++) {
+        sprintf(path, "f%07d", i);
+        tree_len += tree_entry(tree + tree_len, "100644", path,
+                               opts->pack_objects ? pw.objs[i % opts->pack_objects].sha1 : repo->loose[0]);
+    }
+    if(pw_add_object(&pw, TREE, tree, tree_len, repo->wide_tree) != 0)
+        return -1;
+
+    // deep tree: each level has a "dir" subtree and a "file" blob
+    memcpy(file_sha1, opts->pack_objects ? pw.objs[0].sha1 : repo->loose[0], 20);
+    tree_len = tree_entry(tree, "100644", "file", file_sha1);
+    if(pw_add_object(&pw, TREE, tree, tree_len, sha1) != 0)
+        return -1;
+    for(level = 1; level < opts->deep_levels; level++) {
+        tree_len = tree_entry(tree, "40000", "dir", sha1);
+        tree_len += tree_entry(tree + tree_len, "100644", "file", file_sha1);
+        if(pw_add_object(&pw, TREE, tree, tree_len, sha1) != 0)
+            return -1;
+    }
+    memcpy(repo->deep_tree, sha1, 20);
+
+    tree_len = tree_entry(tree, "40000", "deep", repo->deep_tree);
+    tree_len += tree_entry(tree + tree_len, "40000", "wide", repo->wide_tree);
+    if(pw_add_object(&pw, TREE, tree, tree_len, sha1) != 0)
+        return -1;
+
+    // linear history, all pointing at the root tree
+    if(!(commit = malloc(1024)))
+        return -1;
+    for(i = 0; i < opts->commits; i++) {
+        size_t n = sprintf((char *) commit, "tree %s\n", sha1_to_hex(sha1));
+        if(i > 0)
+            n += sprintf((char *) commit + n, "parent %s\n", sha1_to_hex(parent));
+        n += sprintf((char *) commit + n,
+                     "author Bench <bench@example.com> %d +0000\n"
+                     "committer Bench <bench@example.com> %d +0000\n"
+                     "\ncommit %d\n", 1200000000 + i, 1200000000 + i, i);
+        if(pw_add_object(&pw, COMMIT, commit, n, parent) != 0)
+            return -1;
+    }
+    memcpy(repo->head, parent, 20);
+    free(commit);
+    free(tree);
+
+    sha1_final(pack_sha1, &pw.ctx);
+    fwrite(pack_sha1, 1, 20, pw.fp);
+    fclose(pw.fp);
+
+    snprintf(repo->pack_location, sizeof(repo->pack_location), "%s/objects/pack/pack-%s.pack", opts->dir, sha1_to_hex(pack_sha1));
+    snprintf(repo->idx_location, sizeof(repo->idx_location), "%s/objects/pack/pack-%s.idx", opts->dir, sha1_to_hex(pack_sha1));
+    if(rename(tmp_location, repo->pack_location) != 0)
+        return -1;
+    if(write_idx_v1(repo->idx_location, pw.objs, pw.count, pack_sha1) != 0)
+        return -1;
+
+    repo->packed = pw.objs;
+    repo->npacked = pw.count;
+
+    // enough for "git --git-dir=<dir> fsck" to sanity check what we made
+    if(opts->commits > 0) {
+        snprintf(hdr, sizeof(hdr), "%s\n", sha1_to_hex(repo->head));
+        write_file(opts->dir, "refs/heads/master", hdr);
+    }
+    write_file(opts->dir, "HEAD", "ref: refs/heads/master\n");
+    write_file(opts->dir, "config", "[core]\n\trepositoryformatversion = 0\n\tbare = true\n");
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// measurement and reporting
+/////////////////////////////////////////////////////////////////////
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p)
+{
+    if(n == 0)
+        return 0;
+    return sorted[(int) (p * (n - 1) + 0.5)];
+}
+
+// lat holds per-op latencies in seconds; it is sorted in place
+static void report(const char *name, const char *param, int param_value,
+                   double *lat, int ops, uint64_t bytes)
+{
+    double total = 0;
+    int i;
+
+    for(i = 0; i < ops; i++)
+        total += lat[i];
+    qsort(lat, ops, sizeof(double), compare_doubles);
+
+    printf("{\"bench\":\"%s\"", name);
+    if(param)
+        printf(",\"%s\":%d", param, param_value);
+    printf(",\"ops\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"bytes\":%llu,\"bytes_per_sec\":%.1f"
+           ",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+           ops, total, total > 0 ? ops / total : 0, (unsigned long long) bytes, total > 0 ? bytes / total : 0,
+           percentile(lat, ops, 0.50) * 1e6, percentile(lat, ops, 0.90) * 1e6,
+           percentile(lat, ops, 0.99) * 1e6, ops ? lat[ops - 1] * 1e6 : 0);
+    fflush(stdout);
+}
+
+static void bench_idx_lookup(const struct bench_options *opts, const struct bench_repo *repo, double *lat)
+{
+    struct idx *idx;
+    struct idx_entry *entry;
+    struct sha1 hash;
+    double start;
+    int i;
+
+    if(!(idx = load_idx((char *) repo->idx_location))) {
+        fprintf(stderr, "failed to load %s\n", repo->idx_location);
+        return;
+    }
+    hash.length = 20;
+    for(i = 0; i < opts->iterations; i++) {
+        memcpy(hash.sha1, repo->packed[rng_range(repo->npacked)].sha1, 20);
+        start = now_seconds();
+        entry = pack_idx_read(idx, &hash);
+        lat[i] = now_seconds() - start;
+        if(!entry) {
+            fprintf(stderr, "idx lookup failed for %s\n", sha1_to_hex(hash.sha1));
+            break;
+        }
+        free(entry);
+    }
+    unload_idx(idx);
+    report("idx_lookup", NULL, 0, lat, i, 0);
+}
+
+static void bench_loose_read(const struct bench_options *opts, const struct bench_repo *repo, double *lat)
+{
+    struct git_object g_obj;
+    char path[1200];
+    uint64_t bytes = 0;
+    double start;
+    char *hex;
+    int i;
+
+    if(!repo->nloose)
+        return;
+    for(i = 0; i < opts->iterations; i++) {
+        hex = sha1_to_hex(repo->loose[rng_range(repo->nloose)]);
+        snprintf(path, sizeof(path), "%s/objects/%.2s/%s", opts->dir, hex, hex + 2);
+        start = now_seconds();
+        if(loose_get_object(path, &g_obj, 1) != 0) {
+            fprintf(stderr, "loose read failed for %s\n", path);
+            break;
+        }
+        lat[i] = now_seconds() - start;
+        bytes += g_obj.size;
+        free(g_obj.mem_data);
+    }
+    report("loose_read", NULL, 0, lat, i, bytes);
+}
+
+static void bench_pack_read(const struct bench_options *opts, const struct bench_repo *repo, double *lat)
+{
+    struct git_object g_obj;
+    int *candidates, ncandidates, depth, i;
+    const struct bench_obj *obj;
+    uint64_t bytes;
+    double start;
+
+    if(!(candidates = malloc(sizeof(int) * repo->npacked)))
+        return;
+    for(depth = 0; depth <= opts->delta_depth; depth++) {
+        for(i = 0, ncandidates = 0; i < repo->npacked; i++)
+            if(repo->packed[i].type == BLOB && repo->packed[i].depth == depth)
+                candidates[ncandidates++] = i;
+        if(!ncandidates)
+            continue;
+
+        bytes = 0;
+        for(i = 0; i < opts->iterations; i++) {
+            obj = &repo->packed[candidates[rng_range(ncandidates)]];
+            start = now_seconds();
+            if(pack_get_object((char *) repo->pack_location, obj->offset, &g_obj, 1) != 0) {
+                fprintf(stderr, "pack read failed at offset %u\n", obj->offset);
+                break;
+            }
+            lat[i] = now_seconds() - start;
+            bytes += g_obj.size;
+            free(g_obj.mem_data);
+        }
+        report("pack_read", "depth", depth, lat, i, bytes);
+    }
+    free(candidates);
+}
+
+static void bench_patch_delta(const struct bench_options *opts, double *lat)
+{
+    unsigned char *base, *result, *delta, *patched;
+    size_t base_len, result_len, delta_len, hdr_len;
+    uint64_t bytes = 0;
+    double start;
+    int i;
+
+    base_len = opts->blob_size;
+    if(!(base = malloc(base_len)))
+        return;
+    random_text(base, base_len);
+    if(!(result = mutate(base, base_len, &result_len, &delta, &delta_len, &hdr_len))) {
+        free(base);
+        return;
+    }
+    for(i = 0; i < opts->iterations; i++) {
+        start = now_seconds();
+        patched = patch_delta(base, base_len, delta + hdr_len, delta_len - hdr_len, result_len);
+        lat[i] = now_seconds() - start;
+        if(!patched || memcmp(patched, result, result_len) != 0) {
+            fprintf(stderr, "patch_delta produced the wrong result\n");
+            free(patched);
+            break;
+        }
+        bytes += result_len;
+        free(patched);
+    }
+    free(base);
+    free(result);
+    free(delta);
+    report("patch_delta", NULL, 0, lat, i, bytes);
+}
+
+// What verified reads cost: hashing a blob_size object and checking its id,
+// with the portable SHA-1 and then with the CPU's SHA instructions if it has
+// them.
+static void bench_verify(const struct bench_options *opts, double *lat)
+{
+    unsigned char *data, sha1[20];
+    uint64_t bytes;
+    double start;
+    int i, hardware;
+
+    if(!(data = malloc(opts->blob_size)))
+        return;
+    random_text(data, opts->blob_size);
+    hash_object(BLOB, data, opts->blob_size, sha1);
+
+    for(hardware = 0; hardware <= 1; hardware++) {
+        sha1_use_hardware(hardware);
+        if(hardware && strcmp(sha1_implementation(), "portable") == 0)
+            break;
+        bytes = 0;
+        for(i = 0; i < opts->iterations; i++) {
+            start = now_seconds();
+            if(check_object_hash(sha1, BLOB, data, opts->blob_size) != 0) {
+                fprintf(stderr, "check_object_hash rejected a good object\n");
+                break;
+            }
+            lat[i] = now_seconds() - start;
+            bytes += opts->blob_size;
+        }
+        report("verify", "hardware", hardware, lat, i, bytes);
+    }
+    sha1_use_hardware(1);
+    free(data);
+}
+
+// Line diff of a blob_size text file against a copy with a handful of
+// regions rewritten, with each algorithm.
+static void bench_diff(const struct bench_options *opts, double *lat)
+{
+    unsigned char *old, *new, *next, *delta;
+    size_t new_len, next_len, delta_len, hdr_len;
+    struct diff_options dopts;
+    struct diff_result res;
+    uint64_t bytes;
+    double start;
+    int i, algorithm;
+
+    if(!(old = malloc(opts->blob_size)) || !(new = malloc(opts->blob_size))) {
+        free(old);
+        return;
+    }
+    random_text(old, opts->blob_size);
+    memcpy(new, old, opts->blob_size);
+    new_len = opts->blob_size;
+    for(i = 0; i < 16; i++) {
+        if(!(next = mutate(new, new_len, &next_len, &delta, &delta_len, &hdr_len)))
+            break;
+        free(delta);
+        free(new);
+        new = next;
+        new_len = next_len;
+    }
+
+    diff_options_init(&dopts);
+    for(algorithm = DIFF_MYERS; algorithm <= DIFF_HISTOGRAM; algorithm++) {
+        dopts.algorithm = algorithm;
+        bytes = 0;
+        for(i = 0; i < opts->iterations; i++) {
+            start = now_seconds();
+            if(diff_buffers(old, opts->blob_size, new, new_len, &dopts, &res) != DIFF_TEXT ||
+               res.nchanges == 0) {
+                fprintf(stderr, "diff_buffers failed\n");
+                diff_release(&res);
+                break;
+            }
+            diff_release(&res);
+            lat[i] = now_seconds() - start;
+            bytes += opts->blob_size + new_len;
+        }
+        report("diff", "algorithm", algorithm, lat, i, bytes);
+    }
+    free(old);
+    free(new);
+}
+
+// Walks a raw tree the same way raw_tree_to_pyobject() does, minus Python.
+static int parse_tree(const unsigned char *buf, size_t size, const char *want, unsigned char *found)
+{
+    const unsigned char *end = buf + size;
+    const char *name;
+    int entries = 0;
+    char *hex;
+
+    while(buf < end) {
+        (void) atoi((const char *) buf);
+        buf = memchr(buf, ' ', end - buf) + 1;
+        name = (const char *) buf;
+        buf = memchr(buf, '\0', end - buf) + 1;
+        hex = sha1_to_hex(buf);
+        if(want && found && strcmp(name, want) == 0)
+            get_sha1_hex(hex, found);
+        buf += 20;
+        entries++;
+    }
+    return entries;
+}
+
+static int read_packed(struct idx *idx, const struct bench_repo *repo, const unsigned char *sha1, struct git_object *g_obj)
+{
+    struct idx_entry *entry;
+    struct sha1 hash;
+    int ret;
+
+    hash.length = 20;
+    memcpy(hash.sha1, sha1, 20);
+    if(!(entry = pack_idx_read(idx, &hash)))
+        return -1;
+    ret = pack_get_object((char *) repo->pack_location, entry->offset, g_obj, 1);
+    free(entry);
+    return ret;
+}
+
+static void bench_tree_parse(const struct bench_options *opts, const struct bench_repo *repo, double *lat)
+{
+    struct git_object g_obj;
+    unsigned char sha1[20];
+    struct idx *idx;
+    double start;
+    uint64_t bytes = 0;
+    int i, levels;
+
+    if(!(idx = load_idx((char *) repo->idx_location)))
+        return;
+
+    // wide: parse one large tree that is already in memory
+    if(read_packed(idx, repo, repo->wide_tree, &g_obj) != 0) {
+        unload_idx(idx);
+        return;
+    }
+    for(i = 0; i < opts->iterations; i++) {
+        start = now_seconds();
+        parse_tree(g_obj.mem_data, g_obj.size, NULL, NULL);
+        lat[i] = now_seconds() - start;
+        bytes += g_obj.size;
+    }
+    free(g_obj.mem_data);
+    report("tree_parse_wide", "entries", opts->wide_entries, lat, i, bytes);
+
+    // deep: read and parse each level on the way down, like a path lookup does
+    bytes = 0;
+    for(i = 0; i < opts->iterations; i++) {
+        memcpy(sha1, repo->deep_tree, 20);
+        start = now_seconds();
+        for(levels = 0; levels < opts->deep_levels; levels++) {
+            if(read_packed(idx, repo, sha1, &g_obj) != 0)
+                break;
+            parse_tree(g_obj.mem_data, g_obj.size, "dir", sha1);
+            bytes += g_obj.size;
+            free(g_obj.mem_data);
+        }
+        lat[i] = now_seconds() - start;
+    }
+    unload_idx(idx);
+    report("tree_walk_deep", "levels", opts->deep_levels, lat, i, bytes);
+}
+
+// git.py's rev_list(): look up each commit, read it and follow "parent ".
+static void bench_rev_list(const struct bench_options *opts, const struct bench_repo *repo, double *lat)
+{
+    struct git_object g_obj;
+    unsigned char sha1[20];
+    struct idx *idx;
+    uint64_t bytes = 0;
+    double start;
+    int i;
+
+    if(!opts->commits || !(idx = load_idx((char *) repo->idx_location)))
+        return;
+    memcpy(sha1, repo->head, 20);
+    for(i = 0; i < opts->iterations; i++) {
+        start = now_seconds();
+        if(read_packed(idx, repo, sha1, &g_obj) != 0) {
+            fprintf(stderr, "rev_list failed to read %s\n", sha1_to_hex(sha1));
+            break;
+        }
+        if(g_obj.size > 93 && memcmp(g_obj.mem_data + 46, "parent ", 7) == 0) {
+            char hex[41];
+            memcpy(hex, g_obj.mem_data + 53, 40);
+            hex[40] = '\0';
+            get_sha1_hex(hex, sha1);
+        } else {
+            memcpy(sha1, repo->head, 20); // hit the root; start over
+        }
+        lat[i] = now_seconds() - start;
+        bytes += g_obj.size;
+        free(g_obj.mem_data);
+    }
+    unload_idx(idx);
+    report("rev_list", "commits", opts->commits, lat, i, bytes);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -o DIR    where to generate the repository (default: bench-repo)\n"
+        "  -n N      blobs in the pack (default: 2000)\n"
+        "  -d N      maximum delta chain depth (default: 10)\n"
+        "  -l N      loose objects (default: 1000)\n"
+        "  -w N      entries in the wide tree (default: 10000)\n"
+        "  -t N      levels in the deep tree (default: 64)\n"
+        "  -c N      commits (default: 1000)\n"
+        "  -b N      average blob size in bytes (default: 4096)\n"
+        "  -i N      operations per benchmark (default: 5000)\n"
+        "  -s N      random seed (default: 1)\n"
+        "  -g        generate the repository and exit\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts;
+    struct bench_repo repo;
+    double *lat;
+    int c;
+
+    opts.dir = "bench-repo";
+    opts.pack_objects = 2000;
+    opts.delta_depth = 10;
+    opts.loose_objects = 1000;
+    opts.wide_entries = 10000;
+    opts.deep_levels = 64;
+    opts.commits = 1000;
+    opts.blob_size = 4096;
+    opts.iterations = 5000;
+    opts.seed = 1;
+    opts.generate_only = 0;
+
+    while((c = getopt(argc, argv, "o:n:d:l:w:t:c:b:i:s:gh")) != -1) {
+        switch(c) {
+            case 'o': opts.dir = optarg; break;
+            case 'n': opts.pack_objects = atoi(optarg); break;
+            case 'd': opts.delta_depth = atoi(optarg); break;
+            case 'l': opts.loose_objects = atoi(optarg); break;
+            case 'w': opts.wide_entries = atoi(optarg); break;
+            case 't': opts.deep_levels = atoi(optarg); break;
+            case 'c': opts.commits = atoi(optarg); break;
+            case 'b': opts.blob_size = atoi(optarg); break;
+            case 'i': opts.iterations = atoi(optarg); break;
+            case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'g': opts.generate_only = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(opts.pack_objects < 0 || opts.delta_depth < 0 || opts.loose_objects < 0 || opts.wide_entries < 0 ||
+       opts.deep_levels < 1 || opts.commits < 0 || opts.blob_size < 64 || opts.iterations < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // regenerated every run; with the same options and seed the output is identical
+    memset(&repo, 0, sizeof(repo));
+    c = generate_repo(&opts, &repo);
+    if(c != 0) {
+        fprintf(stderr, "failed to generate the benchmark repository in %s\n", opts.dir);
+        return 1;
+    }
+
+    printf("{\"bench\":\"config\",\"dir\":\"%s\",\"seed\":%llu,\"pack_objects\":%d,\"delta_depth\":%d"
+           ",\"loose_objects\":%d,\"wide_entries\":%d,\"deep_levels\":%d,\"commits\":%d"
+           ",\"blob_size\":%d,\"iterations\":%d}\n",
+           opts.dir, (unsigned long long) opts.seed, opts.pack_objects, opts.delta_depth,
+           opts.loose_objects, opts.wide_entries, opts.deep_levels, opts.commits,
+           opts.blob_size, opts.iterations);
+    if(opts.generate_only)
+        return 0;
+
+    if(!(lat = malloc(sizeof(double) * opts.iterations)))
+        return 1;
+
+    // the benchmarks draw from their own stream so the choice of objects
+    // doesn't depend on how the repository was built
+    rng_state = opts.seed * 0xbf58476d1ce4e5b9ULL + 7;
+
+    bench_idx_lookup(&opts, &repo, lat);
+    bench_loose_read(&opts, &repo, lat);
+    bench_pack_read(&opts, &repo, lat);
+    bench_patch_delta(&opts, lat);
+    bench_verify(&opts, lat);
+    bench_diff(&opts, lat);
+    bench_tree_parse(&opts, &repo, lat);
+    bench_rev_list(&opts, &repo, lat);
+
+    free(lat);
+    free(repo.packed);
+    free(repo.loose);
+    return 0;
+}
@@ -0,0 +1,597 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h> // for ntohl(), etc
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "bitmap.h"
+
+// Reachability bitmaps, as in git's pack-bitmap.c.
+//
+// A .bitmap file holds, for a selection of commits, the set of every object
+// reachable from that commit, one bit per object of the pack in pack order
+// and EWAH compressed. Answering "what does this tip reach" is then a lookup
+// when the tip has a bitmap, and otherwise a short walk back to commits that
+// do, OR'ing in their bitmaps. Counting and set differences are plain word
+// operations on the result.
+//
+// File layout (all integers big-endian):
+//   "BITM", version (16 bits, 1), options (16 bits), entry count (32 bits),
+//   the pack's checksum,
+//   the type bitmaps: commits, trees, blobs and tags,
+//   per entry: commit idx position (32 bits), XOR offset (8 bits), flags
+//   (8 bits) and a bitmap, which is XOR'ed against the bitmap of the entry
+//   XOR offset entries back unless the offset is 0,
+//   optional extensions we don't need, and a trailing checksum.
+//
+// An EWAH bitmap: bit count (32 bits), word count (32 bits), that many 64
+// bit words, and the position of the last run-length word (32 bits). The
+// words are a run-length word followed by literal words: bit 0 of a
+// run-length word is the bit to repeat, bits 1-32 how many words of it and
+// bits 33-63 how many literal words follow.
+
+#define BITMAP_HEADER_SIZE 32
+#define BITMAP_OPT_FULL_DAG 1 // every bitmap is closed under reachability
+#define BITMAP_MAX_XOR_OFFSET 160
+
+// The words after each entry's 6 byte header aren't aligned, so no casts.
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static inline uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/////////////////////////////////////////////////////////////////////
+// plain bitmaps                                                   //
+/////////////////////////////////////////////////////////////////////
+
+static struct bitmap *bitmap_new(uint32_t nwords)
+{
+    struct bitmap *b;
+
+    if(!(b = malloc(sizeof(struct bitmap))))
+        return NULL;
+    b->nwords = nwords;
+    if(!(b->words = calloc(nwords ? nwords : 1, sizeof(uint64_t)))) {
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+void bitmap_free(struct bitmap *b)
+{
+    if(!b)
+        return;
+    free(b->words);
+    free(b);
+}
+
+static int bitmap_grow(struct bitmap *b, uint32_t nwords)
+{
+    uint64_t *grown;
+    uint32_t n = b->nwords ? b->nwords : 1;
+
+    if(nwords <= b->nwords)
+        return 0;
+    while(n < nwords)
+        n *= 2;
+    if(!(grown = realloc(b->words, n * sizeof(uint64_t))))
+        return -1;
+    memset(grown + b->nwords, 0, (n - b->nwords) * sizeof(uint64_t));
+    b->words = grown;
+    b->nwords = n;
+    return 0;
+}
+
+static inline int bitmap_get(const struct bitmap *b, uint32_t bit)
+{
+    return (bit / 64 < b->nwords) && (b->words[bit / 64] & (1ULL << (bit % 64)));
+}
+
+static inline int bitmap_set(struct bitmap *b, uint32_t bit)
+{
+    if(bitmap_grow(b, bit / 64 + 1) != 0)
+        return -1;
+    b->words[bit / 64] |= 1ULL << (bit % 64);
+    return 0;
+}
+
+void bitmap_or(struct bitmap *a, const struct bitmap *b)
+{
+    uint32_t i, n = b->nwords;
+
+    // trailing zero words of b don't need room in a
+    while(n > 0 && !b->words[n - 1])
+        n--;
+    if(bitmap_grow(a, n) != 0)
+        n = a->nwords; // out of memory; a is the best we can do
+    for(i = 0; i < n; i++)
+        a->words[i] |= b->words[i];
+}
+
+// a = a & ~b, i.e. what a reaches that b doesn't
+void bitmap_and_not(struct bitmap *a, const struct bitmap *b)
+{
+    uint32_t i, n = (a->nwords < b->nwords) ? a->nwords : b->nwords;
+
+    for(i = 0; i < n; i++)
+        a->words[i] &= ~b->words[i];
+}
+
+/////////////////////////////////////////////////////////////////////
+// EWAH                                                            //
+/////////////////////////////////////////////////////////////////////
+
+// Returns the size of the EWAH bitmap at p, or 0 if it runs past end.
+static size_t ewah_size(const unsigned char *p, const unsigned char *end)
+{
+    uint32_t nwords;
+
+    if(end - p < 8)
+        return 0;
+    nwords = get_be32(p + 4);
+    if((uint64_t) (end - p) < 12 + (uint64_t) nwords * 8)
+        return 0;
+    return 12 + (size_t) nwords * 8;
+}
+
+// Decompresses the EWAH bitmap at p (already checked by ewah_size()).
+static struct bitmap *ewah_decode(const unsigned char *p)
+{
+    uint32_t bits = get_be32(p), nwords = get_be32(p + 4), i, out = 0, run, literals, n;
+    const unsigned char *words = p + 8;
+    struct bitmap *b;
+    uint64_t rlw;
+
+    if(!(b = bitmap_new((bits + 63) / 64)))
+        return NULL;
+
+    for(i = 0; i < nwords; ) {
+        rlw = get_be64(words + (size_t) i++ * 8);
+        run = (rlw >> 1) & 0xffffffff;
+        literals = rlw >> 33;
+        if(run > b->nwords - out || literals > b->nwords - out - run || literals > nwords - i) {
+            bitmap_free(b);
+            return NULL;
+        }
+        if(rlw & 1)
+            memset(b->words + out, 0xff, (size_t) run * sizeof(uint64_t));
+        out += run;
+        for(n = 0; n < literals; n++)
+            b->words[out++] = get_be64(words + (size_t) i++ * 8);
+    }
+    return b;
+}
+
+// Decodes a stored commit bitmap, applying its XOR chain. Caller holds the lock.
+static struct bitmap *entry_bitmap(struct bitmap_index *bi, uint32_t e)
+{
+    uint32_t chain[BITMAP_MAX_XOR_OFFSET + 1], depth = 0, i, n;
+    struct bitmap *b, *base;
+
+    // find the nearest entry in the chain that is ready (or needs no base)
+    while(!bi->entries[e].bitmap && bi->entries[e].xor_base != e) {
+        if(depth == BITMAP_MAX_XOR_OFFSET + 1) {
+            // a long chain; resolve the base first, which bounds our stack
+            if(!entry_bitmap(bi, e))
+                return NULL;
+            break;
+        }
+        chain[depth++] = e;
+        e = bi->entries[e].xor_base;
+    }
+    if(!bi->entries[e].bitmap && !(bi->entries[e].bitmap = ewah_decode(bi->entries[e].ewah)))
+        return NULL;
+
+    // then come back up, XOR'ing each onto the one below
+    while(depth > 0) {
+        base = bi->entries[e].bitmap;
+        e = chain[--depth];
+        if(!(b = ewah_decode(bi->entries[e].ewah)))
+            return NULL;
+        if(bitmap_grow(b, base->nwords) != 0) {
+            bitmap_free(b);
+            return NULL;
+        }
+        n = base->nwords;
+        for(i = 0; i < n; i++)
+            b->words[i] ^= base->words[i];
+        bi->entries[e].bitmap = b;
+    }
+    return bi->entries[e].bitmap;
+}
+
+/////////////////////////////////////////////////////////////////////
+// the index                                                       //
+/////////////////////////////////////////////////////////////////////
+
+static int bitmap_parse(struct bitmap_index *bi)
+{
+    const unsigned char *p = bi->data, *end = bi->data + bi->size - 20;
+    const struct idx *idx = bi->odb->idxs[bi->pack];
+    const struct pack *pack = bi->odb->packs[bi->pack];
+    uint32_t i, xor_offset;
+    size_t len;
+    int t;
+
+    if(bi->size < BITMAP_HEADER_SIZE + 20 || memcmp(p, "BITM", 4) != 0 || p[4] != 0 || p[5] != 1) {
+        printf("Bad bitmap file: unsupported signature or version.\n");
+        return -1;
+    }
+    if(!(p[7] & BITMAP_OPT_FULL_DAG)) {
+        printf("Bad bitmap file: bitmaps aren't closed under reachability.\n");
+        return -1;
+    }
+    if(memcmp(p + 12, pack->data + pack->size - 20, 20) != 0) {
+        printf("Bad bitmap file: it was written for a different pack.\n");
+        return -1;
+    }
+    bi->nentries = get_be32(p + 8);
+    p += BITMAP_HEADER_SIZE;
+
+    for(t = 0; t < 4; t++) {
+        if(!(len = ewah_size(p, end)) || !(bi->types[t] = ewah_decode(p)))
+            return -1;
+        p += len;
+    }
+
+    if(!(bi->entries = calloc(bi->nentries ? bi->nentries : 1, sizeof(struct bitmap_entry))))
+        return -1;
+    for(i = 0; i < bi->nentries; i++) {
+        if(end - p < 6)
+            return -1;
+        bi->entries[i].commit_pos = get_be32(p);
+        xor_offset = p[4];
+        if(bi->entries[i].commit_pos >= idx->entries || xor_offset > i || xor_offset > BITMAP_MAX_XOR_OFFSET)
+            return -1;
+        bi->entries[i].xor_base = i - xor_offset;
+        bi->entries[i].ewah = p + 6;
+        if(!(len = ewah_size(p + 6, end)))
+            return -1;
+        p += 6 + len;
+        if(oid_map_put(&bi->commits, idx_sha1(idx, bi->entries[i].commit_pos), i) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Finds the bitmap for one of odb's packs, if any of them has one. The index
+// keeps its own reference to odb.
+struct bitmap_index *bitmap_open(struct odb *odb)
+{
+    struct bitmap_index *bi;
+    struct stat st;
+    char *location;
+    size_t len;
+    int fd = -1, i;
+    uint32_t n;
+
+    if(!(bi = calloc(1, sizeof(struct bitmap_index))))
+        return NULL;
+    bi->odb = odb_ref(odb);
+    pthread_mutex_init(&bi->lock, NULL);
+
+    for(i = 0; i < odb->npacks && fd < 0; i++) {
+        len = strlen(odb->packs[i]->location);
+        if(len < 5 || !(location = malloc(len + 3)))
+            continue;
+        memcpy(location, odb->packs[i]->location, len - 5);
+        strcpy(location + len - 5, ".bitmap");
+        if((fd = open(location, O_RDONLY)) >= 0)
+            bi->pack = i;
+        free(location);
+    }
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        if(fd >= 0)
+            close(fd);
+        bitmap_close(bi);
+        return NULL;
+    }
+    bi->size = st.st_size;
+    bi->data = mmap(NULL, bi->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(bi->data == MAP_FAILED) {
+        bi->data = NULL;
+        bitmap_close(bi);
+        return NULL;
+    }
+
+    bi->nobjects = odb->idxs[bi->pack]->entries;
+    if(!(bi->order = pack_order(odb->packs[bi->pack], odb->idxs[bi->pack])) ||
+       !(bi->idx_to_bit = malloc(sizeof(uint32_t) * (bi->nobjects + 1)))) {
+        bitmap_close(bi);
+        return NULL;
+    }
+    for(n = 0; n < bi->nobjects; n++)
+        bi->idx_to_bit[bi->order[n].pos] = n;
+
+    if(bitmap_parse(bi) != 0) {
+        printf("Bad bitmap file for %s.\n", odb->packs[bi->pack]->location);
+        bitmap_close(bi);
+        return NULL;
+    }
+    return bi;
+}
+
+void bitmap_close(struct bitmap_index *bi)
+{
+    uint32_t i;
+    int t;
+
+    if(!bi)
+        return;
+
+    if(bi->entries) {
+        for(i = 0; i < bi->nentries; i++)
+            bitmap_free(bi->entries[i].bitmap);
+        free(bi->entries);
+    }
+    for(t = 0; t < 4; t++)
+        bitmap_free(bi->types[t]);
+    oid_map_free(&bi->commits);
+    oid_map_free(&bi->extended);
+    free(bi->extended_types);
+    free(bi->order);
+    free(bi->idx_to_bit);
+    if(bi->data)
+        munmap(bi->data, bi->size);
+    pthread_mutex_destroy(&bi->lock);
+    odb_close(bi->odb);
+    free(bi);
+}
+
+// The bit for an object: its place in the pack, or a new position after the
+// pack for objects stored elsewhere. Returns -1 if the object doesn't exist.
+static int64_t object_bit(struct bitmap_index *bi, const unsigned char *sha1, unsigned int type)
+{
+    struct odb_location loc;
+    unsigned int *grown;
+    uint32_t pos;
+
+    if(idx_find(bi->odb->idxs[bi->pack], sha1, &pos) == 0)
+        return bi->idx_to_bit[pos];
+
+    if(oid_map_get(&bi->extended, sha1, &pos) == 0)
+        return pos;
+    if(odb_find(bi->odb, sha1, &loc) != 0)
+        return -1;
+
+    if(bi->nextended == bi->extended_alloc) {
+        if(!(grown = realloc(bi->extended_types, sizeof(unsigned int) * (bi->extended_alloc * 2 + 16))))
+            return -1;
+        bi->extended_types = grown;
+        bi->extended_alloc = bi->extended_alloc * 2 + 16;
+    }
+    pos = bi->nobjects + bi->nextended;
+    if(oid_map_put(&bi->extended, sha1, pos) != 0)
+        return -1;
+    bi->extended_types[bi->nextended++] = type;
+    return pos;
+}
+
+// Sets the bits for a tree and everything in it, stopping at subtrees that
+// are already set: whatever set them set their contents too.
+static int fill_tree(struct bitmap_index *bi, struct bitmap *result, const unsigned char *tree_sha1,
+                     struct base_cache *cache)
+{
+    struct git_object g_obj;
+    unsigned long pos = 0;
+    unsigned int mode;
+    const char *name;
+    size_t name_len;
+    const unsigned char *sha1;
+    int64_t bit;
+    int ret = 0;
+
+    if((bit = object_bit(bi, tree_sha1, TREE)) < 0)
+        return -1;
+    if(bitmap_get(result, bit))
+        return 0;
+    if(bitmap_set(result, bit) != 0 || odb_read(bi->odb, tree_sha1, &g_obj, cache) != 0)
+        return -1;
+
+    while(ret == 0 && tree_next_entry(g_obj.mem_data, g_obj.size, &pos, &mode, &name, &name_len, &sha1) == 0) {
+        if((mode & 0170000) == S_IFGITLINK)
+            continue;
+        if((mode & 0170000) == S_IFTREE) {
+            ret = fill_tree(bi, result, sha1, cache);
+        } else {
+            if((bit = object_bit(bi, sha1, BLOB)) < 0 || bitmap_set(result, bit) != 0)
+                ret = -1;
+        }
+    }
+    free(g_obj.mem_data);
+    return ret;
+}
+
+struct sha1_list {
+    unsigned char (*sha1s)[20];
+    uint32_t count;
+    uint32_t alloc;
+};
+
+static int sha1_list_add(struct sha1_list *list, const unsigned char *sha1)
+{
+    unsigned char (*grown)[20];
+
+    if(list->count == list->alloc) {
+        if(!(grown = realloc(list->sha1s, 20 * (size_t) (list->alloc * 2 + 16))))
+            return -1;
+        list->sha1s = grown;
+        list->alloc = list->alloc * 2 + 16;
+    }
+    memcpy(list->sha1s[list->count++], sha1, 20);
+    return 0;
+}
+
+// Everything reachable from the tips (commits or tags, or for that matter
+// trees and blobs). Tips with a stored bitmap cost nothing; for the others
+// we walk back until we reach commits that have one.
+static struct bitmap *reachable(struct bitmap_index *bi, const unsigned char (*tips)[20], int ntips,
+                                struct base_cache *cache)
+{
+    struct sha1_list pending = { NULL, 0, 0 }, trees = { NULL, 0, 0 };
+    struct bitmap *result, *stored;
+    struct git_object g_obj;
+    struct odb_location loc;
+    const unsigned char *p, *end;
+    unsigned char sha1[20];
+    uint32_t e, i;
+    int64_t bit;
+    int ok = 1;
+
+    if(!(result = bitmap_new((bi->nobjects + 63) / 64)))
+        return NULL;
+
+    for(i = 0; ok && i < (uint32_t) ntips; i++)
+        ok = sha1_list_add(&pending, tips[i]) == 0;
+
+    while(ok && pending.count > 0) {
+        memcpy(sha1, pending.sha1s[--pending.count], 20);
+
+        if(oid_map_get(&bi->commits, sha1, &e) == 0) {
+            if((stored = entry_bitmap(bi, e)))
+                bitmap_or(result, stored);
+            else
+                ok = 0;
+            continue;
+        }
+
+        if(odb_read(bi->odb, sha1, &g_obj, cache) != 0 || (bit = object_bit(bi, sha1, g_obj.type)) < 0) {
+            free(g_obj.mem_data);
+            ok = 0;
+            break;
+        }
+        if(g_obj.type == TREE) {
+            // left for fill_tree(), which sets the bit itself
+            ok = sha1_list_add(&trees, sha1) == 0;
+            free(g_obj.mem_data);
+            continue;
+        }
+        if(bitmap_get(result, bit)) {
+            free(g_obj.mem_data);
+            continue;
+        }
+        ok = bitmap_set(result, bit) == 0;
+
+        p = g_obj.mem_data;
+        end = p + g_obj.size;
+        if(ok && g_obj.type == COMMIT) {
+            if(parse_header_sha1(&p, end, "tree", sha1) == 0)
+                ok = sha1_list_add(&trees, sha1) == 0;
+            while(ok && parse_header_sha1(&p, end, "parent", sha1) == 0) {
+                // missing parents (a shallow clone) are simply not followed
+                if(odb_find(bi->odb, sha1, &loc) == 0)
+                    ok = sha1_list_add(&pending, sha1) == 0;
+            }
+        } else if(ok && g_obj.type == TAG) {
+            if(parse_header_sha1(&p, end, "object", sha1) == 0)
+                ok = sha1_list_add(&pending, sha1) == 0;
+        }
+        free(g_obj.mem_data);
+    }
+
+    for(i = 0; ok && i < trees.count; i++)
+        ok = fill_tree(bi, result, trees.sha1s[i], cache) == 0;
+
+    free(pending.sha1s);
+    free(trees.sha1s);
+    if(!ok) {
+        bitmap_free(result);
+        return NULL;
+    }
+    return result;
+}
+
+// Returns a new bitmap of everything reachable from the tips, or NULL if
+// one of them (or something they lead to) is missing.
+struct bitmap *bitmap_reachable(struct bitmap_index *bi, const unsigned char (*tips)[20], int ntips)
+{
+    struct base_cache *cache;
+    struct bitmap *result;
+
+    if(!(cache = base_cache_new(16 << 20)))
+        return NULL;
+    pthread_mutex_lock(&bi->lock);
+    result = reachable(bi, tips, ntips, cache);
+    pthread_mutex_unlock(&bi->lock);
+    base_cache_free(cache);
+    return result;
+}
+
+void bitmap_count(struct bitmap_index *bi, const struct bitmap *b, struct bitmap_counts *counts)
+{
+    uint32_t i, n, in_pack = (bi->nobjects + 63) / 64, bit;
+    uint64_t *by_type[4], word;
+    int t;
+
+    memset(counts, 0, sizeof(struct bitmap_counts));
+    by_type[0] = &counts->commits;
+    by_type[1] = &counts->trees;
+    by_type[2] = &counts->blobs;
+    by_type[3] = &counts->tags;
+
+    // objects in the pack: whole words at a time
+    for(t = 0; t < 4; t++) {
+        n = (b->nwords < bi->types[t]->nwords) ? b->nwords : bi->types[t]->nwords;
+        for(i = 0; i < n; i++)
+            *by_type[t] += __builtin_popcountll(b->words[i] & bi->types[t]->words[i]);
+    }
+    for(i = 0; i < b->nwords && i < in_pack; i++) {
+        for(word = b->words[i]; word; word &= word - 1) {
+            bit = i * 64 + __builtin_ctzll(word);
+            if(bit < bi->nobjects)
+                counts->bytes += bi->order[bit].end - bi->order[bit].offset;
+        }
+    }
+
+    // and the few outside it, one by one
+    pthread_mutex_lock(&bi->lock);
+    for(bit = bi->nobjects; bit < bi->nobjects + bi->nextended; bit++) {
+        if(bitmap_get(b, bit) && bi->extended_types[bit - bi->nobjects] >= COMMIT &&
+           bi->extended_types[bit - bi->nobjects] <= TAG)
+            (*by_type[bi->extended_types[bit - bi->nobjects] - 1])++;
+    }
+    pthread_mutex_unlock(&bi->lock);
+
+    counts->objects = counts->commits + counts->trees + counts->blobs + counts->tags;
+}
+
+// Counts what include reaches that exclude doesn't, the "have/want" set
+// difference a fetch negotiates.
+int bitmap_count_reachable(struct bitmap_index *bi, const unsigned char (*include)[20], int ninclude,
+                           const unsigned char (*exclude)[20], int nexclude, struct bitmap_counts *counts)
+{
+    struct bitmap *want, *have;
+
+    if(!(want = bitmap_reachable(bi, include, ninclude)))
+        return -1;
+    if(nexclude > 0) {
+        if(!(have = bitmap_reachable(bi, exclude, nexclude))) {
+            bitmap_free(want);
+            return -1;
+        }
+        bitmap_and_not(want, have);
+        bitmap_free(have);
+    }
+    bitmap_count(bi, want, counts);
+    bitmap_free(want);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "oidmap.h"
+
+struct odb;
+struct pack_order_entry;
+
+// A plain, uncompressed set of bit positions. Bit n is object n of the
+// bitmapped pack in pack order; objects that aren't in that pack get
+// positions after the last one (see bitmap_index.extended).
+struct bitmap {
+    uint64_t *words;
+    uint32_t nwords;     // bits past the end are all 0
+};
+
+// One commit's stored reachability bitmap.
+struct bitmap_entry {
+    uint32_t commit_pos;             // the commit's position in the idx
+    uint32_t xor_base;               // entry this one is XORed against, or itself
+    const unsigned char *ewah;       // the compressed bitmap, in the mmap
+    struct bitmap *bitmap;           // decoded on first use
+};
+
+// A pack's .bitmap file, as written by "git repack -b".
+struct bitmap_index {
+    struct odb *odb;
+    int pack;                        // which of odb's packs the bitmap is for
+    unsigned char *data;             // the mmap'd .bitmap
+    size_t size;
+    uint32_t nobjects;
+    struct pack_order_entry *order;  // bit -> pack entry
+    uint32_t *idx_to_bit;
+    struct bitmap *types[4];         // commits, trees, blobs, tags
+    struct bitmap_entry *entries;
+    uint32_t nentries;
+    struct oid_map commits;          // commit id -> index in entries
+    struct oid_map extended;         // object id -> bit, for objects outside the pack
+    unsigned int *extended_types;
+    uint32_t nextended, extended_alloc;
+    pthread_mutex_t lock;            // decoding and extending happen on demand
+};
+
+struct bitmap_counts {
+    uint64_t objects;
+    uint64_t commits;
+    uint64_t trees;
+    uint64_t blobs;
+    uint64_t tags;
+    uint64_t bytes;      // compressed size in the pack; objects outside it count as 0
+};
+
+struct bitmap_index *bitmap_open(struct odb *odb);
+void bitmap_close(struct bitmap_index *bi);
+
+struct bitmap *bitmap_reachable(struct bitmap_index *bi, const unsigned char (*tips)[20], int ntips);
+void bitmap_or(struct bitmap *a, const struct bitmap *b);
+void bitmap_and_not(struct bitmap *a, const struct bitmap *b);
+void bitmap_count(struct bitmap_index *bi, const struct bitmap *b, struct bitmap_counts *counts);
+void bitmap_free(struct bitmap *b);
+
+int bitmap_count_reachable(struct bitmap_index *bi, const unsigned char (*include)[20], int ninclude,
+                           const unsigned char (*exclude)[20], int nexclude, struct bitmap_counts *counts);
+
+
+#endif
@@ -0,0 +1,523 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "oidmap.h"
+#include "commit.h"
+#include "tree.h"
+#include "diff.h"
+#include "stats.h"
+#include "blame.h"
+
+// Blame the way git's blame.c does it, minus following renames and copies.
+// Every line starts out suspected of having been added by the commit the
+// blame starts at. Commits are taken newest first by commit date; each diffs
+// its version of the file against each parent's in turn and passes on the
+// suspect lines that parent had unchanged. Whatever no parent takes, the
+// commit added.
+//
+// Most commits don't touch the file. The file's blob id is looked up in each
+// commit through the path memo, which only reads trees whose ids it hasn't
+// seen, and a parent with the same blob takes every suspect line without a
+// diff. Each version of the file is read once, when a child first diffs
+// against it, and kept until its own suspects have been passed on.
+
+struct blame_piece {
+    uint32_t final_start;
+    uint32_t count;
+    uint32_t orig_start;         // in the suspect's version of the file
+};
+
+// A commit and its version of the file.
+struct blame_origin {
+    unsigned char commit[20];
+    unsigned char blob[20];
+    int has_blob;                // 0 if the file isn't there, or isn't a file
+    uint64_t date;
+    uint32_t parents;            // index of the first parent in parent_ids
+    uint32_t nparents;
+    unsigned char *data;         // NULL until needed
+    unsigned long size;
+    struct blame_piece *suspects;
+    uint32_t nsuspects, suspects_alloc;
+    int queued;
+};
+
+struct blame_state {
+    const struct odb *odb;
+    struct tree_resolver *paths;
+    const char *path;
+    struct base_cache *cache;
+    const unsigned char *final;      // the file blamed, which blame_release() frees
+
+    struct oid_map origin_map;       // commit id -> index in origins
+    struct blame_origin *origins;
+    uint32_t norigins, origins_alloc;
+    unsigned char (*parent_ids)[20];
+    uint32_t nparent_ids, parent_ids_alloc;
+    uint32_t *queue;                 // a max-heap on commit date
+    uint32_t nqueue, queue_alloc;
+    struct blame_entry *done;
+    uint32_t ndone, done_alloc;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+static uint32_t count_lines(const unsigned char *data, unsigned long size)
+{
+    const unsigned char *p = data, *end = data + size, *nl;
+    uint32_t n = 0;
+
+    while(p < end && (nl = memchr(p, '\n', end - p))) {
+        n++;
+        p = nl + 1;
+    }
+    return n + (p < end);
+}
+
+// Appends a piece, merging it into the last one if it carries straight on.
+static int add_piece(struct blame_piece **pieces, uint32_t *n, uint32_t *alloc, const struct blame_piece *piece)
+{
+    struct blame_piece *last;
+    void *grown;
+
+    if(*n) {
+        last = &(*pieces)[*n - 1];
+        if(last->final_start + last->count == piece->final_start &&
+           last->orig_start + last->count == piece->orig_start) {
+            last->count += piece->count;
+            return 0;
+        }
+    }
+    if(!(grown = grow(*pieces, alloc, *n + 1, sizeof(struct blame_piece))))
+        return -1;
+    *pieces = grown;
+    (*pieces)[(*n)++] = *piece;
+    return 0;
+}
+
+static int compare_orig(const void *a, const void *b)
+{
+    uint32_t x = ((const struct blame_piece *) a)->orig_start, y = ((const struct blame_piece *) b)->orig_start;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+static int compare_final(const void *a, const void *b)
+{
+    uint32_t x = ((const struct blame_entry *) a)->final_start, y = ((const struct blame_entry *) b)->final_start;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/////////////////////////////////////////////////////////////////////
+// origins                                                         //
+/////////////////////////////////////////////////////////////////////
+
+static int add_parent_id(struct blame_state *st, const unsigned char *sha1)
+{
+    void *grown;
+
+    if(!(grown = grow(st->parent_ids, &st->parent_ids_alloc, st->nparent_ids + 1, 20)))
+        return -1;
+    st->parent_ids = grown;
+    memcpy(st->parent_ids[st->nparent_ids++], sha1, 20);
+    return 0;
+}
+
+// Returns the index of a commit's origin, reading the commit and finding the
+// file in it if we haven't yet; -1 if it's missing or not a commit.
+static int64_t load_origin(struct blame_state *st, const unsigned char *id)
+{
+    struct blame_origin *o;
+    struct git_object g_obj;
+    struct commit commit;
+    unsigned char sha1[20];
+    unsigned int mode, i;
+    uint32_t c;
+    void *grown;
+    int ret = -1;
+
+    if(oid_map_get(&st->origin_map, id, &c) == 0)
+        return c;
+    if(!(grown = grow(st->origins, &st->origins_alloc, st->norigins + 1, sizeof(struct blame_origin))))
+        return -1;
+    st->origins = grown;
+    c = st->norigins;
+    o = &st->origins[c];
+    memset(o, 0, sizeof(*o));
+    memcpy(o->commit, id, 20); // id may point into parent_ids, which loading can move
+    o->parents = st->nparent_ids;
+
+    if(odb_read(st->odb, o->commit, &g_obj, st->cache) != 0)
+        return -1;
+    if(g_obj.type == COMMIT && commit_parse(g_obj.mem_data, g_obj.size, &commit) == 0) {
+        o->date = commit.committer.time > 0 ? commit.committer.time : 0;
+        o->nparents = commit.nparents;
+        for(i = 0, ret = 0; ret == 0 && i < commit.nparents; i++) {
+            if((ret = commit_parent(&commit, i, sha1)) == 0)
+                ret = add_parent_id(st, sha1);
+        }
+        if(ret == 0 && (ret = tree_lookup_path(st->paths, st->odb, commit.tree, st->path, st->cache,
+                                               &mode, o->blob)) >= 0) {
+            o->has_blob = (ret == 0 && mode != S_IFTREE && mode != S_IFGITLINK);
+            ret = 0;
+        }
+    }
+    free(g_obj.mem_data);
+    if(ret != 0 || oid_map_put(&st->origin_map, o->commit, c) != 0) {
+        st->nparent_ids = o->parents;
+        return -1;
+    }
+    st->norigins++;
+    return c;
+}
+
+static int read_file(struct blame_state *st, uint32_t o)
+{
+    struct git_object g_obj;
+
+    if(st->origins[o].data)
+        return 0;
+    if(odb_read(st->odb, st->origins[o].blob, &g_obj, st->cache) != 0)
+        return -1;
+    if(g_obj.type != BLOB) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+    st->origins[o].data = g_obj.mem_data;
+    st->origins[o].size = g_obj.size;
+    return 0;
+}
+
+static void drop_file(struct blame_state *st, uint32_t o)
+{
+    if(st->origins[o].data != st->final)
+        free(st->origins[o].data);
+    st->origins[o].data = NULL;
+}
+
+static inline int queue_before(const struct blame_state *st, uint32_t x, uint32_t y)
+{
+    return st->origins[x].date > st->origins[y].date;
+}
+
+static int queue_push(struct blame_state *st, uint32_t o)
+{
+    uint32_t i, parent, tmp;
+    void *grown;
+
+    if(st->origins[o].queued)
+        return 0;
+    if(!(grown = grow(st->queue, &st->queue_alloc, st->nqueue + 1, sizeof(uint32_t))))
+        return -1;
+    st->queue = grown;
+    i = st->nqueue++;
+    st->queue[i] = o;
+    while(i > 0) {
+        parent = (i - 1) / 2;
+        if(!queue_before(st, st->queue[i], st->queue[parent]))
+            break;
+        tmp = st->queue[i];
+        st->queue[i] = st->queue[parent];
+        st->queue[parent] = tmp;
+        i = parent;
+    }
+    st->origins[o].queued = 1;
+    return 0;
+}
+
+static uint32_t queue_pop(struct blame_state *st)
+{
+    uint32_t top = st->queue[0], i = 0, child, tmp;
+
+    st->queue[0] = st->queue[--st->nqueue];
+    for(;;) {
+        child = 2 * i + 1;
+        if(child >= st->nqueue)
+            break;
+        if(child + 1 < st->nqueue && queue_before(st, st->queue[child + 1], st->queue[child]))
+            child++;
+        if(!queue_before(st, st->queue[child], st->queue[i]))
+            break;
+        tmp = st->queue[i];
+        st->queue[i] = st->queue[child];
+        st->queue[child] = tmp;
+        i = child;
+    }
+    st->origins[top].queued = 0;
+    return top;
+}
+
+static int suspect(struct blame_state *st, uint32_t o, const struct blame_piece *piece)
+{
+    struct blame_origin *origin = &st->origins[o];
+
+    if(add_piece(&origin->suspects, &origin->nsuspects, &origin->suspects_alloc, piece) != 0)
+        return -1;
+    return queue_push(st, o);
+}
+
+static int settle(struct blame_state *st, uint32_t o, const struct blame_piece *piece, int resolved)
+{
+    struct blame_entry *e;
+    void *grown;
+
+    if(!(grown = grow(st->done, &st->done_alloc, st->ndone + 1, sizeof(struct blame_entry))))
+        return -1;
+    st->done = grown;
+    e = &st->done[st->ndone++];
+    e->final_start = piece->final_start;
+    e->count = piece->count;
+    e->orig_start = piece->orig_start;
+    e->resolved = resolved;
+    memcpy(e->commit, st->origins[o].commit, 20);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// passing blame                                                   //
+/////////////////////////////////////////////////////////////////////
+
+// Diffs parent's version of the file against o's and hands parent the pieces
+// of todo (sorted by orig_start) that fall in lines it had unchanged, cutting
+// pieces at the edges of changes. What's left replaces todo.
+static int pass_to_parent(struct blame_state *st, uint32_t o, uint32_t p, struct blame_piece **todo,
+                          uint32_t *ntodo)
+{
+    struct blame_piece *kept = NULL, piece, part;
+    uint32_t nkept = 0, kept_alloc = 0, i, k = 0, kk, same_start, same_end, next_start, parent_start;
+    const struct diff_change *ch;
+    struct diff_options opts;
+    struct diff_result res;
+    int ret = 0;
+
+    if(read_file(st, o) != 0 || read_file(st, p) != 0)
+        return -1;
+    diff_options_init(&opts);
+    opts.context = 0;
+    opts.max_bytes = 0;
+    opts.text = 1; // as git blame does
+    if(diff_buffers(st->origins[p].data, st->origins[p].size, st->origins[o].data, st->origins[o].size,
+                    &opts, &res) != DIFF_TEXT) {
+        diff_release(&res);
+        return -1;
+    }
+    ch = res.changes;
+
+    // Unchanged run k is the lines between changes k - 1 and k. Pieces can
+    // overlap (a merge can bring a line in twice), so each one looks for its
+    // first run from where the one before it started rather than ended.
+    for(i = 0; i < *ntodo && ret == 0; i++) {
+        piece = (*todo)[i];
+        while(k < res.nchanges && piece.orig_start >= ch[k].new_start + ch[k].new_count)
+            k++;
+        for(kk = k; piece.count && ret == 0; ) {
+            same_start = kk ? ch[kk - 1].new_start + ch[kk - 1].new_count : 0;
+            parent_start = kk ? ch[kk - 1].old_start + ch[kk - 1].old_count : 0;
+            same_end = (kk < res.nchanges) ? ch[kk].new_start : UINT32_MAX;
+            next_start = (kk < res.nchanges) ? ch[kk].new_start + ch[kk].new_count : UINT32_MAX;
+
+            part = piece;
+            if(piece.orig_start < same_end) {
+                if(same_end - piece.orig_start < part.count)
+                    part.count = same_end - piece.orig_start;
+                part.orig_start = parent_start + (piece.orig_start - same_start);
+                ret = suspect(st, p, &part);
+            } else {
+                if(next_start - piece.orig_start < part.count)
+                    part.count = next_start - piece.orig_start;
+                if(part.count) // nothing in o where the parent's lines were removed
+                    ret = add_piece(&kept, &nkept, &kept_alloc, &part);
+                kk++;
+            }
+            piece.final_start += part.count;
+            piece.orig_start += part.count;
+            piece.count -= part.count;
+        }
+    }
+    diff_release(&res);
+    if(ret != 0) {
+        free(kept);
+        return -1;
+    }
+    free(*todo);
+    *todo = kept;
+    *ntodo = nkept;
+    return 0;
+}
+
+// Passes o's suspects on to its parents, and settles the rest on o.
+static int blame_origin(struct blame_state *st, uint32_t o)
+{
+    struct blame_piece *todo = st->origins[o].suspects;
+    uint32_t ntodo = st->origins[o].nsuspects, i, n, nparents = st->origins[o].nparents;
+    int64_t p;
+    int ret = 0;
+
+    st->origins[o].suspects = NULL;
+    st->origins[o].nsuspects = st->origins[o].suspects_alloc = 0;
+    qsort(todo, ntodo, sizeof(struct blame_piece), compare_orig);
+
+    // a parent with the same version of the file takes the lot
+    for(n = 0; n < nparents && ntodo; n++) {
+        p = load_origin(st, st->parent_ids[st->origins[o].parents + n]);
+        if(p < 0 || !st->origins[p].has_blob || memcmp(st->origins[p].blob, st->origins[o].blob, 20) != 0)
+            continue; // a missing parent (a shallow clone, say) ends the history there
+        for(i = 0; i < ntodo && ret == 0; i++)
+            ret = suspect(st, p, &todo[i]);
+        ntodo = 0;
+    }
+
+    for(n = 0; n < nparents && ntodo && ret == 0; n++) {
+        p = load_origin(st, st->parent_ids[st->origins[o].parents + n]);
+        if(p < 0 || !st->origins[p].has_blob)
+            continue;
+        ret = pass_to_parent(st, o, p, &todo, &ntodo);
+        if(!st->origins[p].queued)
+            drop_file(st, p);
+    }
+
+    for(i = 0; i < ntodo && ret == 0; i++)
+        ret = settle(st, o, &todo[i], 1);
+    free(todo);
+    drop_file(st, o);
+    return ret;
+}
+
+// Sorts the settled pieces into b, joining neighbours from the same commit.
+static int collect(struct blame_state *st, struct blame *b)
+{
+    struct blame_entry *e, *last;
+    uint32_t i;
+
+    qsort(st->done, st->ndone, sizeof(struct blame_entry), compare_final);
+    if(!(b->entries = malloc(sizeof(struct blame_entry) * (st->ndone ? st->ndone : 1))))
+        return -1;
+    for(i = 0; i < st->ndone; i++) {
+        e = &st->done[i];
+        if(!e->resolved)
+            b->unresolved += e->count;
+        last = b->count ? &b->entries[b->count - 1] : NULL;
+        if(last && last->resolved == e->resolved && memcmp(last->commit, e->commit, 20) == 0 &&
+           last->final_start + last->count == e->final_start && last->orig_start + last->count == e->orig_start) {
+            last->count += e->count;
+            continue;
+        }
+        b->entries[b->count++] = *e;
+    }
+    return 0;
+}
+
+static void state_release(struct blame_state *st)
+{
+    uint32_t i;
+
+    for(i = 0; i < st->norigins; i++) {
+        drop_file(st, i);
+        free(st->origins[i].suspects);
+    }
+    base_cache_free(st->cache);
+    oid_map_free(&st->origin_map);
+    free(st->origins);
+    free(st->parent_ids);
+    free(st->queue);
+    free(st->done);
+}
+
+static int run(struct blame_state *st, const unsigned char *commit, uint32_t first, uint32_t count,
+               uint64_t deadline, struct blame *b)
+{
+    struct blame_piece piece;
+    uint32_t o, i;
+    int64_t start;
+
+    if((start = load_origin(st, commit)) < 0)
+        return -1;
+    if(!st->origins[start].has_blob)
+        return 2;
+    if(read_file(st, start) != 0)
+        return -1;
+    b->data = st->origins[start].data;
+    b->size = st->origins[start].size;
+    st->final = b->data;
+    b->nlines = count_lines(b->data, b->size);
+
+    if(first < b->nlines) {
+        piece.final_start = piece.orig_start = first;
+        piece.count = (count && count < b->nlines - first) ? count : b->nlines - first;
+        if(suspect(st, start, &piece) != 0)
+            return -1;
+    }
+    while(st->nqueue) {
+        if(deadline && stats_now_ns() > deadline)
+            break;
+        if(blame_origin(st, queue_pop(st)) != 0)
+            return -1;
+    }
+
+    // out of time: what's left is at least as old as where it got to
+    while(st->nqueue) {
+        o = queue_pop(st);
+        for(i = 0; i < st->origins[o].nsuspects; i++) {
+            if(settle(st, o, &st->origins[o].suspects[i], 0) != 0)
+                return -1;
+        }
+    }
+    if(collect(st, b) != 0)
+        return -1;
+    return b->unresolved ? 1 : 0;
+}
+
+// Blames count lines of the file at path as of commit, starting at line
+// first; count 0 means to the end, and the range is cut short there too.
+// paths remembers the lookups of path in every commit's tree, so blaming the
+// file again, or one near it, is cheaper. With budget_ms > 0, gives up after
+// that long and leaves the lines not yet tracked down unresolved. Returns 0
+// when everything was resolved, 1 if the time ran out first, 2 if there's no
+// file at path, and -1 on errors. Release b in any case.
+int blame_file(const struct odb *odb, struct tree_resolver *paths, const unsigned char *commit, const char *path,
+               uint32_t first, uint32_t count, int budget_ms, struct blame *b)
+{
+    struct blame_state st;
+    uint64_t deadline = 0;
+    int ret;
+
+    memset(b, 0, sizeof(*b));
+    memset(&st, 0, sizeof(st));
+    if(budget_ms > 0)
+        deadline = stats_now_ns() + (uint64_t) budget_ms * 1000000;
+    st.odb = odb;
+    st.paths = paths;
+    st.path = path;
+    if(!(st.cache = base_cache_new(BLAME_CACHE_BYTES)))
+        return -1;
+    ret = run(&st, commit, first, count, deadline, b);
+    state_release(&st);
+    return ret;
+}
+
+void blame_release(struct blame *b)
+{
+    free(b->data);
+    free(b->entries);
+    memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,37 @@
+#ifndef BLAME_H
+#define BLAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct tree_resolver;
+
+#define BLAME_CACHE_BYTES (16 << 20)
+
+// A run of lines of the file that came from one commit. Lines are numbered
+// from 0.
+struct blame_entry {
+    uint32_t final_start;        // where they are in the file blamed
+    uint32_t count;
+    uint32_t orig_start;         // where they were in commit's version of it
+    int resolved;                // 0 if the time ran out first; commit only had them, and may not have added them
+    unsigned char commit[20];
+};
+
+// The file as of the commit the blame started at, and who added its lines.
+struct blame {
+    unsigned char *data;
+    unsigned long size;
+    uint32_t nlines;
+    struct blame_entry *entries; // in file order, covering the lines asked about
+    uint32_t count;
+    uint32_t unresolved;         // lines
+};
+
+int blame_file(const struct odb *odb, struct tree_resolver *paths, const unsigned char *commit, const char *path,
+               uint32_t first, uint32_t count, int budget_ms, struct blame *b);
+void blame_release(struct blame *b);
+
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "commit.h"
+
+static int digits(const char *p, int n)
+{
+    while(n-- > 0) {
+        if(*p < '0' || *p > '9')
+            return 0;
+        p++;
+    }
+    return 1;
+}
+
+// Splits an ident the way git's split_ident_line() does: the name runs up to
+// the first '<', the email to the '>' after it, and the date follows the last
+// '>' on the line. Anything malformed is left out rather than failing the
+// whole commit; git itself is just as forgiving.
+static void parse_ident(const char *line, const char *eol, struct commit_ident *ident)
+{
+    const char *lt, *gt, *p, *name_end;
+    int64_t time = 0;
+    int tz = 0, sign;
+
+    if(!(lt = memchr(line, '<', eol - line)) || !(gt = memchr(lt, '>', eol - lt)))
+        return;
+    for(name_end = lt; name_end > line && name_end[-1] == ' '; name_end--)
+        ;
+    ident->name = line;
+    ident->name_len = name_end - line;
+    ident->email = lt + 1;
+    ident->email_len = gt - lt - 1;
+
+    for(p = eol - 1; *p != '>'; p--)
+        ;
+    for(p++; p < eol && *p == ' '; p++)
+        ;
+    for(; p < eol && *p >= '0' && *p <= '9'; p++)
+        time = time * 10 + (*p - '0');
+    for(; p < eol && *p == ' '; p++)
+        ;
+    if(eol - p >= 5 && (*p == '+' || *p == '-') && digits(p + 1, 4)) {
+        sign = (*p == '-') ? -1 : 1;
+        tz = ((p[1] - '0') * 10 + (p[2] - '0')) * 60 + (p[3] - '0') * 10 + (p[4] - '0');
+        tz *= sign;
+    }
+    ident->time = time;
+    ident->tz = tz;
+}
+
+// Parses a commit's headers. Only the tree line is required; everything after
+// the parents may come in any order, and multi-line headers (gpgsig,
+// mergetag) are skipped.
+int commit_parse(const unsigned char *data, unsigned long size, struct commit *commit)
+{
+    const unsigned char *p = data, *end = data + size, *eol;
+    unsigned char sha1[20];
+    int have_author = 0, have_committer = 0;
+
+    memset(commit, 0, sizeof(*commit));
+    if(parse_header_sha1(&p, end, "tree", commit->tree) != 0)
+        return -1;
+
+    commit->parent_lines = (const char *) p;
+    while(parse_header_sha1(&p, end, "parent", sha1) == 0)
+        commit->nparents++;
+
+    for(; p < end; p = eol + 1) {
+        if(*p == '\n') {
+            p++;
+            break;
+        }
+        if(!(eol = memchr(p, '\n', end - p))) {
+            p = end;
+            break;
+        }
+        if(!have_author && eol - p > 7 && memcmp(p, "author ", 7) == 0) {
+            parse_ident((const char *) p + 7, (const char *) eol, &commit->author);
+            have_author = 1;
+        } else if(!have_committer && eol - p > 10 && memcmp(p, "committer ", 10) == 0) {
+            parse_ident((const char *) p + 10, (const char *) eol, &commit->committer);
+            have_committer = 1;
+        } else if(!commit->encoding && eol - p > 9 && memcmp(p, "encoding ", 9) == 0) {
+            commit->encoding = (const char *) p + 9;
+            commit->encoding_len = eol - p - 9;
+        }
+    }
+    commit->message = p - data;
+    return 0;
+}
+
+// Gets the nth parent; they're only checked, not kept, by commit_parse().
+int commit_parent(const struct commit *commit, unsigned int n, unsigned char *sha1)
+{
+    if(n >= commit->nparents)
+        return -1;
+    return hex_to_sha1(commit->parent_lines + n * COMMIT_PARENT_LINE + 7, sha1);
+}
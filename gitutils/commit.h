@@ -0,0 +1,37 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMMIT_PARENT_LINE 48 // strlen("parent ") + 40 + '\n'
+
+// "Name <email> 1234567890 +0000". A missing or malformed ident leaves name
+// and email NULL.
+struct commit_ident {
+    const char *name;
+    size_t name_len;
+    const char *email;
+    size_t email_len;
+    int64_t time;
+    int tz;               // minutes east of UTC
+};
+
+// A parsed commit. Nothing is copied: the strings point into the data that
+// was parsed, which has to outlive the struct.
+struct commit {
+    unsigned char tree[20];
+    const char *parent_lines;    // the first "parent <sha1>\n" line; see commit_parent()
+    unsigned int nparents;
+    struct commit_ident author;
+    struct commit_ident committer;
+    const char *encoding;        // NULL unless the commit names one
+    size_t encoding_len;
+    unsigned long message;       // where the message starts in the data
+};
+
+int commit_parse(const unsigned char *data, unsigned long size, struct commit *commit);
+int commit_parent(const struct commit *commit, unsigned int n, unsigned char *sha1);
+
+
+#endif
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h> // for ntohl(), etc
+
+#include "commitgraph.h"
+
+// The commit-graph file, as in git's commit-graph.c.
+//
+// It has every commit reachable from some set of tips with its tree, parents,
+// date and generation number, so walks over history can skip reading and
+// parsing commit objects altogether. Whatever it has, it also has all the
+// ancestors of, so a commit missing from it is newer than all of it.
+//
+// File layout (all integers big-endian):
+//   "CGPH", version (8 bits, 1), hash version (8 bits, 1 for SHA-1), chunk
+//   count (8 bits), base graph count (8 bits),
+//   a table of contents: chunk id (32 bits) and offset (64 bits) per chunk,
+//   then an id of 0 and the offset where the last chunk ends,
+//   the chunks, and a trailing checksum.
+//
+// Chunks we use:
+//   OIDF: a fan-out table of 256 counts, as in an idx
+//   OIDL: the commit ids, sorted
+//   CDAT: per commit, its tree id, two parent positions and 64 bits holding
+//         the generation (top 30 bits) and the date (low 34 bits). A missing
+//         parent is 0x70000000; a second parent with the top bit set is
+//         instead where this commit's parents after the first start in EDGE.
+//   EDGE: parent positions; the last one of each list has the top bit set.
+//
+// Split graphs (objects/info/commit-graphs/) aren't read; without a graph,
+// walks simply go back to reading commits and ordering them by date.
+
+#define GRAPH_SIGNATURE 0x43475048 // "CGPH"
+#define GRAPH_CHUNK_OIDF 0x4f494446
+#define GRAPH_CHUNK_OIDL 0x4f49444c
+#define GRAPH_CHUNK_CDAT 0x43444154
+#define GRAPH_CHUNK_EDGE 0x45444745
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_CDAT_SIZE 36
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES 0x80000000
+#define GRAPH_LAST_EDGE 0x80000000
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static int graph_parse(struct commit_graph *g)
+{
+    const unsigned char *toc;
+    uint64_t offset, next, len, cdat_len = 0;
+    uint32_t id, nchunks, i;
+
+    if(g->size < GRAPH_HEADER_SIZE + 12 + 20 || get_be32(g->data) != GRAPH_SIGNATURE)
+        return -1;
+    if(g->data[4] != 1 || g->data[5] != 1 || g->data[7] != 0)
+        return -1; // another version, SHA-256, or one layer of a split graph
+    nchunks = g->data[6];
+    if(GRAPH_HEADER_SIZE + (uint64_t) (nchunks + 1) * 12 > g->size - 20)
+        return -1;
+
+    toc = g->data + GRAPH_HEADER_SIZE;
+    for(i = 0; i < nchunks; i++, toc += 12) {
+        id = get_be32(toc);
+        offset = ((uint64_t) get_be32(toc + 4) << 32) | get_be32(toc + 8);
+        next = ((uint64_t) get_be32(toc + 16) << 32) | get_be32(toc + 20);
+        if(offset > next || next > g->size - 20)
+            return -1;
+        len = next - offset;
+
+        switch(id) {
+        case GRAPH_CHUNK_OIDF:
+            if(len != 256 * 4)
+                return -1;
+            g->fanout = g->data + offset;
+            break;
+        case GRAPH_CHUNK_OIDL:
+            g->oids = g->data + offset;
+            g->ncommits = len / 20;
+            break;
+        case GRAPH_CHUNK_CDAT:
+            g->cdat = g->data + offset;
+            cdat_len = len;
+            break;
+        case GRAPH_CHUNK_EDGE:
+            g->edges = g->data + offset;
+            g->nedges = len / 4;
+            break;
+        }
+    }
+
+    if(!g->fanout || !g->oids || !g->cdat || get_be32(g->fanout + 255 * 4) != g->ncommits)
+        return -1;
+    return (cdat_len == (uint64_t) g->ncommits * GRAPH_CDAT_SIZE) ? 0 : -1;
+}
+
+// Opens <objects_dir>/info/commit-graph. Returns NULL if there isn't one or
+// it can't be used, which callers should take as "no generation numbers".
+struct commit_graph *commit_graph_open(const char *objects_dir)
+{
+    struct commit_graph *g;
+    struct stat st;
+    char *location;
+    int fd;
+
+    if(!(location = malloc(strlen(objects_dir) + sizeof("/info/commit-graph"))))
+        return NULL;
+    sprintf(location, "%s/info/commit-graph", objects_dir);
+    fd = open(location, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 || !(g = calloc(1, sizeof(struct commit_graph)))) {
+        if(fd >= 0)
+            close(fd);
+        free(location);
+        return NULL;
+    }
+
+    g->size = st.st_size;
+    g->data = mmap(NULL, g->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(g->data == MAP_FAILED) {
+        free(location);
+        free(g);
+        return NULL;
+    }
+    g->refs = 1;
+    if(graph_parse(g) != 0) {
+        printf("Ignoring %s: it's malformed or a version we don't read.\n", location);
+        commit_graph_close(g);
+        g = NULL;
+    }
+    free(location);
+    return g;
+}
+
+struct commit_graph *commit_graph_ref(struct commit_graph *g)
+{
+    __sync_add_and_fetch(&g->refs, 1);
+    return g;
+}
+
+void commit_graph_close(struct commit_graph *g)
+{
+    if(!g || __sync_sub_and_fetch(&g->refs, 1) != 0)
+        return;
+    munmap(g->data, g->size);
+    free(g);
+}
+
+int commit_graph_find(const struct commit_graph *g, const unsigned char *sha1, uint32_t *pos)
+{
+    uint32_t lo, hi, mi;
+    int cmp;
+
+    hi = get_be32(g->fanout + sha1[0] * 4);
+    lo = sha1[0] ? get_be32(g->fanout + (sha1[0] - 1) * 4) : 0;
+    if(hi > g->ncommits)
+        return -1;
+    while(lo < hi) {
+        mi = lo + (hi - lo) / 2;
+        cmp = memcmp(sha1, g->oids + (size_t) mi * 20, 20);
+        if(!cmp) {
+            *pos = mi;
+            return 0;
+        }
+        if(cmp < 0)
+            hi = mi;
+        else
+            lo = mi + 1;
+    }
+    return -1;
+}
+
+const unsigned char *commit_graph_sha1(const struct commit_graph *g, uint32_t pos)
+{
+    return g->oids + (size_t) pos * 20;
+}
+
+int commit_graph_commit(const struct commit_graph *g, uint32_t pos, struct graph_commit *c)
+{
+    const unsigned char *p;
+    uint32_t parent1, parent2, high;
+
+    if(pos >= g->ncommits)
+        return -1;
+    p = g->cdat + (size_t) pos * GRAPH_CDAT_SIZE;
+    parent1 = get_be32(p + 20);
+    parent2 = get_be32(p + 24);
+    high = get_be32(p + 28);
+
+    c->tree = p;
+    c->generation = high >> 2;
+    c->date = ((uint64_t) (high & 3) << 32) | get_be32(p + 32);
+    c->parent1 = (parent1 == GRAPH_PARENT_NONE) ? GRAPH_NO_PARENT : parent1;
+    c->parent2 = GRAPH_NO_PARENT;
+    c->extra_edges = GRAPH_NO_PARENT;
+    if(parent2 & GRAPH_EXTRA_EDGES)
+        c->extra_edges = parent2 & ~GRAPH_EXTRA_EDGES;
+    else if(parent2 != GRAPH_PARENT_NONE)
+        c->parent2 = parent2;
+    return 0;
+}
+
+// Gets the nth parent's position. Returns 1 once n is past the last parent,
+// and -1 if the graph is corrupt.
+int commit_graph_parent(const struct commit_graph *g, const struct graph_commit *c, uint32_t n, uint32_t *pos)
+{
+    uint32_t i, edge;
+
+    if(n == 0 || c->extra_edges == GRAPH_NO_PARENT) {
+        *pos = (n == 0) ? c->parent1 : (n == 1) ? c->parent2 : GRAPH_NO_PARENT;
+        if(*pos == GRAPH_NO_PARENT)
+            return 1;
+        return (*pos < g->ncommits) ? 0 : -1;
+    }
+
+    // parents after the first are all in EDGE, up to the one marked last
+    for(i = 0; ; i++) {
+        if(!g->edges || c->extra_edges + i >= g->nedges)
+            return -1;
+        edge = get_be32(g->edges + (size_t) (c->extra_edges + i) * 4);
+        if(i == n - 1) {
+            *pos = edge & ~GRAPH_LAST_EDGE;
+            return (*pos < g->ncommits) ? 0 : -1;
+        }
+        if(edge & GRAPH_LAST_EDGE)
+            return 1;
+    }
+}
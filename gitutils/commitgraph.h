@@ -0,0 +1,45 @@
+#ifndef COMMITGRAPH_H
+#define COMMITGRAPH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define GRAPH_GENERATION_INFINITY 0xffffffff // for commits the graph doesn't have
+#define GRAPH_NO_PARENT 0xffffffff
+
+// A commit as the graph has it. Generation numbers are git's topological
+// levels: one more than the highest of the parents', so an ancestor always
+// has a lower one.
+struct graph_commit {
+    const unsigned char *tree;   // points into the graph
+    uint32_t generation;
+    uint64_t date;
+    uint32_t parent1;            // positions in the graph, or GRAPH_NO_PARENT
+    uint32_t parent2;
+    uint32_t extra_edges;        // more than two parents: where the rest start; else GRAPH_NO_PARENT
+};
+
+// objects/info/commit-graph, mmap'd. It's read only and so safe to share
+// between threads; references are counted like an odb's.
+struct commit_graph {
+    unsigned char *data;
+    size_t size;
+    uint32_t ncommits;
+    const unsigned char *fanout;
+    const unsigned char *oids;
+    const unsigned char *cdat;
+    const unsigned char *edges;  // NULL if no commit has more than two parents
+    uint32_t nedges;
+    unsigned int refs;
+};
+
+struct commit_graph *commit_graph_open(const char *objects_dir);
+struct commit_graph *commit_graph_ref(struct commit_graph *g);
+void commit_graph_close(struct commit_graph *g);
+int commit_graph_find(const struct commit_graph *g, const unsigned char *sha1, uint32_t *pos);
+const unsigned char *commit_graph_sha1(const struct commit_graph *g, uint32_t pos);
+int commit_graph_commit(const struct commit_graph *g, uint32_t pos, struct graph_commit *c);
+int commit_graph_parent(const struct commit_graph *g, const struct graph_commit *c, uint32_t n, uint32_t *pos);
+
+
+#endif
@@ -0,0 +1,1098 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "stats.h"
+#include "diff.h"
+
+// Line diffs of two buffers. Lines are found 16 bytes at a time with SIMD
+// compares where the CPU has them, then hashed and numbered so that equal
+// lines get equal numbers; from there on both algorithms only compare
+// integers. Myers is git's default; histogram is "git diff --histogram",
+// which tends to line up moved blocks of code better. Changed lines are
+// then moved where git would put them, short of its indent heuristic.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DIFF_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DIFF_NEON 1
+#endif
+
+#define HISTOGRAM_MAX_CHAIN 64 // a line more common than this can't anchor a match
+#define NONE 0xffffffff
+
+// A bit for each '\n' among the 16 bytes at p.
+static inline unsigned int newline_mask(const unsigned char *p)
+{
+#if defined(DIFF_SSE2)
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), _mm_set1_epi8('\n')));
+#elif defined(DIFF_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8('\n')), vld1q_u8(bits));
+
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+#else
+    unsigned int mask = 0, i;
+
+    for(i = 0; i < 16; i++)
+        mask |= (unsigned int) (p[i] == '\n') << i;
+    return mask;
+#endif
+}
+
+static uint32_t count_lines(const unsigned char *data, size_t size)
+{
+    uint32_t count = 0;
+    size_t pos;
+
+    for(pos = 0; pos + 16 <= size; pos += 16)
+        count += __builtin_popcount(newline_mask(data + pos));
+    for(; pos < size; pos++)
+        count += (data[pos] == '\n');
+    return count + (size && data[size - 1] != '\n');
+}
+
+// lines must have room for count_lines() of them.
+static void split_lines(const unsigned char *data, size_t size, struct diff_line *lines)
+{
+    size_t pos, end, start = 0;
+    unsigned int mask;
+
+    for(pos = 0; pos + 16 <= size; pos += 16) {
+        for(mask = newline_mask(data + pos); mask; mask &= mask - 1) {
+            end = pos + __builtin_ctz(mask) + 1;
+            lines->start = start;
+            lines->len = end - start;
+            lines++;
+            start = end;
+        }
+    }
+    for(; pos < size; pos++) {
+        if(data[pos] == '\n') {
+            lines->start = start;
+            lines->len = pos + 1 - start;
+            lines++;
+            start = pos + 1;
+        }
+    }
+    if(start < size) {
+        lines->start = start;
+        lines->len = size - start;
+    }
+}
+
+// Eight bytes at a time; equal lines only have to hash alike, and the table
+// compares them anyway.
+static uint64_t hash_line(const unsigned char *p, uint32_t len)
+{
+    uint64_t h = len * 0x9e3779b97f4a7c15ULL, w;
+
+    for(; len >= 8; p += 8, len -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    if(len) {
+        w = 0;
+        memcpy(&w, p, len);
+        h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 32;
+    }
+    return h ^ (h >> 29);
+}
+
+struct line_class {
+    uint64_t hash;
+    const unsigned char *data;
+    uint32_t len;
+};
+
+// Numbers distinct lines from 0, in the order they're first seen.
+struct classifier {
+    struct line_class *classes;
+    uint32_t nclasses;
+    uint32_t *slots;             // class + 1; 0 is empty
+    uint32_t mask;
+};
+
+static int classifier_init(struct classifier *c, uint32_t lines)
+{
+    uint32_t nslots = 16;
+
+    while(nslots < lines * 2)
+        nslots <<= 1;
+    c->nclasses = 0;
+    c->mask = nslots - 1;
+    c->slots = calloc(nslots, sizeof(uint32_t));
+    c->classes = malloc(sizeof(struct line_class) * (lines ? lines : 1));
+    if(!c->slots || !c->classes) {
+        free(c->slots);
+        free(c->classes);
+        return -1;
+    }
+    return 0;
+}
+
+static uint32_t classify(struct classifier *c, const unsigned char *p, uint32_t len)
+{
+    uint64_t hash = hash_line(p, len);
+    uint32_t i = hash & c->mask, id;
+    struct line_class *cls;
+
+    while((id = c->slots[i])) {
+        cls = &c->classes[id - 1];
+        if(cls->hash == hash && cls->len == len && memcmp(cls->data, p, len) == 0)
+            return id - 1;
+        i = (i + 1) & c->mask;
+    }
+    cls = &c->classes[c->nclasses];
+    cls->hash = hash;
+    cls->data = p;
+    cls->len = len;
+    c->slots[i] = ++c->nclasses;
+    return c->nclasses - 1;
+}
+
+#define MYERS_MIN_COST 256      // the cheapest edit script that's worth cutting short
+#define MYERS_GOOD_SNAKE 20     // matches in a row that make a diagonal worth splitting on
+#define MYERS_GOOD_PROGRESS 4   // how far it has to have come, per edit so far
+#define MYERS_MANY_MATCHES 1024 // a line matching this many others is common whatever the file's size
+#define MYERS_SCAN_WINDOW 100   // how far around a common line to look for unmatched ones
+
+struct diff_ctx {
+    uint32_t *a, *b;             // each line's class
+    unsigned char *a_changed, *b_changed;
+    uint32_t *ma, *mb;           // Myers: the classes of the lines the search looks at
+    uint32_t *ia, *ib;           // and which lines they are
+    unsigned char *a_matches, *b_matches; // Myers: 0 for none on the other side, 1 for some, 2 for many
+    uint32_t *a_count, *b_count; // Myers: per class, in the region being diffed
+    long *kv;
+    long *v1, *v2;               // Myers' furthest points, forward and back, by diagonal
+    long max_cost;
+    uint32_t *count, *head;      // histogram: per class, in the region being split
+    uint32_t *next;              // histogram: the next line of a with the same class
+    uint64_t deadline;
+    int approximate;
+};
+
+static int out_of_time(struct diff_ctx *c)
+{
+    if(c->deadline && stats_now_ns() > c->deadline) {
+        c->approximate = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static void mark_changed(struct diff_ctx *c, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)
+{
+    memset(c->a_changed + a0, 1, a1 - a0);
+    memset(c->b_changed + b0, 1, b1 - b0);
+}
+
+// The same for the lines the search is looking at, which needn't be next to
+// each other.
+static void mark_searched(struct diff_ctx *c, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)
+{
+    for(; a0 < a1; a0++)
+        c->a_changed[c->ia[a0]] = 1;
+    for(; b0 < b1; b0++)
+        c->b_changed[c->ib[b0]] = 1;
+}
+
+struct split {
+    uint32_t a, b;
+    int min_before, min_after;   // whether each half needs the shortest script
+};
+
+// When the search has gone on for a while without the two ends meeting, looks
+// for a diagonal that's come a long way with a good run of matches just
+// behind it, and splits there; the script may come out a little longer, but
+// big diffs finish in reasonable time. git does the same.
+static int myers_shortcut(const struct diff_ctx *c, long a0, long a1, long b0, long b1,
+                          long fmin, long fmax, long bmin, long bmax, long cost, struct split *spl)
+{
+    const uint32_t *a = c->ma, *b = c->mb;
+    long fmid = a0 - b0, bmid = a1 - b1, d, dist, x, y, v, k, best;
+
+    for(best = 0, d = fmax; d >= fmin; d -= 2) {
+        dist = (d > fmid) ? d - fmid : fmid - d;
+        x = c->v1[d];
+        y = x - d;
+        v = (x - a0) + (y - b0) - dist;
+        if(v > MYERS_GOOD_PROGRESS * cost && v > best && a0 + MYERS_GOOD_SNAKE <= x && x < a1 &&
+           b0 + MYERS_GOOD_SNAKE <= y && y < b1) {
+            for(k = 1; a[x - k] == b[y - k]; k++) {
+                if(k == MYERS_GOOD_SNAKE) {
+                    best = v;
+                    spl->a = x;
+                    spl->b = y;
+                    break;
+                }
+            }
+        }
+    }
+    if(best > 0) {
+        spl->min_before = 1;
+        spl->min_after = 0;
+        return 0;
+    }
+
+    for(best = 0, d = bmax; d >= bmin; d -= 2) {
+        dist = (d > bmid) ? d - bmid : bmid - d;
+        x = c->v2[d];
+        y = x - d;
+        v = (a1 - x) + (b1 - y) - dist;
+        if(v > MYERS_GOOD_PROGRESS * cost && v > best && a0 < x && x <= a1 - MYERS_GOOD_SNAKE &&
+           b0 < y && y <= b1 - MYERS_GOOD_SNAKE) {
+            for(k = 0; a[x + k] == b[y + k]; k++) {
+                if(k == MYERS_GOOD_SNAKE - 1) {
+                    best = v;
+                    spl->a = x;
+                    spl->b = y;
+                    break;
+                }
+            }
+        }
+    }
+    if(best > 0) {
+        spl->min_before = 0;
+        spl->min_after = 1;
+        return 0;
+    }
+    return -1;
+}
+
+// Past max_cost, settles for whichever end has got furthest.
+static void myers_furthest(const struct diff_ctx *c, long a0, long a1, long b0, long b1,
+                           long fmin, long fmax, long bmin, long bmax, struct split *spl)
+{
+    long d, x, y, fbest = -1, fbest_x = -1, bbest = LONG_MAX, bbest_x = LONG_MAX;
+
+    for(d = fmax; d >= fmin; d -= 2) {
+        x = (c->v1[d] < a1) ? c->v1[d] : a1;
+        y = x - d;
+        if(b1 < y) {
+            x = b1 + d;
+            y = b1;
+        }
+        if(fbest < x + y) {
+            fbest = x + y;
+            fbest_x = x;
+        }
+    }
+    for(d = bmax; d >= bmin; d -= 2) {
+        x = (c->v2[d] > a0) ? c->v2[d] : a0;
+        y = x - d;
+        if(y < b0) {
+            x = b0 + d;
+            y = b0;
+        }
+        if(x + y < bbest) {
+            bbest = x + y;
+            bbest_x = x;
+        }
+    }
+    if((a1 + b1) - bbest < fbest - (a0 + b0)) {
+        spl->a = fbest_x;
+        spl->b = fbest - fbest_x;
+        spl->min_before = 1;
+        spl->min_after = 0;
+    } else {
+        spl->a = bbest_x;
+        spl->b = bbest - bbest_x;
+        spl->min_before = 0;
+        spl->min_after = 1;
+    }
+}
+
+// Finds a point on a shortest edit script through ma[a0..a1) and mb[b0..b1)
+// by searching from both ends until they meet, as in Myers' linear space
+// refinement. Diagonals are numbered x - y, as the lines they pass through
+// are. Returns -1 if the time runs out first.
+static int myers_split(struct diff_ctx *c, long a0, long a1, long b0, long b1, int need_min, struct split *spl)
+{
+    const uint32_t *a = c->ma, *b = c->mb;
+    long *v1 = c->v1, *v2 = c->v2;
+    long dmin = a0 - b1, dmax = a1 - b0, fmid = a0 - b0, bmid = a1 - b1;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid, cost, d, x, y, start;
+    int odd = (fmid - bmid) & 1, snake;
+
+    v1[fmid] = a0;
+    v2[bmid] = a1;
+    for(cost = 1; ; cost++) {
+        if(out_of_time(c))
+            return -1;
+        snake = 0;
+
+        // widen by a diagonal each way, or narrow where that's off the edge;
+        // the diagonals just outside are primed so they're never chosen
+        if(fmin > dmin)
+            v1[--fmin - 1] = -1;
+        else
+            ++fmin;
+        if(fmax < dmax)
+            v1[++fmax + 1] = -1;
+        else
+            --fmax;
+        for(d = fmax; d >= fmin; d -= 2) {
+            x = (v1[d - 1] >= v1[d + 1]) ? v1[d - 1] + 1 : v1[d + 1];
+            start = x;
+            for(y = x - d; x < a1 && y < b1 && a[x] == b[y]; x++, y++)
+                ;
+            if(x - start > MYERS_GOOD_SNAKE)
+                snake = 1;
+            v1[d] = x;
+            if(odd && bmin <= d && d <= bmax && v2[d] <= x) {
+                spl->a = x;
+                spl->b = y;
+                spl->min_before = spl->min_after = 1;
+                return 0;
+            }
+        }
+
+        if(bmin > dmin)
+            v2[--bmin - 1] = LONG_MAX;
+        else
+            ++bmin;
+        if(bmax < dmax)
+            v2[++bmax + 1] = LONG_MAX;
+        else
+            --bmax;
+        for(d = bmax; d >= bmin; d -= 2) {
+            x = (v2[d - 1] < v2[d + 1]) ? v2[d - 1] : v2[d + 1] - 1;
+            start = x;
+            for(y = x - d; x > a0 && y > b0 && a[x - 1] == b[y - 1]; x--, y--)
+                ;
+            if(start - x > MYERS_GOOD_SNAKE)
+                snake = 1;
+            v2[d] = x;
+            if(!odd && fmin <= d && d <= fmax && x <= v1[d]) {
+                spl->a = x;
+                spl->b = y;
+                spl->min_before = spl->min_after = 1;
+                return 0;
+            }
+        }
+
+        if(need_min)
+            continue;
+        if(snake && cost > MYERS_MIN_COST &&
+           myers_shortcut(c, a0, a1, b0, b1, fmin, fmax, bmin, bmax, cost, spl) == 0)
+            return 0;
+        if(cost >= c->max_cost) {
+            myers_furthest(c, a0, a1, b0, b1, fmin, fmax, bmin, bmax, spl);
+            return 0;
+        }
+    }
+}
+
+static void myers_search(struct diff_ctx *c, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1, int need_min)
+{
+    struct split spl;
+
+    for(;;) {
+        while(a0 < a1 && b0 < b1 && c->ma[a0] == c->mb[b0]) {
+            a0++;
+            b0++;
+        }
+        while(a0 < a1 && b0 < b1 && c->ma[a1 - 1] == c->mb[b1 - 1]) {
+            a1--;
+            b1--;
+        }
+        if(a0 == a1 || b0 == b1) {
+            mark_searched(c, a0, a1, b0, b1);
+            return;
+        }
+        if(myers_split(c, a0, a1, b0, b1, need_min, &spl) != 0) {
+            // past the deadline: whatever's left is one big change
+            mark_searched(c, a0, a1, b0, b1);
+            return;
+        }
+        myers_search(c, a0, spl.a, b0, spl.b, spl.min_before);
+        a0 = spl.a;
+        b0 = spl.b;
+        need_min = spl.min_after;
+    }
+}
+
+static long rough_sqrt(long n)
+{
+    long root;
+
+    for(root = 1; n > 0; n >>= 2)
+        root <<= 1;
+    return root;
+}
+
+// Whether a line with many matches is better left out of the search along
+// with the unmatched lines around it: only when it sits among them, and they
+// outnumber lines like it by more than three to one.
+static int among_unmatched(const unsigned char *matches, long i, long first, long last)
+{
+    long r, none_before = 0, many_before = 1, none_after = 0, many_after = 1;
+
+    if(i - first > MYERS_SCAN_WINDOW)
+        first = i - MYERS_SCAN_WINDOW;
+    if(last - i > MYERS_SCAN_WINDOW)
+        last = i + MYERS_SCAN_WINDOW;
+    for(r = 1; i - r >= first && matches[i - r] != 1; r++) {
+        if(matches[i - r])
+            many_before++;
+        else
+            none_before++;
+    }
+    if(!none_before)
+        return 0;
+    for(r = 1; i + r <= last && matches[i + r] != 1; r++) {
+        if(matches[i + r])
+            many_after++;
+        else
+            none_after++;
+    }
+    if(!none_after)
+        return 0;
+    return (many_before + many_after) * 4 < many_before + many_after + none_before + none_after;
+}
+
+// Leaves out of the search, and marks changed, lines it could only ever
+// delete or insert: those with no match on the other side, and common ones
+// stranded among them. In a big rewrite that's most of the lines. Returns
+// how many are left, in order, in lines and classes.
+static uint32_t myers_keep(const uint32_t *cls, const uint32_t *other_count, uint32_t start, uint32_t end,
+                           uint32_t total, unsigned char *matches, unsigned char *changed,
+                           uint32_t *lines, uint32_t *classes)
+{
+    long many = rough_sqrt(total);
+    uint32_t i, n, kept = 0;
+
+    if(many > MYERS_MANY_MATCHES)
+        many = MYERS_MANY_MATCHES;
+    for(i = start; i < end; i++) {
+        n = other_count[cls[i]];
+        matches[i] = !n ? 0 : (n >= many) ? 2 : 1;
+    }
+    for(i = start; i < end; i++) {
+        if(matches[i] == 1 || (matches[i] == 2 && !among_unmatched(matches, i, start, (long) end - 1))) {
+            lines[kept] = i;
+            classes[kept++] = cls[i];
+        } else {
+            changed[i] = 1;
+        }
+    }
+    return kept;
+}
+
+static void myers(struct diff_ctx *c, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)
+{
+    uint32_t i, na = a1 - a0, nb = b1 - b0, kept_a, kept_b;
+
+    for(i = a0; i < a1; i++)
+        c->a_count[c->a[i]] = c->b_count[c->a[i]] = 0;
+    for(i = b0; i < b1; i++)
+        c->a_count[c->b[i]] = c->b_count[c->b[i]] = 0;
+    for(i = a0; i < a1; i++)
+        c->a_count[c->a[i]]++;
+    for(i = b0; i < b1; i++)
+        c->b_count[c->b[i]]++;
+
+    while(a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) {
+        a0++;
+        b0++;
+    }
+    while(a0 < a1 && b0 < b1 && c->a[a1 - 1] == c->b[b1 - 1]) {
+        a1--;
+        b1--;
+    }
+    kept_a = myers_keep(c->a, c->b_count, a0, a1, na, c->a_matches, c->a_changed, c->ia, c->ma);
+    kept_b = myers_keep(c->b, c->a_count, b0, b1, nb, c->b_matches, c->b_changed, c->ib, c->mb);
+
+    c->max_cost = rough_sqrt(kept_a + kept_b + 3);
+    if(c->max_cost < MYERS_MIN_COST)
+        c->max_cost = MYERS_MIN_COST;
+    myers_search(c, 0, kept_a, 0, kept_b, 0);
+}
+
+struct region {
+    uint32_t a0, a1, b0, b1;
+};
+
+// Finds the longest run of lines common to both sides of r, preferring runs
+// whose rarest line is rarer in a; a line that turns up once on each side is
+// the best anchor there is. Returns 1 with the run in lcs, 0 if the sides
+// have nothing in common, and -1 if all they share is lines too common to
+// trust.
+static int histogram_lcs(struct diff_ctx *c, const struct region *r, struct region *lcs)
+{
+    const uint32_t *a = c->a, *b = c->b;
+    uint32_t *count = c->count, *head = c->head, *next = c->next;
+    uint32_t i, bi, b_next, as, ae, bs, be, at, rc;
+    uint32_t best_len = 0, best_rc = HISTOGRAM_MAX_CHAIN + 1;
+    int common = 0;
+
+    for(i = r->b0; i < r->b1; i++)
+        count[b[i]] = 0;
+    for(i = r->a0; i < r->a1; i++) {
+        count[a[i]] = 0;
+        head[a[i]] = NONE;
+    }
+    for(i = r->a1; i-- > r->a0; ) {
+        next[i] = head[a[i]];
+        head[a[i]] = i;
+        count[a[i]]++;
+    }
+
+    for(bi = r->b0; bi < r->b1; bi = b_next) {
+        b_next = bi + 1;
+        if(!count[b[bi]])
+            continue;
+        if(count[b[bi]] > best_rc) {
+            common = 1;
+            continue;
+        }
+        for(at = head[b[bi]]; at != NONE; ) {
+            as = at;
+            ae = at + 1;
+            bs = bi;
+            be = bi + 1;
+            rc = count[a[at]];
+            while(as > r->a0 && bs > r->b0 && a[as - 1] == b[bs - 1]) {
+                as--;
+                bs--;
+                if(rc > count[a[as]])
+                    rc = count[a[as]];
+            }
+            while(ae < r->a1 && be < r->b1 && a[ae] == b[be]) {
+                if(rc > count[a[ae]])
+                    rc = count[a[ae]];
+                ae++;
+                be++;
+            }
+            if(b_next < be)
+                b_next = be;
+            if(ae - as > best_len || rc < best_rc) {
+                lcs->a0 = as;
+                lcs->a1 = ae;
+                lcs->b0 = bs;
+                lcs->b1 = be;
+                best_len = ae - as;
+                best_rc = rc;
+            }
+            // the next place this line turns up that isn't part of the run
+            for(at = next[at]; at != NONE && at < ae; at = next[at])
+                ;
+        }
+    }
+    if(best_len)
+        return 1;
+    return common ? -1 : 0;
+}
+
+static int histogram(struct diff_ctx *c, uint32_t a0, uint32_t a1, uint32_t b0, uint32_t b1)
+{
+    struct region *stack, *grown, r, lcs = { 0, 0, 0, 0 };
+    size_t n = 0, alloc = 64;
+    int ret;
+
+    if(!(stack = malloc(sizeof(struct region) * alloc)))
+        return -1;
+    stack[n].a0 = a0;
+    stack[n].a1 = a1;
+    stack[n].b0 = b0;
+    stack[n++].b1 = b1;
+
+    while(n) {
+        r = stack[--n];
+        if(r.a0 == r.a1 || r.b0 == r.b1 || out_of_time(c)) {
+            mark_changed(c, r.a0, r.a1, r.b0, r.b1);
+            continue;
+        }
+        ret = histogram_lcs(c, &r, &lcs);
+        if(ret < 0) {
+            myers(c, r.a0, r.a1, r.b0, r.b1);
+            continue;
+        }
+        if(ret == 0) {
+            mark_changed(c, r.a0, r.a1, r.b0, r.b1);
+            continue;
+        }
+        if(n + 2 > alloc) {
+            if(!(grown = realloc(stack, sizeof(struct region) * alloc * 2))) {
+                free(stack);
+                return -1;
+            }
+            stack = grown;
+            alloc *= 2;
+        }
+        stack[n].a0 = r.a0;
+        stack[n].a1 = lcs.a0;
+        stack[n].b0 = r.b0;
+        stack[n++].b1 = lcs.b0;
+        stack[n].a0 = lcs.a1;
+        stack[n].a1 = r.a1;
+        stack[n].b0 = lcs.b1;
+        stack[n++].b1 = r.b1;
+    }
+    free(stack);
+    return 0;
+}
+
+// A run of changed lines, possibly empty. The runs on the two sides pair up:
+// the nth run on each side falls between the same two unchanged lines.
+struct group {
+    uint32_t start, end;
+};
+
+static void group_first(const unsigned char *changed, uint32_t count, struct group *g)
+{
+    g->start = 0;
+    for(g->end = 0; g->end < count && changed[g->end]; g->end++)
+        ;
+}
+
+static int group_next(const unsigned char *changed, uint32_t count, struct group *g)
+{
+    if(g->end == count)
+        return -1;
+    g->start = g->end + 1;
+    for(g->end = g->start; g->end < count && changed[g->end]; g->end++)
+        ;
+    return 0;
+}
+
+static int group_previous(const unsigned char *changed, struct group *g)
+{
+    if(g->start == 0)
+        return -1;
+    g->end = g->start - 1;
+    for(g->start = g->end; g->start > 0 && changed[g->start - 1]; g->start--)
+        ;
+    return 0;
+}
+
+// A run can move down a line if its first line is the same as the line after
+// it, and up if its last is the same as the line before it; the unchanged
+// lines are the same either way. It may run into its neighbour.
+static int group_slide_down(const uint32_t *cls, unsigned char *changed, uint32_t count, struct group *g)
+{
+    if(g->end == count || cls[g->start] != cls[g->end])
+        return -1;
+    changed[g->start++] = 0;
+    changed[g->end++] = 1;
+    while(g->end < count && changed[g->end])
+        g->end++;
+    return 0;
+}
+
+static int group_slide_up(const uint32_t *cls, unsigned char *changed, struct group *g)
+{
+    if(g->start == 0 || cls[g->start - 1] != cls[g->end - 1])
+        return -1;
+    changed[--g->start] = 1;
+    changed[--g->end] = 0;
+    while(g->start > 0 && changed[g->start - 1])
+        g->start--;
+    return 0;
+}
+
+// Places each run of changed lines on one side where git would without its
+// indent heuristic: level with a change on the other side if it can be,
+// and otherwise as far down as it will go.
+static void compact(const uint32_t *cls, unsigned char *changed, uint32_t count,
+                    const unsigned char *other_changed, uint32_t other_count)
+{
+    struct group g, go;
+    uint32_t size, earliest_end;
+    int matches_other;
+
+    group_first(changed, count, &g);
+    group_first(other_changed, other_count, &go);
+    for(;;) {
+        if(g.end != g.start) {
+            // up and then down as far as possible, until it stops merging
+            do {
+                size = g.end - g.start;
+                matches_other = 0;
+                while(group_slide_up(cls, changed, &g) == 0)
+                    group_previous(other_changed, &go);
+                earliest_end = g.end;
+                if(go.end > go.start)
+                    matches_other = 1;
+                while(group_slide_down(cls, changed, count, &g) == 0) {
+                    group_next(other_changed, other_count, &go);
+                    if(go.end > go.start)
+                        matches_other = 1;
+                }
+            } while(size != g.end - g.start);
+
+            // back up to the lowest place it lines up with the other side
+            if(g.end != earliest_end && matches_other) {
+                while(go.end == go.start) {
+                    group_slide_up(cls, changed, &g);
+                    group_previous(other_changed, &go);
+                }
+            }
+        }
+        if(group_next(changed, count, &g) != 0)
+            break;
+        group_next(other_changed, other_count, &go);
+    }
+}
+
+static int build_changes(const struct diff_ctx *c, struct diff_result *res)
+{
+    uint32_t i = 0, j = 0, na = res->old_count, nb = res->new_count;
+    struct diff_change *ch;
+
+    // every change but the first follows an unchanged line
+    if(!(res->changes = malloc(sizeof(struct diff_change) * ((na < nb ? na : nb) + 1))))
+        return -1;
+    while(i < na || j < nb) {
+        if((i < na && c->a_changed[i]) || (j < nb && c->b_changed[j])) {
+            ch = &res->changes[res->nchanges++];
+            ch->old_start = i;
+            ch->new_start = j;
+            while(i < na && c->a_changed[i])
+                i++;
+            while(j < nb && c->b_changed[j])
+                j++;
+            ch->old_count = i - ch->old_start;
+            ch->new_count = j - ch->new_start;
+            res->removed += ch->old_count;
+            res->added += ch->new_count;
+        } else {
+            i++;
+            j++;
+        }
+    }
+    return 0;
+}
+
+// Whether git's default rule would show the line after a hunk's "@@": it
+// starts with a letter, '_' or '$', as a function or a section heading
+// usually does. Returns how much of it to show.
+static uint32_t function_line(const unsigned char *text, uint32_t len)
+{
+    if(!len || !((*text >= 'a' && *text <= 'z') || (*text >= 'A' && *text <= 'Z') || *text == '_' || *text == '$'))
+        return 0;
+    if(len > DIFF_FUNC_MAX)
+        len = DIFF_FUNC_MAX;
+    while(len && (text[len - 1] == '\n' || text[len - 1] == ' ' || text[len - 1] == '\t' ||
+                  text[len - 1] == '\r' || text[len - 1] == '\f' || text[len - 1] == '\v'))
+        len--;
+    return len;
+}
+
+// Finds each hunk's function line: the nearest one above it. A hunk only
+// looks as far back as the previous hunk did, and inherits what that found
+// otherwise, so a file with no such lines isn't searched over and over.
+static void find_functions(struct diff_result *res)
+{
+    const struct diff_line *l;
+    uint32_t i, line, searched = 0, func_start = 0, func_len = 0, len;
+
+    for(i = 0; i < res->nhunks; i++) {
+        for(line = res->hunks[i].old_start; line > searched; line--) {
+            l = &res->old_lines[line - 1];
+            if((len = function_line(res->old_data + l->start, l->len))) {
+                func_start = l->start;
+                func_len = len;
+                break;
+            }
+        }
+        searched = res->hunks[i].old_start;
+        res->hunks[i].func_start = func_start;
+        res->hunks[i].func_len = func_len;
+    }
+}
+
+// Groups changes that are at most 2 * context lines apart, so their context
+// would touch, into hunks.
+static int build_hunks(struct diff_result *res, uint32_t context)
+{
+    struct diff_change *first, *last;
+    struct diff_hunk *h;
+    uint32_t i, j, gap;
+
+    if(!(res->hunks = malloc(sizeof(struct diff_hunk) * (res->nchanges ? res->nchanges : 1))))
+        return -1;
+    for(i = 0; i < res->nchanges; i = j) {
+        for(j = i + 1; j < res->nchanges; j++) {
+            last = &res->changes[j - 1];
+            if(res->changes[j].old_start - (last->old_start + last->old_count) > 2 * (uint64_t) context)
+                break;
+        }
+        first = &res->changes[i];
+        last = &res->changes[j - 1];
+        h = &res->hunks[res->nhunks++];
+        h->first_change = i;
+        h->nchanges = j - i;
+
+        // the unchanged lines either side are the same lines on both sides
+        gap = (i == 0) ? first->old_start : first->old_start - (first[-1].old_start + first[-1].old_count);
+        if(gap > context)
+            gap = context;
+        h->old_start = first->old_start - gap;
+        h->new_start = first->new_start - gap;
+        gap = ((j < res->nchanges) ? res->changes[j].old_start : res->old_count) - (last->old_start + last->old_count);
+        if(gap > context)
+            gap = context;
+        h->old_count = last->old_start + last->old_count + gap - h->old_start;
+        h->new_count = last->new_start + last->new_count + gap - h->new_start;
+    }
+    find_functions(res);
+    return 0;
+}
+
+static int diff_lines(struct diff_ctx *c, struct classifier *cls, const struct diff_options *opts,
+                      struct diff_result *res)
+{
+    uint32_t na = res->old_count, nb = res->new_count, i;
+    const struct diff_line *l;
+    size_t diagonals = (size_t) na + nb + 3;
+
+    if(!(c->a = malloc(sizeof(uint32_t) * (na + 1))) || !(c->b = malloc(sizeof(uint32_t) * (nb + 1))) ||
+       !(c->a_changed = calloc(na + 1, 1)) || !(c->b_changed = calloc(nb + 1, 1)) ||
+       !(c->ma = malloc(sizeof(uint32_t) * (na + 1))) || !(c->mb = malloc(sizeof(uint32_t) * (nb + 1))) ||
+       !(c->ia = malloc(sizeof(uint32_t) * (na + 1))) || !(c->ib = malloc(sizeof(uint32_t) * (nb + 1))) ||
+       !(c->a_matches = malloc(na + 1)) || !(c->b_matches = malloc(nb + 1)) ||
+       !(c->kv = malloc(sizeof(long) * 2 * diagonals)))
+        return -1;
+    // diagonals run from -(nb + 1) to na + 1
+    c->v1 = c->kv + nb + 1;
+    c->v2 = c->v1 + diagonals;
+    for(i = 0, l = res->old_lines; i < na; i++, l++)
+        c->a[i] = classify(cls, res->old_data + l->start, l->len);
+    for(i = 0, l = res->new_lines; i < nb; i++, l++)
+        c->b[i] = classify(cls, res->new_data + l->start, l->len);
+    if(!(c->a_count = malloc(sizeof(uint32_t) * (cls->nclasses + 1))) ||
+       !(c->b_count = malloc(sizeof(uint32_t) * (cls->nclasses + 1))))
+        return -1;
+
+    // histogram doesn't trim the lines common to both ends first; the
+    // rarest lines anchor it wherever they are
+    if(opts->algorithm == DIFF_HISTOGRAM) {
+        if(!(c->count = malloc(sizeof(uint32_t) * (cls->nclasses + 1))) ||
+           !(c->head = malloc(sizeof(uint32_t) * (cls->nclasses + 1))) ||
+           !(c->next = malloc(sizeof(uint32_t) * (na + 1))))
+            return -1;
+        if(histogram(c, 0, na, 0, nb) != 0)
+            return -1;
+    } else {
+        myers(c, 0, na, 0, nb);
+    }
+    res->approximate = c->approximate;
+
+    compact(c->a, c->a_changed, na, c->b_changed, nb);
+    compact(c->b, c->b_changed, nb, c->a_changed, na);
+    if(build_changes(c, res) != 0 || build_hunks(res, opts->context) != 0)
+        return -1;
+    return 0;
+}
+
+// With no context wanted, git drops the lines both files end with before
+// diffing, in 1K blocks back from the end and then forward to a line
+// boundary. Where an ambiguous change lands depends on it, so do the same.
+static size_t common_tail(const unsigned char *a, size_t a_size, const unsigned char *b, size_t b_size)
+{
+    size_t smaller = (a_size < b_size) ? a_size : b_size, trimmed = 0, recovered = 0;
+
+    while(trimmed + 1024 <= smaller && memcmp(a + a_size - trimmed - 1024, b + b_size - trimmed - 1024, 1024) == 0)
+        trimmed += 1024;
+    while(recovered < trimmed) {
+        if(a[a_size - trimmed + recovered++] == '\n')
+            break;
+    }
+    return trimmed - recovered;
+}
+
+void diff_options_init(struct diff_options *opts)
+{
+    opts->algorithm = DIFF_MYERS;
+    opts->context = DIFF_CONTEXT;
+    opts->max_bytes = DIFF_MAX_BYTES;
+    opts->budget_ms = 0;
+    opts->text = 0;
+}
+
+// Diffs two buffers line by line. Returns DIFF_TEXT with the changes and
+// hunks in res, DIFF_BINARY or DIFF_TOO_BIG with nothing in it, or -1 if
+// memory runs out. res points into both buffers, so they have to outlive
+// it; diff_release() it whatever this returns.
+int diff_buffers(const unsigned char *old_data, size_t old_size, const unsigned char *new_data, size_t new_size,
+                 const struct diff_options *opts, struct diff_result *res)
+{
+    struct classifier cls;
+    struct diff_ctx c;
+    size_t tail = 0;
+    uint32_t tail_lines = 0;
+    int ret;
+
+    memset(res, 0, sizeof(*res));
+    res->old_data = old_data;
+    res->new_data = new_data;
+    if(old_size >= UINT32_MAX || new_size >= UINT32_MAX ||
+       (opts->max_bytes && (old_size > opts->max_bytes || new_size > opts->max_bytes)))
+        return DIFF_TOO_BIG;
+    if(!opts->text && (memchr(old_data, 0, old_size < DIFF_BINARY_SNIFF ? old_size : DIFF_BINARY_SNIFF) ||
+                      memchr(new_data, 0, new_size < DIFF_BINARY_SNIFF ? new_size : DIFF_BINARY_SNIFF)))
+        return DIFF_BINARY;
+    if(old_size == new_size && memcmp(old_data, new_data, old_size) == 0)
+        return DIFF_TEXT;
+
+    res->old_count = count_lines(old_data, old_size);
+    res->new_count = count_lines(new_data, new_size);
+    if(!(res->old_lines = malloc(sizeof(struct diff_line) * (res->old_count + 1))) ||
+       !(res->new_lines = malloc(sizeof(struct diff_line) * (res->new_count + 1))))
+        return -1;
+    split_lines(old_data, old_size, res->old_lines);
+    split_lines(new_data, new_size, res->new_lines);
+
+    if(classifier_init(&cls, res->old_count + res->new_count) != 0)
+        return -1;
+    memset(&c, 0, sizeof(c));
+    if(opts->budget_ms > 0)
+        c.deadline = stats_now_ns() + (uint64_t) opts->budget_ms * 1000000;
+    if(opts->context == 0) {
+        tail = common_tail(old_data, old_size, new_data, new_size);
+        tail_lines = count_lines(old_data + old_size - tail, tail);
+    }
+    res->old_count -= tail_lines;
+    res->new_count -= tail_lines;
+    ret = diff_lines(&c, &cls, opts, res);
+    res->old_count += tail_lines;
+    res->new_count += tail_lines;
+
+    free(c.a);
+    free(c.b);
+    free(c.a_changed);
+    free(c.b_changed);
+    free(c.ma);
+    free(c.mb);
+    free(c.ia);
+    free(c.ib);
+    free(c.a_matches);
+    free(c.b_matches);
+    free(c.a_count);
+    free(c.b_count);
+    free(c.kv);
+    free(c.count);
+    free(c.head);
+    free(c.next);
+    free(cls.slots);
+    free(cls.classes);
+    return (ret == 0) ? DIFF_TEXT : -1;
+}
+
+// Calls fn for each line of the hunk, in order, with ' ', '-' or '+'. Stops
+// early if fn returns non-zero, and returns what it returned.
+int diff_hunk_lines(const struct diff_result *res, const struct diff_hunk *h, diff_line_fn fn, void *cb_data)
+{
+    const struct diff_change *ch = &res->changes[h->first_change], *end = ch + h->nchanges;
+    uint32_t i = h->old_start, j = h->new_start, old_end = h->old_start + h->old_count;
+    const struct diff_line *l;
+    int ret;
+
+    for(; ch <= end; ch++) {
+        // the context before this change, or after the last one
+        for(; i < (ch < end ? ch->old_start : old_end); i++, j++) {
+            l = &res->old_lines[i];
+            if((ret = fn(' ', res->old_data + l->start, l->len, cb_data)))
+                return ret;
+        }
+        if(ch == end)
+            break;
+        for(; i < ch->old_start + ch->old_count; i++) {
+            l = &res->old_lines[i];
+            if((ret = fn('-', res->old_data + l->start, l->len, cb_data)))
+                return ret;
+        }
+        for(; j < ch->new_start + ch->new_count; j++) {
+            l = &res->new_lines[j];
+            if((ret = fn('+', res->new_data + l->start, l->len, cb_data)))
+                return ret;
+        }
+    }
+    return 0;
+}
+
+struct unified_out {
+    char *buf;
+    size_t size, len;
+};
+
+static void put(struct unified_out *out, const void *data, size_t len)
+{
+    if(out->len < out->size)
+        memcpy(out->buf + out->len, data, (out->size - out->len < len) ? out->size - out->len : len);
+    out->len += len;
+}
+
+static int put_line(char tag, const unsigned char *text, uint32_t len, void *cb_data)
+{
+    static const char no_newline[] = "\n\\ No newline at end of file\n";
+    struct unified_out *out = cb_data;
+
+    put(out, &tag, 1);
+    put(out, text, len);
+    if(!len || text[len - 1] != '\n')
+        put(out, no_newline, sizeof(no_newline) - 1);
+    return 0;
+}
+
+// Appends "-start,count" the way diff does: a count of 1 is left out, and an
+// empty range is numbered by the line before it.
+static int range_header(char *buf, size_t size, char sign, uint32_t start, uint32_t count)
+{
+    if(count == 1)
+        return snprintf(buf, size, "%c%u", sign, start + 1);
+    return snprintf(buf, size, "%c%u,%u", sign, count ? start + 1 : start, count);
+}
+
+// Writes the hunks as "git diff" would, without the file headers. Returns
+// the length the whole of it needs; if that's not less than size, only what
+// fit was written, so grow buf and call again. Otherwise it's \0 terminated.
+size_t diff_unified(const struct diff_result *res, char *buf, size_t size)
+{
+    struct unified_out out;
+    const struct diff_hunk *h;
+    char header[64];
+    uint32_t i;
+    int len;
+
+    out.buf = buf;
+    out.size = size;
+    out.len = 0;
+    for(i = 0; i < res->nhunks; i++) {
+        h = &res->hunks[i];
+        put(&out, "@@ ", 3);
+        len = range_header(header, sizeof(header), '-', h->old_start, h->old_count);
+        put(&out, header, len);
+        put(&out, " ", 1);
+        len = range_header(header, sizeof(header), '+', h->new_start, h->new_count);
+        put(&out, header, len);
+        put(&out, " @@", 3);
+        if(h->func_len) {
+            put(&out, " ", 1);
+            put(&out, res->old_data + h->func_start, h->func_len);
+        }
+        put(&out, "\n", 1);
+        diff_hunk_lines(res, h, put_line, &out);
+    }
+    if(out.len < size)
+        buf[out.len] = '\0';
+    return out.len;
+}
+
+void diff_release(struct diff_result *res)
+{
+    free(res->old_lines);
+    free(res->new_lines);
+    free(res->changes);
+    free(res->hunks);
+    memset(res, 0, sizeof(*res));
+}
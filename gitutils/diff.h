@@ -0,0 +1,72 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DIFF_MYERS 0
+#define DIFF_HISTOGRAM 1
+
+#define DIFF_CONTEXT 3
+#define DIFF_MAX_BYTES (16 << 20)    // per side; bigger files aren't diffed
+#define DIFF_BINARY_SNIFF 8000       // as git does: a NUL in this many leading bytes means binary
+#define DIFF_FUNC_MAX 80             // as git does: how much of a hunk's function line is shown
+
+// diff_buffers() results besides -1
+#define DIFF_TEXT 0
+#define DIFF_BINARY 1
+#define DIFF_TOO_BIG 2
+
+struct diff_options {
+    int algorithm;
+    unsigned int context;        // unchanged lines kept around each change
+    size_t max_bytes;            // 0 for no limit
+    int budget_ms;               // 0 for no limit; past it, what's left is diffed crudely
+    int text;                    // diff files that look binary anyway, as "git diff --text" does
+};
+
+struct diff_line {
+    uint32_t start;              // offset into the file
+    uint32_t len;                // including the '\n', if it has one
+};
+
+// A run of lines removed from the old file and the lines that replace them;
+// either count may be 0. Lines are numbered from 0.
+struct diff_change {
+    uint32_t old_start, old_count;
+    uint32_t new_start, new_count;
+};
+
+// The changes close enough together to share context, and the lines shown
+// around them.
+struct diff_hunk {
+    uint32_t old_start, old_count;
+    uint32_t new_start, new_count;
+    uint32_t first_change, nchanges;
+    uint32_t func_start, func_len; // where in the old file the text after "@@" is; func_len 0 if none
+};
+
+struct diff_result {
+    const unsigned char *old_data, *new_data;
+    struct diff_line *old_lines, *new_lines;
+    uint32_t old_count, new_count;
+    struct diff_change *changes;
+    uint32_t nchanges;
+    struct diff_hunk *hunks;
+    uint32_t nhunks;
+    uint32_t added, removed;     // lines
+    int approximate;             // the budget ran out, so it isn't minimal
+};
+
+// tag is ' ', '-' or '+'; text is the line, with its '\n' if it has one
+typedef int (*diff_line_fn)(char tag, const unsigned char *text, uint32_t len, void *cb_data);
+
+void diff_options_init(struct diff_options *opts);
+int diff_buffers(const unsigned char *old_data, size_t old_size, const unsigned char *new_data, size_t new_size,
+                 const struct diff_options *opts, struct diff_result *res);
+int diff_hunk_lines(const struct diff_result *res, const struct diff_hunk *h, diff_line_fn fn, void *cb_data);
+size_t diff_unified(const struct diff_result *res, char *buf, size_t size);
+void diff_release(struct diff_result *res);
+
+
+#endif
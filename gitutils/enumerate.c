@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "enumerate.h"
+
+// Opens a pack for enumeration. idx_location may be NULL to use the idx next
+// to the pack. cache_bytes bounds the memory spent on delta bases.
+struct pack_enum *pack_enum_open(char *pack_location, char *idx_location, size_t cache_bytes)
+{
+    struct pack_enum *e;
+    char *default_idx = NULL;
+
+    if(!idx_location && !(idx_location = default_idx = pack_idx_location(pack_location)))
+        return NULL;
+    if(!(e = calloc(1, sizeof(struct pack_enum)))) {
+        free(default_idx);
+        return NULL;
+    }
+
+    e->pack = load_pack(pack_location);
+    e->idx = e->pack ? load_idx(idx_location) : NULL;
+    free(default_idx);
+    if(!e->idx || !(e->order = pack_order(e->pack, e->idx)) || !(e->cache = base_cache_new(cache_bytes))) {
+        pack_enum_close(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+// Reads the next object into g_obj, which the caller then owns, and points
+// *sha1 at its id. Returns 1 for an object, 0 once the pack is exhausted and
+// -1 for an object that couldn't be read; that object is skipped, so the
+// caller may carry on.
+int pack_enum_next(struct pack_enum *e, const unsigned char **sha1, struct git_object *g_obj)
+{
+    const struct pack_order_entry *entry;
+
+    if(e->next >= e->idx->entries)
+        return 0;
+
+    entry = &e->order[e->next++];
+    *sha1 = idx_sha1(e->idx, entry->pos);
+    if(pack_read_object(e->pack, e->idx, entry->offset, g_obj, e->cache, entry->is_base) != 0)
+        return -1;
+    return 1;
+}
+
+void pack_enum_close(struct pack_enum *e)
+{
+    if(!e)
+        return;
+
+    if(e->cache)
+        base_cache_free(e->cache);
+    free(e->order);
+    if(e->idx)
+        unload_idx(e->idx);
+    if(e->pack)
+        unload_pack(e->pack);
+    free(e);
+}
+
+// Calls fn for every object in the pack. Returns 0 when everything was read,
+// -1 if the pack couldn't be opened or any object couldn't be read (the rest
+// are still enumerated), or whatever non-zero value fn stopped with.
+int enumerate_pack(char *pack_location, char *idx_location, size_t cache_bytes,
+                   pack_enum_fn fn, void *cb_data)
+{
+    struct pack_enum *e;
+    struct git_object g_obj;
+    const unsigned char *sha1;
+    int ret = 0, status, stop = 0;
+
+    if(!(e = pack_enum_open(pack_location, idx_location, cache_bytes)))
+        return -1;
+
+    while(!stop && (status = pack_enum_next(e, &sha1, &g_obj)) != 0) {
+        if(status < 0) {
+            ret = -1;
+            continue;
+        }
+        stop = fn(sha1, g_obj.type, g_obj.mem_data, g_obj.size, cb_data);
+        free(g_obj.mem_data);
+    }
+
+    pack_enum_close(e);
+    return stop ? stop : ret;
+}
+
+struct enumerate_job {
+    char **pack_locations;
+    int npacks;
+    int next_pack;
+    size_t cache_bytes;
+    pack_enum_fn fn;
+    void *cb_data;
+    int ret;
+    pthread_mutex_t lock;
+};
+
+static void *enumerate_worker(void *data)
+{
+    struct enumerate_job *job = data;
+    int n, ret;
+
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        // once something has stopped us, don't start any more packs
+        n = (job->ret > 0) ? job->npacks : job->next_pack++;
+        pthread_mutex_unlock(&job->lock);
+        if(n >= job->npacks)
+            break;
+
+        ret = enumerate_pack(job->pack_locations[n], NULL, job->cache_bytes, job->fn, job->cb_data);
+
+        pthread_mutex_lock(&job->lock);
+        if(ret != 0 && job->ret <= 0)
+            job->ret = ret;
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// Enumerates several packs, one per thread at a time (threads <= 0 means one
+// per CPU). fn is called from all of the threads at once, so it has to do its
+// own locking. Returns like enumerate_pack(); a stop from fn only ends the
+// pack it happened in, but no new packs are started after it.
+int enumerate_packs(char **pack_locations, int npacks, int threads, size_t cache_bytes,
+                    pack_enum_fn fn, void *cb_data)
+{
+    struct enumerate_job job;
+    pthread_t *workers;
+    int t;
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > npacks)
+        threads = npacks;
+    if(threads <= 0)
+        threads = 1;
+
+    job.pack_locations = pack_locations;
+    job.npacks = npacks;
+    job.next_pack = 0;
+    job.cache_bytes = cache_bytes;
+    job.fn = fn;
+    job.cb_data = cb_data;
+    job.ret = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    if(!(workers = malloc(sizeof(pthread_t) * threads))) {
+        enumerate_worker(&job);
+    } else {
+        for(t = 0; t < threads; t++) {
+            if(pthread_create(&workers[t], NULL, enumerate_worker, &job) != 0)
+                break;
+        }
+        if(t == 0)
+            enumerate_worker(&job); // no threads at all; do it ourselves
+        while(t-- > 0)
+            pthread_join(workers[t], NULL);
+        free(workers);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    return job.ret;
+}
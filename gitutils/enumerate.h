@@ -0,0 +1,39 @@
+#ifndef ENUMERATE_H
+#define ENUMERATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct pack;
+struct idx;
+struct git_object;
+struct pack_order_entry;
+struct base_cache;
+
+// Walks every object in a pack in pack order, so the pack is read front to
+// back exactly once. Deltas are resolved against bases kept in a bounded
+// cache; a base that has been pushed out is rebuilt from the pack.
+struct pack_enum {
+    struct pack *pack;
+    struct idx *idx;
+    struct pack_order_entry *order;
+    struct base_cache *cache;
+    uint32_t next;
+};
+
+// Called once per object. data is only valid during the call, and is \0
+// terminated. Return a positive value to stop early.
+typedef int (*pack_enum_fn)(const unsigned char *sha1, unsigned int type,
+                            const unsigned char *data, unsigned long size, void *cb_data);
+
+struct pack_enum *pack_enum_open(char *pack_location, char *idx_location, size_t cache_bytes);
+int pack_enum_next(struct pack_enum *e, const unsigned char **sha1, struct git_object *g_obj);
+void pack_enum_close(struct pack_enum *e);
+
+int enumerate_pack(char *pack_location, char *idx_location, size_t cache_bytes,
+                   pack_enum_fn fn, void *cb_data);
+int enumerate_packs(char **pack_locations, int npacks, int threads, size_t cache_bytes,
+                    pack_enum_fn fn, void *cb_data);
+
+
+#endif
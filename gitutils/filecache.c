@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "filecache.h"
+#include "stats.h"
 
 struct file_cache_node {
     FILE *file;
@@ -64,6 +65,7 @@ FILE *util_open_file_cached(char *location)
             return NULL;
         file_list->prev = NULL;
         file_list->next = NULL;
+        STATS_INC(file_cache_opens);
         if(!(file_list->file = fopen(location, "rb"))) {
             free(file_list);
             return NULL;
@@ -89,6 +91,7 @@ FILE *util_open_file_cached(char *location)
             if(strlen(location) == strlen(cur_node->location)) {
                 if(memcmp(location, cur_node->location, strlen(location)) == 0) {
                     // found one!
+                    STATS_INC(file_cache_hits);
                     cur_node->reference_count++;
                     fseek(cur_node->file, 0, SEEK_SET);
                     return cur_node->file;
@@ -103,6 +106,7 @@ FILE *util_open_file_cached(char *location)
         cur_node->next->prev = cur_node;
         cur_node = cur_node->next;
         cur_node->next = NULL;
+        STATS_INC(file_cache_opens);
         if(!(cur_node->file = fopen(location, "rb"))) {
             cur_node->prev->next = NULL;
             free(cur_node);
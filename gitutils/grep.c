@@ -0,0 +1,535 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <regex.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "tree.h"
+#include "lstree.h"
+#include "grep.h"
+
+// Content search over a tree, as in "git grep -I -n <pattern> <commit>".
+//
+// The tree is listed with lstree_walk(), then a pool of threads takes the
+// files in listing order, each reading a file and searching it without the
+// lock. grep_next() reports the matches in listing order, so the threads
+// only ever get GREP_WINDOW files ahead of it, and once it has reported as
+// many as were asked for they stop.
+//
+// Patterns without regex syntax, and -F ones, are searched for as strings,
+// 16 bytes at a time with SIMD compares where the CPU has them: positions
+// where both the first and the last byte of the string match are checked in
+// full. Anything else goes to the system's regex engine, which is run over
+// the whole file rather than a line at a time. Either way a file is only
+// split into lines around the matches.
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GREP_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GREP_NEON 1
+#endif
+
+struct grep_hit {
+    uint32_t line;
+    size_t start, len;
+};
+
+struct grep_file {
+    uint32_t entry;              // in the listing
+    int done;
+    int failed;                  // the blob is missing or corrupt
+    unsigned char *data;         // kept until its matches are reported
+    struct grep_hit *hits;
+    uint32_t nhits;
+};
+
+// What a thread searches with. The regex is compiled once per thread, since
+// the system's regexec() may lock a shared one.
+struct grep_matcher {
+    const unsigned char *needle; // the string, when there's no regex
+    size_t len;
+    int icase;
+    regex_t re;
+    int regex;
+};
+
+struct grep {
+    struct odb *odb;
+    struct lstree ls;
+    char *pattern;
+    struct grep_options opts;
+    struct grep_file *files;
+    uint32_t nfiles, files_alloc;
+
+    uint32_t next_file;          // the next one a thread will take
+    uint32_t report_file;        // the one grep_next() is reporting from
+    uint32_t report_hit;
+    uint32_t reported;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;         // for the threads: more room in the window, or stop
+    pthread_cond_t found;        // for grep_next(): a file is done
+    pthread_t *workers;
+    int nworkers;
+
+    char *path;
+    size_t path_alloc;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+/////////////////////////////////////////////////////////////////////
+// searching                                                       //
+/////////////////////////////////////////////////////////////////////
+
+// A bit for each byte equal to c among the 16 at p.
+static inline unsigned int equal_mask(const unsigned char *p, unsigned char c)
+{
+#if defined(GREP_SSE2)
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), _mm_set1_epi8(c)));
+#elif defined(GREP_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t m = vandq_u8(vceqq_u8(vld1q_u8(p), vdupq_n_u8(c)), vld1q_u8(bits));
+
+    return vaddv_u8(vget_low_u8(m)) | (vaddv_u8(vget_high_u8(m)) << 8);
+#else
+    unsigned int mask = 0, i;
+
+    for(i = 0; i < 16; i++)
+        mask |= (unsigned int) (p[i] == c) << i;
+    return mask;
+#endif
+}
+
+static inline unsigned char fold(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline unsigned int byte_mask(const unsigned char *p, unsigned char c, int icase)
+{
+    if(icase && fold(c) >= 'a' && fold(c) <= 'z')
+        return equal_mask(p, fold(c)) | equal_mask(p, fold(c) - ('a' - 'A'));
+    return equal_mask(p, c);
+}
+
+static int same(const struct grep_matcher *m, const unsigned char *p)
+{
+    size_t i;
+
+    if(!m->icase)
+        return memcmp(p, m->needle, m->len) == 0;
+    for(i = 0; i < m->len; i++) {
+        if(fold(p[i]) != fold(m->needle[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static int64_t find_string(const struct grep_matcher *m, const unsigned char *data, size_t size, size_t from)
+{
+    size_t n = m->len, i = from;
+    unsigned int mask;
+
+    if(n == 0)
+        return from;
+    if(size < n)
+        return -1;
+    for(; i + n - 1 + 16 <= size; i += 16) {
+        mask = byte_mask(data + i, m->needle[0], m->icase) & byte_mask(data + i + n - 1, m->needle[n - 1], m->icase);
+        for(; mask; mask &= mask - 1) {
+            if(same(m, data + i + __builtin_ctz(mask)))
+                return i + __builtin_ctz(mask);
+        }
+    }
+    for(; i + n <= size; i++) {
+        if(same(m, data + i))
+            return i;
+    }
+    return -1;
+}
+
+// text is data, or a \0 terminated copy of it where regexec() can't be told
+// where the data ends.
+static int64_t find_regex(const struct grep_matcher *m, const unsigned char *text, size_t size, size_t from)
+{
+    regmatch_t match;
+
+#ifdef REG_STARTEND
+    match.rm_so = from;
+    match.rm_eo = size;
+    if(regexec(&m->re, (const char *) text, 1, &match, REG_STARTEND) != 0)
+        return -1;
+    return match.rm_so;
+#else
+    (void) size;
+    if(regexec(&m->re, (const char *) text + from, 1, &match, 0) != 0)
+        return -1;
+    return from + match.rm_so;
+#endif
+}
+
+static size_t count_newlines(const unsigned char *p, const unsigned char *end)
+{
+    size_t n = 0;
+
+    for(; p + 16 <= end; p += 16)
+        n += __builtin_popcount(equal_mask(p, '\n'));
+    for(; p < end; p++)
+        n += (*p == '\n');
+    return n;
+}
+
+// Finds the lines of a file that match, up to max of them (0 for no limit).
+static int search(const struct grep_matcher *m, const unsigned char *data, size_t size, uint32_t max,
+                  struct grep_hit **hits, uint32_t *nhits)
+{
+    const unsigned char *text = data, *nl;
+    struct grep_hit *hit;
+    uint32_t alloc = 0, line = 1;
+    size_t pos = 0, start;
+    int64_t at;
+    void *grown;
+    char *copy = NULL;
+
+    *hits = NULL;
+    *nhits = 0;
+#ifndef REG_STARTEND
+    if(m->regex) {
+        if(!(copy = malloc(size + 1)))
+            return -1;
+        memcpy(copy, data, size);
+        copy[size] = '\0';
+        text = (const unsigned char *) copy;
+    }
+#endif
+
+    while(pos < size && (!max || *nhits < max)) {
+        at = m->regex ? find_regex(m, text, size, pos) : find_string(m, data, size, pos);
+        if(at < 0 || (size_t) at >= size)
+            break;
+        line += count_newlines(data + pos, data + at);
+        for(start = at; start > pos && data[start - 1] != '\n'; start--)
+            ;
+        nl = memchr(data + at, '\n', size - at);
+
+        if(!(grown = grow(*hits, &alloc, *nhits + 1, sizeof(struct grep_hit)))) {
+            free(copy);
+            return -1;
+        }
+        *hits = grown;
+        hit = &(*hits)[(*nhits)++];
+        hit->line = line;
+        hit->start = start;
+        hit->len = (nl ? (size_t) (nl - data) : size) - start;
+        if(!nl)
+            break;
+        pos = nl - data + 1;
+        line++;
+    }
+    free(copy);
+    return 0;
+}
+
+// Patterns with nothing special in them are searched for as strings.
+static int is_plain(const char *pattern, int flags)
+{
+    const char *special = (flags & GREP_EXTENDED) ? "\\.[]*^$+?(){}|" : "\\.[]*^$";
+
+    return (flags & GREP_FIXED) || !pattern[strcspn(pattern, special)];
+}
+
+static int matcher_init(struct grep_matcher *m, const char *pattern, int flags)
+{
+    int cflags = REG_NEWLINE;
+
+    memset(m, 0, sizeof(*m));
+    m->icase = (flags & GREP_ICASE) != 0;
+    if(is_plain(pattern, flags)) {
+        m->needle = (const unsigned char *) pattern;
+        m->len = strlen(pattern);
+        return 0;
+    }
+    if(flags & GREP_EXTENDED)
+        cflags |= REG_EXTENDED;
+    if(flags & GREP_ICASE)
+        cflags |= REG_ICASE;
+    if(regcomp(&m->re, pattern, cflags) != 0)
+        return -1;
+    m->regex = 1;
+    return 0;
+}
+
+static void matcher_release(struct grep_matcher *m)
+{
+    if(m->regex)
+        regfree(&m->re);
+}
+
+/////////////////////////////////////////////////////////////////////
+// threads                                                         //
+/////////////////////////////////////////////////////////////////////
+
+// Reads and searches one file, with the lock not held. Binary files and ones
+// over the size limit are passed over.
+static int search_file(struct grep *g, const struct grep_matcher *m, struct base_cache *cache,
+                       const unsigned char *sha1, struct grep_file *result)
+{
+    struct git_object g_obj;
+    uint64_t size;
+
+    if(odb_object_size(g->odb, sha1, &size) != 0)
+        return -1;
+    if(g->opts.max_bytes && size > g->opts.max_bytes)
+        return 0;
+    if(odb_read(g->odb, sha1, &g_obj, cache) != 0)
+        return -1;
+    if(g_obj.type != BLOB) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+    if(!memchr(g_obj.mem_data, 0, g_obj.size < GREP_BINARY_SNIFF ? g_obj.size : GREP_BINARY_SNIFF) &&
+       search(m, g_obj.mem_data, g_obj.size, g->opts.max_matches, &result->hits, &result->nhits) != 0) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+    if(result->nhits)
+        result->data = g_obj.mem_data;
+    else
+        free(g_obj.mem_data);
+    return 0;
+}
+
+static void *grep_worker(void *data)
+{
+    struct grep *g = data;
+    struct base_cache *cache;
+    struct grep_matcher m;
+    struct grep_file result;
+    unsigned char sha1[20];
+    uint32_t f;
+    int ret, ready;
+
+    cache = base_cache_new(GREP_CACHE_BYTES);
+    ready = (matcher_init(&m, g->pattern, g->opts.flags) == 0);
+    pthread_mutex_lock(&g->lock);
+    for(;;) {
+        while(!g->stop && g->next_file < g->nfiles && g->next_file >= g->report_file + GREP_WINDOW)
+            pthread_cond_wait(&g->wake, &g->lock);
+        if(g->stop || g->next_file >= g->nfiles)
+            break;
+        f = g->next_file++;
+        memcpy(sha1, g->ls.entries[g->files[f].entry].sha1, 20);
+        pthread_mutex_unlock(&g->lock);
+
+        memset(&result, 0, sizeof(result));
+        ret = (cache && ready) ? search_file(g, &m, cache, sha1, &result) : -1;
+
+        pthread_mutex_lock(&g->lock);
+        g->files[f].failed = (ret != 0);
+        g->files[f].data = result.data;
+        g->files[f].hits = result.hits;
+        g->files[f].nhits = result.nhits;
+        g->files[f].done = 1;
+        pthread_cond_broadcast(&g->found);
+    }
+    pthread_mutex_unlock(&g->lock);
+
+    if(ready)
+        matcher_release(&m);
+    if(cache)
+        base_cache_free(cache);
+    return NULL;
+}
+
+void grep_options_init(struct grep_options *opts)
+{
+    opts->flags = 0;
+    opts->threads = 0;
+    opts->max_bytes = GREP_MAX_BYTES;
+    opts->max_matches = 0;
+}
+
+// Searches the files under prefix ("" for everything) in start, a commit,
+// tree or tag, for lines matching pattern: a basic regex, or as opts->flags
+// say. The search goes on in the background; grep_next() gets the matches.
+// Returns 0, 1 if there's no such path, 2 if the pattern isn't a valid
+// regex, and -1 if an object is missing or malformed.
+int grep_start(struct odb *odb, struct tree_resolver *paths, const unsigned char *start, const char *prefix,
+               const char *pattern, const struct grep_options *opts, struct grep **result)
+{
+    struct grep_matcher m;
+    struct grep *g;
+    struct grep_file *f;
+    unsigned int mode;
+    uint32_t i;
+    int ret, t;
+
+    *result = NULL;
+    if(matcher_init(&m, pattern, opts->flags) != 0)
+        return 2;
+    matcher_release(&m);
+
+    if(!(g = calloc(1, sizeof(struct grep))))
+        return -1;
+    if(!(g->pattern = strdup(pattern))) {
+        free(g);
+        return -1;
+    }
+    g->opts = *opts;
+    if((ret = lstree_walk(odb, paths, start, prefix, 0, 0, opts->threads, &g->ls)) != 0) {
+        free(g->pattern);
+        free(g);
+        return ret;
+    }
+    g->odb = odb_ref(odb); // the search may outlive the caller's reference
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->wake, NULL);
+    pthread_cond_init(&g->found, NULL);
+
+    // regular files only, as git does; not symlinks or submodules
+    for(i = 0; i < g->ls.norder; i++) {
+        mode = g->ls.entries[g->ls.order[i]].mode;
+        if((mode & 0170000) != 0100000)
+            continue;
+        if(!(f = grow(g->files, &g->files_alloc, g->nfiles + 1, sizeof(struct grep_file)))) {
+            grep_free(g);
+            return -1;
+        }
+        g->files = f;
+        memset(&g->files[g->nfiles], 0, sizeof(struct grep_file));
+        g->files[g->nfiles++].entry = g->ls.order[i];
+    }
+
+    t = opts->threads;
+    if(t <= 0)
+        t = sysconf(_SC_NPROCESSORS_ONLN);
+    if(t <= 0)
+        t = 1;
+    if(!(g->workers = malloc(sizeof(pthread_t) * t))) {
+        grep_free(g);
+        return -1;
+    }
+    for(g->nworkers = 0; g->nworkers < t; g->nworkers++) {
+        if(pthread_create(&g->workers[g->nworkers], NULL, grep_worker, g) != 0)
+            break;
+    }
+    if(!g->nworkers) {
+        grep_free(g);
+        return -1;
+    }
+    *result = g;
+    return 0;
+}
+
+// Gets the next match, in the order "git grep" lists them. Returns 0 with
+// one, 1 when there are no more, and -1 if a file couldn't be read; m->path
+// says which, and the search goes on past it.
+int grep_next(struct grep *g, struct grep_match *m)
+{
+    struct grep_file *f = NULL;
+    struct grep_hit *hit;
+    size_t len;
+    char *grown;
+    int ret = 1;
+
+    pthread_mutex_lock(&g->lock);
+    while(g->report_file < g->nfiles && (!g->opts.max_matches || g->reported < g->opts.max_matches)) {
+        f = &g->files[g->report_file];
+        while(!f->done)
+            pthread_cond_wait(&g->found, &g->lock);
+        if(f->failed) {
+            f->failed = 0;
+            ret = -1;
+            break;
+        }
+        if(g->report_hit < f->nhits) {
+            hit = &f->hits[g->report_hit++];
+            m->text = f->data + hit->start;
+            m->len = hit->len;
+            m->line = hit->line;
+            g->reported++;
+            ret = 0;
+            break;
+        }
+        free(f->data);
+        free(f->hits);
+        f->data = NULL;
+        f->hits = NULL;
+        g->report_file++;
+        g->report_hit = 0;
+        pthread_cond_broadcast(&g->wake);
+    }
+    if(ret > 0) {
+        g->stop = 1;
+        pthread_cond_broadcast(&g->wake);
+    }
+    pthread_mutex_unlock(&g->lock);
+    if(ret > 0)
+        return ret;
+
+    // the listing doesn't change once the search starts, so no need for the lock
+    len = lstree_path(&g->ls, f->entry, g->path, g->path_alloc);
+    if(len >= g->path_alloc) {
+        if(!(grown = realloc(g->path, len + 1))) {
+            m->path = "";
+            return -1;
+        }
+        g->path = grown;
+        g->path_alloc = len + 1;
+        lstree_path(&g->ls, f->entry, g->path, g->path_alloc);
+    }
+    m->path = g->path;
+    return ret;
+}
+
+// Stops the search if it's still going.
+void grep_free(struct grep *g)
+{
+    uint32_t i;
+
+    if(!g)
+        return;
+    pthread_mutex_lock(&g->lock);
+    g->stop = 1;
+    pthread_cond_broadcast(&g->wake);
+    pthread_mutex_unlock(&g->lock);
+    while(g->nworkers-- > 0)
+        pthread_join(g->workers[g->nworkers], NULL);
+
+    for(i = 0; i < g->nfiles; i++) {
+        free(g->files[i].data);
+        free(g->files[i].hits);
+    }
+    pthread_cond_destroy(&g->found);
+    pthread_cond_destroy(&g->wake);
+    pthread_mutex_destroy(&g->lock);
+    odb_close(g->odb);
+    lstree_release(&g->ls);
+    free(g->files);
+    free(g->workers);
+    free(g->pattern);
+    free(g->path);
+    free(g);
+}
@@ -0,0 +1,41 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct tree_resolver;
+struct grep;
+
+#define GREP_FIXED    1 // the pattern is a string, not a regex, as with "git grep -F"
+#define GREP_EXTENDED 2 // an extended regex, as with "git grep -E"
+#define GREP_ICASE    4
+
+#define GREP_MAX_BYTES (16 << 20)     // bigger blobs aren't searched
+#define GREP_BINARY_SNIFF 8000        // as git does: a NUL in this many leading bytes means binary
+#define GREP_CACHE_BYTES (8 << 20)    // per thread
+#define GREP_WINDOW 256               // files searched ahead of the one being reported
+
+struct grep_options {
+    int flags;
+    int threads;                 // one per CPU if <= 0
+    size_t max_bytes;            // 0 for no limit
+    uint32_t max_matches;        // 0 for no limit
+};
+
+struct grep_match {
+    const char *path;            // these two are only valid until the next grep_next()
+    const unsigned char *text;   // the line, without its '\n'
+    size_t len;
+    uint32_t line;               // from 1
+};
+
+void grep_options_init(struct grep_options *opts);
+int grep_start(struct odb *odb, struct tree_resolver *paths, const unsigned char *start, const char *prefix,
+               const char *pattern, const struct grep_options *opts, struct grep **g);
+int grep_next(struct grep *g, struct grep_match *m);
+void grep_free(struct grep *g);
+
+
+#endif
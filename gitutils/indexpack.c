@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "libgitread.h"
+#include "sha1.h"
+#include "stats.h"
+#include "indexpack.h"
+
+// Builds the idx for a pack that doesn't have one, like "git index-pack".
+//
+// Nothing in a pack records where each entry's zlib stream ends, so entries
+// can only be found by inflating them one after another; the first pass is
+// therefore sequential. It records every entry's boundaries and CRC32 and
+// hashes the objects that aren't deltas. The deltas then form trees, one per
+// base that isn't a delta itself. Workers take whole trees and walk each one
+// depth first, so every object in it is inflated once and shared by all of
+// its children.
+
+struct ip_object {
+    uint64_t offset;
+    uint64_t end;
+    uint32_t crc;
+    unsigned int type;      // the real type; set for deltas once they're resolved
+    uint32_t depth;         // length of the delta chain, 0 for whole objects
+    int resolved;
+    unsigned char sha1[20];
+};
+
+// A delta, filed under the base it needs: OFS_DELTAs by the base's offset,
+// REF_DELTAs by its id.
+struct ip_child {
+    uint64_t base_offset;
+    const unsigned char *base_sha1;  // points into the pack
+    uint32_t object;
+};
+
+struct ip_state {
+    const struct pack *pack;
+    struct ip_object *objects;
+    uint32_t nobjects;
+    struct ip_child *ofs, *ref;
+    uint32_t nofs, nref;
+    uint32_t *roots;        // whole objects that some delta is based on
+    uint32_t nroots;
+    uint32_t next_root;
+    uint32_t resolved;
+    uint32_t max_depth;
+    int failed;
+    char *error;            // the result's; the first failure's reason
+    pthread_mutex_t lock;
+};
+
+// One object on a worker's depth first walk, with the children it has left.
+struct ip_frame {
+    uint32_t object;
+    unsigned char *data;
+    unsigned long size;
+    uint32_t next_ofs, end_ofs;
+    uint32_t next_ref, end_ref;
+};
+
+struct ip_sorted {
+    unsigned char sha1[20];
+    uint32_t object;
+};
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static int compare_ofs_children(const void *a, const void *b)
+{
+    uint64_t x = ((const struct ip_child *) a)->base_offset, y = ((const struct ip_child *) b)->base_offset;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_ref_children(const void *a, const void *b)
+{
+    return memcmp(((const struct ip_child *) a)->base_sha1, ((const struct ip_child *) b)->base_sha1, 20);
+}
+
+static int compare_sorted(const void *a, const void *b)
+{
+    return memcmp(((const struct ip_sorted *) a)->sha1, ((const struct ip_sorted *) b)->sha1, 20);
+}
+
+static uint32_t crc_range(const unsigned char *data, uint64_t start, uint64_t end)
+{
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uInt n;
+
+    while(start < end) {
+        n = (end - start > 0x40000000) ? 0x40000000 : end - start;
+        crc = crc32(crc, data + start, n);
+        start += n;
+    }
+    return crc;
+}
+
+// Finds the deltas based on frame->object and sets up the frame to visit them.
+static uint32_t find_children(const struct ip_state *state, struct ip_frame *frame)
+{
+    const struct ip_object *obj = &state->objects[frame->object];
+    uint32_t lo, hi, mi;
+
+    for(lo = 0, hi = state->nofs; lo < hi; ) {
+        mi = lo + (hi - lo) / 2;
+        if(state->ofs[mi].base_offset < obj->offset)
+            lo = mi + 1;
+        else
+            hi = mi;
+    }
+    frame->next_ofs = lo;
+    while(lo < state->nofs && state->ofs[lo].base_offset == obj->offset)
+        lo++;
+    frame->end_ofs = lo;
+
+    for(lo = 0, hi = state->nref; lo < hi; ) {
+        mi = lo + (hi - lo) / 2;
+        if(memcmp(state->ref[mi].base_sha1, obj->sha1, 20) < 0)
+            lo = mi + 1;
+        else
+            hi = mi;
+    }
+    frame->next_ref = lo;
+    while(lo < state->nref && memcmp(state->ref[lo].base_sha1, obj->sha1, 20) == 0)
+        lo++;
+    frame->end_ref = lo;
+
+    return (frame->end_ofs - frame->next_ofs) + (frame->end_ref - frame->next_ref);
+}
+
+// Records why indexing failed. Workers can fail at once; the first reason is
+// the one kept. Must be called without state->lock held.
+static void ip_error(struct ip_state *state, const char *fmt, ...)
+{
+    va_list ap;
+
+    pthread_mutex_lock(&state->lock);
+    if(!state->error[0]) {
+        va_start(ap, fmt);
+        vsnprintf(state->error, INDEX_PACK_ERROR_MAX, fmt, ap);
+        va_end(ap);
+    }
+    pthread_mutex_unlock(&state->lock);
+}
+
+static unsigned char *inflate_at(const struct pack *pack, uint64_t offset, uint64_t *size)
+{
+    struct pack_entry entry;
+    unsigned char *data;
+
+    if(pack_entry_header(pack, offset, &entry) != 0 || pack_inflate_entry(pack, &entry, &data, NULL) != 0)
+        return NULL;
+    *size = entry.size;
+    return data;
+}
+
+// Resolves every delta that descends from root. The stack is the worker's own
+// and is kept between trees.
+static int resolve_tree(struct ip_state *state, uint32_t root, struct ip_frame **stack, uint32_t *stack_alloc,
+                        uint32_t *resolved, uint32_t *max_depth)
+{
+    struct ip_frame *frames = *stack, *top, *grown;
+    struct ip_object *base, *obj;
+    unsigned char *delta, *data;
+    uint64_t size;
+    unsigned long result_size;
+    uint32_t depth = 0, child;
+    int ret = 0;
+
+    if(!(frames[0].data = inflate_at(state->pack, state->objects[root].offset, &size))) {
+        ip_error(state, "failed to inflate the object at offset %llu",
+                 (unsigned long long) state->objects[root].offset);
+        return -1;
+    }
+    frames[0].object = root;
+    frames[0].size = size;
+    find_children(state, &frames[0]);
+    depth = 1;
+
+    while(depth > 0) {
+        top = &frames[depth - 1];
+        if(top->next_ofs < top->end_ofs) {
+            child = state->ofs[top->next_ofs++].object;
+        } else if(top->next_ref < top->end_ref) {
+            child = state->ref[top->next_ref++].object;
+        } else {
+            free(top->data);
+            depth--;
+            continue;
+        }
+
+        // only a pack holding the same base twice can lead two workers here
+        obj = &state->objects[child];
+        if(__sync_lock_test_and_set(&obj->resolved, 1))
+            continue;
+
+        base = &state->objects[top->object];
+        data = NULL;
+        if((delta = inflate_at(state->pack, obj->offset, &size))) {
+            data = pack_apply_delta(top->data, top->size, delta, size, &result_size);
+            free(delta);
+        }
+        if(!data) {
+            ip_error(state, "failed to resolve the delta at offset %llu", (unsigned long long) obj->offset);
+            ret = -1;
+            break;
+        }
+        obj->type = base->type;
+        obj->depth = base->depth + 1;
+        hash_git_object(obj->type, data, result_size, obj->sha1);
+        (*resolved)++;
+        if(obj->depth > *max_depth)
+            *max_depth = obj->depth;
+
+        if(depth == *stack_alloc) {
+            if(!(grown = realloc(frames, sizeof(struct ip_frame) * *stack_alloc * 2))) {
+                free(data);
+                ret = -1;
+                break;
+            }
+            *stack = frames = grown;
+            *stack_alloc *= 2;
+        }
+        frames[depth].object = child;
+        frames[depth].data = data;
+        frames[depth].size = result_size;
+        if(find_children(state, &frames[depth]) > 0)
+            depth++;
+        else
+            free(data); // most deltas are leaves; don't bother stacking them
+    }
+
+    while(depth > 0)
+        free(frames[--depth].data);
+    return ret;
+}
+
+static void *resolve_worker(void *data)
+{
+    struct ip_state *state = data;
+    struct ip_frame *stack;
+    uint32_t stack_alloc = 64, root, resolved = 0, max_depth = 0;
+
+    if(!(stack = malloc(sizeof(struct ip_frame) * stack_alloc))) {
+        pthread_mutex_lock(&state->lock);
+        state->failed = 1;
+        pthread_mutex_unlock(&state->lock);
+        return NULL;
+    }
+
+    for(;;) {
+        pthread_mutex_lock(&state->lock);
+        if(state->failed || state->next_root >= state->nroots) {
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+        root = state->roots[state->next_root++];
+        pthread_mutex_unlock(&state->lock);
+
+        if(resolve_tree(state, root, &stack, &stack_alloc, &resolved, &max_depth) != 0) {
+            pthread_mutex_lock(&state->lock);
+            state->failed = 1;
+            pthread_mutex_unlock(&state->lock);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&state->lock);
+    state->resolved += resolved;
+    if(max_depth > state->max_depth)
+        state->max_depth = max_depth;
+    pthread_mutex_unlock(&state->lock);
+    free(stack);
+    return NULL;
+}
+
+// The sequential pass: walks the entries front to back, recording where each
+// one is and hashing the ones that aren't deltas.
+static int scan_pack(struct ip_state *state)
+{
+    const struct pack *pack = state->pack;
+    struct ip_object *obj;
+    struct ip_child *child;
+    struct pack_entry entry;
+    unsigned char *data;
+    uint64_t offset = 12;
+    uint32_t i;
+
+    for(i = 0; i < state->nobjects; i++) {
+        obj = &state->objects[i];
+        if(pack_entry_header(pack, offset, &entry) != 0 || pack_inflate_entry(pack, &entry, &data, &obj->end) != 0) {
+            ip_error(state, "bad entry at offset %llu", (unsigned long long) offset);
+            return -1;
+        }
+        obj->offset = offset;
+        obj->crc = crc_range(pack->data, offset, obj->end);
+        obj->depth = 0;
+
+        if(entry.type == OFS_DELTA || entry.type == REF_DELTA) {
+            child = (entry.type == OFS_DELTA) ? &state->ofs[state->nofs++] : &state->ref[state->nref++];
+            child->base_offset = entry.base_offset;
+            child->base_sha1 = entry.base_sha1;
+            child->object = i;
+            obj->type = entry.type;
+            obj->resolved = 0;
+        } else {
+            obj->type = entry.type;
+            obj->resolved = 1;
+            hash_git_object(entry.type, data, entry.size, obj->sha1);
+        }
+        free(data);
+        offset = obj->end;
+    }
+
+    if(offset != pack->size - 20) {
+        ip_error(state, "%llu bytes after the last entry", (unsigned long long) (pack->size - 20 - offset));
+        return -1;
+    }
+    return 0;
+}
+
+// Picks out the whole objects that have deltas based on them.
+static int find_roots(struct ip_state *state)
+{
+    struct ip_frame frame;
+    uint32_t i;
+
+    qsort(state->ofs, state->nofs, sizeof(struct ip_child), compare_ofs_children);
+    qsort(state->ref, state->nref, sizeof(struct ip_child), compare_ref_children);
+
+    if(!(state->roots = malloc(sizeof(uint32_t) * (state->nobjects + 1))))
+        return -1;
+    for(i = 0; i < state->nobjects; i++) {
+        frame.object = i;
+        if(state->objects[i].resolved && find_children(state, &frame) > 0)
+            state->roots[state->nroots++] = i;
+    }
+    return 0;
+}
+
+static int write_file(struct ip_state *state, const char *location, const unsigned char *data, size_t size)
+{
+    char *tmp;
+    FILE *f;
+    int ok;
+
+    // write next to it and rename, so nobody ever maps half an index
+    if(!(tmp = malloc(strlen(location) + sizeof(".tmp"))))
+        return -1;
+    sprintf(tmp, "%s.tmp", location);
+    if(!(f = fopen(tmp, "wb"))) {
+        ip_error(state, "failed to create %s", tmp);
+        free(tmp);
+        return -1;
+    }
+    ok = fwrite(data, 1, size, f) == size;
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp, location) != 0) {
+        ip_error(state, "failed to write %s", location);
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+// A version 2 idx; see map_idx() for the layout.
+static int write_idx(struct ip_state *state, const struct ip_sorted *sorted, const unsigned char *pack_checksum,
+                     const char *location)
+{
+    const struct ip_object *obj;
+    unsigned char *buf, *p, *crcs, *offsets, *large;
+    uint32_t i, nlarge = 0, fanout[256];
+    uint64_t offset;
+    size_t size;
+    int ret;
+
+    for(i = 0; i < state->nobjects; i++) {
+        if(state->objects[i].offset > 0x7fffffff)
+            nlarge++;
+    }
+    size = 8 + 4 * 256 + (size_t) state->nobjects * (20 + 4 + 4) + (size_t) nlarge * 8 + 20 + 20;
+    if(!(buf = malloc(size)))
+        return -1;
+
+    put_be32(buf, IDX_VERSION_TWO_SIG);
+    put_be32(buf + 4, 2);
+
+    memset(fanout, 0, sizeof(fanout));
+    for(i = 0; i < state->nobjects; i++)
+        fanout[sorted[i].sha1[0]]++;
+    for(i = 1; i < 256; i++)
+        fanout[i] += fanout[i - 1];
+    for(i = 0; i < 256; i++)
+        put_be32(buf + 8 + 4 * i, fanout[i]);
+
+    p = buf + 8 + 4 * 256;
+    crcs = p + (size_t) state->nobjects * 20;
+    offsets = crcs + (size_t) state->nobjects * 4;
+    large = offsets + (size_t) state->nobjects * 4;
+    nlarge = 0;
+    for(i = 0; i < state->nobjects; i++) {
+        obj = &state->objects[sorted[i].object];
+        memcpy(p + (size_t) i * 20, sorted[i].sha1, 20);
+        put_be32(crcs + (size_t) i * 4, obj->crc);
+        offset = obj->offset;
+        if(offset > 0x7fffffff) {
+            put_be32(offsets + (size_t) i * 4, 0x80000000 | nlarge);
+            put_be32(large + (size_t) nlarge * 8, offset >> 32);
+            put_be32(large + (size_t) nlarge * 8 + 4, offset & 0xffffffff);
+            nlarge++;
+        } else {
+            put_be32(offsets + (size_t) i * 4, offset);
+        }
+    }
+    p = large + (size_t) nlarge * 8;
+    memcpy(p, pack_checksum, 20);
+    sha1_buffer(buf, size - 20, p + 20);
+
+    ret = write_file(state, location, buf, size);
+    free(buf);
+    return ret;
+}
+
+// The reverse index git keeps next to a pack: for each object in pack order,
+// its position in the idx.
+static int write_rev(struct ip_state *state, const struct ip_sorted *sorted, const unsigned char *pack_checksum,
+                     const char *location)
+{
+    unsigned char *buf;
+    uint32_t i, *idx_pos;
+    size_t size = 12 + (size_t) state->nobjects * 4 + 20 + 20;
+    int ret;
+
+    if(!(idx_pos = malloc(sizeof(uint32_t) * (state->nobjects + 1))))
+        return -1;
+    if(!(buf = malloc(size))) {
+        free(idx_pos);
+        return -1;
+    }
+    for(i = 0; i < state->nobjects; i++)
+        idx_pos[sorted[i].object] = i;
+
+    memcpy(buf, "RIDX", 4);
+    put_be32(buf + 4, 1);    // version
+    put_be32(buf + 8, 1);    // hash function: sha1
+    for(i = 0; i < state->nobjects; i++)
+        put_be32(buf + 12 + (size_t) i * 4, idx_pos[i]); // objects[] is already in pack order
+    memcpy(buf + size - 40, pack_checksum, 20);
+    sha1_buffer(buf, size - 20, buf + size - 20);
+
+    ret = write_file(state, location, buf, size);
+    free(buf);
+    free(idx_pos);
+    return ret;
+}
+
+struct trailer_job {
+    const struct pack *pack;
+    int ok;
+};
+
+static void *check_trailer(void *data)
+{
+    struct trailer_job *job = data;
+    unsigned char sha1[20];
+
+    sha1_buffer(job->pack->data, job->pack->size - 20, sha1);
+    job->ok = memcmp(sha1, job->pack->data + job->pack->size - 20, 20) == 0;
+    return NULL;
+}
+
+// Finds and resolves every object in the pack. On success *threads is the
+// number of workers actually used.
+static int resolve_pack(struct ip_state *state, int *threads)
+{
+    pthread_t *workers;
+    int t;
+
+    // every entry takes at least two bytes, which bounds a lying header
+    if(state->nobjects > (state->pack->size - 12 - 20) / 2) {
+        ip_error(state, "the header claims more objects than fit in it");
+        return -1;
+    }
+    state->objects = malloc(sizeof(struct ip_object) * (state->nobjects + 1));
+    state->ofs = malloc(sizeof(struct ip_child) * (state->nobjects + 1));
+    state->ref = malloc(sizeof(struct ip_child) * (state->nobjects + 1));
+    if(!state->objects || !state->ofs || !state->ref)
+        return -1;
+
+    if(scan_pack(state) != 0 || find_roots(state) != 0)
+        return -1;
+
+    if(*threads <= 0)
+        *threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(*threads <= 0)
+        *threads = 1;
+    if((uint32_t) *threads > state->nroots)
+        *threads = state->nroots ? state->nroots : 1;
+    if(!(workers = malloc(sizeof(pthread_t) * *threads)))
+        return -1;
+    for(t = 0; t < *threads; t++) {
+        if(pthread_create(&workers[t], NULL, resolve_worker, state) != 0) {
+            resolve_worker(state);
+            workers[t] = pthread_self();
+        }
+    }
+    for(t = 0; t < *threads; t++) {
+        if(!pthread_equal(workers[t], pthread_self()))
+            pthread_join(workers[t], NULL);
+    }
+    free(workers);
+
+    if(state->failed)
+        return -1;
+    if(state->resolved != state->nofs + state->nref) {
+        ip_error(state, "%u deltas have no base in the pack", state->nofs + state->nref - state->resolved);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_index(struct ip_state *state, const char *idx_location, const char *rev_location)
+{
+    const unsigned char *pack_checksum = state->pack->data + state->pack->size - 20;
+    struct ip_sorted *sorted;
+    uint32_t i;
+    int ret;
+
+    if(!(sorted = malloc(sizeof(struct ip_sorted) * (state->nobjects + 1))))
+        return -1;
+    for(i = 0; i < state->nobjects; i++) {
+        memcpy(sorted[i].sha1, state->objects[i].sha1, 20);
+        sorted[i].object = i;
+    }
+    qsort(sorted, state->nobjects, sizeof(struct ip_sorted), compare_sorted);
+
+    ret = write_idx(state, sorted, pack_checksum, idx_location);
+    if(ret == 0 && rev_location)
+        ret = write_rev(state, sorted, pack_checksum, rev_location);
+    free(sorted);
+    return ret;
+}
+
+// Writes a version 2 idx for the pack at pack_location to idx_location (NULL
+// means next to the pack) and, if rev_location isn't NULL, a reverse index
+// there. Deltas are resolved by up to threads workers (0 means one per CPU).
+// Thin packs, whose deltas refer to objects outside the pack, can't be
+// indexed. Returns 0 on success and -1 on failure, with the reason in
+// result->error.
+int index_pack(char *pack_location, const char *idx_location, const char *rev_location,
+               int threads, struct index_pack_result *result)
+{
+    struct ip_state state;
+    struct trailer_job trailer;
+    struct pack *pack;
+    pthread_t trailer_thread;
+    char *default_idx = NULL;
+    uint64_t start = stats_now_ns();
+    int ret;
+
+    memset(result, 0, sizeof(struct index_pack_result));
+    memset(&state, 0, sizeof(struct ip_state));
+
+    if(!idx_location && !(idx_location = default_idx = pack_idx_location(pack_location))) {
+        snprintf(result->error, INDEX_PACK_ERROR_MAX, "%s doesn't end in .pack", pack_location);
+        return -1;
+    }
+    if(!(pack = load_pack(pack_location))) {
+        snprintf(result->error, INDEX_PACK_ERROR_MAX, "%s can't be opened or isn't a pack", pack_location);
+        free(default_idx);
+        return -1;
+    }
+    state.pack = pack;
+    state.nobjects = pack->entries;
+    state.error = result->error;
+    pthread_mutex_init(&state.lock, NULL);
+
+    // the checksum needs a pass of its own; overlap it with everything else
+    trailer.pack = pack;
+    trailer.ok = 0;
+    if(pthread_create(&trailer_thread, NULL, check_trailer, &trailer) == 0) {
+        ret = resolve_pack(&state, &threads);
+        pthread_join(trailer_thread, NULL);
+    } else {
+        check_trailer(&trailer);
+        ret = resolve_pack(&state, &threads);
+    }
+
+    if(ret == 0 && !trailer.ok) {
+        ip_error(&state, "its checksum doesn't match its contents");
+        ret = -1;
+    }
+    if(ret == 0)
+        ret = write_index(&state, idx_location, rev_location);
+
+    // the failures that don't say why are all allocations
+    if(ret != 0 && !result->error[0])
+        snprintf(result->error, INDEX_PACK_ERROR_MAX, "out of memory");
+    if(ret == 0) {
+        result->objects = state.nobjects;
+        result->deltas = state.resolved;
+        result->max_depth = state.max_depth;
+        result->threads = threads;
+        memcpy(result->pack_checksum, pack->data + pack->size - 20, 20);
+    }
+    result->seconds = (stats_now_ns() - start) / 1e9;
+
+    pthread_mutex_destroy(&state.lock);
+    free(state.roots);
+    free(state.objects);
+    free(state.ofs);
+    free(state.ref);
+    free(default_idx);
+    unload_pack(pack);
+    return ret;
+}
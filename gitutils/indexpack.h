@@ -0,0 +1,22 @@
+#ifndef INDEXPACK_H
+#define INDEXPACK_H
+
+#include <stdint.h>
+
+#define INDEX_PACK_ERROR_MAX 256
+
+struct index_pack_result {
+    uint32_t objects;
+    uint32_t deltas;
+    uint32_t max_depth;     // longest delta chain
+    int threads;
+    double seconds;
+    unsigned char pack_checksum[20];
+    char error[INDEX_PACK_ERROR_MAX]; // why it failed, if it did
+};
+
+int index_pack(char *pack_location, const char *idx_location, const char *rev_location,
+               int threads, struct index_pack_result *result);
+
+
+#endif
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "commit.h"
+#include "tree.h"
+#include "stats.h"
+#include "lastmod.h"
+
+// Finds the last commit to change each entry of a directory in one walk back
+// through first parents, the history Git.rev_list(path=...) follows. Only the
+// directory's own tree id is compared from commit to commit; its tree is
+// read, and the entries still unresolved checked against it, only when that
+// id changes. The walk stops once every entry is resolved.
+
+// Orders tree entries the way git does: by name, with trees sorting as if
+// their names ended in '/'. Both names must be followed by a NUL, as they are
+// in tree data.
+static int entry_cmp(const char *a, size_t a_len, unsigned int a_mode,
+                     const char *b, size_t b_len, unsigned int b_mode)
+{
+    unsigned char ca, cb;
+    size_t len = a_len < b_len ? a_len : b_len;
+    int cmp;
+
+    if((cmp = memcmp(a, b, len)))
+        return cmp;
+    ca = a[len];
+    cb = b[len];
+    if(!ca && a_mode == S_IFTREE)
+        ca = '/';
+    if(!cb && b_mode == S_IFTREE)
+        cb = '/';
+    return (ca < cb) ? -1 : (ca > cb) ? 1 : 0;
+}
+
+static int read_commit(const struct odb *odb, struct base_cache *cache, const unsigned char *sha1,
+                       unsigned char *tree, unsigned char *parent, int *has_parent)
+{
+    struct git_object g_obj;
+    struct commit commit;
+    int ret = -1;
+
+    if(odb_read(odb, sha1, &g_obj, cache) != 0)
+        return -1;
+    if(g_obj.type == COMMIT && commit_parse(g_obj.mem_data, g_obj.size, &commit) == 0) {
+        memcpy(tree, commit.tree, 20);
+        *has_parent = (commit_parent(&commit, 0, parent) == 0);
+        ret = 0;
+    }
+    free(g_obj.mem_data);
+    return ret;
+}
+
+// Checks the pending entries against the directory as the parent had it
+// (data is NULL if it had none). Whatever differs was last changed by child.
+static int settle(struct lastmod *lm, uint32_t *pending, uint32_t *npending,
+                  const unsigned char *data, unsigned long size, const unsigned char *child)
+{
+    struct lastmod_entry *e;
+    unsigned long pos = 0;
+    unsigned int mode = 0;
+    const char *name = NULL;
+    size_t name_len = 0;
+    const unsigned char *sha1 = NULL;
+    int have = 0, cmp;
+    uint32_t i, kept = 0;
+
+    if(data && pos < size) {
+        if(tree_next_entry(data, size, &pos, &mode, &name, &name_len, &sha1) != 0)
+            return -1;
+        have = 1;
+    }
+
+    // both lists are in tree order, so one pass over each will do
+    for(i = 0; i < *npending; i++) {
+        e = &lm->entries[pending[i]];
+        cmp = -1;
+        while(have && (cmp = entry_cmp(name, name_len, mode, e->name, e->name_len, e->mode)) < 0) {
+            if(pos >= size) {
+                have = 0;
+                break;
+            }
+            if(tree_next_entry(data, size, &pos, &mode, &name, &name_len, &sha1) != 0)
+                return -1;
+        }
+        if(have && cmp == 0 && mode == e->mode && memcmp(sha1, e->sha1, 20) == 0) {
+            pending[kept++] = pending[i];
+            continue;
+        }
+        e->resolved = 1;
+        memcpy(e->commit, child, 20);
+    }
+    *npending = kept;
+    return 0;
+}
+
+static int walk_back(struct lastmod *lm, const struct odb *odb, struct tree_resolver *paths,
+                     struct base_cache *cache, const unsigned char *start, const unsigned char *start_dir,
+                     int has_parent, const unsigned char *first_parent, const char *dir,
+                     uint64_t deadline, uint32_t *pending, uint32_t *npending)
+{
+    unsigned char child[20], child_dir[20], parent[20], tree[20], parent_dir[20], next[20];
+    struct git_object g_obj;
+    unsigned int mode;
+    int ret, next_has_parent;
+
+    memcpy(child, start, 20);
+    memcpy(child_dir, start_dir, 20);
+    memcpy(parent, first_parent, 20);
+
+    while(*npending) {
+        if(deadline && stats_now_ns() > deadline)
+            return 0;
+        if(!has_parent) // whatever is left came in with the root commit
+            return settle(lm, pending, npending, NULL, 0, child);
+
+        if(read_commit(odb, cache, parent, tree, next, &next_has_parent) != 0)
+            return -1;
+        if((ret = tree_lookup_path(paths, odb, tree, dir, cache, &mode, parent_dir)) < 0)
+            return -1;
+
+        if(ret > 0 || mode != S_IFTREE) {
+            if(settle(lm, pending, npending, NULL, 0, child) != 0)
+                return -1;
+        } else if(memcmp(parent_dir, child_dir, 20) != 0) {
+            if(odb_read(odb, parent_dir, &g_obj, cache) != 0)
+                return -1;
+            ret = (g_obj.type == TREE) ? settle(lm, pending, npending, g_obj.mem_data, g_obj.size, child) : -1;
+            free(g_obj.mem_data);
+            if(ret != 0)
+                return -1;
+        }
+
+        memcpy(child, parent, 20);
+        memcpy(child_dir, parent_dir, 20);
+        memcpy(parent, next, 20);
+        has_parent = next_has_parent;
+    }
+    return 0;
+}
+
+// Lists the directory at dir ("" for the root) as of commit, with the last
+// commit to change each entry. paths remembers the lookups of dir in every
+// commit's tree, so asking again (or about a neighbouring directory) is
+// cheap. With budget_ms > 0, gives up after that long and leaves the rest
+// unresolved. Returns 0 when everything was resolved, 1 if the time ran out
+// first, 2 if there's no directory at dir, and -1 on errors. Release lm in
+// any case.
+int lastmod_dir(const struct odb *odb, struct tree_resolver *paths, const unsigned char *commit,
+                const char *dir, int budget_ms, struct lastmod *lm)
+{
+    unsigned char tree[20], dir_sha1[20], parent[20];
+    struct base_cache *cache;
+    struct git_object g_obj;
+    struct lastmod_entry *e;
+    unsigned long pos;
+    unsigned int mode;
+    const char *name;
+    size_t name_len;
+    const unsigned char *sha1;
+    uint32_t *pending, npending, i;
+    uint64_t deadline = 0;
+    int has_parent, ret;
+
+    memset(lm, 0, sizeof(*lm));
+    if(budget_ms > 0)
+        deadline = stats_now_ns() + (uint64_t) budget_ms * 1000000;
+    if(!(cache = base_cache_new(LASTMOD_CACHE_BYTES)))
+        return -1;
+
+    if(read_commit(odb, cache, commit, tree, parent, &has_parent) != 0 ||
+       (ret = tree_lookup_path(paths, odb, tree, dir, cache, &mode, dir_sha1)) < 0) {
+        base_cache_free(cache);
+        return -1;
+    }
+    if(ret > 0 || mode != S_IFTREE) {
+        base_cache_free(cache);
+        return 2;
+    }
+    if(odb_read(odb, dir_sha1, &g_obj, cache) != 0 || g_obj.type != TREE) {
+        free(g_obj.mem_data);
+        base_cache_free(cache);
+        return -1;
+    }
+    lm->tree_data = g_obj.mem_data;
+    lm->tree_size = g_obj.size;
+
+    // one pass to count the entries, another to fill them in
+    for(pos = 0; pos < lm->tree_size; lm->count++) {
+        if(tree_next_entry(lm->tree_data, lm->tree_size, &pos, &mode, &name, &name_len, &sha1) != 0) {
+            base_cache_free(cache);
+            return -1;
+        }
+    }
+    lm->entries = calloc(lm->count ? lm->count : 1, sizeof(struct lastmod_entry));
+    pending = malloc(sizeof(uint32_t) * (lm->count ? lm->count : 1));
+    if(!lm->entries || !pending) {
+        free(pending);
+        base_cache_free(cache);
+        return -1;
+    }
+    for(pos = 0, i = 0; i < lm->count; i++) {
+        e = &lm->entries[i];
+        tree_next_entry(lm->tree_data, lm->tree_size, &pos, &e->mode, &e->name, &e->name_len, &sha1);
+        memcpy(e->sha1, sha1, 20);
+        pending[i] = i;
+    }
+    npending = lm->count;
+
+    ret = walk_back(lm, odb, paths, cache, commit, dir_sha1, has_parent, parent, dir, deadline,
+                    pending, &npending);
+    free(pending);
+    base_cache_free(cache);
+    if(ret != 0)
+        return -1;
+    lm->unresolved = npending;
+    return npending ? 1 : 0;
+}
+
+void lastmod_release(struct lastmod *lm)
+{
+    free(lm->tree_data);
+    free(lm->entries);
+    memset(lm, 0, sizeof(*lm));
+}
@@ -0,0 +1,36 @@
+#ifndef LASTMOD_H
+#define LASTMOD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct tree_resolver;
+
+#define LASTMOD_CACHE_BYTES (16 << 20)
+
+struct lastmod_entry {
+    const char *name;            // points into the directory's tree data
+    size_t name_len;
+    unsigned int mode;
+    unsigned char sha1[20];
+    int resolved;                // 0 if the time ran out first
+    unsigned char commit[20];    // the last commit that changed it
+};
+
+// Every entry of a directory, as of the commit the walk started at, with the
+// commit that last changed each one.
+struct lastmod {
+    unsigned char *tree_data;
+    unsigned long tree_size;
+    struct lastmod_entry *entries;
+    uint32_t count;
+    uint32_t unresolved;
+};
+
+int lastmod_dir(const struct odb *odb, struct tree_resolver *paths, const unsigned char *commit,
+                const char *dir, int budget_ms, struct lastmod *lm);
+void lastmod_release(struct lastmod *lm);
+
+
+#endif
@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -11,6 +13,9 @@
 
 #include "libgitread.h"
 #include "filecache.h"
+#include "basecache.h"
+#include "sha1.h"
+#include "stats.h"
 
 #define CHUNKSIZE (1024*4)
 
@@ -74,6 +79,23 @@ int get_sha1_hex(const char *hex, unsigned char *sha1)
 	return 0;
 }
 
+// Parses exactly 40 hex digits, with no regard for what follows them, so it
+// is safe to point into the middle of a commit or tag.
+int hex_to_sha1(const char *hex, unsigned char *sha1)
+{
+    unsigned int val;
+    int i;
+
+    for(i = 0; i < 20; i++) {
+        val = (hexval(hex[0]) << 4) | hexval(hex[1]);
+        if(val & ~0xff)
+            return -1;
+        sha1[i] = val;
+        hex += 2;
+    }
+    return 0;
+}
+
 // Taken directly from sha1_file.c from git v 1.5.5
 //
 // This uses a funky buffer/cache thing which could be removed,
@@ -96,6 +118,83 @@ char * sha1_to_hex(const unsigned char * sha1)
 	return buffer;
 }
 
+const char *object_type_name(unsigned int type)
+{
+    static const char *names[] = { NULL, "commit", "tree", "blob", "tag" };
+
+    if(type < COMMIT || type > TAG)
+        return NULL;
+    return names[type];
+}
+
+// Computes an object's id: the sha1 of "<type> <size>\0" followed by the data.
+int hash_git_object(unsigned int type, const unsigned char *data, unsigned long size, unsigned char *sha1)
+{
+    struct sha1_ctx ctx;
+    char hdr[32];
+    int hdr_len;
+
+    if(!object_type_name(type))
+        return -1;
+    hdr_len = sprintf(hdr, "%s %lu", object_type_name(type), size) + 1;
+    sha1_init(&ctx);
+    sha1_update(&ctx, hdr, hdr_len);
+    sha1_update(&ctx, data, size);
+    sha1_final(sha1, &ctx);
+    return 0;
+}
+
+// Checks that an object read for sha1 really is that object. Returns 0, or
+// GITREAD_CORRUPT if its data doesn't hash to the id.
+int check_object_hash(const unsigned char *sha1, unsigned int type, const unsigned char *data, unsigned long size)
+{
+    uint64_t start = STATS_START();
+    unsigned char actual[20];
+    int bad;
+
+    bad = hash_git_object(type, data, size, actual) != 0 || memcmp(actual, sha1, 20) != 0;
+    STATS_VERIFY(size, start, bad);
+    return bad ? GITREAD_CORRUPT : 0;
+}
+
+// Reads one tree entry at *pos, moving *pos past it. Tree data comes
+// straight off disk, so nothing about it is trusted.
+int tree_next_entry(const unsigned char *data, unsigned long size, unsigned long *pos,
+                    unsigned int *mode, const char **name, size_t *name_len, const unsigned char **sha1)
+{
+    const unsigned char *p = data + *pos, *end = data + size, *nul;
+    unsigned int m = 0;
+
+    if(p >= end)
+        return -1;
+    while(p < end && *p >= '0' && *p <= '7')
+        m = (m << 3) | (*p++ - '0');
+    if(p >= end || *p++ != ' ')
+        return -1;
+    if(!(nul = memchr(p, '\0', end - p)) || nul == p || end - nul < 21)
+        return -1;
+
+    *mode = m;
+    *name = (const char *) p;
+    *name_len = nul - p;
+    *sha1 = nul + 1;
+    *pos = (nul + 21) - data;
+    return 0;
+}
+
+// Finds "<field> <40 hex digits>\n" at *p, moving *p past it.
+int parse_header_sha1(const unsigned char **p, const unsigned char *end, const char *field, unsigned char *sha1)
+{
+    size_t len = strlen(field);
+
+    if(end - *p < (long) len + 42 || memcmp(*p, field, len) != 0 || (*p)[len] != ' ' || (*p)[len + 41] != '\n')
+        return -1;
+    if(hex_to_sha1((const char *) *p + len + 1, sha1) != 0)
+        return -1;
+    *p += len + 42;
+    return 0;
+}
+
 // Taken from patch-delta.c from git v 1.5.5 with some small changes.
 void *patch_delta(const void *src_buf, unsigned long src_size,
 		  const void *delta_buf, unsigned long delta_size,
@@ -103,24 +202,38 @@ void *patch_delta(const void *src_buf, unsigned long src_size,
 {
 	const unsigned char *data, *top;
 	unsigned char *dst_buf, *out, cmd;
-	unsigned long size;
-
-	if (delta_size < DELTA_SIZE_MIN)
-		return NULL;
+	unsigned long size, max_op;
 
+	// The two size headers have already been stripped off by the caller, so
+	// DELTA_SIZE_MIN is checked there; a lone copy op can be just two bytes.
 	data = delta_buf;
 	top = (const unsigned char *) delta_buf + delta_size;
 
     size = dst_size;
 
-	dst_buf = malloc(size + 1);
-	dst_buf[size] = 0; // what is with this??
+	// dst_size comes from the pack, which may not be trustworthy, so one the
+	// ops couldn't add up to is refused before anything is allocated. Each
+	// op takes at least a byte of the delta: a copy gives at most 0xffffff
+	// bytes and no more than the whole source, an insert less than a byte
+	// per byte.
+	max_op = src_size < 0xffffff ? src_size : 0xffffff;
+	if (max_op == 0)
+		max_op = 1;
+	if (size / max_op > delta_size)
+		return NULL;
+
+	if (!(dst_buf = malloc(size + 1)))
+		return NULL;
+	dst_buf[size] = 0; // so a result can be used as a string
 
 	out = dst_buf;
 	while (data < top) {
 		cmd = *data++;
 		if (cmd & 0x80) {
 			unsigned long cp_off = 0, cp_size = 0;
+			// the offset and size bytes have to be there
+			if (__builtin_popcount(cmd & 0x7f) > top - data)
+				break;
 			if (cmd & 0x01) cp_off = *data++;
 			if (cmd & 0x02) cp_off |= (*data++ << 8);
 			if (cmd & 0x04) cp_off |= (*data++ << 16);
@@ -137,7 +250,7 @@ void *patch_delta(const void *src_buf, unsigned long src_size,
 			out += cp_size;
 			size -= cp_size;
 		} else if (cmd) {
-			if (cmd > size)
+			if (cmd > size || cmd > top - data)
 				break;
 			memcpy(out, data, cmd);
 			out += cmd;
@@ -170,19 +283,23 @@ void *patch_delta(const void *src_buf, unsigned long src_size,
 // with file pointers instead of data buffers.
 //
 // This must be called twice on the delta pack entry: first to get the
-// expected source size, and again to get the target size.
-static inline unsigned int get_delta_hdr_size(unsigned char **datap)//FILE *pack_fp)
+// expected source size, and again to get the target size. *datap is set to
+// NULL if the header runs past end or doesn't fit in 64 bits.
+static inline uint64_t get_delta_hdr_size(unsigned char **datap, const unsigned char *end)
 {
     unsigned char *data = *datap;
 	unsigned char cmd;
-	unsigned int size = 0;
+	uint64_t size = 0;
 	int i = 0;
 	do {
-        //fread(&cmd, 1, 1, pack_fp);
+        if (data >= end || i > 63) {
+            *datap = NULL;
+            return 0;
+        }
         cmd = *data++;
-		size |= (cmd & ~0x80) << i;
+		size |= (uint64_t) (cmd & ~0x80) << i;
 		i += 7;
-    } while (cmd & 0x80); // && data < top);
+    } while (cmd & 0x80);
     *datap = data;
 	return size;
 }
@@ -209,7 +326,10 @@ static inline unsigned int get_delta_hdr_size(unsigned char **datap)//FILE *pack
 //
 // ! There's a LOT of common code between this and loose_get_object; probably should
 // do some refactoring to combine common parts later.
-int pack_get_object(char * location, unsigned int offset, struct git_object * g_obj, int full)
+//
+// depth is bumped once per delta level on the way down, so the caller ends up
+// with the length of the chain it just resolved.
+static int pack_unpack_object(char * location, unsigned int offset, struct git_object * g_obj, int full, unsigned int *depth)
 {
     FILE *pack_fp = NULL, *delta_fp = NULL;
     z_stream zst;
@@ -221,7 +341,7 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
     int status;
     int amount_read = 0;
     unsigned int size = 0, type = 0, shift;
-    unsigned int base_size = 0, result_size = 0; // used for deltas
+    uint64_t base_size = 0, result_size = 0; // used for deltas
     unsigned char byte;
     
     int i;
@@ -298,7 +418,8 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
         }
         
         // get the base object
-        if(pack_get_object(location, base_idx->offset, &base_object, 1) != 0) {
+        (*depth)++;
+        if(pack_unpack_object(location, base_idx->offset, &base_object, 1, depth) != 0) {
             free(base_idx);
             util_close_file_cached(pack_fp);
             return -1;
@@ -321,7 +442,8 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
 
         // get the base object
         //printf("#### getting a delta\n");
-        if(pack_get_object(location, pack_offset, &base_object, 1) != 0) {
+        (*depth)++;
+        if(pack_unpack_object(location, pack_offset, &base_object, 1, depth) != 0) {
             printf("!!!! failed to get the base object for a OFS_DELTA\n");
             free(g_obj->mem_data);
             g_obj->mem_data = NULL;
@@ -394,6 +516,8 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
             }*/
         } while(zst.avail_out == 0 && status != Z_STREAM_END);
     } while (status != Z_STREAM_END);
+    STATS_ADD(bytes_read[STATS_PACKED], zst.total_in);
+    STATS_ADD(bytes_inflated[STATS_PACKED], zst.total_out);
     inflateEnd(&zst);
     util_close_file_cached(pack_fp);
 
@@ -401,10 +525,23 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
 
     if(type == REF_DELTA || type == OFS_DELTA) {
         //fseek(g_obj->data, 0, SEEK_SET);
+        if(size < DELTA_SIZE_MIN) {
+            free(g_obj->mem_data);
+            free(base_object.mem_data);
+            g_obj->mem_data = NULL;
+            return -1;
+        }
         
         // have to get these two sizes before decompression
-        base_size = get_delta_hdr_size(&obj_data);
-        result_size = get_delta_hdr_size(&obj_data);
+        base_size = get_delta_hdr_size(&obj_data, g_obj->mem_data + size);
+        if(obj_data)
+            result_size = get_delta_hdr_size(&obj_data, g_obj->mem_data + size);
+        if(!obj_data) {
+            free(g_obj->mem_data);
+            free(base_object.mem_data);
+            g_obj->mem_data = NULL;
+            return -1;
+        }
         
         // needed 'since those two hdr_sizes are included in the delta size
         size -= obj_data - g_obj->mem_data;//ftell(g_obj->data);
@@ -462,6 +599,498 @@ int pack_get_object(char * location, unsigned int offset, struct git_object * g_
     return 0;
 }
 
+int pack_get_object(char * location, unsigned int offset, struct git_object * g_obj, int full)
+{
+    uint64_t start = STATS_START();
+    unsigned int depth = 0;
+    int ret;
+
+    ret = pack_unpack_object(location, offset, g_obj, full, &depth);
+    if(ret == 0) {
+        STATS_INC(objects[STATS_PACKED][g_obj->type & 7]);
+        STATS_DELTA_DEPTH(depth);
+    }
+    STATS_END(STATS_OP_PACK_GET_OBJECT, start, ret != 0);
+    return ret;
+}
+
+/////////////////////////////////////////////////////////////////////
+// mmap'd packs                                                    //
+//                                                                 //
+// pack_get_object() above streams through a shared FILE *, which  //
+// is fine for one caller at a time. Everything below works on an  //
+// mmap of the whole pack, never seeks, and keeps no state outside //
+// of its arguments, so any number of threads can read one pack at //
+// once.                                                           //
+/////////////////////////////////////////////////////////////////////
+
+void unload_pack(struct pack *pack)
+{
+    if(!pack)
+        return;
+
+    if(pack->data)
+        munmap(pack->data, pack->size);
+
+    free(pack->location);
+    free(pack);
+}
+
+// Maps a pack and checks its header. Returns NULL, without saying why, if it
+// can't be opened or isn't a version 2 or 3 pack; callers that serve requests
+// meet half-written packs routinely and mustn't print.
+struct pack * load_pack(char *location)
+{
+    int pack_fd;
+    struct stat pack_st;
+    struct pack *pack;
+    void *raw_pack_data;
+    uint32_t *hdr;
+
+    if((pack_fd = open(location, O_RDONLY)) < 0)
+        return NULL;
+    if(fstat(pack_fd, &pack_st)) {
+        close(pack_fd);
+        return NULL;
+    }
+    if((size_t) pack_st.st_size < 12 + 20) { // header + checksum
+        close(pack_fd);
+        return NULL;
+    }
+
+    raw_pack_data = mmap(NULL, pack_st.st_size, PROT_READ, MAP_PRIVATE, pack_fd, 0);
+    close(pack_fd);
+    if(raw_pack_data == MAP_FAILED)
+        return NULL;
+
+    hdr = raw_pack_data;
+    if(memcmp(raw_pack_data, "PACK", 4) != 0 || (ntohl(hdr[1]) != 2 && ntohl(hdr[1]) != 3)) {
+        munmap(raw_pack_data, pack_st.st_size);
+        return NULL;
+    }
+
+    if(!(pack = malloc(sizeof(struct pack)))) {
+        munmap(raw_pack_data, pack_st.st_size);
+        return NULL;
+    }
+    if(!(pack->location = malloc(strlen(location) + 1))) {
+        free(pack);
+        munmap(raw_pack_data, pack_st.st_size);
+        return NULL;
+    }
+    memcpy(pack->location, location, strlen(location) + 1);
+    pack->data = raw_pack_data;
+    pack->size = pack_st.st_size;
+    pack->entries = ntohl(hdr[2]);
+
+    return pack;
+}
+
+// Decodes the entry header at offset; see pack_get_object() for the format.
+// Entries never extend into the trailing checksum.
+int pack_entry_header(const struct pack *pack, uint64_t offset, struct pack_entry *entry)
+{
+    const unsigned char *data = pack->data;
+    uint64_t end = pack->size - 20, size, base;
+    unsigned int shift;
+    unsigned char byte;
+
+    if(offset < 12 || offset >= end)
+        return -1;
+
+    entry->offset = offset;
+    byte = data[offset++];
+    entry->type = (byte >> 4) & 7;
+    size = byte & 0xf;
+    shift = 4;
+    while(byte & 0x80) {
+        if(offset >= end || shift > 57)
+            return -1;
+        byte = data[offset++];
+        size += (uint64_t) (byte & 0x7f) << shift;
+        shift += 7;
+    }
+    entry->size = size;
+    entry->base_offset = 0;
+    entry->base_sha1 = NULL;
+
+    if(entry->type == OFS_DELTA) {
+        if(offset >= end)
+            return -1;
+        byte = data[offset++];
+        base = byte & 0x7f;
+        while(byte & 0x80) {
+            if(offset >= end || base >> 56)
+                return -1;
+            byte = data[offset++];
+            base = ((base + 1) << 7) + (byte & 0x7f);
+        }
+        if(base == 0 || base > entry->offset)
+            return -1;
+        entry->base_offset = entry->offset - base;
+    } else if(entry->type == REF_DELTA) {
+        if(offset + 20 > end)
+            return -1;
+        entry->base_sha1 = data + offset;
+        offset += 20;
+    } else if(entry->type < COMMIT || entry->type > TAG) {
+        return -1;
+    }
+
+    entry->data_offset = offset;
+    return 0;
+}
+
+// Inflates the entry's zlib stream into a new buffer of entry->size bytes
+// (plus a terminating \0 that isn't counted). If end isn't NULL it is set to
+// the offset just past the compressed data, i.e. where the next entry starts.
+int pack_inflate_entry(const struct pack *pack, const struct pack_entry *entry, unsigned char **out, uint64_t *end)
+{
+    z_stream zst;
+    unsigned char *buf;
+    uint64_t avail = pack->size - 20 - entry->data_offset;
+    int status;
+
+    *out = NULL;
+    if(!(buf = malloc(entry->size + 1)))
+        return -1;
+
+    zst.zalloc = Z_NULL;
+    zst.zfree = Z_NULL;
+    zst.opaque = Z_NULL;
+    zst.next_in = pack->data + entry->data_offset;
+    zst.avail_in = (avail > 0x7fffffff) ? 0x7fffffff : avail;
+    if(inflateInit(&zst) != Z_OK) {
+        free(buf);
+        return -1;
+    }
+    zst.next_out = buf;
+    zst.avail_out = entry->size + 1; // room for one byte too many so we notice bad sizes
+
+    for(;;) {
+        status = inflate(&zst, Z_FINISH);
+        if(status == Z_BUF_ERROR && zst.avail_in == 0 && avail > zst.total_in) {
+            // more than 2GB of compressed input; feed the next slice
+            uint64_t left = avail - zst.total_in;
+            zst.avail_in = (left > 0x7fffffff) ? 0x7fffffff : left;
+            continue;
+        }
+        break;
+    }
+
+    if(status != Z_STREAM_END || zst.total_out != entry->size) {
+        inflateEnd(&zst);
+        free(buf);
+        return -1;
+    }
+    STATS_ADD(bytes_read[STATS_PACKED], zst.total_in);
+    STATS_ADD(bytes_inflated[STATS_PACKED], zst.total_out);
+    if(end)
+        *end = entry->data_offset + zst.total_in;
+    inflateEnd(&zst);
+
+    buf[entry->size] = '\0';
+    *out = buf;
+    return 0;
+}
+
+// Applies an inflated delta (size headers included) to base. Returns the new
+// buffer, \0 terminated, with its length in *result_size.
+unsigned char *pack_apply_delta(const unsigned char *base, unsigned long base_size,
+                                const unsigned char *delta, unsigned long delta_size,
+                                unsigned long *result_size)
+{
+    unsigned char *ops = (unsigned char *) delta, *end = ops + delta_size;
+    uint64_t expected_base, size;
+
+    if(delta_size < DELTA_SIZE_MIN)
+        return NULL;
+    expected_base = get_delta_hdr_size(&ops, end);
+    if(!ops || expected_base != base_size)
+        return NULL;
+    size = get_delta_hdr_size(&ops, end);
+    if(!ops || size != (unsigned long) size)
+        return NULL;
+    *result_size = size;
+    return patch_delta(base, base_size, ops, end - ops, *result_size);
+}
+
+// Gets the size of the object at offset without reading it. A delta's result
+// size is in its first few bytes, so only those are inflated.
+int pack_object_size(const struct pack *pack, uint64_t offset, uint64_t *size)
+{
+    struct pack_entry entry;
+    unsigned char head[20];
+    z_stream zst;
+    uint64_t avail, value;
+    unsigned int i, have, shift, n;
+    int status;
+
+    if(pack_entry_header(pack, offset, &entry) != 0)
+        return -1;
+    if(entry.type != OFS_DELTA && entry.type != REF_DELTA) {
+        *size = entry.size;
+        return 0;
+    }
+
+    avail = pack->size - 20 - entry.data_offset;
+    memset(&zst, 0, sizeof(zst));
+    zst.next_in = pack->data + entry.data_offset;
+    zst.avail_in = (avail > 0x7fffffff) ? 0x7fffffff : avail;
+    zst.next_out = head;
+    zst.avail_out = sizeof(head);
+    if(inflateInit(&zst) != Z_OK)
+        return -1;
+    status = inflate(&zst, Z_SYNC_FLUSH);
+    have = sizeof(head) - zst.avail_out;
+    inflateEnd(&zst);
+    if(status != Z_OK && status != Z_STREAM_END)
+        return -1;
+
+    // the base's size, then the result's
+    for(i = 0, n = 0; n < 2; n++) {
+        value = 0;
+        shift = 0;
+        do {
+            if(i >= have || shift > 63)
+                return -1;
+            value |= (uint64_t) (head[i] & 0x7f) << shift;
+            shift += 7;
+        } while(head[i++] & 0x80);
+    }
+    *size = value;
+    return 0;
+}
+
+// Reads the object at offset out of an mmap'd pack, resolving delta chains.
+// REF_DELTA bases are looked up in idx, which may be NULL for packs that only
+// use OFS_DELTA.
+//
+// With a cache, every intermediate base is remembered and the chain walk stops
+// at the first base already there. The object itself is only added when
+// cache_result is set, since most objects are never anyone's base. The cache
+// may be a shared one (see basecache.h).
+int pack_read_object(const struct pack *pack, const struct idx *idx, uint64_t offset,
+                     struct git_object *g_obj, struct base_cache *cache, int cache_result)
+{
+    uint64_t chain_static[64], *chain = chain_static, *grown;
+    unsigned int depth = 0, chain_length, chain_alloc = 64;
+    struct pack_entry entry;
+    struct base_cache_entry *hit, *held = NULL; // held backs base while base_cached
+    unsigned char *base = NULL, *delta, *result;
+    unsigned long base_size = 0, result_size;
+    unsigned int type = 0;
+    int base_cached = 0, ret = -1;
+    uint64_t cur = offset, start = STATS_START();
+    uint32_t pos;
+
+    g_obj->size = 0;
+    g_obj->type = UKNOWNTYPE;
+    g_obj->data = NULL;
+    g_obj->mem_data = NULL;
+
+    // walk down the chain until we hit something we don't need a delta for
+    for(;;) {
+        if(cache && (hit = base_cache_get(cache, pack, cur))) {
+            base = hit->data;
+            base_size = hit->size;
+            type = hit->type;
+            base_cached = 1;
+            held = hit;
+            break;
+        }
+        if(pack_entry_header(pack, cur, &entry) != 0)
+            goto out;
+        if(entry.type != OFS_DELTA && entry.type != REF_DELTA) {
+            if(pack_inflate_entry(pack, &entry, &base, NULL) != 0)
+                goto out;
+            base_size = entry.size;
+            type = entry.type;
+            break;
+        }
+
+        if(depth == chain_alloc) {
+            if(depth >= PACK_MAX_DELTA_CHAIN)
+                goto out;
+            if(!(grown = malloc(sizeof(uint64_t) * chain_alloc * 2)))
+                goto out;
+            memcpy(grown, chain, sizeof(uint64_t) * depth);
+            if(chain != chain_static)
+                free(chain);
+            chain = grown;
+            chain_alloc *= 2;
+        }
+        chain[depth++] = cur;
+
+        if(entry.type == OFS_DELTA) {
+            cur = entry.base_offset;
+        } else {
+            if(!idx || idx_find(idx, entry.base_sha1, &pos) != 0)
+                goto out;
+            cur = idx_offset(idx, pos);
+        }
+    }
+
+    // now back up it, applying each delta to the result of the one below
+    chain_length = depth;
+    while(depth > 0) {
+        cur = chain[--depth];
+        if(pack_entry_header(pack, cur, &entry) != 0 || pack_inflate_entry(pack, &entry, &delta, NULL) != 0)
+            goto out;
+        result = pack_apply_delta(base, base_size, delta, entry.size, &result_size);
+        free(delta);
+        if(!base_cached)
+            free(base);
+        else
+            base_cache_release(cache, held);
+        base = NULL;
+        held = NULL;
+        if(!result)
+            goto out;
+
+        base = result;
+        base_size = result_size;
+        base_cached = 0;
+        // the entry we just built is only a base if there is more to apply
+        if(depth > 0 && cache && (held = base_cache_add(cache, pack, cur, type, result, result_size)))
+            base_cached = 1;
+    }
+
+    // hand back something the caller owns
+    if(base_cached) {
+        if(!(result = malloc(base_size + 1)))
+            goto out;
+        memcpy(result, base, base_size + 1);
+        base_cache_release(cache, held);
+        held = NULL;
+        base = result;
+        base_cached = 0;
+    } else if(cache && cache_result) {
+        if((result = malloc(base_size + 1))) {
+            memcpy(result, base, base_size + 1);
+            if(base_cache_put(cache, pack, offset, type, result, base_size) != 0)
+                free(result);
+        }
+    }
+
+    g_obj->type = type;
+    g_obj->size = base_size;
+    g_obj->mem_data = base;
+    base = NULL;
+    ret = 0;
+
+    STATS_INC(objects[STATS_PACKED][type & 7]);
+    STATS_DELTA_DEPTH(chain_length);
+
+out:
+    if(base && !base_cached)
+        free(base);
+    if(held)
+        base_cache_release(cache, held);
+    if(chain != chain_static)
+        free(chain);
+    STATS_END(STATS_OP_PACK_READ_OBJECT, start, ret != 0);
+    return ret;
+}
+
+// A file that goes with a pack: the same name with ext (".idx", ".rev")
+// instead of .pack. Returns a malloc()'d string, or NULL if the name doesn't
+// end in .pack.
+static char *pack_sibling_location(const char *pack_location, const char *ext)
+{
+    size_t len = strlen(pack_location);
+    char *location;
+
+    if(len < 5 || strcmp(pack_location + len - 5, ".pack") != 0)
+        return NULL;
+    if(!(location = malloc(len - 5 + strlen(ext) + 1)))
+        return NULL;
+    memcpy(location, pack_location, len - 5);
+    strcpy(location + len - 5, ext);
+    return location;
+}
+
+char *pack_idx_location(const char *pack_location)
+{
+    return pack_sibling_location(pack_location, ".idx");
+}
+
+char *pack_rev_location(const char *pack_location)
+{
+    return pack_sibling_location(pack_location, ".rev");
+}
+
+static int compare_order_offsets(const void *a, const void *b)
+{
+    uint64_t x = ((const struct pack_order_entry *) a)->offset, y = ((const struct pack_order_entry *) b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+// Finds the entry that starts at offset in an offset-sorted table.
+static int order_find_offset(const struct pack_order_entry *order, uint32_t count, uint64_t offset, uint32_t *found)
+{
+    uint32_t lo = 0, hi = count, mi;
+
+    while(lo < hi) {
+        mi = lo + (hi - lo) / 2;
+        if(order[mi].offset == offset) {
+            *found = mi;
+            return 0;
+        }
+        if(order[mi].offset < offset)
+            lo = mi + 1;
+        else
+            hi = mi;
+    }
+    return -1;
+}
+
+// Lists the pack's entries in the order they appear in the pack, with where
+// each one ends and whether any delta uses it as a base. Only entry headers
+// are read, so this is cheap next to inflating anything. Entries whose header
+// is damaged are left for the caller to trip over when it reads them.
+// Returns a malloc()'d array of idx->entries elements, or NULL.
+struct pack_order_entry *pack_order(const struct pack *pack, const struct idx *idx)
+{
+    struct pack_order_entry *order;
+    struct pack_entry header;
+    uint32_t i, pos, base, *by_pos;
+
+    if(!(order = malloc(sizeof(struct pack_order_entry) * (idx->entries + 1))))
+        return NULL;
+    if(!(by_pos = malloc(sizeof(uint32_t) * (idx->entries + 1)))) {
+        free(order);
+        return NULL;
+    }
+
+    for(i = 0; i < idx->entries; i++) {
+        order[i].offset = idx_offset(idx, i);
+        order[i].pos = i;
+        order[i].is_base = 0;
+    }
+    qsort(order, idx->entries, sizeof(struct pack_order_entry), compare_order_offsets);
+    for(i = 0; i < idx->entries; i++) {
+        order[i].end = (i + 1 < idx->entries) ? order[i + 1].offset : pack->size - 20;
+        by_pos[order[i].pos] = i;
+    }
+
+    for(i = 0; i < idx->entries; i++) {
+        if(pack_entry_header(pack, order[i].offset, &header) != 0)
+            continue;
+        if(header.type == OFS_DELTA) {
+            if(order_find_offset(order, idx->entries, header.base_offset, &base) == 0)
+                order[base].is_base = 1;
+        } else if(header.type == REF_DELTA) {
+            if(idx_find(idx, header.base_sha1, &pos) == 0)
+                order[by_pos[pos]].is_base = 1;
+        }
+    }
+
+    free(by_pos);
+    return order;
+}
+
 void unload_idx(struct idx *idx)
 {
     if(!idx)
@@ -475,14 +1104,17 @@ void unload_idx(struct idx *idx)
     idx = NULL;
 }
 
-struct idx * load_idx(char *location)
+// Like load_pack(), this returns NULL without saying why; an odb refresh can
+// meet an idx that's still being written.
+static struct idx * map_idx(char *location)
 {
     int idx_fd;
-    int idx_size;
     struct stat idx_st;
     struct idx *idx;
     void *raw_idx_data;
-    uint32_t *hdr, entries;
+    uint32_t *hdr, entries, nlarge = 0;
+    int version;
+    size_t min_size;
 
     if((idx_fd = open(location, O_RDONLY)) < 0)
         return NULL;
@@ -492,9 +1124,8 @@ struct idx * load_idx(char *location)
         close(idx_fd);
         return NULL;
     }
-    if((int) idx_st.st_size < 4*256+24+20+20) // header + one entry + packfile checksum + idxfile checksum
+    if((size_t) idx_st.st_size < 4*256+20+20) // header + packfile checksum + idxfile checksum
     {
-        printf("Bad idx file: size is too small.\n");
         close(idx_fd);
         return NULL;
     }
@@ -502,50 +1133,71 @@ struct idx * load_idx(char *location)
     // mmap the idx file
     raw_idx_data = (unsigned char *) mmap(NULL, idx_st.st_size, PROT_READ, MAP_PRIVATE, idx_fd, 0);
     close(idx_fd);
-    if(!raw_idx_data)
+    if(raw_idx_data == MAP_FAILED)
         return NULL;
     
     // check for version 1 or 2
     hdr = raw_idx_data;
     if(*hdr == htonl(IDX_VERSION_TWO_SIG)) {
-        printf("Version 2 idx files not supported.\n");
-        munmap(raw_idx_data, idx_st.st_size);
-        return NULL;
-    }
-    
-    // Additional version integrety checks go here if desired.
-    // 1) For version 1 idxs, read all 255 chunks in the header and ensure that the preceeding
-    //    chunk is less than the following chunk. (This is unimplemented for small speed
-    //    reasons.)
-    // 2) Read the total object count and compare it to the actual size. (This is implemented.)
-    entries = ntohl(hdr[255]);
-    if((uint32_t) idx_st.st_size != (4*256 + entries * 24 + 20 + 20)) {
-        printf("Bad idx file: file length does not match the number of entries.\n");
-        munmap(raw_idx_data, idx_st.st_size);
-        return NULL;
+        // Version 2: magic, version, fan-out, then separate tables of sha1s,
+        // crc32s and 31-bit offsets, and a table of 64-bit offsets for the
+        // entries whose 31-bit offset has the high bit set.
+        if((size_t) idx_st.st_size < 8 + 4*256 + 20 + 20 || ntohl(hdr[1]) != 2) {
+                munmap(raw_idx_data, idx_st.st_size);
+            return NULL;
+        }
+        version = 2;
+        entries = ntohl(hdr[2 + 255]);
+        min_size = 8 + 4*256 + (size_t) entries * (20 + 4 + 4) + 20 + 20;
+        if((size_t) idx_st.st_size < min_size || (idx_st.st_size - min_size) % 8 != 0 ||
+           (idx_st.st_size - min_size) / 8 > (entries ? entries - 1 : 0)) {
+            munmap(raw_idx_data, idx_st.st_size);
+            return NULL;
+        }
+        nlarge = (idx_st.st_size - min_size) / 8;
+    } else {
+        // Additional version integrety checks go here if desired.
+        // 1) For version 1 idxs, read all 255 chunks in the header and ensure that the preceeding
+        //    chunk is less than the following chunk. (This is unimplemented for small speed
+        //    reasons.)
+        // 2) Read the total object count and compare it to the actual size. (This is implemented.)
+        version = 1;
+        entries = ntohl(hdr[255]);
+        if((size_t) idx_st.st_size != (4*256 + (size_t) entries * 24 + 20 + 20)) {
+            munmap(raw_idx_data, idx_st.st_size);
+            return NULL;
+        }
     }
     
     // Enough checking. Time to store all this to an idx struct and return it.
     if(!(idx = malloc(sizeof(struct idx)))) {
-        printf("Failed to allocate an idx struct.\n");
         munmap(raw_idx_data, idx_st.st_size);
         return NULL;
     }
     if(!(idx->location = malloc(strlen(location)+1))) {
-        printf("Failed to allocate idx.location.\n");
         free(idx);
         munmap(raw_idx_data, idx_st.st_size);
         return NULL;
     }
     memcpy(idx->location, location, strlen(location)+1);
     idx->data = raw_idx_data;
-    idx->version = 1;
+    idx->version = version;
     idx->size = idx_st.st_size;
     idx->entries = entries;
+    idx->nlarge = nlarge;
     
     return idx;
 }
 
+struct idx * load_idx(char *location)
+{
+    uint64_t start = STATS_START();
+    struct idx *idx = map_idx(location);
+
+    STATS_END(STATS_OP_LOAD_IDX, start, idx == NULL);
+    return idx;
+}
+
 // Compare two hashes. The name is a bit of a misnomer; "pf" means "partial hash"
 // and "full hash", though all this really means is the first argument needs to
 // be a struct sha1 and the second a 20-byte, binary sha1.
@@ -558,198 +1210,279 @@ static inline int hashcmp_pf(const struct sha1 *hash, const unsigned char *full_
     return memcmp((unsigned char *) &hash->sha1/*partial_hash*/, full_hash, hash->length);
 }
 
+static inline const uint32_t *idx_fanout(const struct idx *idx)
+{
+    return (const uint32_t *) (idx->data + ((idx->version == 2) ? 8 : 0));
+}
+
+// The n'th sha1 in sorted order.
+const unsigned char *idx_sha1(const struct idx *idx, uint32_t n)
+{
+    if(idx->version == 2)
+        return idx->data + 8 + 4*256 + 20 * (size_t) n;
+    return idx->data + 4*256 + 24 * (size_t) n + 4;
+}
+
+// Pack offset of the n'th entry. Returns 0 (never a valid entry offset) if the
+// idx points at a large offset it doesn't have.
+uint64_t idx_offset(const struct idx *idx, uint32_t n)
+{
+    const unsigned char *table;
+    uint32_t ofs;
+
+    if(idx->version != 2)
+        return ntohl(*((const uint32_t *) (idx->data + 4*256 + 24 * (size_t) n)));
+
+    table = idx->data + 8 + 4*256 + (size_t) idx->entries * 24; // past the sha1s and crcs
+    ofs = ntohl(((const uint32_t *) table)[n]);
+    if(!(ofs & 0x80000000))
+        return ofs;
+
+    ofs &= 0x7fffffff;
+    if(ofs >= idx->nlarge)
+        return 0;
+    table += (size_t) idx->entries * 4 + (size_t) ofs * 8;
+    return ((uint64_t) ntohl(((const uint32_t *) table)[0]) << 32) | ntohl(((const uint32_t *) table)[1]);
+}
+
+// CRC32 of the n'th entry's raw pack data; only version 2 idx files have these.
+int idx_crc32(const struct idx *idx, uint32_t n, uint32_t *crc)
+{
+    if(idx->version != 2)
+        return -1;
+    *crc = ntohl(((const uint32_t *) (idx->data + 8 + 4*256 + (size_t) idx->entries * 20))[n]);
+    return 0;
+}
+
+// The trailer: the checksum of the pack this idx describes, then its own.
+const unsigned char *idx_pack_checksum(const struct idx *idx)
+{
+    return idx->data + idx->size - 40;
+}
+
+// Finds a full 20-byte sha1; *pos is set to its position in sorted order.
+int idx_find(const struct idx *idx, const unsigned char *sha1, uint32_t *pos)
+{
+    const uint32_t *fanout = idx_fanout(idx);
+    uint32_t hi, lo, mi;
+    int cmp;
+
+    hi = ntohl(fanout[sha1[0]]);
+    lo = (sha1[0] == 0) ? 0 : ntohl(fanout[sha1[0] - 1]);
+    if(hi > idx->entries)
+        return -1; // corrupt fan-out
+
+    while(lo < hi) {
+        mi = lo + (hi - lo) / 2;
+        cmp = memcmp(sha1, idx_sha1(idx, mi), 20);
+        STATS_INC(idx_probes);
+        if(!cmp) {
+            if(pos)
+                *pos = mi;
+            return 0;
+        }
+        if(cmp < 0)
+            hi = mi;
+        else
+            lo = mi + 1;
+    }
+    return -1;
+}
+
 // Note: This function does accept shortened sha1s, just be aware that it returns the first
 //       match. This could result in false positives with extremely shortened sha1s.
-//
-// Version 2 idx files are currently not supported.
-struct idx_entry * pack_idx_read(const struct idx *idx_index, const struct sha1 *hash)
+static struct idx_entry * idx_search(const struct idx *idx_index, const struct sha1 *hash)
 {
     struct idx_entry *nice_entry = NULL;
-    const uint32_t *level1_ofs = idx_index->data;
-    const unsigned char *index = idx_index->data;
+    const uint32_t *level1_ofs;
     unsigned hi, lo;
     
-    if(!index || !hash)
+    if(!idx_index || !idx_index->data || !hash || hash->length == 0)
         return NULL;
 
     // Basic idea: the idx's sha1 entries are sorted smallest to largest, so we don't
     // need to search everything.
-    index += 4 * 256; // bypass the header
+    level1_ofs = idx_fanout(idx_index);
 	hi = ntohl(level1_ofs[ *hash->sha1 ]);
 	lo = ((hash->sha1[0] == 0) ? 0 : ntohl(level1_ofs[ *hash->sha1 - 1 ]));
+	if (hi > idx_index->entries)
+		return NULL;
 
-	do {
+	while (lo < hi) {
 		unsigned mi = (lo + hi) / 2;
-		unsigned x = mi * 24 + 4;
-		int cmp = hashcmp_pf(hash, index + x);
+		int cmp = hashcmp_pf(hash, idx_sha1(idx_index, mi));
+		STATS_INC(idx_probes);
 		if (!cmp) {
 		    // we have a match!
 		    if(!(nice_entry = malloc(sizeof(struct idx_entry))))
                 return NULL;
-            nice_entry->offset = ntohl(*((uint32_t *) (index + 24 * mi)));
-            memcpy(nice_entry->sha1, index + 24 * mi + 4, 20);
+            nice_entry->offset = idx_offset(idx_index, mi);
+            memcpy(nice_entry->sha1, idx_sha1(idx_index, mi), 20);
             return nice_entry;
 		}
 		if (cmp < 0)
 			hi = mi;
 		else
 			lo = mi+1;
-	} while (lo < hi);
+	}
     
     return NULL; // no match
 }
 
-// much of this function is from the zlib zpipe.c example
-int loose_get_object(char * location, struct git_object * g_obj, int full)
+struct idx_entry * pack_idx_read(const struct idx *idx_index, const struct sha1 *hash)
 {
-    FILE *loose_fp = NULL;
-    FILE *tmp = NULL;
-    unsigned char real_read_buffer[CHUNKSIZE];
-    unsigned char real_small_write_buffer[128]; //CHUNKSIZE];
-    unsigned char *read_buffer = real_read_buffer;
-    unsigned char *small_write_buffer = real_small_write_buffer;
-    unsigned char *c_ptr = NULL, *obj_data = NULL;
+    uint64_t start = STATS_START();
+    struct idx_entry *entry;
 
-    int status;
-    int amount_read = 0;
+    STATS_INC(idx_lookups);
+    entry = idx_search(idx_index, hash);
+    STATS_END(STATS_OP_PACK_IDX_READ, start, 0); // a miss is a normal answer, not an error
+    return entry;
+}
+
+#define LOOSE_READ_MAX (64*1024) // smaller files are read; bigger ones are mmap'd
+
+// Parses a loose object's "<type> <size>\0" header out of the start of its
+// inflated data. Returns the header's length.
+int loose_parse_header(const unsigned char *buf, unsigned long len, struct git_object *g_obj)
+{
+    const unsigned char *nul, *p;
+    unsigned long size = 0;
+
+    if(!(nul = memchr(buf, '\0', len)) || !(p = memchr(buf, ' ', nul - buf)))
+        return -1;
+
+    if(p - buf == 4 && memcmp(buf, "blob", 4) == 0)
+        g_obj->type = BLOB;
+    else if(p - buf == 6 && memcmp(buf, "commit", 6) == 0)
+        g_obj->type = COMMIT;
+    else if(p - buf == 4 && memcmp(buf, "tree", 4) == 0)
+        g_obj->type = TREE;
+    else if(p - buf == 3 && memcmp(buf, "tag", 3) == 0)
+        g_obj->type = TAG;
+    else
+        return -1;
 
-    int find_type = 1;
-    int find_size = 1;
+    if(++p == nul)
+        return -1;
+    for(; p < nul; p++) {
+        if(*p < '0' || *p > '9' || size > (ULONG_MAX - 9) / 10)
+            return -1;
+        size = size * 10 + (*p - '0');
+    }
+    g_obj->size = size;
+    return nul + 1 - buf;
+}
 
+// The whole compressed file is read (or mapped) up front, so the header comes
+// from one small inflate. Without full, blobs stop there; everything else is
+// inflated in one more call straight into a buffer of exactly the right size,
+// which is NUL terminated like pack_read_object()'s.
+static int loose_inflate_object(char * location, struct git_object * g_obj, int full)
+{
+    unsigned char small_file[LOOSE_READ_MAX], header[LOOSE_HEADER_MAX];
+    unsigned char *file = small_file;
+    unsigned long have;
+    struct stat st;
+    ssize_t n;
+    size_t got = 0;
+    int fd, status, header_len, ret = -1, mapped = 0;
     z_stream zst;
-    
+
     // initialize
     g_obj->size = 0;
     g_obj->type = UKNOWNTYPE;
     g_obj->data = NULL;
     g_obj->mem_data = NULL;
 
-    zst.zalloc = Z_NULL; // use defaults
-    zst.zfree = Z_NULL;  // ''
-    zst.opaque = Z_NULL;
-    zst.avail_in = 0;
-    zst.next_in = Z_NULL;
-
-    if(!(loose_fp = fopen(location, "r")))
+    if((fd = open(location, O_RDONLY)) < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
         return -1;
-    
-    if((status = inflateInit(&zst)) != Z_OK) {
-        fclose(loose_fp);
-        return status;
     }
-    
-    // start reading in data and decompressing it
-    do {
-        zst.avail_in = fread(read_buffer, 1, CHUNKSIZE, loose_fp);
-        if(ferror(loose_fp)) {
-            inflateEnd(&zst);
-            fclose(loose_fp);
+    if(st.st_size > LOOSE_READ_MAX) {
+        if((file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            close(fd);
             return -1;
         }
-        if(zst.avail_in == 0) { // eof ?
-            fclose(loose_fp);
+        mapped = 1;
+    } else {
+        while(got < (size_t) st.st_size && (n = pread(fd, file + got, st.st_size - got, got)) > 0)
+            got += n;
+        if(got < (size_t) st.st_size) {
+            close(fd);
             return -1;
         }
-        zst.next_in = read_buffer;
-        
-        // fill up the write buffer
-        do {
-            if(g_obj->mem_data == NULL) {
-                // we are just trying to get the type and size right now, so we use a small buffer
-                zst.avail_out = 128;
-                zst.next_out = small_write_buffer;
-            } else {
-                // okay, now we are really goin' to town...
-                zst.avail_out = g_obj->size - (obj_data - g_obj->mem_data); //amount_read; // already read some of the data...
-                zst.next_out = obj_data;
-            }
-            
-            // error check
-            status = inflate(&zst, Z_NO_FLUSH);
-            switch(status) {
-                case Z_STREAM_ERROR:
-                case Z_NEED_DICT:
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    inflateEnd(&zst);
-                    fclose(loose_fp);
-                    return status;
-            }
-     
-            if(g_obj->mem_data == NULL)
-                amount_read = 128 - zst.avail_out;
-            else
-                amount_read = g_obj->size - ((obj_data - g_obj->mem_data) + zst.avail_out);
-            
-            // Yes, we actually check for an amount read even though we do little
-            // other error checking and it SHOULD be correct. :)
-            if(amount_read >= 6 && (find_type || find_size)) {
-                if(find_type) {
-                    // we have enough data to find out the type
-                    if(memcmp("blob", small_write_buffer, 4) == 0) {
-                        g_obj->type = BLOB;
-                    } else if(memcmp("commit", small_write_buffer, 6) == 0) {
-                        g_obj->type = COMMIT;
-                        full = 1;
-                    } else if(memcmp("tree", small_write_buffer, 4) == 0) {
-                        g_obj->type = TREE;
-                        full = 1;
-                    } else if(memcmp("tag", small_write_buffer, 3) == 0) {
-                        g_obj->type = TAG;
-                    } else {
-                        g_obj->type = UKNOWNTYPE;
-                    }
-                    find_type = 0;
-                }
-                if(find_size) {
-                    // \0 comes after the size
-                    //c_ptr = (unsigned char*) memchr(small_write_buffer, '\0', amount_read);
-                    // find the space that comes before the size
-                    c_ptr = (unsigned char*) memchr(small_write_buffer, ' ', amount_read);
-                    g_obj->size = atoi((char *) c_ptr);
-                    find_size = 0;
-                    
-                    if(full) {
-                        if(!(g_obj->mem_data = (unsigned char *) malloc(g_obj->size))) {
-                            // can't allocate space for the data
-                            fclose(loose_fp);
-                            inflateEnd(&zst);
-                            return -1;
-                        }
-                        obj_data = g_obj->mem_data; // setup the utility pointer
-                    }
-                }
-            }
-            
-            // Write out lingering data from the first time through reading.
-            // After this write, zlib will write directly to obj_data itself.
-            if(full && g_obj->mem_data - obj_data == 0) {
-                // we are at the start, so at this point:
-                // 1) we have data in a buffer
-                // 2) some of that data we need to discard (up to and including the \0)
-                c_ptr = (unsigned char*) memchr(small_write_buffer, '\0', amount_read) + 1;
-                memcpy(obj_data, c_ptr, amount_read - (c_ptr - small_write_buffer));
-                obj_data += (amount_read - (c_ptr - small_write_buffer));
-                
-                // fwrite(c_ptr, 1, amount_read - (c_ptr - write_buffer), g_obj->data);
-            } else if(full) {
-                // update the pointer so we don't overwrite anything
-                obj_data += amount_read;
-            } else if(!full) {
-                // all they wanted was the type and size; clean up and return
-                fclose(loose_fp);
-                inflateEnd(&zst);
-                return 0;
-            }
-        } while(zst.avail_out == 0 && status != Z_STREAM_END);
-    } while (status != Z_STREAM_END);
+    }
+    close(fd);
+
+    memset(&zst, 0, sizeof(zst));
+    zst.next_in = file;
+    zst.avail_in = st.st_size;
+    zst.next_out = header;
+    zst.avail_out = sizeof(header);
+    if(inflateInit(&zst) != Z_OK) {
+        if(mapped)
+            munmap(file, st.st_size);
+        return -1;
+    }
+
+    status = inflate(&zst, Z_SYNC_FLUSH);
+    have = sizeof(header) - zst.avail_out;
+    if((status != Z_OK && status != Z_STREAM_END) ||
+       (header_len = loose_parse_header(header, have, g_obj)) < 0)
+        goto out;
+
+    // the rest of git.py wants the contents of anything that isn't a blob
+    if(g_obj->type != BLOB)
+        full = 1;
+    if(!full) {
+        ret = 0;
+        goto out;
+    }
+
+    have -= header_len;
+    if(have > g_obj->size || !(g_obj->mem_data = malloc(g_obj->size + 1)))
+        goto out;
+    memcpy(g_obj->mem_data, header + header_len, have);
+    if(status != Z_STREAM_END) {
+        // room for one byte too many, so a stream longer than its header says shows up
+        zst.next_out = g_obj->mem_data + have;
+        zst.avail_out = g_obj->size - have + 1;
+        status = inflate(&zst, Z_FINISH);
+        have = g_obj->size + 1 - zst.avail_out;
+    }
+    if(status != Z_STREAM_END || have != g_obj->size) {
+        free(g_obj->mem_data);
+        g_obj->mem_data = NULL;
+        goto out;
+    }
+    g_obj->mem_data[g_obj->size] = '\0';
+    ret = 0;
+
+out:
+    STATS_ADD(bytes_read[STATS_LOOSE], zst.total_in);
+    STATS_ADD(bytes_inflated[STATS_LOOSE], zst.total_out);
     inflateEnd(&zst);
-    fclose(loose_fp);
-    
-    return 0;
+    if(mapped)
+        munmap(file, st.st_size);
+    return ret;
+}
+
+int loose_get_object(char * location, struct git_object * g_obj, int full)
+{
+    uint64_t start = STATS_START();
+    int ret;
+
+    ret = loose_inflate_object(location, g_obj, full);
+    if(ret == 0)
+        STATS_INC(objects[STATS_LOOSE][g_obj->type & 7]);
+    STATS_END(STATS_OP_LOOSE_GET_OBJECT, start, ret != 0);
+    return ret;
 }
 
-inline int str_sha1_to_sha1_obj(const char *str_sha1, struct sha1 *obj_sha1)
+int str_sha1_to_sha1_obj(const char *str_sha1, struct sha1 *obj_sha1)
 {
     obj_sha1->length = strlen(str_sha1) / 2; // will drop any odd amount that get_sha1_hex drops
     return get_sha1_hex(str_sha1, obj_sha1->sha1);
@@ -11,8 +11,17 @@
 #define OFS_DELTA 6
 #define REF_DELTA 7
 
+#define PACK_MAX_DELTA_CHAIN 10000 // git itself stops at 4095; anything deeper is a loop
+
 #define DELTA_SIZE_MIN 4
 
+#define LOOSE_HEADER_MAX 64 // "<type> <size>\0" is never longer than this
+
+#define GITREAD_CORRUPT -2 // an object's data doesn't hash to its id
+
+#define S_IFGITLINK 0160000 // a tree entry for a submodule commit; it isn't in this repository
+#define S_IFTREE    0040000
+
 #define IDX_VERSION_TWO_SIG 0xff744f63 // '\377tOc'
 
 struct sha1 {
@@ -26,8 +35,35 @@ struct idx {
     int version;
     size_t size;
     uint32_t entries;
+    uint32_t nlarge; // version 2: number of 64-bit offsets
 };
 
+struct pack {
+    char *location;
+    unsigned char *data;
+    size_t size;
+    uint32_t entries;
+};
+
+struct pack_entry {
+    uint64_t offset;      // where the entry starts
+    uint64_t data_offset; // where its zlib stream starts
+    unsigned int type;    // may be OFS_DELTA or REF_DELTA
+    uint64_t size;        // inflated size of this entry (of the delta itself for deltas)
+    uint64_t base_offset; // OFS_DELTA only
+    const unsigned char *base_sha1; // REF_DELTA only; points into the pack
+};
+
+// One entry of a pack in pack order; see pack_order().
+struct pack_order_entry {
+    uint64_t offset;
+    uint64_t end;    // where the next entry (or the trailer) starts
+    uint32_t pos;    // position in the idx
+    int is_base;     // some delta in the pack is based on this entry
+};
+
+struct base_cache;
+
 struct idx_entry {
     uint32_t offset;
     unsigned char sha1[20];
@@ -35,13 +71,20 @@ struct idx_entry {
 
 struct git_object {
     unsigned int type;
-    unsigned int size;
+    uint64_t size;
     FILE *data;
     unsigned char* mem_data;
 };
 
 int get_sha1_hex(const char *hex, unsigned char *sha1);
-inline int str_sha1_to_sha1_obj(const char *str_sha1, struct sha1 *obj_sha1);
+int hex_to_sha1(const char *hex, unsigned char *sha1);
+const char *object_type_name(unsigned int type);
+int hash_git_object(unsigned int type, const unsigned char *data, unsigned long size, unsigned char *sha1);
+int check_object_hash(const unsigned char *sha1, unsigned int type, const unsigned char *data, unsigned long size);
+int tree_next_entry(const unsigned char *data, unsigned long size, unsigned long *pos,
+                    unsigned int *mode, const char **name, size_t *name_len, const unsigned char **sha1);
+int parse_header_sha1(const unsigned char **p, const unsigned char *end, const char *field, unsigned char *sha1);
+int str_sha1_to_sha1_obj(const char *str_sha1, struct sha1 *obj_sha1);
 char * sha1_to_hex(const unsigned char * sha1);
 void *patch_delta(const void *src_buf, unsigned long src_size,
 		  const void *delta_buf, unsigned long delta_size,
@@ -54,6 +97,27 @@ void unload_idx(struct idx *idx);
 struct idx * load_idx(char *location);
 struct idx_entry * pack_idx_read(const struct idx *index, const struct sha1 *hash);
 int loose_get_object(char * location, struct git_object * g_obj, int full);
+int loose_parse_header(const unsigned char *buf, unsigned long len, struct git_object *g_obj);
+
+const unsigned char *idx_sha1(const struct idx *idx, uint32_t n);
+uint64_t idx_offset(const struct idx *idx, uint32_t n);
+int idx_crc32(const struct idx *idx, uint32_t n, uint32_t *crc);
+const unsigned char *idx_pack_checksum(const struct idx *idx);
+int idx_find(const struct idx *idx, const unsigned char *sha1, uint32_t *pos);
+
+void unload_pack(struct pack *pack);
+struct pack * load_pack(char *location);
+char *pack_idx_location(const char *pack_location);
+char *pack_rev_location(const char *pack_location);
+int pack_entry_header(const struct pack *pack, uint64_t offset, struct pack_entry *entry);
+int pack_inflate_entry(const struct pack *pack, const struct pack_entry *entry, unsigned char **out, uint64_t *end);
+unsigned char *pack_apply_delta(const unsigned char *base, unsigned long base_size,
+                                const unsigned char *delta, unsigned long delta_size,
+                                unsigned long *result_size);
+int pack_object_size(const struct pack *pack, uint64_t offset, uint64_t *size);
+int pack_read_object(const struct pack *pack, const struct idx *idx, uint64_t offset,
+                     struct git_object *g_obj, struct base_cache *cache, int cache_result);
+struct pack_order_entry *pack_order(const struct pack *pack, const struct idx *idx);
 
 
 
@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "tree.h"
+#include "lstree.h"
+
+// Recursive tree listings, as in "git ls-tree -r".
+//
+// Subtrees don't depend on one another, so a pool of threads reads them:
+// each takes a directory off a shared stack of ones still to read, reads and
+// parses its tree (and blob sizes, if asked for) without the lock, then takes
+// the lock to add the entries and push the subtrees it found. Directories
+// come back in whatever order the threads get to them, but each one's entries
+// are added together and in tree order, so once everything is read a single
+// pass puts the listing in git's order.
+
+struct lstree_child {
+    const char *name;    // points into the tree's data
+    size_t name_len;
+    unsigned int mode;
+    const unsigned char *sha1;
+    int64_t size;
+};
+
+struct lstree_job {
+    const struct odb *odb;
+    struct lstree *ls;
+    int max_depth;
+    int flags;
+    uint32_t *pending;   // directories waiting to be read
+    uint32_t npending, pending_alloc;
+    int busy;            // threads reading a directory right now
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619U;
+    return h;
+}
+
+static int grow_name_slots(struct lstree *ls)
+{
+    uint32_t *slots, n = ls->nname_slots ? ls->nname_slots * 2 : 1024, i, j;
+    const char *name;
+
+    if(!(slots = calloc(n, sizeof(uint32_t))))
+        return -1;
+    for(i = 0; i < ls->nname_slots; i++) {
+        if(!ls->name_slots[i])
+            continue;
+        name = ls->names + ls->name_slots[i] - 1;
+        j = name_hash(name, strlen(name)) & (n - 1);
+        while(slots[j])
+            j = (j + 1) & (n - 1);
+        slots[j] = ls->name_slots[i];
+    }
+    free(ls->name_slots);
+    ls->name_slots = slots;
+    ls->nname_slots = n;
+    return 0;
+}
+
+// Returns where name is kept in ls->names, adding it if it isn't yet; -1 if
+// out of memory.
+static int64_t intern_name(struct lstree *ls, const char *name, size_t len)
+{
+    uint32_t i, offset;
+    size_t n;
+    char *grown;
+
+    if(ls->nnames * 2 >= ls->nname_slots && grow_name_slots(ls) != 0)
+        return -1;
+    i = name_hash(name, len) & (ls->nname_slots - 1);
+    while(ls->name_slots[i]) {
+        offset = ls->name_slots[i] - 1;
+        if(strncmp(ls->names + offset, name, len) == 0 && ls->names[offset + len] == '\0')
+            return offset;
+        i = (i + 1) & (ls->nname_slots - 1);
+    }
+
+    if(ls->names_size + len + 1 > ls->names_alloc) {
+        n = ls->names_alloc ? ls->names_alloc : 4096;
+        while(n < ls->names_size + len + 1)
+            n *= 2;
+        if(n > UINT32_MAX || !(grown = realloc(ls->names, n)))
+            return -1;
+        ls->names = grown;
+        ls->names_alloc = n;
+    }
+    offset = ls->names_size;
+    memcpy(ls->names + offset, name, len);
+    ls->names[offset + len] = '\0';
+    ls->names_size += len + 1;
+    ls->name_slots[i] = offset + 1;
+    ls->nnames++;
+    return offset;
+}
+
+static int64_t add_entry(struct lstree *ls, const char *name, size_t name_len, unsigned int mode,
+                         const unsigned char *sha1, uint32_t parent, uint32_t depth, int64_t size)
+{
+    struct lstree_entry *e;
+    int64_t name_offset;
+    void *grown;
+
+    if((name_offset = intern_name(ls, name, name_len)) < 0)
+        return -1;
+    if(!(grown = grow(ls->entries, &ls->alloc, ls->count + 1, sizeof(struct lstree_entry))))
+        return -1;
+    ls->entries = grown;
+    e = &ls->entries[ls->count];
+    memcpy(e->sha1, sha1, 20);
+    e->mode = mode;
+    e->name = name_offset;
+    e->parent = parent;
+    e->children = LSTREE_NONE;
+    e->nchildren = 0;
+    e->depth = depth;
+    e->size = size;
+    return ls->count++;
+}
+
+static int has_size(unsigned int mode)
+{
+    // regular files and symlinks; trees and submodules aren't blobs
+    return (mode & 0170000) == 0100000 || (mode & 0170000) == 0120000;
+}
+
+// Reads and parses one tree, with the lock not held. The children point into
+// g_obj's data.
+static int read_children(struct lstree_job *job, struct base_cache *cache, const unsigned char *tree,
+                         struct git_object *g_obj, struct lstree_child **children, uint32_t *alloc,
+                         uint32_t *count)
+{
+    struct lstree_child *c;
+    unsigned long pos = 0;
+    uint64_t size;
+    void *grown;
+
+    *count = 0;
+    if(odb_read(job->odb, tree, g_obj, cache) != 0)
+        return -1;
+    if(g_obj->type != TREE)
+        return -1;
+
+    while(pos < g_obj->size) {
+        if(!(grown = grow(*children, alloc, *count + 1, sizeof(struct lstree_child))))
+            return -1;
+        *children = grown;
+        c = &(*children)[*count];
+        if(tree_next_entry(g_obj->mem_data, g_obj->size, &pos, &c->mode, &c->name, &c->name_len, &c->sha1) != 0)
+            return -1;
+        c->size = -1;
+        if((job->flags & LSTREE_SIZES) && has_size(c->mode)) {
+            if(odb_object_size(job->odb, c->sha1, &size) != 0)
+                return -1;
+            c->size = size;
+        }
+        (*count)++;
+    }
+    return 0;
+}
+
+// Adds a directory's entries and queues its subtrees; the lock is held.
+static int add_children(struct lstree_job *job, uint32_t dir, uint32_t depth,
+                        const struct lstree_child *children, uint32_t count)
+{
+    struct lstree *ls = job->ls;
+    uint32_t first = ls->count, i;
+    int64_t e;
+    void *grown;
+
+    for(i = 0; i < count; i++) {
+        e = add_entry(ls, children[i].name, children[i].name_len, children[i].mode, children[i].sha1,
+                      dir, depth, children[i].size);
+        if(e < 0)
+            return -1;
+        if(children[i].mode != S_IFTREE || (job->max_depth > 0 && depth >= (uint32_t) job->max_depth))
+            continue;
+        if(!(grown = grow(job->pending, &job->pending_alloc, job->npending + 1, sizeof(uint32_t))))
+            return -1;
+        job->pending = grown;
+        job->pending[job->npending++] = e;
+    }
+    ls->entries[dir].children = first;
+    ls->entries[dir].nchildren = count;
+    return 0;
+}
+
+static void *lstree_worker(void *data)
+{
+    struct lstree_job *job = data;
+    struct base_cache *cache;
+    struct lstree_child *children = NULL;
+    struct git_object g_obj;
+    uint32_t alloc = 0, count, dir, depth;
+    unsigned char tree[20];
+    int ret;
+
+    cache = base_cache_new(LSTREE_CACHE_BYTES);
+    pthread_mutex_lock(&job->lock);
+    if(!cache)
+        job->failed = 1;
+    for(;;) {
+        while(!job->npending && job->busy && !job->failed)
+            pthread_cond_wait(&job->wake, &job->lock);
+        if(!job->npending || job->failed)
+            break;
+        dir = job->pending[--job->npending];
+        memcpy(tree, job->ls->entries[dir].sha1, 20);
+        depth = job->ls->entries[dir].depth + 1;
+        job->busy++;
+        pthread_mutex_unlock(&job->lock);
+
+        ret = read_children(job, cache, tree, &g_obj, &children, &alloc, &count);
+
+        pthread_mutex_lock(&job->lock);
+        if(ret == 0)
+            ret = add_children(job, dir, depth, children, count);
+        if(ret != 0)
+            job->failed = 1;
+        free(g_obj.mem_data);
+        job->busy--;
+        // there's more to do, or we're done
+        pthread_cond_broadcast(&job->wake);
+    }
+    pthread_cond_broadcast(&job->wake);
+    pthread_mutex_unlock(&job->lock);
+
+    if(cache)
+        base_cache_free(cache);
+    free(children);
+    return NULL;
+}
+
+// Reads everything under the directory entry dir.
+static int expand(const struct odb *odb, struct lstree *ls, uint32_t dir, int max_depth, int flags, int threads)
+{
+    struct lstree_job job;
+    pthread_t *workers;
+    int t;
+
+    memset(&job, 0, sizeof(job));
+    job.odb = odb;
+    job.ls = ls;
+    job.max_depth = max_depth;
+    job.flags = flags;
+    if(!(job.pending = grow(NULL, &job.pending_alloc, 1, sizeof(uint32_t))))
+        return -1;
+    job.pending[job.npending++] = dir;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.wake, NULL);
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    if(!(workers = malloc(sizeof(pthread_t) * threads))) {
+        lstree_worker(&job);
+    } else {
+        for(t = 0; t < threads; t++) {
+            if(pthread_create(&workers[t], NULL, lstree_worker, &job) != 0)
+                break;
+        }
+        if(t == 0)
+            lstree_worker(&job); // no threads at all; do it ourselves
+        while(t-- > 0)
+            pthread_join(workers[t], NULL);
+        free(workers);
+    }
+
+    pthread_cond_destroy(&job.wake);
+    pthread_mutex_destroy(&job.lock);
+    free(job.pending);
+    return job.failed ? -1 : 0;
+}
+
+// Lists depth first in tree order, as git does: a tree's entries come right
+// where the tree would be.
+static int build_order(struct lstree *ls, int flags)
+{
+    uint32_t *stack = NULL, *next = NULL, alloc = 0, next_alloc = 0, depth = 0, dir, e;
+    void *grown;
+
+    if(!(ls->order = malloc(sizeof(uint32_t) * (ls->count ? ls->count : 1))))
+        return -1;
+    if(!(stack = grow(NULL, &alloc, 1, sizeof(uint32_t))) || !(next = grow(NULL, &next_alloc, 1, sizeof(uint32_t)))) {
+        free(stack);
+        return -1;
+    }
+    stack[0] = 0;
+    next[0] = 0;
+    depth = 1;
+
+    while(depth) {
+        dir = stack[depth - 1];
+        if(ls->entries[dir].children == LSTREE_NONE || next[depth - 1] >= ls->entries[dir].nchildren) {
+            depth--;
+            continue;
+        }
+        e = ls->entries[dir].children + next[depth - 1]++;
+        if(ls->entries[e].children == LSTREE_NONE || (flags & LSTREE_TREES))
+            ls->order[ls->norder++] = e;
+        if(ls->entries[e].children == LSTREE_NONE)
+            continue;
+
+        if(!(grown = grow(stack, &alloc, depth + 1, sizeof(uint32_t)))) {
+            free(stack);
+            free(next);
+            return -1;
+        }
+        stack = grown;
+        if(!(grown = grow(next, &next_alloc, depth + 1, sizeof(uint32_t)))) {
+            free(stack);
+            free(next);
+            return -1;
+        }
+        next = grown;
+        stack[depth] = e;
+        next[depth++] = 0;
+    }
+
+    free(stack);
+    free(next);
+    return 0;
+}
+
+// Lists everything under prefix ("a/b"; empty components are ignored) in
+// start, a commit, tree or tag, with up to threads threads (one per CPU if
+// threads <= 0). max_depth > 0 stops recursing that many levels below prefix;
+// trees there are listed like any other entry. As with git, the directories
+// along prefix are there too (listed only with LSTREE_TREES), and a prefix
+// naming a file lists just that file. Returns 0, 1 if there's no such path,
+// and -1 if an object is missing or malformed.
+int lstree_walk(const struct odb *odb, struct tree_resolver *paths, const unsigned char *start,
+                const char *prefix, int max_depth, int flags, int threads, struct lstree *ls)
+{
+    unsigned char sha1[20];
+    unsigned int mode;
+    const char *p, *slash;
+    char *component;
+    uint64_t size;
+    int64_t e, dir;
+    int ret;
+
+    memset(ls, 0, sizeof(struct lstree));
+    if((ret = tree_resolve_path(paths, odb, start, "", &mode, sha1)) != 0)
+        return ret;
+    if(!(component = malloc(strlen(prefix) + 1)) || (dir = add_entry(ls, "", 0, mode, sha1, LSTREE_NONE, 0, -1)) < 0) {
+        free(component);
+        lstree_release(ls);
+        return -1;
+    }
+
+    // one step at a time, so each directory on the way gets an entry
+    for(p = prefix; *p && mode == S_IFTREE; p = slash) {
+        while(*p == '/')
+            p++;
+        if(!*p)
+            break;
+        if(!(slash = strchr(p, '/')))
+            slash = p + strlen(p);
+        memcpy(component, p, slash - p);
+        component[slash - p] = '\0';
+
+        if((ret = tree_lookup_path(paths, odb, ls->entries[dir].sha1, component, NULL, &mode, sha1)) != 0)
+            break;
+        size = 0;
+        if((flags & LSTREE_SIZES) && has_size(mode) && (ret = odb_object_size(odb, sha1, &size)) != 0)
+            break;
+        if((e = add_entry(ls, component, slash - p, mode, sha1, dir, 0,
+                          ((flags & LSTREE_SIZES) && has_size(mode)) ? (int64_t) size : -1)) < 0) {
+            ret = -1;
+            break;
+        }
+        ls->entries[dir].children = e;
+        ls->entries[dir].nchildren = 1;
+        dir = e;
+    }
+    // the path went on past a file
+    for(; ret == 0 && *p; p++) {
+        if(*p != '/')
+            ret = 1;
+    }
+    free(component);
+
+    if(ret == 0 && mode == S_IFTREE)
+        ret = expand(odb, ls, dir, max_depth, flags, threads);
+    if(ret == 0)
+        ret = build_order(ls, flags);
+    if(ret != 0)
+        lstree_release(ls);
+    return ret;
+}
+
+// Writes an entry's path, from the top of the tree listed, \0 terminated if
+// there's room. Returns its length, which may be size or more if there isn't.
+size_t lstree_path(const struct lstree *ls, uint32_t entry, char *buf, size_t size)
+{
+    size_t len = 0, name_len, end;
+    uint32_t e;
+
+    for(e = entry; e != LSTREE_NONE; e = ls->entries[e].parent) {
+        name_len = strlen(ls->names + ls->entries[e].name);
+        if(name_len)
+            len += name_len + (len ? 1 : 0);
+    }
+    if(len >= size)
+        return len;
+
+    // from the entry up, so back to front
+    buf[len] = '\0';
+    end = len;
+    for(e = entry; e != LSTREE_NONE; e = ls->entries[e].parent) {
+        name_len = strlen(ls->names + ls->entries[e].name);
+        if(!name_len)
+            continue;
+        end -= name_len;
+        memcpy(buf + end, ls->names + ls->entries[e].name, name_len);
+        if(end)
+            buf[--end] = '/';
+    }
+    return len;
+}
+
+void lstree_release(struct lstree *ls)
+{
+    free(ls->entries);
+    free(ls->names);
+    free(ls->name_slots);
+    free(ls->order);
+    memset(ls, 0, sizeof(struct lstree));
+}
@@ -0,0 +1,48 @@
+#ifndef LSTREE_H
+#define LSTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct tree_resolver;
+
+#define LSTREE_CACHE_BYTES (8 << 20) // per thread
+#define LSTREE_NONE 0xffffffff
+
+#define LSTREE_TREES 1 // list the trees recursed into too, as "ls-tree -t" does
+#define LSTREE_SIZES 2 // get blob sizes, as "ls-tree -l" does
+
+// One entry of the listing. Entry 0 is the root tree, and isn't listed
+// itself.
+struct lstree_entry {
+    unsigned char sha1[20];
+    unsigned int mode;
+    uint32_t name;       // where its name starts in names
+    uint32_t parent;     // the entry for the directory it's in
+    uint32_t children;   // a tree that was recursed into: its first entry; else LSTREE_NONE
+    uint32_t nchildren;
+    uint32_t depth;      // 1 for the entries of the directory listed; 0 for it and those above
+    int64_t size;        // -1 unless sizes were asked for and it's a blob
+};
+
+// A recursive listing. Each path component is kept once in names however
+// many entries share it, so a big tree costs little more than its entries.
+struct lstree {
+    struct lstree_entry *entries;
+    uint32_t count, alloc;
+    char *names;         // \0 terminated names, back to back
+    size_t names_size, names_alloc;
+    uint32_t *name_slots; // hash set of offsets into names, plus one; 0 is empty
+    uint32_t nname_slots, nnames;
+    uint32_t *order;     // the entries listed, in "git ls-tree -r" order
+    uint32_t norder;
+};
+
+int lstree_walk(const struct odb *odb, struct tree_resolver *paths, const unsigned char *start,
+                const char *prefix, int max_depth, int flags, int threads, struct lstree *ls);
+size_t lstree_path(const struct lstree *ls, uint32_t entry, char *buf, size_t size);
+void lstree_release(struct lstree *ls);
+
+
+#endif
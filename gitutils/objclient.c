@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libgitread.h"
+#include "objclient.h"
+
+#define CLIENT_READ_CHUNK 65536
+
+struct objclient *objclient_connect(const char *path)
+{
+    struct objclient *client;
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if(!(client = calloc(1, sizeof(struct objclient))))
+        return NULL;
+    if((client->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        free(client);
+        return NULL;
+    }
+    if(connect(client->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(client->fd);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void objclient_close(struct objclient *client)
+{
+    if(!client)
+        return;
+    close(client->fd);
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+static int flush_requests(struct objclient *client)
+{
+    const char *p = client->out;
+    size_t len = client->out_len;
+    ssize_t n;
+
+    while(len > 0) {
+        if((n = write(client->fd, p, len)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    client->out_len = 0;
+    return 0;
+}
+
+// Queues a request for name (a sha1 or a ref). Requests go out in batches, when
+// objclient_receive() needs a reply. Returns -1 once OBJCLIENT_WINDOW requests
+// are outstanding; receive some replies first.
+int objclient_send(struct objclient *client, const char *name, int info)
+{
+    size_t len = strlen(name), need;
+    char *grown;
+
+    if(client->npending == OBJCLIENT_WINDOW || !len || strchr(name, '\n'))
+        return -1;
+
+    need = client->out_len + len + 6;
+    if(need > client->out_alloc) {
+        if(!(grown = realloc(client->out, need * 2)))
+            return -1;
+        client->out = grown;
+        client->out_alloc = need * 2;
+    }
+    if(info) {
+        memcpy(client->out + client->out_len, "info ", 5);
+        client->out_len += 5;
+    }
+    memcpy(client->out + client->out_len, name, len);
+    client->out_len += len;
+    client->out[client->out_len++] = '\n';
+
+    client->pending[(client->pending_start + client->npending) % OBJCLIENT_WINDOW] = info;
+    client->npending++;
+    return 0;
+}
+
+// Makes sure at least want bytes are buffered.
+static int fill(struct objclient *client, size_t want)
+{
+    char *grown;
+    ssize_t n;
+
+    if(client->in_start) {
+        memmove(client->in, client->in + client->in_start, client->in_len);
+        client->in_start = 0;
+    }
+    while(client->in_len < want) {
+        if(client->in_alloc - client->in_len < CLIENT_READ_CHUNK) {
+            if(!(grown = realloc(client->in, client->in_len + CLIENT_READ_CHUNK)))
+                return -1;
+            client->in = grown;
+            client->in_alloc = client->in_len + CLIENT_READ_CHUNK;
+        }
+        n = read(client->fd, client->in + client->in_len, client->in_alloc - client->in_len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        client->in_len += n;
+    }
+    return 0;
+}
+
+// Returns the next reply line, NUL terminated in place, and consumes it.
+static char *read_line(struct objclient *client)
+{
+    char *line, *nl;
+    size_t scanned = 0;
+
+    for(;;) {
+        line = client->in + client->in_start;
+        if(client->in_len > scanned && (nl = memchr(line + scanned, '\n', client->in_len - scanned))) {
+            *nl = '\0';
+            client->in_start += nl - line + 1;
+            client->in_len -= nl - line + 1;
+            return line;
+        }
+        scanned = client->in_len;
+        if(fill(client, client->in_len + 1) != 0)
+            return NULL;
+    }
+}
+
+static int parse_type(const char *name, unsigned int *type)
+{
+    unsigned int t;
+
+    for(t = 1; t <= 4; t++) {
+        if(strcmp(name, object_type_name(t)) == 0) {
+            *type = t;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads the reply to the oldest outstanding request, sending any queued ones
+// first. A missing object isn't an error: found is just 0 (and corrupt is set
+// if the server had it but it failed verification). Returns -1 if
+// nothing is outstanding or the connection failed; the client is of no more
+// use after that.
+int objclient_receive(struct objclient *client, struct objclient_reply *reply)
+{
+    char *line, *type, *size, *end;
+    size_t have;
+    int info;
+
+    memset(reply, 0, sizeof(*reply));
+    if(!client->npending || flush_requests(client) != 0)
+        return -1;
+    info = client->pending[client->pending_start];
+    client->pending_start = (client->pending_start + 1) % OBJCLIENT_WINDOW;
+    client->npending--;
+
+    if(!(line = read_line(client)))
+        return -1;
+    if((end = strrchr(line, ' ')) && strcmp(end, " missing") == 0)
+        return 0;
+    if(end && strcmp(end, " corrupt") == 0) {
+        reply->corrupt = 1;
+        return 0;
+    }
+
+    // <sha1> <type> <size>
+    if(strlen(line) < 44 || line[40] != ' ')
+        return -1;
+    line[40] = '\0';
+    type = line + 41;
+    if(hex_to_sha1(line, reply->sha1) != 0 || !(size = strchr(type, ' ')))
+        return -1;
+    *size++ = '\0';
+    if(parse_type(type, &reply->type) != 0)
+        return -1;
+    reply->size = strtoul(size, &end, 10);
+    if(end == size || *end)
+        return -1;
+    reply->found = 1;
+    if(info)
+        return 0;
+
+    if(!(reply->data = malloc(reply->size + 1)))
+        return -1;
+    // whatever is buffered, then straight into data, then the trailing newline
+    have = client->in_len < reply->size ? client->in_len : reply->size;
+    memcpy(reply->data, client->in + client->in_start, have);
+    client->in_start += have;
+    client->in_len -= have;
+    while(have < reply->size) {
+        ssize_t n = read(client->fd, reply->data + have, reply->size - have);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            free(reply->data);
+            reply->data = NULL;
+            return -1;
+        }
+        have += n;
+    }
+    reply->data[reply->size] = '\0';
+
+    if(fill(client, 1) != 0 || client->in[client->in_start] != '\n') {
+        free(reply->data);
+        reply->data = NULL;
+        return -1;
+    }
+    client->in_start++;
+    client->in_len--;
+    return 0;
+}
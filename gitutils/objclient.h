@@ -0,0 +1,37 @@
+#ifndef OBJCLIENT_H
+#define OBJCLIENT_H
+
+#include <stddef.h>
+
+// Most requests that can be sent before their replies have to be read. The
+// server answers while we're still sending, so this bounds what either side
+// can have waiting on the other.
+#define OBJCLIENT_WINDOW 64
+
+// A connection to an objserver (see objserver.c for the protocol).
+struct objclient {
+    int fd;
+    char *in;                 // replies read but not yet handed out
+    size_t in_start, in_len, in_alloc;
+    char *out;                // requests not yet sent
+    size_t out_len, out_alloc;
+    unsigned char pending[OBJCLIENT_WINDOW]; // whether each outstanding request was an info one
+    unsigned int pending_start, npending;
+};
+
+struct objclient_reply {
+    int found;
+    int corrupt;              // not found because it failed the server's verification (objserver -V)
+    unsigned char sha1[20];
+    unsigned int type;
+    unsigned long size;
+    unsigned char *data;      // malloc()'d and NUL terminated; NULL for info requests
+};
+
+struct objclient *objclient_connect(const char *path);
+void objclient_close(struct objclient *client);
+int objclient_send(struct objclient *client, const char *name, int info);
+int objclient_receive(struct objclient *client, struct objclient_reply *reply);
+
+
+#endif
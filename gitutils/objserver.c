@@ -0,0 +1,646 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "refs.h"
+
+// A long-running object server. It speaks "git cat-file --batch" over a Unix
+// domain socket, so every worker process on a host shares one set of open
+// packs and one warm cache instead of each keeping its own.
+//
+// A request is a line: "<name>" or "contents <name>" for the object, or
+// "info <name>" for just its header, where name is a 40 digit sha1 or a ref
+// ("master", "refs/tags/v1.0"). The replies are
+//
+//     <sha1> <type> <size>\n<contents>\n
+//     <sha1> <type> <size>\n                  (info)
+//     <name> missing\n
+//     <name> corrupt\n                       (with -V, it didn't hash to its id)
+//
+// Requests can be pipelined; replies come back in order.
+//
+// The main thread polls the listening socket and every idle connection. A
+// connection with input is handed to a worker, which reads what is there,
+// answers the complete requests and hands it back. Sockets are non-blocking:
+// a worker never waits on a client that isn't reading its replies. What the
+// socket won't take stays buffered, the connection goes back to the poller to
+// wait until it's writable, and no more of its requests are answered until
+// that has gone out, so a stalled client only holds about OUT_FLUSH bytes
+// and one object rather than a worker. Every so often the main
+// thread also checks objects/pack for packs added or removed by a fetch or a
+// repack; workers pick up the new set at their next connection, and a pack is
+// only unmapped (and dropped from the caches) once nothing is reading it.
+
+#define OBJECT_CACHE_SHARDS 16
+#define READ_CHUNK 65536
+#define OUT_FLUSH 65536     // replies are batched up to this much, and no more are
+                            // answered while this much is still waiting to go out
+
+struct conn {
+    int fd;
+    int closed;
+    char *in;               // a partial request left over from the last read
+    size_t in_len, in_alloc;
+    char *out;              // replies the socket hasn't taken yet
+    size_t out_len, out_alloc;
+};
+
+struct server {
+    struct odb *odb;                         // the latest snapshot of the packs
+    pthread_mutex_t odb_lock;                // for swapping it
+    int refresh_ms;                          // how often to look for new packs
+    struct ref_store *refs;
+    pthread_mutex_t refs_lock;               // the ref store isn't thread safe
+    struct base_cache *bases;                // delta bases, shared by all workers
+    struct base_cache *objects[OBJECT_CACHE_SHARDS]; // whole objects
+
+    int listen_fd;
+    int wake[2];                             // workers and signals poke the poller here
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct conn **ready;                     // waiting for a worker
+    size_t nready, ready_alloc;
+    struct conn **done;                      // waiting to go back to the poller
+    size_t ndone, done_alloc;
+    int stopping;
+};
+
+static volatile sig_atomic_t stop_requested;
+static int signal_fd = -1;
+
+static void on_signal(int sig)
+{
+    stop_requested = 1;
+    if(signal_fd >= 0)
+        (void) !write(signal_fd, "s", 1);
+}
+
+static int push(struct conn ***list, size_t *count, size_t *alloc, struct conn *c)
+{
+    struct conn **grown;
+    size_t n;
+
+    if(*count == *alloc) {
+        n = *alloc ? *alloc * 2 : 16;
+        if(!(grown = realloc(*list, sizeof(struct conn *) * n)))
+            return -1;
+        *list = grown;
+        *alloc = n;
+    }
+    (*list)[(*count)++] = c;
+    return 0;
+}
+
+static void conn_free(struct conn *c)
+{
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Writes as much of buf as the socket takes without blocking, and returns how
+// much that was. A write error closes the connection.
+static size_t write_some(struct conn *c, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    ssize_t n;
+
+    while(!c->closed && sent < len) {
+        if((n = write(c->fd, (const char *) buf + sent, len - sent)) < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                c->closed = 1;
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Sends what's buffered; whatever the socket won't take yet is kept.
+static void flush_out(struct conn *c)
+{
+    size_t sent;
+
+    if(c->closed || !c->out_len)
+        return;
+    sent = write_some(c, c->out, c->out_len);
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+}
+
+static void append_out(struct conn *c, const void *data, size_t len)
+{
+    char *grown;
+    size_t alloc;
+
+    if(c->closed)
+        return;
+    if(c->out_len + len > c->out_alloc) {
+        for(alloc = c->out_alloc ? c->out_alloc : 4096; alloc < c->out_len + len; alloc *= 2)
+            ;
+        if(!(grown = realloc(c->out, alloc))) {
+            c->closed = 1;
+            return;
+        }
+        c->out = grown;
+        c->out_alloc = alloc;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+static void reply(struct conn *c, const unsigned char *sha1, unsigned int type, unsigned long size,
+                  const unsigned char *data)
+{
+    static const char hex[] = "0123456789abcdef";
+    char header[128];
+    size_t sent = 0;
+    int len, i;
+
+    // not sha1_to_hex(); its buffers are shared between threads
+    for(i = 0; i < 20; i++) {
+        header[i * 2] = hex[sha1[i] >> 4];
+        header[i * 2 + 1] = hex[sha1[i] & 0xf];
+    }
+    len = 40 + snprintf(header + 40, sizeof(header) - 40, " %s %lu\n", object_type_name(type), size);
+    append_out(c, header, len);
+    if(!data)
+        return;
+    if(size > OUT_FLUSH) {
+        // big objects go straight out rather than through the buffer, as far
+        // as the socket takes them
+        flush_out(c);
+        if(!c->out_len)
+            sent = write_some(c, data, size);
+    }
+    append_out(c, data + sent, size - sent);
+    append_out(c, "\n", 1);
+    if(c->out_len > OUT_FLUSH)
+        flush_out(c);
+}
+
+static struct base_cache *object_shard(struct server *srv, uint64_t offset)
+{
+    return srv->objects[(offset >> 4) % OBJECT_CACHE_SHARDS];
+}
+
+static int serve_object(struct server *srv, const struct odb *odb, struct conn *c,
+                        const unsigned char *sha1, int info)
+{
+    struct odb_location loc;
+    struct base_cache_entry *hit;
+    struct base_cache *shard;
+    struct git_object g_obj;
+    const struct pack *pack;
+    int ret;
+
+    if(odb_find(odb, sha1, &loc) != 0)
+        return -1;
+
+    if(loc.pack < 0) {
+        // loose objects are few and usually new; they aren't worth caching
+        if((ret = odb_read_at(odb, sha1, &loc, &g_obj, NULL)) != 0)
+            return ret;
+        reply(c, sha1, g_obj.type, g_obj.size, info ? NULL : g_obj.mem_data);
+        free(g_obj.mem_data);
+        return 0;
+    }
+
+    pack = odb->packs[loc.pack];
+    shard = object_shard(srv, loc.offset);
+    if((hit = base_cache_get(shard, pack, loc.offset))) {
+        reply(c, sha1, hit->type, hit->size, info ? NULL : hit->data);
+        base_cache_release(shard, hit);
+        return 0;
+    }
+
+    if(pack_read_object(pack, odb->idxs[loc.pack], loc.offset, &g_obj, srv->bases, 0) != 0)
+        return -1;
+    // checked once on the way into the cache; hits were checked then
+    if(odb->verify && check_object_hash(sha1, g_obj.type, g_obj.mem_data, g_obj.size) != 0) {
+        free(g_obj.mem_data);
+        return GITREAD_CORRUPT;
+    }
+    reply(c, sha1, g_obj.type, g_obj.size, info ? NULL : g_obj.mem_data);
+    if(base_cache_put(shard, pack, loc.offset, g_obj.type, g_obj.mem_data, g_obj.size) != 0)
+        free(g_obj.mem_data);
+    return 0;
+}
+
+static int resolve_name(struct server *srv, const char *name, unsigned char *sha1)
+{
+    struct ref ref;
+    int ret;
+
+    if(strlen(name) == 40 && hex_to_sha1(name, sha1) == 0)
+        return 0;
+
+    pthread_mutex_lock(&srv->refs_lock);
+    if((ret = refs_dwim(srv->refs, name, &ref)) == 0)
+        memcpy(sha1, ref.sha1, 20);
+    refs_release(&ref);
+    pthread_mutex_unlock(&srv->refs_lock);
+    return ret;
+}
+
+static void serve_request(struct server *srv, const struct odb *odb, struct conn *c, char *line)
+{
+    unsigned char sha1[20];
+    int info = 0, ret = -1;
+
+    if(strncmp(line, "info ", 5) == 0) {
+        info = 1;
+        line += 5;
+    } else if(strncmp(line, "contents ", 9) == 0) {
+        line += 9;
+    }
+
+    if(resolve_name(srv, line, sha1) == 0 && (ret = serve_object(srv, odb, c, sha1, info)) == 0)
+        return;
+    append_out(c, line, strlen(line));
+    if(ret == GITREAD_CORRUPT)
+        append_out(c, " corrupt\n", 9);
+    else
+        append_out(c, " missing\n", 9);
+}
+
+// Reads what the client has sent, without waiting for more. Returns -1 if
+// there was nothing to read; the connection is closed if the client has gone.
+static int read_in(struct conn *c)
+{
+    char *grown;
+    ssize_t n;
+
+    if(c->in_alloc - c->in_len < READ_CHUNK) {
+        if(!(grown = realloc(c->in, c->in_len + READ_CHUNK + 1))) {
+            c->closed = 1;
+            return -1;
+        }
+        c->in = grown;
+        c->in_alloc = c->in_len + READ_CHUNK + 1;
+    }
+    do {
+        n = read(c->fd, c->in + c->in_len, c->in_alloc - c->in_len - 1);
+    } while(n < 0 && errno == EINTR);
+    if(n <= 0) {
+        if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            c->closed = 1;
+        return -1;
+    }
+    c->in_len += n;
+    return 0;
+}
+
+// Sends what was left over from last time, then answers the complete requests
+// already read or, if there are none, reads what the client has sent. It stops
+// answering while OUT_FLUSH or more is waiting to go out; the poller brings the
+// connection back once the socket is writable.
+static void serve_conn(struct server *srv, struct conn *c)
+{
+    char *line, *nl, *end;
+    struct odb *odb;
+    size_t left;
+
+    flush_out(c);
+    if(c->closed || c->out_len)
+        return;
+    if((!c->in_len || !memchr(c->in, '\n', c->in_len)) && read_in(c) != 0)
+        return;
+
+    // the poller may swap in a new snapshot meanwhile; this one stays usable
+    pthread_mutex_lock(&srv->odb_lock);
+    odb = odb_ref(srv->odb);
+    pthread_mutex_unlock(&srv->odb_lock);
+
+    line = c->in;
+    end = c->in + c->in_len;
+    // reply() sends once more than OUT_FLUSH has built up, so going past it
+    // means the socket is full
+    do {
+        while(!c->closed && c->out_len <= OUT_FLUSH && (nl = memchr(line, '\n', end - line))) {
+            *nl = '\0';
+            if(nl > line && nl[-1] == '\r')
+                nl[-1] = '\0';
+            if(*line)
+                serve_request(srv, odb, c, line);
+            line = nl + 1;
+        }
+        flush_out(c);
+    } while(!c->closed && !c->out_len && memchr(line, '\n', end - line));
+    odb_close(odb);
+
+    left = end - line;
+    memmove(c->in, line, left);
+    c->in_len = left;
+    if(!c->out_len && c->in_len > 4096) // nobody sends a name that long
+        c->closed = 1;
+}
+
+static void *worker(void *data)
+{
+    struct server *srv = data;
+    struct conn *c;
+
+    for(;;) {
+        pthread_mutex_lock(&srv->lock);
+        while(!srv->nready && !srv->stopping)
+            pthread_cond_wait(&srv->cond, &srv->lock);
+        if(srv->stopping) {
+            pthread_mutex_unlock(&srv->lock);
+            return NULL;
+        }
+        c = srv->ready[--srv->nready];
+        pthread_mutex_unlock(&srv->lock);
+
+        serve_conn(srv, c);
+
+        pthread_mutex_lock(&srv->lock);
+        if(push(&srv->done, &srv->ndone, &srv->done_alloc, c) != 0)
+            c->closed = 1; // the poller never sees it again; leak it rather than race
+        pthread_mutex_unlock(&srv->lock);
+        (void) !write(srv->wake[1], "w", 1);
+    }
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long.\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    // a socket left behind by a server that's gone is fine to replace
+    if(lstat(path, &st) == 0) {
+        if(!S_ISSOCK(st.st_mode) || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            printf("%s is in use.\n", path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        unlink(path);
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+    }
+
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        printf("Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A pack is being unmapped. Its address may be reused by the next one mapped,
+// so nothing may be left in the caches under it.
+static void retire_pack(const struct pack *pack, void *data)
+{
+    struct server *srv = data;
+    size_t i;
+
+    base_cache_drop_pack(srv->bases, pack);
+    for(i = 0; i < OBJECT_CACHE_SHARDS; i++)
+        base_cache_drop_pack(srv->objects[i], pack);
+}
+
+static void refresh_packs(struct server *srv)
+{
+    struct odb *fresh, *old;
+
+    if(odb_refresh(srv->odb, 0, &fresh) <= 0)
+        return;
+    pthread_mutex_lock(&srv->odb_lock);
+    old = srv->odb;
+    srv->odb = fresh;
+    pthread_mutex_unlock(&srv->odb_lock);
+    odb_close(old);
+    printf("Packs changed; now serving %d.\n", fresh->npacks);
+    fflush(stdout);
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// The poller: owns every connection that isn't with a worker.
+static void serve(struct server *srv)
+{
+    struct conn **idle = NULL, *c;
+    size_t nidle = 0, idle_alloc = 0, i, j;
+    struct pollfd *fds = NULL, *grown;
+    size_t fds_alloc = 0;
+    char drain[64];
+    long next_refresh = now_ms() + srv->refresh_ms, wait;
+    int fd;
+
+    while(!stop_requested) {
+        if(nidle + 2 > fds_alloc) {
+            fds_alloc = (nidle + 2) * 2;
+            if(!(grown = realloc(fds, sizeof(struct pollfd) * fds_alloc)))
+                break;
+            fds = grown;
+        }
+        fds[0].fd = srv->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = srv->wake[0];
+        fds[1].events = POLLIN;
+        // one with replies still to send isn't read from until they've gone
+        for(i = 0; i < nidle; i++) {
+            fds[i + 2].fd = idle[i]->fd;
+            fds[i + 2].events = idle[i]->out_len ? POLLOUT : POLLIN;
+        }
+        wait = -1;
+        if(srv->refresh_ms > 0 && (wait = next_refresh - now_ms()) <= 0) {
+            // only this thread refreshes, so odb_refresh() needs no lock
+            refresh_packs(srv);
+            next_refresh = now_ms() + srv->refresh_ms;
+            wait = srv->refresh_ms;
+        }
+        if(poll(fds, nidle + 2, (int) wait) < 0) {
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        if(stop_requested)
+            break;
+
+        // hand connections with input, or room for their output, to the workers
+        pthread_mutex_lock(&srv->lock);
+        for(i = 0, j = 0; i < nidle; i++) {
+            if(fds[i + 2].revents && push(&srv->ready, &srv->nready, &srv->ready_alloc, idle[i]) == 0)
+                continue;
+            idle[j++] = idle[i];
+        }
+        nidle = j;
+        pthread_cond_broadcast(&srv->cond);
+
+        // and take back the ones they've finished with
+        if(fds[1].revents)
+            (void) !read(srv->wake[0], drain, sizeof(drain));
+        while(srv->ndone) {
+            c = srv->done[--srv->ndone];
+            if(c->closed || push(&idle, &nidle, &idle_alloc, c) != 0)
+                conn_free(c);
+        }
+        pthread_mutex_unlock(&srv->lock);
+
+        if(fds[0].revents && (fd = accept(srv->listen_fd, NULL, NULL)) >= 0) {
+            c = NULL;
+            if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+               !(c = calloc(1, sizeof(struct conn))) || push(&idle, &nidle, &idle_alloc, c) != 0) {
+                free(c);
+                close(fd);
+                continue;
+            }
+            c->fd = fd;
+        }
+    }
+
+    for(i = 0; i < nidle; i++)
+        conn_free(idle[i]);
+    free(idle);
+    free(fds);
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-t threads] [-c object cache MB] [-d delta base cache MB] [-r refresh seconds]\n"
+           "          [-V] <git dir> <socket>\n"
+           "  -V  check every object served hashes to its id\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct server srv;
+    struct sigaction sa;
+    pthread_t *workers;
+    size_t object_mb = 256, delta_mb = 64;
+    int threads = 0, verify = 0, opt, t, started = 0;
+    double refresh = 1;
+    size_t i;
+
+    while((opt = getopt(argc, argv, "t:c:d:r:Vh")) != -1) {
+        switch(opt) {
+        case 't': threads = atoi(optarg); break;
+        case 'c': object_mb = strtoul(optarg, NULL, 10); break;
+        case 'd': delta_mb = strtoul(optarg, NULL, 10); break;
+        case 'r': refresh = atof(optarg); break;
+        case 'V': verify = 1; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+
+    memset(&srv, 0, sizeof(srv));
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_mutex_init(&srv.refs_lock, NULL);
+    pthread_mutex_init(&srv.odb_lock, NULL);
+    srv.refresh_ms = refresh > 0 ? (int) (refresh * 1000) : 0;
+    pthread_cond_init(&srv.cond, NULL);
+
+    if(!(srv.odb = odb_open(argv[optind]))) {
+        printf("Failed to open the object store in %s.\n", argv[optind]);
+        return 1;
+    }
+    if(!(srv.refs = refs_open(argv[optind])) || !(srv.bases = base_cache_new_shared(delta_mb << 20))) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    for(i = 0; i < OBJECT_CACHE_SHARDS; i++) {
+        if(!(srv.objects[i] = base_cache_new_shared((object_mb << 20) / OBJECT_CACHE_SHARDS))) {
+            printf("Out of memory.\n");
+            return 1;
+        }
+    }
+    odb_set_retire_hook(srv.odb, retire_pack, &srv);
+    odb_set_verify(srv.odb, verify);
+    if(pipe(srv.wake) != 0 || (srv.listen_fd = listen_on(argv[optind + 1])) < 0)
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal_fd = srv.wake[1];
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if(!(workers = malloc(sizeof(pthread_t) * threads)))
+        return 1;
+    for(t = 0; t < threads; t++) {
+        if(pthread_create(&workers[t], NULL, worker, &srv) != 0)
+            break;
+        started++;
+    }
+    if(!started) {
+        printf("Failed to start any workers.\n");
+        return 1;
+    }
+    printf("Serving %s on %s with %d threads.\n", argv[optind], argv[optind + 1], started);
+    fflush(stdout);
+
+    serve(&srv);
+
+    pthread_mutex_lock(&srv.lock);
+    srv.stopping = 1;
+    pthread_cond_broadcast(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+    for(t = 0; t < started; t++)
+        pthread_join(workers[t], NULL);
+
+    while(srv.nready)
+        conn_free(srv.ready[--srv.nready]);
+    while(srv.ndone)
+        conn_free(srv.done[--srv.ndone]);
+    close(srv.listen_fd);
+    unlink(argv[optind + 1]);
+
+    free(workers);
+    free(srv.ready);
+    free(srv.done);
+    odb_set_retire_hook(srv.odb, NULL, NULL); // the caches go first
+    for(i = 0; i < OBJECT_CACHE_SHARDS; i++)
+        base_cache_free(srv.objects[i]);
+    base_cache_free(srv.bases);
+    refs_close(srv.refs);
+    odb_close(srv.odb);
+    return 0;
+}
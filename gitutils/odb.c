@@ -0,0 +1,575 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "libgitread.h"
+#include "odb.h"
+#include "basecache.h"
+#include "stats.h"
+
+// Builds <objects dir>/xx/yyyy... for a loose object; path needs room for
+// strlen(objects_dir) + 43 bytes. This doesn't use sha1_to_hex(), whose
+// static buffers would make odb reads unsafe to share between threads.
+void odb_loose_path(const struct odb *odb, const unsigned char *sha1, char *path)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *p = path + strlen(odb->objects_dir);
+    int i;
+
+    memcpy(path, odb->objects_dir, p - path);
+    *p++ = '/';
+    for(i = 0; i < 20; i++) {
+        *p++ = hex[sha1[i] >> 4];
+        *p++ = hex[sha1[i] & 0xf];
+        if(i == 0)
+            *p++ = '/';
+    }
+    *p = '\0';
+}
+
+static void odb_pack_unref(struct odb_pack *op)
+{
+    if(__sync_sub_and_fetch(&op->refs, 1) != 0)
+        return;
+    if(op->retire)
+        op->retire(op->pack, op->retire_data);
+    unload_idx(op->idx);
+    unload_pack(op->pack);
+    free(op->idx_name);
+    free(op);
+}
+
+static struct odb_pack *odb_pack_load(const char *pack_dir, const char *idx_name, const struct stat *st)
+{
+    size_t dir_len = strlen(pack_dir), name_len = strlen(idx_name);
+    char *idx_location, *pack_location;
+    struct odb_pack *op;
+
+    if(!(op = calloc(1, sizeof(struct odb_pack))))
+        return NULL;
+    if(!(op->idx_name = strdup(idx_name)) || !(idx_location = malloc(dir_len + name_len + 2))) {
+        free(op->idx_name);
+        free(op);
+        return NULL;
+    }
+    sprintf(idx_location, "%s/%s", pack_dir, idx_name);
+    if((pack_location = malloc(dir_len + name_len + 3))) {
+        sprintf(pack_location, "%s/%.*spack", pack_dir, (int) name_len - 3, idx_name);
+        if((op->pack = load_pack(pack_location)))
+            op->idx = load_idx(idx_location);
+        free(pack_location);
+    }
+    free(idx_location);
+
+    if(!op->idx) {
+        if(op->pack)
+            unload_pack(op->pack);
+        free(op->idx_name);
+        free(op);
+        return NULL;
+    }
+    op->dev = st->st_dev;
+    op->ino = st->st_ino;
+    op->size = st->st_size;
+    op->refs = 1;
+    return op;
+}
+
+// Adds a pack to a snapshot that's being built, taking over a reference to it.
+static int odb_add_pack(struct odb *odb, struct odb_pack *op)
+{
+    struct pack **packs;
+    struct idx **idxs;
+    struct odb_pack **shared;
+
+    if((packs = realloc(odb->packs, sizeof(struct pack *) * (odb->npacks + 1))))
+        odb->packs = packs;
+    if((idxs = realloc(odb->idxs, sizeof(struct idx *) * (odb->npacks + 1))))
+        odb->idxs = idxs;
+    if((shared = realloc(odb->shared, sizeof(struct odb_pack *) * (odb->npacks + 1))))
+        odb->shared = shared;
+    if(!packs || !idxs || !shared) {
+        odb_pack_unref(op);
+        return -1;
+    }
+
+    op->retire = odb->retire;
+    op->retire_data = odb->retire_data;
+    odb->packs[odb->npacks] = op->pack;
+    odb->idxs[odb->npacks] = op->idx;
+    odb->shared[odb->npacks] = op;
+    odb->npacks++;
+    return 0;
+}
+
+// Fills odb with the packs in objects/pack. Those old (which may be NULL)
+// already has are shared rather than loaded again; new ones go first, since
+// that's where recent objects are. Packs that fail to load are skipped with a
+// message; the objects in them will simply be missing.
+static int odb_scan_packs(struct odb *odb, const struct odb *old)
+{
+    char *pack_dir, *path;
+    unsigned char *kept = NULL;
+    struct odb_pack *op;
+    struct dirent *de;
+    struct stat st;
+    size_t len;
+    DIR *dir;
+    int i, ret = 0;
+
+    if(!(pack_dir = malloc(strlen(odb->objects_dir) + sizeof("/pack"))))
+        return -1;
+    sprintf(pack_dir, "%s/pack", odb->objects_dir);
+    if(!(path = malloc(strlen(pack_dir) + NAME_MAX + 2)) ||
+       (old && !(kept = calloc(old->npacks ? old->npacks : 1, 1)))) {
+        free(path);
+        free(pack_dir);
+        return -1;
+    }
+
+    // stamped before reading, so anything added during the scan is seen next time
+    odb->scanned = time(NULL);
+    odb->pack_dir_mtime = (stat(pack_dir, &st) == 0) ? st.st_mtime : 0;
+
+    if((dir = opendir(pack_dir))) {
+        while(ret == 0 && (de = readdir(dir))) {
+            len = strlen(de->d_name);
+            if(len < 5 || strcmp(de->d_name + len - 4, ".idx") != 0)
+                continue;
+            sprintf(path, "%s/%s", pack_dir, de->d_name);
+            if(stat(path, &st) != 0)
+                continue; // deleted since readdir()
+
+            for(i = 0; old && i < old->npacks; i++) {
+                op = old->shared[i];
+                if(strcmp(op->idx_name, de->d_name) == 0 && op->dev == st.st_dev &&
+                   op->ino == st.st_ino && op->size == st.st_size) {
+                    kept[i] = 1;
+                    break;
+                }
+            }
+            if(old && i < old->npacks)
+                continue;
+
+            // one that's half written is tried again at the next refresh
+            if(!(op = odb_pack_load(pack_dir, de->d_name, &st)))
+                STATS_INC(packs_skipped);
+            else
+                ret = odb_add_pack(odb, op);
+        }
+        closedir(dir);
+    }
+
+    for(i = 0; ret == 0 && old && i < old->npacks; i++) {
+        if(kept[i]) {
+            __sync_add_and_fetch(&old->shared[i]->refs, 1);
+            ret = odb_add_pack(odb, old->shared[i]);
+        }
+    }
+
+    free(kept);
+    free(path);
+    free(pack_dir);
+    return ret;
+}
+
+static struct odb *odb_alloc(const char *objects_dir)
+{
+    struct odb *odb;
+
+    if(!(odb = calloc(1, sizeof(struct odb))))
+        return NULL;
+    if(!(odb->objects_dir = strdup(objects_dir))) {
+        free(odb);
+        return NULL;
+    }
+    odb->refs = 1;
+    return odb;
+}
+
+// Opens the object store of the repository at git_dir (the .git directory,
+// or a bare repository).
+struct odb *odb_open(const char *git_dir)
+{
+    struct odb *odb;
+    struct stat st;
+    char *objects_dir;
+
+    if(!(objects_dir = malloc(strlen(git_dir) + sizeof("/objects"))))
+        return NULL;
+    sprintf(objects_dir, "%s/objects", git_dir);
+    if(stat(objects_dir, &st) != 0 || !S_ISDIR(st.st_mode) || !(odb = odb_alloc(objects_dir))) {
+        free(objects_dir);
+        return NULL;
+    }
+    free(objects_dir);
+
+    if(odb_scan_packs(odb, NULL) != 0) {
+        odb_close(odb);
+        return NULL;
+    }
+    return odb;
+}
+
+// Takes another reference to a snapshot, for a reader that may outlive the
+// owner's (e.g. one that runs while the owner refreshes).
+struct odb *odb_ref(struct odb *odb)
+{
+    __sync_add_and_fetch(&odb->refs, 1);
+    return odb;
+}
+
+// Drops a reference; the last one frees the snapshot and lets go of its packs.
+void odb_close(struct odb *odb)
+{
+    int i;
+
+    if(!odb || __sync_sub_and_fetch(&odb->refs, 1) != 0)
+        return;
+
+    for(i = 0; i < odb->npacks; i++)
+        odb_pack_unref(odb->shared[i]);
+    free(odb->packs);
+    free(odb->idxs);
+    free(odb->shared);
+    free(odb->objects_dir);
+    free(odb);
+}
+
+// Checks whether packs have been added to or removed from objects/pack since
+// odb was made. Unless force is set, the directory's mtime is trusted when it
+// hasn't moved, except within the second of the last scan, when a change could
+// hide behind it. Returns 1 with a new snapshot in *fresh when the set has
+// changed (odb itself is left as it was), 0 if it hasn't, and -1 on errors.
+// Only one thread may refresh a given odb at a time; others can keep reading
+// it meanwhile.
+int odb_refresh(struct odb *odb, int force, struct odb **fresh)
+{
+    struct odb *next;
+    struct stat st;
+    char *pack_dir;
+    time_t mtime;
+    int i, same;
+
+    *fresh = NULL;
+    if(!(pack_dir = malloc(strlen(odb->objects_dir) + sizeof("/pack"))))
+        return -1;
+    sprintf(pack_dir, "%s/pack", odb->objects_dir);
+    mtime = (stat(pack_dir, &st) == 0) ? st.st_mtime : 0;
+    free(pack_dir);
+    if(!force && mtime == odb->pack_dir_mtime && mtime < odb->scanned)
+        return 0;
+
+    if(!(next = odb_alloc(odb->objects_dir)))
+        return -1;
+    next->retire = odb->retire;
+    next->retire_data = odb->retire_data;
+    next->verify = odb->verify;
+    if(odb_scan_packs(next, odb) != 0) {
+        odb_close(next);
+        return -1;
+    }
+
+    same = (next->npacks == odb->npacks);
+    for(i = 0; same && i < odb->npacks; i++)
+        same = (next->shared[i] == odb->shared[i]);
+    if(same) {
+        // nothing to swap; just remember that we looked
+        odb->pack_dir_mtime = next->pack_dir_mtime;
+        odb->scanned = next->scanned;
+        odb_close(next);
+        return 0;
+    }
+
+    next->generation = odb->generation + 1;
+    *fresh = next;
+    return 1;
+}
+
+// Sets a function to call as each of odb's packs is finally unloaded. Later
+// snapshots made by odb_refresh() inherit it.
+void odb_set_retire_hook(struct odb *odb, odb_retire_fn fn, void *data)
+{
+    int i;
+
+    odb->retire = fn;
+    odb->retire_data = data;
+    for(i = 0; i < odb->npacks; i++) {
+        odb->shared[i]->retire = fn;
+        odb->shared[i]->retire_data = data;
+    }
+}
+
+// Turns verified reads on or off. With them on, every object read through odb
+// is hashed and checked against the id it was asked for, which costs a SHA-1
+// over its data; one that doesn't match is an error (GITREAD_CORRUPT) rather
+// than bad data passed on. Later snapshots made by odb_refresh() inherit it.
+void odb_set_verify(struct odb *odb, int verify)
+{
+    odb->verify = verify;
+}
+
+// Drops an object that didn't hash to its id.
+static int odb_reject(struct git_object *g_obj)
+{
+    free(g_obj->mem_data);
+    g_obj->mem_data = NULL;
+    return GITREAD_CORRUPT;
+}
+
+// Finds where an object is stored, without reading it.
+int odb_find(const struct odb *odb, const unsigned char *sha1, struct odb_location *loc)
+{
+    struct stat st;
+    char *path;
+    int i, ret;
+
+    for(i = 0; i < odb->npacks; i++) {
+        if(idx_find(odb->idxs[i], sha1, &loc->pos) == 0) {
+            loc->pack = i;
+            loc->offset = idx_offset(odb->idxs[i], loc->pos);
+            return 0;
+        }
+    }
+
+    if(!(path = malloc(strlen(odb->objects_dir) + 43)))
+        return -1;
+    odb_loose_path(odb, sha1, path);
+    ret = stat(path, &st);
+    free(path);
+    if(ret != 0)
+        return -1;
+
+    loc->pack = -1;
+    loc->pos = 0;
+    loc->offset = 0;
+    return 0;
+}
+
+// Reads an object that odb_find() has already located. The cache, which may
+// be NULL, belongs to the calling thread. Returns 0, -1, or GITREAD_CORRUPT
+// when verifying and the object isn't what it should be.
+int odb_read_at(const struct odb *odb, const unsigned char *sha1, const struct odb_location *loc,
+                struct git_object *g_obj, struct base_cache *cache)
+{
+    char *path;
+    int ret;
+
+    if(loc->pack >= 0) {
+        if(pack_read_object(odb->packs[loc->pack], odb->idxs[loc->pack], loc->offset, g_obj, cache, 0) != 0)
+            return -1;
+        if(odb->verify && check_object_hash(sha1, g_obj->type, g_obj->mem_data, g_obj->size) != 0)
+            return odb_reject(g_obj);
+        return 0;
+    }
+
+    if(!(path = malloc(strlen(odb->objects_dir) + 43)))
+        return -1;
+    odb_loose_path(odb, sha1, path);
+    ret = loose_get_object(path, g_obj, 1);
+    free(path);
+    if(ret != 0) {
+        free(g_obj->mem_data);
+        g_obj->mem_data = NULL;
+        return -1;
+    }
+    if(odb->verify && check_object_hash(sha1, g_obj->type, g_obj->mem_data, g_obj->size) != 0)
+        return odb_reject(g_obj);
+    return 0;
+}
+
+int odb_read(const struct odb *odb, const unsigned char *sha1, struct git_object *g_obj, struct base_cache *cache)
+{
+    struct odb_location loc;
+
+    g_obj->mem_data = NULL;
+    if(odb_find(odb, sha1, &loc) != 0)
+        return -1;
+    return odb_read_at(odb, sha1, &loc, g_obj, cache);
+}
+
+// Gets an object's size without reading all of it where that's cheaper: a
+// packed object's is in its header, and a loose blob's header is all that's
+// inflated.
+int odb_object_size(const struct odb *odb, const unsigned char *sha1, uint64_t *size)
+{
+    struct odb_location loc;
+    struct git_object g_obj;
+    char *path;
+    int ret;
+
+    if(odb_find(odb, sha1, &loc) != 0)
+        return -1;
+    if(loc.pack >= 0)
+        return pack_object_size(odb->packs[loc.pack], loc.offset, size);
+
+    if(!(path = malloc(strlen(odb->objects_dir) + 43)))
+        return -1;
+    odb_loose_path(odb, sha1, path);
+    ret = loose_get_object(path, &g_obj, 0);
+    free(path);
+    if(ret == 0)
+        *size = g_obj.size;
+    free(g_obj.mem_data);
+    return ret;
+}
+
+struct batch_item {
+    int index;           // where in the caller's arrays it goes
+    int pack;
+    uint32_t pos;        // in that pack's idx
+    uint64_t offset;
+};
+
+static int compare_batch_items(const void *a, const void *b)
+{
+    const struct batch_item *x = a, *y = b;
+
+    if(x->pack != y->pack)
+        return x->pack < y->pack ? -1 : 1;
+    if(x->offset != y->offset)
+        return x->offset < y->offset ? -1 : 1;
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Lists the offsets of every base the items' delta chains go through. Only
+// the entry headers are read, which is cheap next to inflating anything.
+static int collect_bases(const struct pack *pack, const struct idx *idx, const struct batch_item *items,
+                         int count, uint64_t **bases, size_t *nbases)
+{
+    size_t alloc = count + 16;
+    struct pack_entry entry;
+    uint64_t cur, *grown;
+    unsigned int depth;
+    uint32_t pos;
+    int i;
+
+    *nbases = 0;
+    if(!(*bases = malloc(sizeof(uint64_t) * alloc)))
+        return -1;
+    for(i = 0; i < count; i++) {
+        cur = items[i].offset;
+        for(depth = 0; depth < PACK_MAX_DELTA_CHAIN; depth++) {
+            if(pack_entry_header(pack, cur, &entry) != 0)
+                break;
+            if(entry.type == OFS_DELTA)
+                cur = entry.base_offset;
+            else if(entry.type == REF_DELTA && idx && idx_find(idx, entry.base_sha1, &pos) == 0)
+                cur = idx_offset(idx, pos);
+            else
+                break;
+
+            if(*nbases == alloc) {
+                alloc *= 2;
+                if(!(grown = realloc(*bases, sizeof(uint64_t) * alloc)))
+                    return -1;
+                *bases = grown;
+            }
+            (*bases)[(*nbases)++] = cur;
+        }
+    }
+    qsort(*bases, *nbases, sizeof(uint64_t), compare_offsets);
+    return 0;
+}
+
+// Reads objects from one pack in offset order. An object that is also a base
+// of another one in the batch is kept in the cache for it.
+static void read_pack_items(const struct odb *odb, const struct batch_item *items, int count,
+                            struct git_object *objects, struct base_cache *cache)
+{
+    const struct pack *pack = odb->packs[items[0].pack];
+    const struct idx *idx = odb->idxs[items[0].pack];
+    struct git_object *g_obj, *prev;
+    uint64_t *bases = NULL;
+    size_t nbases = 0;
+    int i, is_base;
+
+    if(count > 1 && collect_bases(pack, idx, items, count, &bases, &nbases) != 0)
+        nbases = 0; // still correct, just slower
+
+    for(i = 0; i < count; i++) {
+        g_obj = &objects[items[i].index];
+        if(i > 0 && items[i].offset == items[i - 1].offset) {
+            // asked for twice
+            prev = &objects[items[i - 1].index];
+            *g_obj = *prev;
+            if(prev->mem_data && (g_obj->mem_data = malloc(prev->size + 1)))
+                memcpy(g_obj->mem_data, prev->mem_data, prev->size + 1);
+            continue;
+        }
+        is_base = nbases && bsearch(&items[i].offset, bases, nbases, sizeof(uint64_t), compare_offsets);
+        if(pack_read_object(pack, idx, items[i].offset, g_obj, cache, is_base) != 0)
+            g_obj->mem_data = NULL;
+        else if(odb->verify && check_object_hash(idx_sha1(idx, items[i].pos), g_obj->type,
+                                                 g_obj->mem_data, g_obj->size) != 0)
+            g_obj->type = odb_reject(g_obj);
+    }
+    free(bases);
+}
+
+// Reads a batch of objects. Rather than going in the order asked, it finds
+// them all first and reads each pack's share in offset order, so a cold page
+// cache sees mostly sequential reads, and delta bases the objects share are
+// only inflated once (cache_bytes bounds how many are kept). objects[i] gets
+// sha1s[i]; missing and unreadable objects get a NULL mem_data, and so do
+// ones that fail verification, with their type set to GITREAD_CORRUPT.
+// Returns how many were read, or -1 if we ran out of memory.
+int odb_read_many(const struct odb *odb, const unsigned char (*sha1s)[20], int count,
+                  struct git_object *objects, size_t cache_bytes)
+{
+    struct batch_item *items;
+    struct odb_location loc;
+    struct base_cache *cache;
+    int i, j, nitems = 0, found = 0;
+
+    if(!(items = malloc(sizeof(struct batch_item) * (count ? count : 1))))
+        return -1;
+    if(!(cache = base_cache_new(cache_bytes))) {
+        free(items);
+        return -1;
+    }
+
+    for(i = 0; i < count; i++) {
+        objects[i].mem_data = NULL;
+        if(odb_find(odb, sha1s[i], &loc) != 0)
+            continue;
+        if(loc.pack < 0) {
+            if(odb_read_at(odb, sha1s[i], &loc, &objects[i], NULL) == GITREAD_CORRUPT)
+                objects[i].type = GITREAD_CORRUPT;
+            continue;
+        }
+        items[nitems].index = i;
+        items[nitems].pack = loc.pack;
+        items[nitems].pos = loc.pos;
+        items[nitems].offset = loc.offset;
+        nitems++;
+    }
+    qsort(items, nitems, sizeof(struct batch_item), compare_batch_items);
+
+    for(i = 0; i < nitems; i = j) {
+        for(j = i + 1; j < nitems && items[j].pack == items[i].pack; j++)
+            ;
+        read_pack_items(odb, items + i, j - i, objects, cache);
+    }
+
+    for(i = 0; i < count; i++) {
+        if(objects[i].mem_data)
+            found++;
+    }
+    base_cache_free(cache);
+    free(items);
+    return found;
+}
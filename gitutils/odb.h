@@ -0,0 +1,77 @@
+#ifndef ODB_H
+#define ODB_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct pack;
+struct idx;
+struct git_object;
+struct base_cache;
+
+// Called as a pack is unloaded, e.g. to drop it from caches keyed by its address.
+typedef void (*odb_retire_fn)(const struct pack *pack, void *data);
+
+// One pack and its index, shared by every snapshot of the pack set that has
+// it and unloaded when the last of them is closed.
+struct odb_pack {
+    struct pack *pack;
+    struct idx *idx;
+    char *idx_name;      // the .idx file's name within objects/pack
+    dev_t dev;           // the .idx file's, to notice one replaced under the same name
+    ino_t ino;
+    off_t size;
+    unsigned int refs;
+    odb_retire_fn retire;
+    void *retire_data;
+};
+
+// A repository's object store: its packs (mmap'd, so reads are thread safe)
+// and its loose objects. Packs are checked first since that's where nearly
+// everything lives.
+//
+// An odb is a snapshot of the pack set. odb_refresh() makes a new one when
+// packs have been added or removed, sharing the packs that are still there,
+// and whoever holds the old one (see odb_ref()) keeps reading from it; its
+// packs stay mapped until the last snapshot using them is closed. Loose
+// objects are always looked up afresh.
+struct odb {
+    char *objects_dir;   // <git dir>/objects
+    struct pack **packs;
+    struct idx **idxs;
+    int npacks;
+
+    struct odb_pack **shared;  // parallel to packs and idxs
+    unsigned int refs;         // odb_ref() and odb_close()
+    uint64_t generation;       // counts the refreshes that changed the pack set
+    time_t pack_dir_mtime;     // objects/pack when it was last read
+    time_t scanned;
+    odb_retire_fn retire;
+    void *retire_data;
+    int verify;                // check that what's read hashes to its id; see odb_set_verify()
+};
+// Where an object lives. pack is -1 for a loose object.
+struct odb_location {
+    int pack;
+    uint32_t pos;        // position in that pack's idx
+    uint64_t offset;     // offset in that pack
+};
+
+struct odb *odb_open(const char *git_dir);
+void odb_close(struct odb *odb);
+struct odb *odb_ref(struct odb *odb);
+int odb_refresh(struct odb *odb, int force, struct odb **fresh);
+void odb_set_retire_hook(struct odb *odb, odb_retire_fn fn, void *data);
+void odb_set_verify(struct odb *odb, int verify);
+void odb_loose_path(const struct odb *odb, const unsigned char *sha1, char *path);
+int odb_find(const struct odb *odb, const unsigned char *sha1, struct odb_location *loc);
+int odb_read(const struct odb *odb, const unsigned char *sha1, struct git_object *g_obj, struct base_cache *cache);
+int odb_read_at(const struct odb *odb, const unsigned char *sha1, const struct odb_location *loc,
+                struct git_object *g_obj, struct base_cache *cache);
+int odb_object_size(const struct odb *odb, const unsigned char *sha1, uint64_t *size);
+int odb_read_many(const struct odb *odb, const unsigned char (*sha1s)[20], int count,
+                  struct git_object *objects, size_t cache_bytes);
+
+
+#endif
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "oidmap.h"
+
+static inline uint32_t oid_hash(const unsigned char *sha1)
+{
+    uint32_t h;
+
+    memcpy(&h, sha1, sizeof(h)); // ids are already uniformly distributed
+    return h;
+}
+
+static int oid_map_slot(const struct oid_map *map, const unsigned char *sha1, uint32_t *slot)
+{
+    uint32_t mask = map->size - 1, i = oid_hash(sha1) & mask;
+
+    while(map->values[i] != UINT32_MAX) {
+        if(memcmp(map->keys[i], sha1, 20) == 0) {
+            *slot = i;
+            return 1;
+        }
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return 0;
+}
+
+int oid_map_get(const struct oid_map *map, const unsigned char *sha1, uint32_t *value)
+{
+    uint32_t slot;
+
+    if(!map->size || !oid_map_slot(map, sha1, &slot))
+        return -1;
+    if(value)
+        *value = map->values[slot];
+    return 0;
+}
+
+int oid_map_put(struct oid_map *map, const unsigned char *sha1, uint32_t value)
+{
+    struct oid_map old = *map;
+    uint32_t i, slot;
+
+    // keep it at most half full
+    if((map->count + 1) * 2 > map->size) {
+        map->size = old.size ? old.size * 2 : 64;
+        map->keys = malloc(20 * (size_t) map->size);
+        map->values = malloc(sizeof(uint32_t) * (size_t) map->size);
+        if(!map->keys || !map->values) {
+            free(map->keys);
+            free(map->values);
+            *map = old;
+            return -1;
+        }
+        memset(map->values, 0xff, sizeof(uint32_t) * (size_t) map->size);
+        for(i = 0; i < old.size; i++) {
+            if(old.values[i] == UINT32_MAX)
+                continue;
+            oid_map_slot(map, old.keys[i], &slot);
+            memcpy(map->keys[slot], old.keys[i], 20);
+            map->values[slot] = old.values[i];
+        }
+        free(old.keys);
+        free(old.values);
+    }
+
+    if(!oid_map_slot(map, sha1, &slot)) {
+        memcpy(map->keys[slot], sha1, 20);
+        map->count++;
+    }
+    map->values[slot] = value;
+    return 0;
+}
+
+void oid_map_free(struct oid_map *map)
+{
+    free(map->keys);
+    free(map->values);
+}
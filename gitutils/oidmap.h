@@ -0,0 +1,20 @@
+#ifndef OIDMAP_H
+#define OIDMAP_H
+
+#include <stdint.h>
+
+// An open addressing map from object ids to 32 bit values. Zero it to start
+// with an empty one. Not thread safe.
+struct oid_map {
+    unsigned char (*keys)[20];
+    uint32_t *values; // UINT32_MAX marks an empty slot, so it can't be stored
+    uint32_t size;    // always a power of two
+    uint32_t count;
+};
+
+int oid_map_get(const struct oid_map *map, const unsigned char *sha1, uint32_t *value);
+int oid_map_put(struct oid_map *map, const unsigned char *sha1, uint32_t value);
+void oid_map_free(struct oid_map *map);
+
+
+#endif
@@ -1,7 +1,33 @@
 #include <Python.h>
 #include <structmember.h> // also a Python include
+#include <time.h>
 
 #include "libgitread.h"
+#include "stats.h"
+#include "verify.h"
+#include "enumerate.h"
+#include "odb.h"
+#include "walk.h"
+#include "bitmap.h"
+#include "indexpack.h"
+#include "tree.h"
+#include "lastmod.h"
+#include "blame.h"
+#include "grep.h"
+#include "archive.h"
+#include "lstree.h"
+#include "refs.h"
+#include "objclient.h"
+#include "commit.h"
+#include "commitgraph.h"
+#include "ancestry.h"
+#include "range.h"
+#include "diff.h"
+#include "sha1.h"
+#include "trace.h"
+
+// Raised when verified reads find an object that doesn't hash to its id.
+static PyObject *CorruptObjectError;
 
 typedef struct {
     PyObject_HEAD
@@ -20,71 +46,2775 @@ static void PackIdx_dealloc(PackIdxObject *self)
     self->ob_type->tp_free((PyObject*)self);
 }
 
-static PyObject *PackIdx_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+static PyObject *PackIdx_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    PackIdxObject *self;
+    
+    self = (PackIdxObject *)type->tp_alloc(type, 0);
+    if(self != NULL) {
+        // setup values
+        self->idx = NULL;
+        self->location = NULL;
+    }
+    
+    return (PyObject *)self;
+}
+
+static int PackIdx_init(PackIdxObject *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *location;
+    
+    if(!PyArg_ParseTuple(args, "S", &location))
+        return -1; // error
+    
+    // quick error check, since it is possible to call __init__ more than once (which we don't support)
+    if(self->idx != NULL || self->location != NULL) {
+        PyErr_SetString(PyExc_Exception, "This object has already been intialized once.");
+        return -1;
+    }
+    
+    // load up the idx
+    self->idx = load_idx(PyString_AsString(location));
+    
+    if(!self->idx) {
+        PyErr_SetString(PyExc_Exception, "Failed to load the idx file.");
+        return -1;
+    }
+    
+    // save the location for easy access from Python
+    self->location = location;
+    Py_INCREF(location);
+    
+    return 0; // success
+}
+
+/*static void PackIdx_close(PackIdxObject *self)
+{
+    
+}*/
+
+static PyMemberDef PackIdx_members[] = {
+    {"location", T_OBJECT, offsetof(PackIdxObject, location), READONLY, "location of the idx file"},
+    {NULL}
+};
+
+/*static PyMethodDef PackIdx_methods[] = {
+    {"close", (PyCFunction)PackIdx_close, METH_NOARGS,
+        "Closes the idx file properly. This method is called if you simply delete the object."},
+    {NULL}
+};*/
+
+static PyTypeObject PackIdxType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.PackIdx",         /*tp_name*/
+    sizeof(PackIdxObject),     /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PackIdx_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "PackIdx objects",         /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    0,		                   /* tp_iter */
+    0,		                   /* tp_iternext */
+    0,//PackIdx_methods,           /* tp_methods */
+    PackIdx_members,           /* tp_members */
+    0,                         /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)PackIdx_init,    /* tp_init */
+    0,                         /* tp_alloc */
+    PackIdx_new,               /* tp_new */
+};
+
+// ObjectBuffer owns the malloc()'d payload handed back by libgitread and
+// exposes it through both the old and new buffer protocols, so str(),
+// memoryview() and socket.send() can all use it without another copy.
+// The payload is freed when the last reference goes away.
+typedef struct {
+    PyObject_HEAD
+    unsigned char *data;
+    Py_ssize_t size;
+    long hash; // -1 until first hashed, as str's ob_shash
+} ObjectBufferObject;
+
+static PyTypeObject ObjectBufferType;
+
+static void ObjectBuffer_dealloc(ObjectBufferObject *self)
+{
+    free(self->data);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+// Takes ownership of g_obj->mem_data; the caller must not free it afterwards,
+// even on failure.
+static PyObject *object_buffer_from_git_object(struct git_object *g_obj)
+{
+    ObjectBufferObject *self;
+
+    if(!(self = PyObject_New(ObjectBufferObject, &ObjectBufferType))) {
+        free(g_obj->mem_data);
+        g_obj->mem_data = NULL;
+        return NULL;
+    }
+    self->data = g_obj->mem_data;
+    self->size = g_obj->size;
+    self->hash = -1;
+    g_obj->mem_data = NULL;
+
+    return (PyObject *)self;
+}
+
+static Py_ssize_t ObjectBuffer_length(ObjectBufferObject *self)
+{
+    return self->size;
+}
+
+static PyObject *ObjectBuffer_item(ObjectBufferObject *self, Py_ssize_t i)
+{
+    if(i < 0 || i >= self->size) {
+        PyErr_SetString(PyExc_IndexError, "ObjectBuffer index out of range");
+        return NULL;
+    }
+    return PyString_FromStringAndSize((char *) self->data + i, 1);
+}
+
+// slices are copied out as strings; this keeps git.py's header slicing working
+static PyObject *ObjectBuffer_slice(ObjectBufferObject *self, Py_ssize_t lo, Py_ssize_t hi)
+{
+    if(lo < 0)
+        lo = 0;
+    if(hi > self->size)
+        hi = self->size;
+    if(hi < lo)
+        hi = lo;
+    return PyString_FromStringAndSize((char *) self->data + lo, hi - lo);
+}
+
+static PyObject *ObjectBuffer_str(ObjectBufferObject *self)
+{
+    return PyString_FromStringAndSize((char *) self->data, self->size);
+}
+
+// Compares the bytes with a str or another ObjectBuffer, as str does, so code
+// written when objects came back as str can still compare them.
+static PyObject *ObjectBuffer_richcompare(ObjectBufferObject *self, PyObject *other, int op)
+{
+    const unsigned char *data;
+    Py_ssize_t size;
+    int cmp, res;
+
+    if(PyString_Check(other)) {
+        data = (const unsigned char *) PyString_AS_STRING(other);
+        size = PyString_GET_SIZE(other);
+    } else if(PyObject_TypeCheck(other, &ObjectBufferType)) {
+        data = ((ObjectBufferObject *) other)->data;
+        size = ((ObjectBufferObject *) other)->size;
+    } else {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    cmp = memcmp(self->data, data, self->size < size ? self->size : size);
+    if(cmp == 0)
+        cmp = (self->size > size) - (self->size < size);
+    switch(op) {
+    case Py_LT: res = cmp < 0; break;
+    case Py_LE: res = cmp <= 0; break;
+    case Py_EQ: res = cmp == 0; break;
+    case Py_NE: res = cmp != 0; break;
+    case Py_GT: res = cmp > 0; break;
+    default: res = cmp >= 0; break;
+    }
+    return PyBool_FromLong(res);
+}
+
+// Hashes as the equal str does, so either finds the other in a dict. This is
+// Python 2.7's string_hash() run over the payload in place, -R secret and
+// all; like str, the result is cached since the bytes never change.
+static long ObjectBuffer_hash(ObjectBufferObject *self)
+{
+    unsigned char *p = self->data;
+    Py_ssize_t len = self->size;
+    long x;
+
+    if(self->hash != -1)
+        return self->hash;
+    if(len == 0)
+        return self->hash = 0;
+    x = _Py_HashSecret.prefix;
+    x ^= *p << 7;
+    while(--len >= 0)
+        x = (1000003 * x) ^ *p++;
+    x ^= self->size;
+    x ^= _Py_HashSecret.suffix;
+    if(x == -1)
+        x = -2;
+    return self->hash = x;
+}
+
+static Py_ssize_t ObjectBuffer_getreadbuf(ObjectBufferObject *self, Py_ssize_t segment, void **ptr)
+{
+    if(segment != 0) {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent ObjectBuffer segment");
+        return -1;
+    }
+    *ptr = self->data;
+    return self->size;
+}
+
+static Py_ssize_t ObjectBuffer_getsegcount(ObjectBufferObject *self, Py_ssize_t *lenp)
+{
+    if(lenp)
+        *lenp = self->size;
+    return 1;
+}
+
+static int ObjectBuffer_getbuffer(ObjectBufferObject *self, Py_buffer *view, int flags)
+{
+    return PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->size, 1, flags);
+}
+
+static PySequenceMethods ObjectBuffer_as_sequence = {
+    (lenfunc)ObjectBuffer_length,          /*sq_length*/
+    0,                                     /*sq_concat*/
+    0,                                     /*sq_repeat*/
+    (ssizeargfunc)ObjectBuffer_item,       /*sq_item*/
+    (ssizessizeargfunc)ObjectBuffer_slice, /*sq_slice*/
+};
+
+static PyBufferProcs ObjectBuffer_as_buffer = {
+    (readbufferproc)ObjectBuffer_getreadbuf, /*bf_getreadbuffer*/
+    0,                                       /*bf_getwritebuffer*/
+    (segcountproc)ObjectBuffer_getsegcount,  /*bf_getsegcount*/
+    (charbufferproc)ObjectBuffer_getreadbuf, /*bf_getcharbuffer*/
+    (getbufferproc)ObjectBuffer_getbuffer,   /*bf_getbuffer*/
+    0,                                       /*bf_releasebuffer*/
+};
+
+static PyTypeObject ObjectBufferType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.ObjectBuffer",    /*tp_name*/
+    sizeof(ObjectBufferObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)ObjectBuffer_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    &ObjectBuffer_as_sequence, /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    (hashfunc)ObjectBuffer_hash, /*tp_hash */
+    0,                         /*tp_call*/
+    (reprfunc)ObjectBuffer_str, /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    &ObjectBuffer_as_buffer,   /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Read-only object payload owned by libgitread; supports the buffer protocol.\n"
+    "It compares and hashes by its bytes like a str, but isn't one: call str()\n"
+    "where a real str is needed.", /* tp_doc */
+    0,                         /* tp_traverse */
+    0,                         /* tp_clear */
+    (richcmpfunc)ObjectBuffer_richcompare, /* tp_richcompare */
+};
+
+// PackIterator walks a whole pack in pack order; see enumerate.c. The GIL is
+// released while each object is read, so one thread per pack enumerates
+// several packs in parallel.
+typedef struct {
+    PyObject_HEAD
+    struct pack_enum *e;
+} PackIteratorObject;
+
+static void PackIterator_dealloc(PackIteratorObject *self)
+{
+    pack_enum_close(self->e);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *PackIterator_next(PackIteratorObject *self)
+{
+    struct git_object g_obj;
+    const unsigned char *sha1;
+    PyObject *data;
+    int status;
+
+    if(!self->e)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    status = pack_enum_next(self->e, &sha1, &g_obj);
+    Py_END_ALLOW_THREADS
+
+    if(status == 0) {
+        // done; let go of the pack right away rather than when we're collected
+        pack_enum_close(self->e);
+        self->e = NULL;
+        return NULL;
+    }
+    if(status < 0) {
+        // the bad object is skipped, so next() may be called again
+        PyErr_Format(PyExc_Exception, "failed to read object %s from the pack.", sha1_to_hex(sha1));
+        return NULL;
+    }
+
+    if(!(data = object_buffer_from_git_object(&g_obj)))
+        return NULL;
+    return Py_BuildValue("(sIKN)", sha1_to_hex(sha1), g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, data);
+}
+
+static PyTypeObject PackIteratorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.PackIterator",    /*tp_name*/
+    sizeof(PackIteratorObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)PackIterator_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /*tp_flags*/
+    "Iterator over every object in a pack, in pack order.", /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)PackIterator_next, /* tp_iternext */
+};
+
+// Repo is a repository's object store, opened once and shared by whatever
+// is read from it.
+// Commit is a parsed commit. It keeps its own copy of the data, and builds
+// strings out of it only when they're asked for.
+typedef struct {
+    PyObject_HEAD
+    unsigned char *data;
+    unsigned long size;
+    struct commit commit;
+    PyObject *sha1;            // None when parsed from bare data
+} CommitObject;
+
+static PyTypeObject CommitType;
+
+static void Commit_dealloc(CommitObject *self)
+{
+    free(self->data);
+    Py_XDECREF(self->sha1);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+// Takes ownership of data, even on failure.
+static PyObject *commit_from_data(unsigned char *data, unsigned long size, const char *sha1)
+{
+    CommitObject *self;
+
+    if(!(self = PyObject_New(CommitObject, &CommitType))) {
+        free(data);
+        return NULL;
+    }
+    self->data = data;
+    self->size = size;
+    self->sha1 = NULL;
+    if(commit_parse(data, size, &self->commit) != 0) {
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_ValueError, "not a valid commit.");
+        return NULL;
+    }
+    if(sha1)
+        self->sha1 = PyString_FromString(sha1);
+    else
+        Py_INCREF(self->sha1 = Py_None);
+    if(!self->sha1) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject *)self;
+}
+
+static PyObject *optional_string(const char *s, size_t len)
+{
+    if(!s)
+        Py_RETURN_NONE;
+    return PyString_FromStringAndSize(s, len);
+}
+
+static PyObject *Commit_get_tree(CommitObject *self, void *closure)
+{
+    return PyString_FromString(sha1_to_hex(self->commit.tree));
+}
+
+static PyObject *Commit_get_parents(CommitObject *self, void *closure)
+{
+    unsigned char sha1[20];
+    PyObject *parents, *hex;
+    unsigned int i;
+
+    if(!(parents = PyTuple_New(self->commit.nparents)))
+        return NULL;
+    for(i = 0; i < self->commit.nparents; i++) {
+        commit_parent(&self->commit, i, sha1);
+        if(!(hex = PyString_FromString(sha1_to_hex(sha1)))) {
+            Py_DECREF(parents);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(parents, i, hex);
+    }
+    return parents;
+}
+
+// closure picks the ident (0 author, 1 committer) and the field (name, email, time, tz)
+static PyObject *Commit_get_ident(CommitObject *self, void *closure)
+{
+    int which = (int) (intptr_t) closure;
+    const struct commit_ident *ident = (which & 4) ? &self->commit.committer : &self->commit.author;
+
+    switch(which & 3) {
+    case 0: return optional_string(ident->name, ident->name_len);
+    case 1: return optional_string(ident->email, ident->email_len);
+    case 2: return PyLong_FromLongLong(ident->time);
+    default: return PyInt_FromLong(ident->tz);
+    }
+}
+
+static PyObject *Commit_get_encoding(CommitObject *self, void *closure)
+{
+    return optional_string(self->commit.encoding, self->commit.encoding_len);
+}
+
+static PyObject *Commit_get_message(CommitObject *self, void *closure)
+{
+    return PyString_FromStringAndSize((const char *) self->data + self->commit.message,
+                                      self->size - self->commit.message);
+}
+
+static PyObject *Commit_get_raw(CommitObject *self, void *closure)
+{
+    return PyString_FromStringAndSize((const char *) self->data, self->size);
+}
+
+#define COMMIT_IDENT_GETTERS(prefix, which, who) \
+    {prefix "_name", (getter)Commit_get_ident, NULL, who "'s name, or None", (void *) (which)}, \
+    {prefix "_email", (getter)Commit_get_ident, NULL, who "'s email, or None", (void *) ((which) | 1)}, \
+    {prefix "_time", (getter)Commit_get_ident, NULL, who "'s timestamp, in seconds since the epoch", (void *) ((which) | 2)}, \
+    {prefix "_tz", (getter)Commit_get_ident, NULL, who "'s timezone, in minutes east of UTC", (void *) ((which) | 3)}
+
+static PyGetSetDef Commit_getset[] = {
+    {"tree", (getter)Commit_get_tree, NULL, "the root tree's sha1", NULL},
+    {"parents", (getter)Commit_get_parents, NULL, "a tuple of the parents' sha1s", NULL},
+    COMMIT_IDENT_GETTERS("author", 0, "the author"),
+    COMMIT_IDENT_GETTERS("committer", 4, "the committer"),
+    {"encoding", (getter)Commit_get_encoding, NULL, "the message's encoding, or None for UTF-8", NULL},
+    {"message", (getter)Commit_get_message, NULL, "the message, after the headers", NULL},
+    {"raw", (getter)Commit_get_raw, NULL, "the whole commit", NULL},
+    {NULL}
+};
+
+static PyMemberDef Commit_members[] = {
+    {"sha1", T_OBJECT, offsetof(CommitObject, sha1), READONLY, "the commit's sha1, or None"},
+    {NULL}
+};
+
+static PyTypeObject CommitType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.Commit",          /*tp_name*/
+    sizeof(CommitObject),      /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Commit_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "a parsed commit; see Repo.commit() and parse_commit()", /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    0,		                   /* tp_iter */
+    0,		                   /* tp_iternext */
+    0,                         /* tp_methods */
+    Commit_members,            /* tp_members */
+    Commit_getset,             /* tp_getset */
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct odb *odb;
+    struct bitmap_index *bitmap; // opened when first needed
+    int bitmap_tried;
+    int bitmap_stale;            // it's for an older snapshot of the packs
+    int bitmap_users;            // threads counting with it right now
+    struct ref_store *refs;
+    struct tree_resolver *paths; // made when first needed
+    struct commit_graph *graph;  // opened when first needed; NULL if there isn't one
+    int graph_tried;
+    struct range_index *ranges;  // read_range()'s zlib checkpoints; made when first needed
+    PyObject *git_dir;
+    double refresh_interval;     // check for new packs this often; 0 for only on request
+    double last_refresh;
+} RepoObject;
+
+static PyTypeObject RepoType;
+
+static void Repo_dealloc(RepoObject *self)
+{
+    bitmap_close(self->bitmap);
+    tree_resolver_free(self->paths);
+    commit_graph_close(self->graph);
+    range_index_free(self->ranges);
+    refs_close(self->refs);
+    odb_close(self->odb);
+    Py_XDECREF(self->git_dir);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *Repo_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    RepoObject *self;
+
+    self = (RepoObject *)type->tp_alloc(type, 0);
+    if(self != NULL) {
+        self->odb = NULL;
+        self->bitmap = NULL;
+        self->bitmap_tried = 0;
+        self->bitmap_stale = 0;
+        self->bitmap_users = 0;
+        self->refs = NULL;
+        self->paths = NULL;
+        self->graph = NULL;
+        self->graph_tried = 0;
+        self->ranges = NULL;
+        self->git_dir = NULL;
+        self->refresh_interval = 0;
+        self->last_refresh = 0;
+    }
+
+    return (PyObject *)self;
+}
+
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Repo_init(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"git_dir", "refresh", "verify", NULL};
+    PyObject *git_dir;
+    int verify = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "S|di", kwlist, &git_dir, &self->refresh_interval, &verify))
+        return -1;
+
+    if(self->odb != NULL) {
+        PyErr_SetString(PyExc_Exception, "This object has already been intialized once.");
+        return -1;
+    }
+
+    if(!(self->odb = odb_open(PyString_AsString(git_dir)))) {
+        PyErr_SetString(PyExc_Exception, "Failed to open the repository's object store.");
+        return -1;
+    }
+    odb_set_verify(self->odb, verify);
+    if(!(self->refs = refs_open(PyString_AsString(git_dir)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->git_dir = git_dir;
+    Py_INCREF(git_dir);
+    self->last_refresh = monotonic_seconds();
+
+    return 0;
+}
+
+// Swaps in a new snapshot of the packs if they've changed. Readers that let go
+// of the GIL hold their own reference to the old one, so it's simply dropped.
+static int repo_refresh(RepoObject *self, int force)
+{
+    struct odb *fresh;
+    int ret;
+
+    self->last_refresh = monotonic_seconds();
+    if((ret = odb_refresh(self->odb, force, &fresh)) <= 0)
+        return ret;
+    odb_close(self->odb);
+    self->odb = fresh;
+    if(self->bitmap_tried)
+        self->bitmap_stale = 1;
+    // a repack is when the commit-graph usually gets rewritten too
+    commit_graph_close(self->graph);
+    self->graph = NULL;
+    self->graph_tried = 0;
+    return 1;
+}
+
+// Gets the current snapshot, refreshing it first if it's due, for a caller
+// that's about to let go of the GIL; odb_close() it afterwards.
+static struct odb *repo_odb(RepoObject *self)
+{
+    if(!self->odb) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+    if(self->refresh_interval > 0 && monotonic_seconds() - self->last_refresh >= self->refresh_interval)
+        repo_refresh(self, 0); // on failure, keep using what we have
+    return odb_ref(self->odb);
+}
+
+// A call that found an object missing gets one more try if the packs have
+// changed since it took its snapshot: a gc or repack moves objects into new
+// packs and prunes the loose ones, so it's looked for again in a fresh
+// snapshot, as git's reprepare_packed_git() does.
+static int repo_retry(RepoObject *self, uint64_t generation)
+{
+    if(self->odb->generation != generation)
+        return 1;
+    return repo_refresh(self, 1) > 0;
+}
+
+// The bitmap for the current snapshot. One left over from an older snapshot
+// is replaced once no other thread is counting with it.
+static struct bitmap_index *repo_bitmap(RepoObject *self)
+{
+    if(self->bitmap_stale && !self->bitmap_users) {
+        bitmap_close(self->bitmap);
+        self->bitmap = NULL;
+        self->bitmap_tried = 0;
+        self->bitmap_stale = 0;
+    }
+    // opened with the GIL held, so two threads can't both open it
+    if(!self->bitmap_tried) {
+        self->bitmap = bitmap_open(self->odb);
+        self->bitmap_tried = 1;
+    }
+    return self->bitmap;
+}
+
+// The commit-graph, with a reference for a caller that's about to let go of
+// the GIL; commit_graph_close() it afterwards. NULL if there isn't one.
+static struct commit_graph *repo_graph(RepoObject *self)
+{
+    // opened with the GIL held, so two threads can't both open it
+    if(!self->graph_tried) {
+        self->graph = commit_graph_open(self->odb->objects_dir);
+        self->graph_tried = 1;
+    }
+    return self->graph ? commit_graph_ref(self->graph) : NULL;
+}
+
+// Turns a sequence of hex ids into an array of binary ones.
+static int sha1s_from_sequence(PyObject *seq, unsigned char (**sha1s)[20], int *count)
+{
+    PyObject *fast, *item;
+    Py_ssize_t i, n;
+
+    *sha1s = NULL;
+    *count = 0;
+    if(!(fast = PySequence_Fast(seq, "expected a sequence of sha1s")))
+        return -1;
+    n = PySequence_Fast_GET_SIZE(fast);
+    if(!(*sha1s = malloc(20 * (n ? n : 1)))) {
+        Py_DECREF(fast);
+        PyErr_NoMemory();
+        return -1;
+    }
+    for(i = 0; i < n; i++) {
+        item = PySequence_Fast_GET_ITEM(fast, i);
+        if(!PyString_Check(item) || PyString_Size(item) != 40 ||
+           hex_to_sha1(PyString_AsString(item), (*sha1s)[i]) != 0) {
+            PyErr_SetString(PyExc_ValueError, "expected a 40 digit hex sha1");
+            Py_DECREF(fast);
+            free(*sha1s);
+            *sha1s = NULL;
+            return -1;
+        }
+    }
+    *count = n;
+    Py_DECREF(fast);
+    return 0;
+}
+
+// Puts the exclude sha1s after the include ones, which is how a trace keeps
+// them, and frees exclude. Returns 0, or -1 with an exception set.
+static int sha1s_join(unsigned char (**include)[20], int ninclude, unsigned char (*exclude)[20], int nexclude)
+{
+    unsigned char (*joined)[20];
+
+    if(!nexclude) {
+        free(exclude);
+        return 0;
+    }
+    if(!(joined = realloc(*include, 20 * (ninclude + nexclude)))) {
+        free(exclude);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(joined + ninclude, exclude, 20 * nexclude);
+    free(exclude);
+    *include = joined;
+    return 0;
+}
+
+// Records a traced iterator's call once it's finished with. Its last number
+// counts the items taken; it's -1 if they all were.
+static void trace_iterator_done(struct trace_call **trace, int all)
+{
+    if(!*trace)
+        return;
+    if(all)
+        (*trace)->nums[(*trace)->nnums - 1] = -1;
+    trace_record(*trace);
+    free(*trace);
+    *trace = NULL;
+}
+
+// WalkIterator yields (sha1, type, path) for each reachable object; see walk.c.
+typedef struct {
+    PyObject_HEAD
+    struct walk *walk;
+    RepoObject *repo; // keeps the object store open
+    struct trace_call *trace; // NULL unless tracing
+} WalkIteratorObject;
+
+static void WalkIterator_dealloc(WalkIteratorObject *self)
+{
+    walk_free(self->walk);
+    trace_iterator_done(&self->trace, 0);
+    Py_XDECREF(self->repo);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *WalkIterator_next(WalkIteratorObject *self)
+{
+    const unsigned char *sha1;
+    const char *path;
+    unsigned int type;
+    uint64_t start = 0;
+    int status;
+
+    if(!self->walk)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(self->trace)
+        start = trace_clock();
+    status = walk_next(self->walk, &sha1, &type, &path);
+    if(self->trace)
+        self->trace->latency_ns += trace_clock() - start;
+    Py_END_ALLOW_THREADS
+
+    if(status == 0) {
+        walk_free(self->walk);
+        self->walk = NULL;
+        trace_iterator_done(&self->trace, 1);
+        return NULL;
+    }
+    if(self->trace) {
+        self->trace->nums[self->trace->nnums - 1]++;
+        if(status < 0)
+            self->trace->flags |= TRACE_FAILED;
+    }
+    if(status < 0) {
+        // the walk moves on past it, so next() may be called again
+        PyErr_Format(PyExc_Exception, "object %s is missing or corrupt.", sha1_to_hex(sha1));
+        return NULL;
+    }
+    return Py_BuildValue("(sIs)", sha1_to_hex(sha1), type, path);
+}
+
+static PyTypeObject WalkIteratorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.WalkIterator",    /*tp_name*/
+    sizeof(WalkIteratorObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)WalkIterator_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /*tp_flags*/
+    "Iterator over the objects reachable from a set of tips.", /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)WalkIterator_next, /* tp_iternext */
+};
+
+static PyObject *Repo_walk(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"include", "exclude", "cache_mb", NULL};
+    PyObject *include_seq, *exclude_seq = NULL;
+    unsigned char (*include)[20], (*exclude)[20] = NULL;
+    int ninclude, nexclude = 0, cache_mb = 64;
+    WalkIteratorObject *iter;
+    struct trace_call call;
+    uint64_t generation;
+    struct odb *odb;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|Oi", kwlist, &include_seq, &exclude_seq, &cache_mb))
+        return NULL;
+
+    if(sha1s_from_sequence(include_seq, &include, &ninclude) != 0)
+        return NULL;
+    if(exclude_seq && sha1s_from_sequence(exclude_seq, &exclude, &nexclude) != 0) {
+        free(include);
+        return NULL;
+    }
+    if(sha1s_join(&include, ninclude, exclude, nexclude) != 0) {
+        free(include);
+        return NULL;
+    }
+
+    if(!(iter = PyObject_New(WalkIteratorObject, &WalkIteratorType))) {
+        free(include);
+        return NULL;
+    }
+    iter->walk = NULL;
+    iter->repo = self;
+    iter->trace = NULL;
+    Py_INCREF(self);
+    trace_args(&call, include, ninclude + nexclude, NULL, NULL);
+    trace_num(&call, ninclude);
+    trace_num(&call, cache_mb);
+    trace_num(&call, 0);
+
+    // the walk keeps its own reference to this snapshot
+    do {
+        if(!(odb = repo_odb(self))) {
+            Py_DECREF(iter);
+            free(include);
+            return NULL;
+        }
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_WALK);
+        iter->walk = walk_new(odb, (const unsigned char (*)[20]) include, ninclude,
+                              (const unsigned char (*)[20]) include + ninclude, nexclude, (size_t) cache_mb << 20);
+        if(iter->walk)
+            iter->trace = trace_defer(&call);
+        else
+            trace_end(&call, 1);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(!iter->walk && repo_retry(self, generation));
+    free(include);
+
+    if(!iter->walk) {
+        Py_DECREF(iter);
+        PyErr_SetString(PyExc_Exception, "failed to start the walk; is every tip in the repository?");
+        return NULL;
+    }
+    return (PyObject *)iter;
+}
+
+static PyObject *Repo_count_reachable(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"include", "exclude", NULL};
+    PyObject *include_seq, *exclude_seq = NULL;
+    unsigned char (*include)[20], (*exclude)[20] = NULL;
+    int ninclude, nexclude = 0, ret;
+    struct bitmap_counts counts;
+    struct bitmap_index *bitmap;
+    struct trace_call call;
+    struct odb *odb;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &include_seq, &exclude_seq))
+        return NULL;
+    if(!(odb = repo_odb(self)))
+        return NULL;
+    odb_close(odb); // the bitmap holds its own reference
+
+    if(!(bitmap = repo_bitmap(self))) {
+        PyErr_SetString(PyExc_Exception, "The repository has no usable .bitmap; run \"git repack -adb\".");
+        return NULL;
+    }
+
+    if(sha1s_from_sequence(include_seq, &include, &ninclude) != 0)
+        return NULL;
+    if(exclude_seq && sha1s_from_sequence(exclude_seq, &exclude, &nexclude) != 0) {
+        free(include);
+        return NULL;
+    }
+    if(sha1s_join(&include, ninclude, exclude, nexclude) != 0) {
+        free(include);
+        return NULL;
+    }
+    trace_args(&call, include, ninclude + nexclude, NULL, NULL);
+    trace_num(&call, ninclude);
+
+    self->bitmap_users++;
+    Py_BEGIN_ALLOW_THREADS
+    trace_begin(&call, TRACE_COUNT_REACHABLE);
+    ret = bitmap_count_reachable(bitmap, (const unsigned char (*)[20]) include, ninclude,
+                                 (const unsigned char (*)[20]) include + ninclude, nexclude, &counts);
+    trace_end(&call, ret != 0);
+    Py_END_ALLOW_THREADS
+    self->bitmap_users--;
+    free(include);
+
+    if(ret != 0) {
+        PyErr_SetString(PyExc_Exception, "failed to count; is every tip in the repository?");
+        return NULL;
+    }
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+                         "objects", (unsigned PY_LONG_LONG) counts.objects,
+                         "commits", (unsigned PY_LONG_LONG) counts.commits,
+                         "trees", (unsigned PY_LONG_LONG) counts.trees,
+                         "blobs", (unsigned PY_LONG_LONG) counts.blobs,
+                         "tags", (unsigned PY_LONG_LONG) counts.tags,
+                         "bytes", (unsigned PY_LONG_LONG) counts.bytes);
+}
+
+static PyObject *Repo_commit(RepoObject *self, PyObject *args)
+{
+    char *hex;
+    unsigned char sha1[20];
+    struct git_object g_obj;
+    struct trace_call call;
+    struct odb *odb;
+    uint64_t generation;
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "s", &hex))
+        return NULL;
+    if(strlen(hex) != 40 || hex_to_sha1(hex, sha1) != 0) {
+        PyErr_SetString(PyExc_ValueError, "expected a 40 digit hex sha1");
+        return NULL;
+    }
+    trace_args(&call, sha1, 1, NULL, NULL);
+
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_COMMIT);
+        ret = odb_read(odb, sha1, &g_obj, NULL);
+        trace_end(&call, ret == GITREAD_CORRUPT);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(ret != 0 && ret != GITREAD_CORRUPT && repo_retry(self, generation));
+
+    if(ret == GITREAD_CORRUPT) {
+        PyErr_Format(CorruptObjectError, "object %s doesn't match its id.", hex);
+        return NULL;
+    }
+    if(ret != 0)
+        Py_RETURN_NONE;
+    if(g_obj.type != COMMIT) {
+        free(g_obj.mem_data);
+        PyErr_Format(PyExc_ValueError, "%s is a %s, not a commit.", hex, object_type_name(g_obj.type));
+        return NULL;
+    }
+    return commit_from_data(g_obj.mem_data, g_obj.size, hex);
+}
+
+// Takes a sha1 or a ref name. Returns 1 if it's neither, and -1 with an
+// exception set if the repository isn't open.
+static int repo_rev(RepoObject *self, const char *rev, unsigned char *sha1)
+{
+    struct ref ref;
+
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return -1;
+    }
+    if(strlen(rev) == 40 && hex_to_sha1(rev, sha1) == 0)
+        return 0;
+    if(refs_dwim(self->refs, rev, &ref) != 0)
+        return 1;
+    memcpy(sha1, ref.sha1, 20);
+    refs_release(&ref);
+    return 0;
+}
+
+// Like repo_rev(), but peels tags, since ancestry is about commits. Raises
+// ValueError for a rev that's neither a sha1 nor a ref.
+static int repo_commit_rev(RepoObject *self, const char *rev, unsigned char *sha1)
+{
+    struct ref ref;
+    int ret;
+
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return -1;
+    }
+    if(strlen(rev) == 40 && hex_to_sha1(rev, sha1) == 0)
+        return 0;
+    if(refs_dwim(self->refs, rev, &ref) != 0) {
+        PyErr_Format(PyExc_ValueError, "%s isn't a sha1 or a ref.", rev);
+        return -1;
+    }
+    ret = refs_peel(&ref, self->odb, sha1);
+    refs_release(&ref);
+    if(ret != 0) {
+        PyErr_Format(PyExc_Exception, "failed to peel %s; an object it points at is missing.", rev);
+        return -1;
+    }
+    return 0;
+}
+
+// An ancestry context on the current snapshot and commit-graph, for a caller
+// that's about to let go of the GIL; ancestry_done() it afterwards.
+static struct ancestry *repo_ancestry(RepoObject *self, struct odb **odb, struct commit_graph **graph)
+{
+    struct ancestry *a;
+
+    if(!(*odb = repo_odb(self)))
+        return NULL;
+    *graph = repo_graph(self);
+    if(!(a = ancestry_new(*odb, *graph))) {
+        commit_graph_close(*graph);
+        odb_close(*odb);
+        PyErr_NoMemory();
+    }
+    return a;
+}
+
+static void ancestry_done(struct ancestry *a, struct odb *odb, struct commit_graph *graph)
+{
+    ancestry_free(a);
+    commit_graph_close(graph);
+    odb_close(odb);
+}
+
+// The memo of path lookups, shared by everything that resolves paths.
+static struct tree_resolver *repo_paths(RepoObject *self)
+{
+    // made with the GIL held, so two threads can't both make it
+    if(!self->paths && !(self->paths = tree_resolver_new(TREE_MEMO_DEFAULT)))
+        PyErr_NoMemory();
+    return self->paths;
+}
+
+// Tree lists give modes as their octal digits read as decimal; so do these.
+static long mode_as_listed(unsigned int mode)
+{
+    char octal[16];
+
+    snprintf(octal, sizeof(octal), "%o", mode);
+    return atol(octal);
+}
+
+static PyObject *Repo_resolve_path(RepoObject *self, PyObject *args)
+{
+    char *rev, *path;
+    unsigned char start[20], sha1[20];
+    unsigned int mode;
+    struct trace_call call;
+    struct odb *odb;
+    uint64_t generation;
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "ss", &rev, &path))
+        return NULL;
+    if((ret = repo_rev(self, rev, start)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self))
+        return NULL;
+    trace_args(&call, start, 1, path, NULL);
+
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_RESOLVE_PATH);
+        ret = tree_resolve_path(self->paths, odb, start, path, &mode, sha1);
+        trace_end(&call, ret < 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret < 0) {
+        PyErr_Format(PyExc_Exception, "failed to resolve %s:%s; an object along the way is missing or corrupt.",
+                     rev, path);
+        return NULL;
+    }
+    if(ret > 0)
+        Py_RETURN_NONE;
+    return Py_BuildValue("(ls)", mode_as_listed(mode), sha1_to_hex(sha1));
+}
+
+static PyObject *Repo_last_modified(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"rev", "path", "budget_ms", NULL};
+    char *rev, *path = "", hex[41];
+    unsigned char start[20];
+    struct lastmod lm;
+    struct lastmod_entry *e;
+    PyObject *list, *item;
+    struct trace_call call;
+    struct odb *odb;
+    uint64_t generation;
+    int budget_ms = 0, ret;
+    uint32_t i;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|si", kwlist, &rev, &path, &budget_ms))
+        return NULL;
+    if((ret = repo_rev(self, rev, start)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self))
+        return NULL;
+
+    trace_args(&call, start, 1, path, NULL);
+    trace_num(&call, budget_ms);
+
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_LAST_MODIFIED);
+        ret = lastmod_dir(odb, self->paths, start, path, budget_ms, &lm);
+        trace_end(&call, ret < 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+        if(ret < 0)
+            lastmod_release(&lm);
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret < 0 || ret == 2) {
+        lastmod_release(&lm);
+        if(ret == 2)
+            Py_RETURN_NONE;
+        PyErr_Format(PyExc_Exception, "failed to walk the history of %s:%s; an object is missing or corrupt.",
+                     rev, path);
+        return NULL;
+    }
+
+    if(!(list = PyList_New(lm.count))) {
+        lastmod_release(&lm);
+        return NULL;
+    }
+    for(i = 0; i < lm.count; i++) {
+        e = &lm.entries[i];
+        strcpy(hex, sha1_to_hex(e->sha1));
+        item = Py_BuildValue("(s#lss)", e->name, (int) e->name_len, mode_as_listed(e->mode), hex,
+                             e->resolved ? sha1_to_hex(e->commit) : NULL);
+        if(!item) {
+            Py_DECREF(list);
+            lastmod_release(&lm);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    lastmod_release(&lm);
+    return list;
+}
+
+// GrepIterator yields (path, line, text) for each matching line; see grep.c.
+typedef struct {
+    PyObject_HEAD
+    struct grep *grep;
+    RepoObject *repo; // keeps the object store open
+    struct trace_call *trace; // NULL unless tracing
+} GrepIteratorObject;
+
+static void GrepIterator_dealloc(GrepIteratorObject *self)
+{
+    // stopping waits for the threads to finish the files they're on
+    Py_BEGIN_ALLOW_THREADS
+    grep_free(self->grep);
+    Py_END_ALLOW_THREADS
+    trace_iterator_done(&self->trace, 0);
+    Py_XDECREF(self->repo);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *GrepIterator_next(GrepIteratorObject *self)
+{
+    struct grep_match m;
+    uint64_t start = 0;
+    int status;
+
+    if(!self->grep)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    if(self->trace)
+        start = trace_clock();
+    status = grep_next(self->grep, &m);
+    if(self->trace)
+        self->trace->latency_ns += trace_clock() - start;
+    Py_END_ALLOW_THREADS
+
+    if(status > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        grep_free(self->grep);
+        Py_END_ALLOW_THREADS
+        self->grep = NULL;
+        trace_iterator_done(&self->trace, 1);
+        return NULL;
+    }
+    if(self->trace) {
+        self->trace->nums[self->trace->nnums - 1]++;
+        if(status < 0)
+            self->trace->flags |= TRACE_FAILED;
+    }
+    if(status < 0) {
+        // the search moves on past it, so next() may be called again
+        PyErr_Format(PyExc_Exception, "failed to read %s; it's missing or corrupt.", m.path);
+        return NULL;
+    }
+    return Py_BuildValue("(sIs#)", m.path, m.line, (const char *) m.text, (Py_ssize_t) m.len);
+}
+
+static PyTypeObject GrepIteratorType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.GrepIterator",    /*tp_name*/
+    sizeof(GrepIteratorObject), /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)GrepIterator_dealloc, /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_ITER, /*tp_flags*/
+    "Iterator over the lines of a tree's files that match a pattern.", /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    PyObject_SelfIter,         /* tp_iter */
+    (iternextfunc)GrepIterator_next, /* tp_iternext */
+};
+
+static PyObject *Repo_grep(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"rev", "pattern", "path", "fixed", "extended", "ignore_case", "max_matches",
+                             "max_bytes", "threads", NULL};
+    char *rev, *pattern, *path = "";
+    unsigned char start[20];
+    int fixed = 0, extended = 0, ignore_case = 0, ret;
+    Py_ssize_t max_bytes = GREP_MAX_BYTES;
+    struct grep_options opts;
+    GrepIteratorObject *iter;
+    struct trace_call call;
+    uint64_t generation;
+    struct odb *odb;
+
+    grep_options_init(&opts);
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "ss|siiiIni", kwlist, &rev, &pattern, &path, &fixed, &extended,
+                                    &ignore_case, &opts.max_matches, &max_bytes, &opts.threads))
+        return NULL;
+    if(max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes can't be negative.");
+        return NULL;
+    }
+    opts.max_bytes = max_bytes;
+    opts.flags = (fixed ? GREP_FIXED : 0) | (extended ? GREP_EXTENDED : 0) | (ignore_case ? GREP_ICASE : 0);
+    if((ret = repo_rev(self, rev, start)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self) || !(iter = PyObject_New(GrepIteratorObject, &GrepIteratorType)))
+        return NULL;
+    iter->grep = NULL;
+    iter->repo = self;
+    iter->trace = NULL;
+    Py_INCREF(self);
+    trace_args(&call, start, 1, path, pattern);
+    trace_num(&call, opts.flags);
+    trace_num(&call, opts.max_matches);
+    trace_num(&call, opts.max_bytes);
+    trace_num(&call, opts.threads);
+    trace_num(&call, 0);
+
+    // the search keeps its own reference to this snapshot
+    do {
+        if(!(odb = repo_odb(self))) {
+            Py_DECREF(iter);
+            return NULL;
+        }
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_GREP);
+        ret = grep_start(odb, self->paths, start, path, pattern, &opts, &iter->grep);
+        if(ret == 0)
+            iter->trace = trace_defer(&call);
+        else
+            trace_end(&call, ret != 1);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret != 0) {
+        Py_DECREF(iter);
+        if(ret == 1)
+            Py_RETURN_NONE;
+        if(ret == 2)
+            PyErr_Format(PyExc_ValueError, "invalid regular expression: %s", pattern);
+        else
+            PyErr_Format(PyExc_Exception, "failed to list %s:%s; an object is missing or corrupt.", rev, path);
+        return NULL;
+    }
+    return (PyObject *)iter;
+}
+
+// Passes archive_write()'s output to a Python callable. The archive is
+// written from the calling thread, so that's the one that takes the GIL
+// back; an exception the callable raises is left set.
+static int archive_py_write(const void *data, size_t len, void *cb_data)
+{
+    PyGILState_STATE state = PyGILState_Ensure();
+    PyObject *chunk, *res = NULL;
+
+    if((chunk = PyString_FromStringAndSize(data, len))) {
+        res = PyObject_CallFunctionObjArgs((PyObject *) cb_data, chunk, NULL);
+        Py_DECREF(chunk);
+    }
+    Py_XDECREF(res);
+    PyGILState_Release(state);
+    return res ? 0 : -1;
+}
+
+static PyObject *Repo_archive(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"rev", "out", "format", "path", "prefix", "level", "threads", NULL};
+    char *rev, *format = "tar", *path = "";
+    unsigned char start[20];
+    struct archive_options opts;
+    struct trace_call call;
+    PyObject *out;
+    struct odb *odb;
+    int fd = -1, ret;
+
+    archive_options_init(&opts);
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "sO|sssii", kwlist, &rev, &out, &format, &path, &opts.base,
+                                    &opts.level, &opts.threads))
+        return NULL;
+    if(strcmp(format, "tar") == 0) {
+        opts.format = ARCHIVE_TAR;
+    } else if(strcmp(format, "zip") == 0) {
+        opts.format = ARCHIVE_ZIP;
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown archive format %s; it can be tar or zip.", format);
+        return NULL;
+    }
+    if(opts.level < -1 || opts.level > 9) {
+        PyErr_SetString(PyExc_ValueError, "level can be 0 to 9, or -1 for zlib's default.");
+        return NULL;
+    }
+    if(PyInt_Check(out) || PyLong_Check(out)) {
+        if((fd = PyInt_AsLong(out)) < 0) {
+            if(!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "out isn't a file descriptor.");
+            return NULL;
+        }
+    } else if(!PyCallable_Check(out)) {
+        PyErr_SetString(PyExc_TypeError, "out has to be a file descriptor or a function to call with the data.");
+        return NULL;
+    }
+    if((ret = repo_rev(self, rev, start)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self) || !(odb = repo_odb(self)))
+        return NULL;
+
+    trace_args(&call, start, 1, path, opts.base);
+    trace_num(&call, opts.format);
+    trace_num(&call, opts.level);
+    trace_num(&call, opts.threads);
+
+    Py_BEGIN_ALLOW_THREADS
+    trace_begin(&call, TRACE_ARCHIVE);
+    if(fd >= 0)
+        ret = archive_write(odb, self->paths, start, path, &opts, archive_fd_write, &fd);
+    else
+        ret = archive_write(odb, self->paths, start, path, &opts, archive_py_write, out);
+    trace_end(&call, ret < 0 || ret == 2);
+    odb_close(odb);
+    Py_END_ALLOW_THREADS
+
+    if(ret == 1)
+        Py_RETURN_NONE;
+    if(ret == 2) {
+        if(fd >= 0)
+            PyErr_SetFromErrno(PyExc_IOError);
+        return NULL;
+    }
+    if(ret != 0) {
+        PyErr_Format(PyExc_Exception, "failed to archive %s:%s; an object is missing or corrupt.", rev, path);
+        return NULL;
+    }
+    Py_RETURN_TRUE;
+}
+
+static PyObject *Repo_blame(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"rev", "path", "start", "end", "budget_ms", NULL};
+    char *rev, *path, hex[41];
+    unsigned char commit[20];
+    unsigned int start = 1, end = 0;
+    struct blame b;
+    struct blame_entry *e;
+    PyObject *list, *item;
+    struct trace_call call;
+    struct odb *odb;
+    uint64_t generation;
+    int budget_ms = 0, ret;
+    uint32_t i;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "ss|IIi", kwlist, &rev, &path, &start, &end, &budget_ms))
+        return NULL;
+    if(start < 1 || (end && end < start)) {
+        PyErr_SetString(PyExc_ValueError, "lines are numbered from 1, and end can't be before start.");
+        return NULL;
+    }
+    if((ret = repo_rev(self, rev, commit)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self))
+        return NULL;
+
+    trace_args(&call, commit, 1, path, NULL);
+    trace_num(&call, start);
+    trace_num(&call, end);
+    trace_num(&call, budget_ms);
+
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_BLAME);
+        ret = blame_file(odb, self->paths, commit, path, start - 1, end ? end - start + 1 : 0, budget_ms, &b);
+        trace_end(&call, ret < 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+        if(ret < 0)
+            blame_release(&b);
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret < 0 || ret == 2) {
+        blame_release(&b);
+        if(ret == 2)
+            Py_RETURN_NONE;
+        PyErr_Format(PyExc_Exception, "failed to blame %s:%s; an object is missing or corrupt.", rev, path);
+        return NULL;
+    }
+    if(start > b.nlines && (start > 1 || end)) {
+        PyErr_Format(PyExc_ValueError, "%s:%s has only %u lines.", rev, path, b.nlines);
+        blame_release(&b);
+        return NULL;
+    }
+
+    if(!(list = PyList_New(b.count))) {
+        blame_release(&b);
+        return NULL;
+    }
+    for(i = 0; i < b.count; i++) {
+        e = &b.entries[i];
+        strcpy(hex, sha1_to_hex(e->commit));
+        item = Py_BuildValue("(zIII)", e->resolved ? hex : NULL, e->orig_start + 1, e->final_start + 1, e->count);
+        if(!item) {
+            Py_DECREF(list);
+            blame_release(&b);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    blame_release(&b);
+    return list;
+}
+
+// One ls_tree() entry. A million entries is a million tuples, so they're put
+// together by hand rather than with Py_BuildValue(), and entries with the same
+// mode share one int.
+static PyObject *lstree_entry_tuple(const struct lstree_entry *e, const char *path, size_t len, int sizes,
+                                    PyObject **mode, unsigned int *last_mode)
+{
+    PyObject *item, *value;
+
+    if(!*mode || e->mode != *last_mode) {
+        Py_XDECREF(*mode);
+        if(!(*mode = PyInt_FromLong(mode_as_listed(e->mode))))
+            return NULL;
+        *last_mode = e->mode;
+    }
+    if(!(item = PyTuple_New(sizes ? 4 : 3)))
+        return NULL;
+    Py_INCREF(*mode);
+    PyTuple_SET_ITEM(item, 1, *mode);
+    if(!(value = PyString_FromStringAndSize(path, len))) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(item, 0, value);
+    if(!(value = PyString_FromStringAndSize(sha1_to_hex(e->sha1), 40))) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    PyTuple_SET_ITEM(item, 2, value);
+    if(sizes) {
+        if(e->size < 0) {
+            Py_INCREF(Py_None);
+            value = Py_None;
+        } else if(!(value = PyInt_FromLong(e->size))) {
+            Py_DECREF(item);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(item, 3, value);
+    }
+    return item;
+}
+
+static PyObject *Repo_ls_tree(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"rev", "path", "depth", "trees", "sizes", "threads", NULL};
+    char *rev, *path = "", *buf = NULL, *grown;
+    unsigned char start[20];
+    int depth = 0, trees = 0, sizes = 0, threads = 0, flags, ret;
+    size_t buf_size = 0, len;
+    struct trace_call call;
+    struct lstree ls;
+    PyObject *list, *item, *mode = NULL;
+    unsigned int last_mode = 0;
+    uint64_t generation;
+    struct odb *odb;
+    uint32_t i;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|siiii", kwlist, &rev, &path, &depth, &trees, &sizes, &threads))
+        return NULL;
+    if((ret = repo_rev(self, rev, start)) != 0) {
+        if(ret < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    if(!repo_paths(self))
+        return NULL;
+
+    flags = (trees ? LSTREE_TREES : 0) | (sizes ? LSTREE_SIZES : 0);
+    trace_args(&call, start, 1, path, NULL);
+    trace_num(&call, depth);
+    trace_num(&call, flags);
+    trace_num(&call, threads);
+
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_LS_TREE);
+        ret = lstree_walk(odb, self->paths, start, path, depth, flags, threads, &ls);
+        trace_end(&call, ret < 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret != 0) {
+        if(ret > 0)
+            Py_RETURN_NONE;
+        PyErr_Format(PyExc_Exception, "failed to list %s:%s; an object is missing or corrupt.", rev, path);
+        return NULL;
+    }
+
+    if(!(list = PyList_New(ls.norder))) {
+        lstree_release(&ls);
+        return NULL;
+    }
+    for(i = 0; i < ls.norder; i++) {
+        while((len = lstree_path(&ls, ls.order[i], buf, buf_size)) >= buf_size) {
+            if(!(grown = realloc(buf, len + 256)))
+                break;
+            buf = grown;
+            buf_size = len + 256;
+        }
+        if(len >= buf_size)
+            item = PyErr_NoMemory();
+        else
+            item = lstree_entry_tuple(&ls.entries[ls.order[i]], buf, len, sizes, &mode, &last_mode);
+        if(!item) {
+            Py_DECREF(list);
+            list = NULL;
+            break;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    Py_XDECREF(mode);
+    free(buf);
+    lstree_release(&ls);
+    return list;
+}
+
+static PyObject *Repo_is_ancestor(RepoObject *self, PyObject *args)
+{
+    char *ancestor_rev, *descendant_rev;
+    unsigned char sha1s[2][20];  // the ancestor and the descendant
+    struct commit_graph *graph;
+    struct trace_call call;
+    struct ancestry *a;
+    uint64_t generation;
+    struct odb *odb;
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "ss", &ancestor_rev, &descendant_rev))
+        return NULL;
+    if(repo_commit_rev(self, ancestor_rev, sha1s[0]) != 0 || repo_commit_rev(self, descendant_rev, sha1s[1]) != 0)
+        return NULL;
+    trace_args(&call, sha1s, 2, NULL, NULL);
+
+    do {
+        if(!(a = repo_ancestry(self, &odb, &graph)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_IS_ANCESTOR);
+        ret = ancestry_is_ancestor(a, sha1s[0], sha1s[1]);
+        trace_end(&call, ret < 0);
+        ancestry_done(a, odb, graph);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret < 0) {
+        PyErr_Format(PyExc_Exception, "failed to compare %s and %s; a commit is missing or corrupt.",
+                     ancestor_rev, descendant_rev);
+        return NULL;
+    }
+    return PyBool_FromLong(ret);
+}
+
+static PyObject *Repo_merge_bases(RepoObject *self, PyObject *args)
+{
+    char *one_rev;
+    PyObject *others, *fast, *list, *item;
+    unsigned char one[20], (*sha1s)[20], (*bases)[20]; // sha1s is one, then the others
+    struct commit_graph *graph;
+    struct trace_call call;
+    struct ancestry *a;
+    uint64_t generation;
+    struct odb *odb;
+    Py_ssize_t i, n;
+    int ret, nbases;
+
+    if(!PyArg_ParseTuple(args, "sO", &one_rev, &others))
+        return NULL;
+    if(repo_commit_rev(self, one_rev, one) != 0)
+        return NULL;
+    if(!(fast = PySequence_Fast(others, "expected a sequence of revs")))
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(fast);
+    if(!(sha1s = malloc(20 * (n + 1)))) {
+        Py_DECREF(fast);
+        return PyErr_NoMemory();
+    }
+    memcpy(sha1s[0], one, 20);
+    for(i = 0; i < n; i++) {
+        item = PySequence_Fast_GET_ITEM(fast, i);
+        if(!PyString_Check(item)) {
+            PyErr_SetString(PyExc_TypeError, "expected a sequence of revs");
+            break;
+        }
+        if(repo_commit_rev(self, PyString_AsString(item), sha1s[i + 1]) != 0)
+            break;
+    }
+    Py_DECREF(fast);
+    if(i < n) {
+        free(sha1s);
+        return NULL;
+    }
+    trace_args(&call, sha1s, n + 1, NULL, NULL);
+
+    do {
+        if(!(a = repo_ancestry(self, &odb, &graph))) {
+            free(sha1s);
+            return NULL;
+        }
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_MERGE_BASES);
+        ret = ancestry_merge_bases(a, sha1s[0], (const unsigned char (*)[20]) sha1s + 1, n, &bases, &nbases);
+        trace_end(&call, ret < 0);
+        ancestry_done(a, odb, graph);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+    free(sha1s);
+
+    if(ret < 0) {
+        PyErr_Format(PyExc_Exception, "failed to find the merge bases of %s; a commit is missing or corrupt.",
+                     one_rev);
+        return NULL;
+    }
+    if(!(list = PyList_New(nbases))) {
+        free(bases);
+        return NULL;
+    }
+    for(i = 0; i < nbases; i++) {
+        if(!(item = PyString_FromString(sha1_to_hex(bases[i])))) {
+            Py_DECREF(list);
+            free(bases);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    free(bases);
+    return list;
+}
+
+static PyObject *Repo_ahead_behind(RepoObject *self, PyObject *args)
+{
+    char *one_rev, *two_rev;
+    unsigned char sha1s[2][20];  // one and two
+    struct commit_graph *graph;
+    struct trace_call call;
+    struct ancestry *a;
+    uint64_t generation;
+    struct odb *odb;
+    uint32_t ahead, behind;
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "ss", &one_rev, &two_rev))
+        return NULL;
+    if(repo_commit_rev(self, one_rev, sha1s[0]) != 0 || repo_commit_rev(self, two_rev, sha1s[1]) != 0)
+        return NULL;
+    trace_args(&call, sha1s, 2, NULL, NULL);
+
+    do {
+        if(!(a = repo_ancestry(self, &odb, &graph)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_AHEAD_BEHIND);
+        ret = ancestry_ahead_behind(a, sha1s[0], sha1s[1], &ahead, &behind);
+        trace_end(&call, ret < 0);
+        ancestry_done(a, odb, graph);
+        Py_END_ALLOW_THREADS
+    } while(ret < 0 && repo_retry(self, generation));
+
+    if(ret < 0) {
+        PyErr_Format(PyExc_Exception, "failed to compare %s and %s; a commit is missing or corrupt.",
+                     one_rev, two_rev);
+        return NULL;
+    }
+    return Py_BuildValue("(II)", ahead, behind);
+}
+
+static PyObject *Repo_read_many(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"sha1s", "cache_mb", NULL};
+    PyObject *sha1s_seq, *list, *item, *data;
+    unsigned char (*sha1s)[20];
+    struct git_object *objects;
+    struct trace_call call;
+    uint64_t generation;
+    struct odb *odb;
+    int count, ret, i, cache_mb = 64;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &sha1s_seq, &cache_mb))
+        return NULL;
+    if(sha1s_from_sequence(sha1s_seq, &sha1s, &count) != 0)
+        return NULL;
+    if(!(objects = malloc(sizeof(struct git_object) * (count ? count : 1)))) {
+        free(sha1s);
+        return PyErr_NoMemory();
+    }
+
+    trace_args(&call, sha1s, count, NULL, NULL);
+    trace_num(&call, cache_mb);
+
+    for(;;) {
+        if(!(odb = repo_odb(self))) {
+            free(objects);
+            free(sha1s);
+            return NULL;
+        }
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_READ_MANY);
+        ret = odb_read_many(odb, (const unsigned char (*)[20]) sha1s, count, objects,
+                            cache_mb > 0 ? (size_t) cache_mb << 20 : 0);
+        trace_end(&call, ret < 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+        if(ret < 0 || ret == count || !repo_retry(self, generation))
+            break;
+        for(i = 0; i < count; i++)
+            free(objects[i].mem_data);
+    }
+
+    if(ret < 0) {
+        free(objects);
+        free(sha1s);
+        return PyErr_NoMemory();
+    }
+
+    // each object's data moves into its buffer as we go; free what's left if we fail
+    list = PyList_New(count);
+    for(i = 0; i < count; i++) {
+        if(!list) {
+            free(objects[i].mem_data);
+            continue;
+        }
+        if(!objects[i].mem_data && objects[i].type == (unsigned int) GITREAD_CORRUPT) {
+            PyErr_Format(CorruptObjectError, "object %s doesn't match its id.", sha1_to_hex(sha1s[i]));
+            Py_CLEAR(list);
+            continue;
+        }
+        if(!objects[i].mem_data) {
+            Py_INCREF(Py_None);
+            PyList_SET_ITEM(list, i, Py_None);
+            continue;
+        }
+        item = NULL;
+        if((data = object_buffer_from_git_object(&objects[i])))
+            item = Py_BuildValue("(IKN)", objects[i].type, (unsigned PY_LONG_LONG) objects[i].size, data);
+        if(!item) {
+            Py_CLEAR(list);
+            continue;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    free(objects);
+    free(sha1s);
+    return list;
+}
+
+static PyObject *Repo_read_range(RepoObject *self, PyObject *args)
+{
+    char *hex;
+    unsigned char sha1[20];
+    PY_LONG_LONG offset, length;
+    struct range_reader *reader;
+    struct git_object g_obj;
+    struct trace_call call;
+    struct odb *odb;
+    unsigned int type;
+    uint64_t size, got = 0, generation;
+    int found, ret = 0;
+
+    if(!PyArg_ParseTuple(args, "sLL", &hex, &offset, &length))
+        return NULL;
+    if(offset < 0 || length < 0) {
+        PyErr_SetString(PyExc_ValueError, "offset and length can't be negative.");
+        return NULL;
+    }
+    if(strlen(hex) != 40 || hex_to_sha1(hex, sha1) != 0) {
+        PyErr_SetString(PyExc_ValueError, "expected a 40 digit hex sha1");
+        return NULL;
+    }
+    // made with the GIL held, so two threads can't both make it
+    if(!self->ranges && !(self->ranges = range_index_new(RANGE_INDEX_BYTES)))
+        return PyErr_NoMemory();
+
+    trace_args(&call, sha1, 1, NULL, NULL);
+    trace_num(&call, offset);
+    trace_num(&call, length);
+
+    g_obj.mem_data = NULL;
+    do {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_READ_RANGE);
+        found = (range_open(odb, sha1, self->ranges, &reader, &type, &size) == 0);
+        if(found) {
+            if((uint64_t) offset > size)
+                offset = size;
+            if((uint64_t) length > size - offset)
+                length = size - offset;
+            if(length <= UINT_MAX && (g_obj.mem_data = malloc(length + 1)))
+                ret = range_read(reader, offset, length, g_obj.mem_data, &got);
+            range_close(reader);
+        }
+        trace_end(&call, ret != 0);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+    } while(!found && repo_retry(self, generation));
+
+    if(!found)
+        Py_RETURN_NONE;
+    if(length > UINT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "ranges of 4GB or more aren't supported.");
+        return NULL;
+    }
+    if(!g_obj.mem_data)
+        return PyErr_NoMemory();
+    if(ret != 0) {
+        free(g_obj.mem_data);
+        PyErr_Format(PyExc_Exception, "failed to read %s; it is corrupt.", hex);
+        return NULL;
+    }
+    g_obj.mem_data[got] = '\0';
+    g_obj.type = type;
+    g_obj.size = got;
+    return Py_BuildValue("(IKN)", type, (unsigned PY_LONG_LONG) size, object_buffer_from_git_object(&g_obj));
+}
+
+// Fills in diff options from the keywords diff() and Repo.diff() share.
+static int diff_options_from_args(const char *algorithm, int context, Py_ssize_t max_bytes, int budget_ms,
+                                  struct diff_options *opts)
+{
+    diff_options_init(opts);
+    if(strcmp(algorithm, "myers") == 0) {
+        opts->algorithm = DIFF_MYERS;
+    } else if(strcmp(algorithm, "histogram") == 0) {
+        opts->algorithm = DIFF_HISTOGRAM;
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown diff algorithm %s; expected myers or histogram.", algorithm);
+        return -1;
+    }
+    if(context < 0 || max_bytes < 0) {
+        PyErr_SetString(PyExc_ValueError, "context and max_bytes can't be negative.");
+        return -1;
+    }
+    opts->context = context;
+    opts->max_bytes = max_bytes;
+    opts->budget_ms = budget_ms;
+    return 0;
+}
+
+struct diff_lines {
+    PyObject *list;
+    PyObject *tags[3];           // ' ', '-' and '+', shared by every line
+};
+
+static int append_diff_line(char tag, const unsigned char *text, uint32_t len, void *cb_data)
+{
+    struct diff_lines *data = cb_data;
+    PyObject *line, *item;
+
+    if(!(line = PyString_FromStringAndSize((const char *) text, len)))
+        return 1;
+    item = PyTuple_Pack(2, data->tags[(tag == ' ') ? 0 : (tag == '-') ? 1 : 2], line);
+    Py_DECREF(line);
+    if(!item || PyList_Append(data->list, item) != 0) {
+        Py_XDECREF(item);
+        return 1;
+    }
+    Py_DECREF(item);
+    return 0;
+}
+
+// One (old_start, old_count, new_start, new_count, function, lines) tuple per
+// hunk, numbering lines from 1.
+static PyObject *diff_hunks_to_pyobject(const struct diff_result *res)
+{
+    const struct diff_hunk *h;
+    struct diff_lines data;
+    PyObject *hunks, *func, *item = NULL;
+    uint32_t i;
+
+    if(!(hunks = PyList_New(res->nhunks)))
+        return NULL;
+    data.tags[0] = PyString_FromString(" ");
+    data.tags[1] = PyString_FromString("-");
+    data.tags[2] = PyString_FromString("+");
+    for(i = 0; i < res->nhunks && data.tags[0] && data.tags[1] && data.tags[2]; i++) {
+        h = &res->hunks[i];
+        if(!(data.list = PyList_New(0)))
+            break;
+        if(diff_hunk_lines(res, h, append_diff_line, &data) != 0) {
+            Py_DECREF(data.list);
+            break;
+        }
+        if(h->func_len) {
+            func = PyString_FromStringAndSize((const char *) res->old_data + h->func_start, h->func_len);
+        } else {
+            Py_INCREF(Py_None);
+            func = Py_None;
+        }
+        if(!func || !(item = Py_BuildValue("(IIIINN)", h->old_start + 1, h->old_count, h->new_start + 1,
+                                           h->new_count, func, data.list))) {
+            if(!func)
+                Py_DECREF(data.list);
+            break;
+        }
+        PyList_SET_ITEM(hunks, i, item);
+    }
+    Py_XDECREF(data.tags[0]);
+    Py_XDECREF(data.tags[1]);
+    Py_XDECREF(data.tags[2]);
+    if(i < res->nhunks) {
+        Py_DECREF(hunks);
+        return NULL;
+    }
+    return hunks;
+}
+
+// (kind, added, removed, hunks), where kind is "text", "approximate" (out of
+// time), "binary" or "too big"; hunks is a string in unified format or a list
+// of tuples.
+static PyObject *diff_result_to_pyobject(const struct diff_result *res, int status, int unified)
+{
+    PyObject *hunks;
+    size_t len;
+
+    if(status == DIFF_BINARY)
+        return Py_BuildValue("(sOOO)", "binary", Py_None, Py_None, Py_None);
+    if(status == DIFF_TOO_BIG)
+        return Py_BuildValue("(sOOO)", "too big", Py_None, Py_None, Py_None);
+    if(status != DIFF_TEXT)
+        return PyErr_NoMemory();
+
+    if(unified) {
+        len = diff_unified(res, NULL, 0);
+        if(len > PY_SSIZE_T_MAX - 1)
+            return PyErr_NoMemory();
+        if((hunks = PyString_FromStringAndSize(NULL, len)))
+            diff_unified(res, PyString_AS_STRING(hunks), len + 1);
+    } else {
+        hunks = diff_hunks_to_pyobject(res);
+    }
+    if(!hunks)
+        return NULL;
+    return Py_BuildValue("(sIIN)", res->approximate ? "approximate" : "text", res->added, res->removed, hunks);
+}
+
+// One side of Repo.diff(): a blob, or an empty file for no sha1. Returns 0,
+// 1 if it's missing, DIFF_TOO_BIG without reading it if it's over the limit,
+// or GITREAD_CORRUPT.
+static int diff_read_blob(const struct odb *odb, const unsigned char *sha1, size_t max_bytes,
+                          struct git_object *g_obj)
+{
+    uint64_t size;
+    int ret;
+
+    g_obj->mem_data = NULL;
+    g_obj->type = BLOB;
+    g_obj->size = 0;
+    if(!sha1)
+        return 0;
+    if(odb_object_size(odb, sha1, &size) != 0)
+        return 1;
+    if(max_bytes && size > max_bytes)
+        return DIFF_TOO_BIG;
+    if((ret = odb_read(odb, sha1, g_obj, NULL)) != 0) {
+        g_obj->mem_data = NULL;
+        return (ret == GITREAD_CORRUPT) ? ret : 1;
+    }
+    return 0;
+}
+
+static PyObject *Repo_diff(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"old", "new", "algorithm", "context", "unified", "max_bytes", "budget_ms", NULL};
+    char *hex[2], *algorithm = "myers";
+    unsigned char sha1[2][20];
+    int context = DIFF_CONTEXT, unified = 0, budget_ms = 0, ret[2], status = -1, i;
+    Py_ssize_t max_bytes = DIFF_MAX_BYTES;
+    struct git_object g_obj[2];
+    struct diff_options opts;
+    struct diff_result res;
+    struct trace_call call;
+    uint64_t generation;
+    PyObject *result;
+    struct odb *odb;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "zz|siini", kwlist, &hex[0], &hex[1], &algorithm, &context,
+                                    &unified, &max_bytes, &budget_ms))
+        return NULL;
+    memset(sha1, 0, sizeof(sha1));
+    for(i = 0; i < 2; i++) {
+        if(hex[i] && (strlen(hex[i]) != 40 || hex_to_sha1(hex[i], sha1[i]) != 0)) {
+            PyErr_SetString(PyExc_ValueError, "expected a 40 digit hex sha1 or None");
+            return NULL;
+        }
+    }
+    if(diff_options_from_args(algorithm, context, max_bytes, budget_ms, &opts) != 0)
+        return NULL;
+    trace_args(&call, sha1, 2, NULL, NULL);
+    trace_num(&call, (hex[0] ? 1 : 0) | (hex[1] ? 2 : 0));
+    trace_num(&call, opts.algorithm);
+    trace_num(&call, context);
+    trace_num(&call, unified);
+    trace_num(&call, max_bytes);
+    trace_num(&call, budget_ms);
+
+    memset(&res, 0, sizeof(res));
+    for(;;) {
+        if(!(odb = repo_odb(self)))
+            return NULL;
+        generation = odb->generation;
+        Py_BEGIN_ALLOW_THREADS
+        trace_begin(&call, TRACE_DIFF);
+        for(i = 0; i < 2; i++)
+            ret[i] = diff_read_blob(odb, hex[i] ? sha1[i] : NULL, opts.max_bytes, &g_obj[i]);
+        if(ret[0] == DIFF_TOO_BIG || ret[1] == DIFF_TOO_BIG)
+            status = DIFF_TOO_BIG;
+        else if(ret[0] == 0 && ret[1] == 0 && g_obj[0].type == BLOB && g_obj[1].type == BLOB)
+            status = diff_buffers(g_obj[0].mem_data ? g_obj[0].mem_data : (unsigned char *) "", g_obj[0].size,
+                                  g_obj[1].mem_data ? g_obj[1].mem_data : (unsigned char *) "", g_obj[1].size,
+                                  &opts, &res);
+        trace_end(&call, ret[0] == GITREAD_CORRUPT || ret[1] == GITREAD_CORRUPT);
+        odb_close(odb);
+        Py_END_ALLOW_THREADS
+        if((ret[0] != 1 && ret[1] != 1) || !repo_retry(self, generation))
+            break;
+        free(g_obj[0].mem_data);
+        free(g_obj[1].mem_data);
+    }
+
+    result = NULL;
+    for(i = 0; i < 2 && !result; i++) {
+        if(ret[i] == GITREAD_CORRUPT) {
+            PyErr_Format(CorruptObjectError, "object %s doesn't match its id.", hex[i]);
+            break;
+        }
+        if(ret[i] == 0 && g_obj[i].type != BLOB) {
+            PyErr_Format(PyExc_ValueError, "%s is a %s, not a blob.", hex[i], object_type_name(g_obj[i].type));
+            break;
+        }
+    }
+    if(i == 2) {
+        if(status == DIFF_TOO_BIG || (ret[0] == 0 && ret[1] == 0)) {
+            result = diff_result_to_pyobject(&res, status, unified);
+        } else {
+            Py_INCREF(Py_None);
+            result = Py_None;
+        }
+    }
+    diff_release(&res);
+    free(g_obj[0].mem_data);
+    free(g_obj[1].mem_data);
+    return result;
+}
+
+struct refs_list {
+    PyObject *list;
+    struct odb *odb; // set to peel
+};
+
+static int append_ref(const struct ref *ref, void *cb_data)
+{
+    struct refs_list *data = cb_data;
+    unsigned char peeled[20];
+    PyObject *item;
+    char hex[41];
+
+    memcpy(hex, sha1_to_hex(ref->sha1), 41);
+    if(!data->odb)
+        item = Py_BuildValue("(ss)", ref->name, hex);
+    else if(refs_peel(ref, data->odb, peeled) == 0)
+        item = Py_BuildValue("(sss)", ref->name, hex, sha1_to_hex(peeled));
+    else
+        item = Py_BuildValue("(ssO)", ref->name, hex, Py_None);
+
+    if(!item || PyList_Append(data->list, item) != 0) {
+        Py_XDECREF(item);
+        return 1;
+    }
+    Py_DECREF(item);
+    return 0;
+}
+
+// These don't let go of the GIL: the ref store isn't thread safe, and with
+// everything cached they're quicker than the switch would be.
+static PyObject *Repo_refs(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"prefix", "peel", NULL};
+    char *prefix = "";
+    int peel = 0;
+    struct refs_list data;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|si", kwlist, &prefix, &peel))
+        return NULL;
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+
+    if(!(data.list = PyList_New(0)))
+        return NULL;
+    data.odb = peel ? self->odb : NULL;
+    if(refs_for_each(self->refs, prefix, append_ref, &data) != 0) {
+        if(!PyErr_Occurred())
+            PyErr_SetString(PyExc_Exception, "failed to read the repository's refs.");
+        Py_DECREF(data.list);
+        return NULL;
+    }
+    return data.list;
+}
+
+static PyObject *Repo_resolve_ref(RepoObject *self, PyObject *args)
+{
+    char *name;
+    struct ref ref;
+    PyObject *retObj;
+
+    if(!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+
+    if(refs_dwim(self->refs, name, &ref) != 0)
+        Py_RETURN_NONE;
+    retObj = PyString_FromString(sha1_to_hex(ref.sha1));
+    refs_release(&ref);
+    return retObj;
+}
+
+static PyObject *Repo_peel_ref(RepoObject *self, PyObject *args)
+{
+    char *name;
+    struct ref ref;
+    unsigned char peeled[20];
+    int ret;
+
+    if(!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+
+    if(refs_dwim(self->refs, name, &ref) != 0)
+        Py_RETURN_NONE;
+    ret = refs_peel(&ref, self->odb, peeled);
+    refs_release(&ref);
+    if(ret != 0) {
+        PyErr_Format(PyExc_Exception, "failed to peel %s; an object it points at is missing.", name);
+        return NULL;
+    }
+    return PyString_FromString(sha1_to_hex(peeled));
+}
+
+static PyObject *Repo_head(RepoObject *self)
+{
+    struct ref ref;
+    PyObject *retObj;
+    int ret;
+
+    if(!self->refs) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+
+    ret = refs_read(self->refs, "HEAD", &ref);
+    if(ret < 0) {
+        refs_release(&ref);
+        PyErr_SetString(PyExc_Exception, "HEAD is missing or malformed.");
+        return NULL;
+    }
+    retObj = Py_BuildValue("(zz)", ref.target, ret == 0 ? sha1_to_hex(ref.sha1) : NULL);
+    refs_release(&ref);
+    return retObj;
+}
+
+static PyObject *Repo_refresh(RepoObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"force", NULL};
+    int force = 0, ret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &force))
+        return NULL;
+    if(!self->odb) {
+        PyErr_SetString(PyExc_Exception, "This repository was never opened.");
+        return NULL;
+    }
+
+    if((ret = repo_refresh(self, force)) < 0) {
+        PyErr_SetString(PyExc_Exception, "failed to rescan the repository's packs.");
+        return NULL;
+    }
+    return PyBool_FromLong(ret);
+}
+
+static PyObject *Repo_get_generation(RepoObject *self, void *closure)
+{
+    if(!self->odb)
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLongLong(self->odb->generation);
+}
+
+static PyGetSetDef Repo_getset[] = {
+    {"generation", (getter)Repo_get_generation, NULL, "how many times refresh() has found the packs changed", NULL},
+    {NULL}
+};
+
+static PyMemberDef Repo_members[] = {
+    {"git_dir", T_OBJECT, offsetof(RepoObject, git_dir), READONLY, "the repository's .git directory"},
+    {NULL}
+};
+
+static PyMethodDef Repo_methods[] = {
+    {"walk", (PyCFunction)Repo_walk, METH_VARARGS | METH_KEYWORDS,
+        "walk(include, exclude=(), cache_mb=64) -> iterator of (sha1, type, path)\n\n"
+        "Lists every object reachable from the include sha1s but not from the exclude\n"
+        "ones, like \"git rev-list --objects\". path is where a tree or blob was first\n"
+        "found, and \"\" for commits, tags and root trees. The sha1s must be 40 digit\n"
+        "hex ids; unlike grep() or blame(), ref names aren't resolved (see\n"
+        "resolve_ref())."},
+    {"grep", (PyCFunction)Repo_grep, METH_VARARGS | METH_KEYWORDS,
+        "grep(rev, pattern, path=\"\", fixed=False, extended=False, ignore_case=False, max_matches=0,\n"
+        "     max_bytes=16MB, threads=0) -> iterator of (path, line, text), or None\n\n"
+        "Searches the files under path in rev for lines matching pattern, like\n"
+        "\"git grep -I -n pattern rev -- path\": a basic regex, an extended one, or a\n"
+        "plain string with fixed. Binary files and ones over max_bytes (0 for no limit)\n"
+        "are skipped. Files are read and searched by a thread per CPU (or threads),\n"
+        "but matches come out in git's order; stopping early, or at max_matches,\n"
+        "stops the search. Returns None if there's no such path."},
+    {"archive", (PyCFunction)Repo_archive, METH_VARARGS | METH_KEYWORDS,
+        "archive(rev, out, format=\"tar\", path=\"\", prefix=\"\", level=-1, threads=0) -> True, or None\n\n"
+        "Writes what \"git archive --format=format --prefix=prefix rev path\" would:\n"
+        "a tar or zip of the files under path, with prefix put in front of their\n"
+        "names, to out, a file descriptor or a function called with each piece in\n"
+        "turn. level is zip's compression level. Blobs are read ahead by a thread\n"
+        "per CPU (or threads), but only so far, and big ones are streamed, so\n"
+        "memory use doesn't grow with the tree. Returns None if there's no such\n"
+        "path."},
+    {"count_reachable", (PyCFunction)Repo_count_reachable, METH_VARARGS | METH_KEYWORDS,
+        "count_reachable(include, exclude=()) -> dict\n\n"
+        "Counts the objects (by type) and packed bytes reachable from include but not\n"
+        "from exclude, using the pack's .bitmap. Objects outside the bitmapped pack\n"
+        "are counted but add no bytes. Both take 40 digit hex sha1s, not ref names."},
+    {"refresh", (PyCFunction)Repo_refresh, METH_VARARGS | METH_KEYWORDS,
+        "refresh(force=False) -> whether the packs changed\n\n"
+        "Picks up packs added to or removed from objects/pack since the last look.\n"
+        "It's cheap when nothing has changed: unless forced, only the directory's\n"
+        "mtime is checked, and packs already open are never reloaded. Walks already\n"
+        "running carry on with the packs they started with. Repo(git_dir, refresh=s)\n"
+        "does this at most every s seconds before reading anything, and a call that\n"
+        "finds an object missing forces it once and tries again, as after a gc."},
+    {"commit", (PyCFunction)Repo_commit, METH_VARARGS,
+        "commit(sha1) -> Commit or None\n\n"
+        "Reads and parses a commit. sha1 must be a 40 digit hex id, not a ref name.\n"
+        "Raises ValueError if it isn't, or isn't a commit."},
+    {"read_many", (PyCFunction)Repo_read_many, METH_VARARGS | METH_KEYWORDS,
+        "read_many(sha1s, cache_mb=64) -> list of (type, size, data) or None\n\n"
+        "Reads a batch of objects, returned in the order asked for. They're read in\n"
+        "pack order, so a cold page cache sees mostly sequential reads, and delta\n"
+        "bases they share are only inflated once. Missing objects give None. The\n"
+        "sha1s must be 40 digit hex ids, not ref names."},
+    {"refs", (PyCFunction)Repo_refs, METH_VARARGS | METH_KEYWORDS,
+        "refs(prefix=\"\", peel=False) -> list of (name, sha1) or (name, sha1, peeled)\n\n"
+        "Lists the refs starting with prefix, packed and loose, in name order. With\n"
+        "peel, peeled is what an annotated tag points at (sha1 itself for other refs)."},
+    {"resolve_path", (PyCFunction)Repo_resolve_path, METH_VARARGS,
+        "resolve_path(rev, path) -> (mode, sha1) or None\n\n"
+        "Looks path (\"a/b/c\") up in rev, a commit, tree or tag sha1 or a ref name,\n"
+        "like \"git rev-parse rev:path\". Steps already taken are remembered, so\n"
+        "repeated lookups of deep paths read only trees they haven't seen."},
+    {"last_modified", (PyCFunction)Repo_last_modified, METH_VARARGS | METH_KEYWORDS,
+        "last_modified(rev, path=\"\", budget_ms=0) -> list of (name, mode, sha1, commit) or None\n\n"
+        "Lists the directory at path as of rev, with the last commit (following\n"
+        "first parents) to change each entry, all in one walk of the history.\n"
+        "With a budget, entries still unresolved when it runs out have commit None.\n"
+        "Returns None if there's no such directory."},
+    {"blame", (PyCFunction)Repo_blame, METH_VARARGS | METH_KEYWORDS,
+        "blame(rev, path, start=1, end=0, budget_ms=0) -> list of (commit, orig_line, final_line, count) or None\n\n"
+        "Who added each line of the file at path as of rev, like \"git blame\n"
+        "--porcelain -L start,end\" (end 0 for the end of the file) without following\n"
+        "renames. A list entry is a run of count lines starting at final_line that\n"
+        "commit added, where they were at orig_line. With a budget, lines not yet\n"
+        "tracked down when it runs out have commit None. Returns None if there's no\n"
+        "such file."},
+    {"read_range", (PyCFunction)Repo_read_range, METH_VARARGS,
+        "read_range(sha1, offset, length) -> (type, size, data), or None\n\n"
+        "Reads length bytes of an object starting at offset (fewer at its end);\n"
+        "size is the whole object's. Only as much of the object as the range needs\n"
+        "is inflated, and a delta only has the ops covering the range applied, so\n"
+        "a preview of a big blob costs about what the preview's size does. Big\n"
+        "objects are checkpointed as they're read, so later reads further in can\n"
+        "start close by. Returns None if there's no such object. sha1 must be a\n"
+        "40 digit hex id, not a ref name; ValueError is raised if it isn't, or if\n"
+        "offset or length is negative."},
+    {"diff", (PyCFunction)Repo_diff, METH_VARARGS | METH_KEYWORDS,
+        "diff(old, new, algorithm='myers', context=3, unified=False, max_bytes=16MB, budget_ms=0)\n"
+        "    -> (kind, added, removed, hunks), or None if a blob is missing\n\n"
+        "Line diff of two blobs, either of which may be None for an empty file. kind is\n"
+        "'text', 'binary' or 'too big' (either is over max_bytes; 0 for no limit), and\n"
+        "only text has the rest. hunks is the diff as git prints it, minus the file\n"
+        "headers, with unified; otherwise a list of (old_start, old_count, new_start,\n"
+        "new_count, function, [(tag, line), ...]) with tag ' ', '-' or '+'. algorithm\n"
+        "may be 'histogram'. Past budget_ms, what's left is one big change and kind is\n"
+        "'approximate'."},
+    {"ls_tree", (PyCFunction)Repo_ls_tree, METH_VARARGS | METH_KEYWORDS,
+        "ls_tree(rev, path=\"\", depth=0, trees=False, sizes=False, threads=0)\n"
+        "    -> list of (path, mode, sha1) or (path, mode, sha1, size), or None\n\n"
+        "Lists everything under path in rev recursively, like \"git ls-tree -r\".\n"
+        "depth > 0 recurses at most that many levels below path. With trees, the\n"
+        "trees recursed into are listed too (-t); with sizes, blobs have their size\n"
+        "and everything else None (-l). Subtrees are read by threads threads at\n"
+        "once, one per CPU by default. Returns None if there's no such path."},
+    {"is_ancestor", (PyCFunction)Repo_is_ancestor, METH_VARARGS,
+        "is_ancestor(ancestor, descendant) -> bool\n\n"
+        "Whether ancestor is reachable from descendant, like \"git merge-base\n"
+        "--is-ancestor\"; a commit counts as its own ancestor. Revs are sha1s or ref\n"
+        "names. With a commit-graph, generation numbers cut the walk short."},
+    {"merge_bases", (PyCFunction)Repo_merge_bases, METH_VARARGS,
+        "merge_bases(one, others) -> list of sha1\n\n"
+        "The best common ancestors of one and all of others, like \"git merge-base\n"
+        "--all one others...\". Empty if the histories are unrelated."},
+    {"ahead_behind", (PyCFunction)Repo_ahead_behind, METH_VARARGS,
+        "ahead_behind(one, two) -> (ahead, behind)\n\n"
+        "How many commits are reachable from one but not two, and the other way\n"
+        "round, like \"git rev-list --left-right --count one...two\"."},
+    {"resolve_ref", (PyCFunction)Repo_resolve_ref, METH_VARARGS,
+        "resolve_ref(name) -> sha1 or None\n\n"
+        "Resolves a full or short ref name (\"master\", \"v1.0\") the way git does."},
+    {"peel_ref", (PyCFunction)Repo_peel_ref, METH_VARARGS,
+        "peel_ref(name) -> sha1 or None\n\n"
+        "Like resolve_ref(), but follows annotated tags to what they point at."},
+    {"head", (PyCFunction)Repo_head, METH_NOARGS,
+        "head() -> (ref, sha1)\n\n"
+        "ref is the ref HEAD points at, or None if it's detached; sha1 is None on a\n"
+        "branch with no commits yet."},
+    {NULL}
+};
+
+static PyTypeObject RepoType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                         /*ob_size*/
+    "gitutil.Repo",            /*tp_name*/
+    sizeof(RepoObject),        /*tp_basicsize*/
+    0,                         /*tp_itemsize*/
+    (destructor)Repo_dealloc,  /*tp_dealloc*/
+    0,                         /*tp_print*/
+    0,                         /*tp_getattr*/
+    0,                         /*tp_setattr*/
+    0,                         /*tp_compare*/
+    0,                         /*tp_repr*/
+    0,                         /*tp_as_number*/
+    0,                         /*tp_as_sequence*/
+    0,                         /*tp_as_mapping*/
+    0,                         /*tp_hash */
+    0,                         /*tp_call*/
+    0,                         /*tp_str*/
+    0,                         /*tp_getattro*/
+    0,                         /*tp_setattro*/
+    0,                         /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,        /*tp_flags*/
+    "Repo(git_dir, refresh=0, verify=0): a repository's packs and loose objects;\n"
+    "with verify, every object read is checked against its id (see CorruptObjectError)", /* tp_doc */
+    0,		                   /* tp_traverse */
+    0,		                   /* tp_clear */
+    0,		                   /* tp_richcompare */
+    0,		                   /* tp_weaklistoffset */
+    0,		                   /* tp_iter */
+    0,		                   /* tp_iternext */
+    Repo_methods,              /* tp_methods */
+    Repo_members,              /* tp_members */
+    Repo_getset,               /* tp_getset */
+    0,                         /* tp_base */
+    0,                         /* tp_dict */
+    0,                         /* tp_descr_get */
+    0,                         /* tp_descr_set */
+    0,                         /* tp_dictoffset */
+    (initproc)Repo_init,       /* tp_init */
+    0,                         /* tp_alloc */
+    Repo_new,                  /* tp_new */
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct objclient *client;
+    int busy;                  // a call has let go of the GIL part way through
+} ObjectClientObject;
+
+static void ObjectClient_dealloc(ObjectClientObject *self)
+{
+    objclient_close(self->client);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *ObjectClient_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-    PackIdxObject *self;
-    
-    self = (PackIdxObject *)type->tp_alloc(type, 0);
+    ObjectClientObject *self;
+
+    self = (ObjectClientObject *)type->tp_alloc(type, 0);
     if(self != NULL) {
-        // setup values
-        self->idx = NULL;
-        self->location = NULL;
+        self->client = NULL;
+        self->busy = 0;
     }
-    
+
     return (PyObject *)self;
 }
 
-static int PackIdx_init(PackIdxObject *self, PyObject *args, PyObject *kwds)
+static int ObjectClient_init(ObjectClientObject *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *location;
-    
-    if(!PyArg_ParseTuple(args, "S", &location))
-        return -1; // error
-    
-    // quick error check, since it is possible to call __init__ more than once (which we don't support)
-    if(self->idx != NULL || self->location != NULL) {
+    char *path;
+
+    if(!PyArg_ParseTuple(args, "s", &path))
+        return -1;
+
+    if(self->client != NULL) {
         PyErr_SetString(PyExc_Exception, "This object has already been intialized once.");
         return -1;
     }
-    
-    // load up the idx
-    self->idx = load_idx(PyString_AsString(location));
-    
-    if(!self->idx) {
-        PyErr_SetString(PyExc_Exception, "Failed to load the idx file.");
+
+    Py_BEGIN_ALLOW_THREADS
+    self->client = objclient_connect(path);
+    Py_END_ALLOW_THREADS
+    if(!self->client) {
+        PyErr_Format(PyExc_Exception, "failed to connect to %s: %s", path, strerror(errno));
         return -1;
     }
-    
-    // save the location for easy access from Python
-    self->location = location;
-    Py_INCREF(location);
-    
-    return 0; // success
+
+    return 0;
 }
 
-/*static void PackIdx_close(PackIdxObject *self)
+// Claims the connection for a call that will let go of the GIL.
+static int object_client_claim(ObjectClientObject *self)
 {
-    
-}*/
+    if(!self->client) {
+        PyErr_SetString(PyExc_Exception, "This client isn't connected.");
+        return -1;
+    }
+    if(self->busy) {
+        PyErr_SetString(PyExc_Exception, "This client is already in use by another thread.");
+        return -1;
+    }
+    self->busy = 1;
+    return 0;
+}
 
-static PyMemberDef PackIdx_members[] = {
-    {"location", T_OBJECT, offsetof(PackIdxObject, location), READONLY, "location of the idx file"},
-    {NULL}
-};
+// The connection is out of step with the server once anything goes wrong.
+static PyObject *object_client_failed(ObjectClientObject *self)
+{
+    objclient_close(self->client);
+    self->client = NULL;
+    PyErr_SetString(PyExc_Exception, "lost the connection to the object server.");
+    return NULL;
+}
 
-/*static PyMethodDef PackIdx_methods[] = {
-    {"close", (PyCFunction)PackIdx_close, METH_NOARGS,
-        "Closes the idx file properly. This method is called if you simply delete the object."},
+static PyObject *object_client_reply_to_pyobject(struct objclient_reply *reply)
+{
+    struct git_object g_obj;
+    PyObject *data;
+
+    if(reply->corrupt) {
+        PyErr_SetString(CorruptObjectError, "the object server found the object doesn't match its id.");
+        return NULL;
+    }
+    if(!reply->found)
+        Py_RETURN_NONE;
+    if(!reply->data)
+        return Py_BuildValue("(sIk)", sha1_to_hex(reply->sha1), reply->type, reply->size);
+
+    g_obj.type = reply->type;
+    g_obj.size = reply->size;
+    g_obj.mem_data = reply->data;
+    reply->data = NULL;
+    if(!(data = object_buffer_from_git_object(&g_obj)))
+        return NULL;
+    return Py_BuildValue("(sIkN)", sha1_to_hex(reply->sha1), reply->type, reply->size, data);
+}
+
+static PyObject *object_client_get(ObjectClientObject *self, const char *name, int info)
+{
+    struct objclient_reply reply;
+    int ret;
+
+    if(object_client_claim(self) != 0)
+        return NULL;
+    if(objclient_send(self->client, name, info) != 0) {
+        self->busy = 0;
+        PyErr_SetString(PyExc_ValueError, "not a valid object name.");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = objclient_receive(self->client, &reply);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+
+    if(ret != 0)
+        return object_client_failed(self);
+    return object_client_reply_to_pyobject(&reply);
+}
+
+static PyObject *ObjectClient_get(ObjectClientObject *self, PyObject *args)
+{
+    char *name;
+
+    if(!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    return object_client_get(self, name, 0);
+}
+
+static PyObject *ObjectClient_info(ObjectClientObject *self, PyObject *args)
+{
+    char *name;
+
+    if(!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    return object_client_get(self, name, 1);
+}
+
+// Keeps OBJCLIENT_WINDOW requests in flight, so a batch costs about one round
+// trip rather than one per object.
+static PyObject *ObjectClient_get_many(ObjectClientObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"names", "info", NULL};
+    PyObject *names, *fast, *list = NULL, *item;
+    struct objclient_reply reply;
+    Py_ssize_t n, sent = 0, received = 0;
+    char *name;
+    int info = 0, ret;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &names, &info))
+        return NULL;
+    if(!(fast = PySequence_Fast(names, "names must be a sequence of object names")))
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(fast);
+    if(!(list = PyList_New(n)) || object_client_claim(self) != 0) {
+        Py_XDECREF(list);
+        Py_DECREF(fast);
+        return NULL;
+    }
+
+    while(received < n) {
+        while(sent < n && self->client->npending < OBJCLIENT_WINDOW) {
+            if(!(name = PyString_AsString(PySequence_Fast_GET_ITEM(fast, sent))))
+                break;
+            if(objclient_send(self->client, name, info) != 0) {
+                PyErr_SetString(PyExc_ValueError, "not a valid object name.");
+                break;
+            }
+            sent++;
+        }
+        if(PyErr_Occurred())
+            break;
+
+        Py_BEGIN_ALLOW_THREADS
+        ret = objclient_receive(self->client, &reply);
+        Py_END_ALLOW_THREADS
+        if(ret != 0) {
+            self->busy = 0;
+            Py_DECREF(list);
+            Py_DECREF(fast);
+            return object_client_failed(self);
+        }
+        if(!(item = object_client_reply_to_pyobject(&reply)))
+            break;
+        PyList_SET_ITEM(list, received++, item);
+    }
+    self->busy = 0;
+    Py_DECREF(fast);
+
+    if(received < n) {
+        // replies to what was sent are still on their way; drop the connection
+        // rather than leave it out of step
+        objclient_close(self->client);
+        self->client = NULL;
+        Py_DECREF(list);
+        return NULL;
+    }
+    return list;
+}
+
+static PyObject *ObjectClient_close(ObjectClientObject *self)
+{
+    if(self->busy) {
+        PyErr_SetString(PyExc_Exception, "This client is in use by another thread.");
+        return NULL;
+    }
+    objclient_close(self->client);
+    self->client = NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef ObjectClient_methods[] = {
+    {"get", (PyCFunction)ObjectClient_get, METH_VARARGS,
+        "get(name) -> (sha1, type, size, data) or None\n\n"
+        "Reads an object, by sha1 or ref name, from the server."},
+    {"info", (PyCFunction)ObjectClient_info, METH_VARARGS,
+        "info(name) -> (sha1, type, size) or None\n\n"
+        "Like get(), without the data."},
+    {"get_many", (PyCFunction)ObjectClient_get_many, METH_VARARGS | METH_KEYWORDS,
+        "get_many(names, info=False) -> list of what get() (or info()) would return\n\n"
+        "Pipelines the requests, which is much faster than asking one at a time."},
+    {"close", (PyCFunction)ObjectClient_close, METH_NOARGS,
+        "close()\n\n"
+        "Disconnects from the server."},
     {NULL}
-};*/
+};
 
-static PyTypeObject PackIdxType = {
+static PyTypeObject ObjectClientType = {
     PyObject_HEAD_INIT(NULL)
     0,                         /*ob_size*/
-    "gitutil.PackIdx",         /*tp_name*/
-    sizeof(PackIdxObject),     /*tp_basicsize*/
+    "gitutil.ObjectClient",    /*tp_name*/
+    sizeof(ObjectClientObject), /*tp_basicsize*/
     0,                         /*tp_itemsize*/
-    (destructor)PackIdx_dealloc, /*tp_dealloc*/
+    (destructor)ObjectClient_dealloc, /*tp_dealloc*/
     0,                         /*tp_print*/
     0,                         /*tp_getattr*/
     0,                         /*tp_setattr*/
@@ -100,24 +2830,24 @@ static PyTypeObject PackIdxType = {
     0,                         /*tp_setattro*/
     0,                         /*tp_as_buffer*/
     Py_TPFLAGS_DEFAULT,        /*tp_flags*/
-    "PackIdx objects",         /* tp_doc */
+    "ObjectClient(socket_path): a connection to an objserver", /* tp_doc */
     0,		                   /* tp_traverse */
     0,		                   /* tp_clear */
     0,		                   /* tp_richcompare */
     0,		                   /* tp_weaklistoffset */
     0,		                   /* tp_iter */
     0,		                   /* tp_iternext */
-    0,//PackIdx_methods,           /* tp_methods */
-    PackIdx_members,           /* tp_members */
+    ObjectClient_methods,      /* tp_methods */
+    0,                         /* tp_members */
     0,                         /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
     0,                         /* tp_descr_get */
     0,                         /* tp_descr_set */
     0,                         /* tp_dictoffset */
-    (initproc)PackIdx_init,    /* tp_init */
+    (initproc)ObjectClient_init, /* tp_init */
     0,                         /* tp_alloc */
-    PackIdx_new,               /* tp_new */
+    ObjectClient_new,          /* tp_new */
 };
 
 static PyObject *raw_tree_to_pyobject(struct git_object *g_obj)
@@ -194,9 +2924,28 @@ static PyObject *raw_tree_to_pyobject(struct git_object *g_obj)
     return pylist;
 }
 
+// The legacy getters check what they read against the id when they're given
+// one. Frees the data and raises if it doesn't match.
+static int legacy_check_object(const char *hex, struct git_object *g_obj)
+{
+    unsigned char sha1[20];
+
+    if(strlen(hex) != 40 || hex_to_sha1(hex, sha1) != 0) {
+        free(g_obj->mem_data);
+        PyErr_SetString(PyExc_ValueError, "expected a 40 digit hex sha1");
+        return -1;
+    }
+    if(check_object_hash(sha1, g_obj->type, g_obj->mem_data, g_obj->size) != 0) {
+        free(g_obj->mem_data);
+        PyErr_Format(CorruptObjectError, "object %s doesn't match its id.", hex);
+        return -1;
+    }
+    return 0;
+}
+
 static PyObject *gu_pack_get_object(PyObject *self, PyObject *args)
 {
-    char *location;
+    char *location, *hex = NULL;
     int full = 0;
     unsigned int offset;
     struct git_object g_obj;
@@ -205,38 +2954,40 @@ static PyObject *gu_pack_get_object(PyObject *self, PyObject *args)
     PyObject *retObj;
     PyObject *buffstr;
 
-    if(!PyArg_ParseTuple(args, "si|i", &location, &offset, &full))
+    if(!PyArg_ParseTuple(args, "si|iz", &location, &offset, &full, &hex))
         return NULL;
 
-    ret = pack_get_object(location, offset, &g_obj, full);
+    ret = pack_get_object(location, offset, &g_obj, full || hex);
     
     if(ret != 0) {
         printf("!!!! %i", ret);
         PyErr_SetString(PyExc_Exception, "error occured while getting a packed object; perhaps the pack file doesn't exist or is corrupt.");
         return NULL;
     }
+    if(hex && legacy_check_object(hex, &g_obj) != 0)
+        return NULL;
     
     if(g_obj.mem_data != NULL) {
         if(g_obj.type == TREE) {
             pytree = raw_tree_to_pyobject(&g_obj);
             free(g_obj.mem_data);//fclose(g_obj.data); // we have to do this ourselves, just in case the previous call errored out
-            retObj = Py_BuildValue("iiO", g_obj.type, g_obj.size, pytree);
+            retObj = Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, pytree);
             Py_DECREF(pytree);
             return retObj;
         }
-        buffstr =  PyString_FromStringAndSize((char *) g_obj.mem_data, g_obj.size);
-        retObj = Py_BuildValue("iiO", g_obj.type, g_obj.size, buffstr);
+        if(!(buffstr = object_buffer_from_git_object(&g_obj)))
+            return NULL;
+        retObj = Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, buffstr);
         Py_DECREF(buffstr); // this function is done messing with it, so it needs to give up its reference for proper gc
-        free(g_obj.mem_data);
         return retObj;
     } else {
-        return Py_BuildValue("iiO", g_obj.type, g_obj.size, Py_None);
+        return Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, Py_None);
     }
 }
 
 static PyObject *gu_loose_get_object(PyObject *self, PyObject *args)
 {
-    char *location;
+    char *location, *hex = NULL;
     int full = 0;
     struct git_object g_obj;
     int ret;
@@ -244,31 +2995,33 @@ static PyObject *gu_loose_get_object(PyObject *self, PyObject *args)
     PyObject *retObj;
     PyObject *buffstr;
 
-    if(!PyArg_ParseTuple(args, "s|i", &location, &full))
+    if(!PyArg_ParseTuple(args, "s|iz", &location, &full, &hex))
         return NULL;
 
-    ret = loose_get_object(location, &g_obj, full);
+    ret = loose_get_object(location, &g_obj, full || hex);
     
     if(ret != 0) {
         PyErr_SetString(PyExc_Exception, "error occured while getting a loose object; perhaps the object's file doesn't exist or is corrupt.");
         return NULL;
     }
+    if(hex && legacy_check_object(hex, &g_obj) != 0)
+        return NULL;
     
     if(g_obj.mem_data != NULL) {
         if(g_obj.type == TREE) {
             pytree = raw_tree_to_pyobject(&g_obj);
             free(g_obj.mem_data);//fclose(g_obj.data); // we have to do this ourselves, just in case the previous call errored out
-            retObj = Py_BuildValue("iiO", g_obj.type, g_obj.size, pytree);
+            retObj = Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, pytree);
             Py_DECREF(pytree);
             return retObj;
         }
-        buffstr = PyString_FromStringAndSize((char *) g_obj.mem_data, g_obj.size);
-        retObj = Py_BuildValue("iiO", g_obj.type, g_obj.size, buffstr);
+        if(!(buffstr = object_buffer_from_git_object(&g_obj)))
+            return NULL;
+        retObj = Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, buffstr);
         Py_DECREF(buffstr);
-        free(g_obj.mem_data);
         return retObj;
     } else {
-        return Py_BuildValue("iiO", g_obj.type, g_obj.size, Py_None);
+        return Py_BuildValue("iKO", g_obj.type, (unsigned PY_LONG_LONG) g_obj.size, Py_None);
     }
 }
 
@@ -297,20 +3050,412 @@ static PyObject *gu_pack_idx_read(PyObject *self, PyObject *args)
     }
 }
 
+// Only sets a key if the value could be built; errors are picked up at the end
+// by checking PyErr_Occurred().
+static void dict_set_steal(PyObject *dict, const char *key, PyObject *value)
+{
+    if(value) {
+        PyDict_SetItemString(dict, key, value);
+        Py_DECREF(value);
+    }
+}
+
+static PyObject *stats_by_type(const uint64_t *counts)
+{
+    return Py_BuildValue("{s:K,s:K,s:K,s:K}",
+                         "commit", (unsigned PY_LONG_LONG) counts[COMMIT],
+                         "tree", (unsigned PY_LONG_LONG) counts[TREE],
+                         "blob", (unsigned PY_LONG_LONG) counts[BLOB],
+                         "tag", (unsigned PY_LONG_LONG) counts[TAG]);
+}
+
+static PyObject *stats_by_store(const uint64_t *counts)
+{
+    return Py_BuildValue("{s:K,s:K}",
+                         "loose", (unsigned PY_LONG_LONG) counts[STATS_LOOSE],
+                         "packed", (unsigned PY_LONG_LONG) counts[STATS_PACKED]);
+}
+
+// {upper bound in microseconds: calls}, leaving out empty buckets
+static PyObject *stats_histogram(const uint64_t *buckets)
+{
+    PyObject *hist, *key, *value;
+    int i;
+
+    if(!(hist = PyDict_New()))
+        return NULL;
+    for(i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+        if(!buckets[i])
+            continue;
+        key = PyLong_FromUnsignedLongLong(1ULL << i);
+        value = PyLong_FromUnsignedLongLong(buckets[i]);
+        if(key && value)
+            PyDict_SetItem(hist, key, value);
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+    }
+    return hist;
+}
+
+static PyObject *gu_stats(PyObject *self, PyObject *args)
+{
+    struct gu_stats stats;
+    PyObject *dict, *sub, *value;
+    uint64_t lookups;
+    int i;
+
+    stats_snapshot(&stats);
+
+    if(!(dict = PyDict_New()))
+        return NULL;
+
+    if((sub = PyDict_New())) {
+        dict_set_steal(sub, "loose", stats_by_type(stats.objects[STATS_LOOSE]));
+        dict_set_steal(sub, "packed", stats_by_type(stats.objects[STATS_PACKED]));
+        dict_set_steal(dict, "objects", sub);
+    }
+    dict_set_steal(dict, "bytes_read", stats_by_store(stats.bytes_read));
+    dict_set_steal(dict, "bytes_inflated", stats_by_store(stats.bytes_inflated));
+
+    if((sub = PyDict_New())) {
+        for(i = 0; i < STATS_DELTA_DEPTH_BUCKETS; i++) {
+            if(!stats.delta_depth[i])
+                continue;
+            value = PyLong_FromUnsignedLongLong(stats.delta_depth[i]);
+            if(value) {
+                PyObject *key = PyInt_FromLong(i);
+                if(key)
+                    PyDict_SetItem(sub, key, value);
+                Py_XDECREF(key);
+                Py_DECREF(value);
+            }
+        }
+        dict_set_steal(dict, "delta_depth", sub);
+    }
+
+    dict_set_steal(dict, "idx", Py_BuildValue("{s:K,s:K}",
+                   "lookups", (unsigned PY_LONG_LONG) stats.idx_lookups,
+                   "probes", (unsigned PY_LONG_LONG) stats.idx_probes));
+
+    lookups = stats.file_cache_opens + stats.file_cache_hits;
+    dict_set_steal(dict, "file_cache", Py_BuildValue("{s:K,s:K,s:d}",
+                   "opens", (unsigned PY_LONG_LONG) stats.file_cache_opens,
+                   "hits", (unsigned PY_LONG_LONG) stats.file_cache_hits,
+                   "hit_rate", lookups ? (double) stats.file_cache_hits / lookups : 0.0));
+
+    lookups = stats.base_cache_hits + stats.base_cache_misses;
+    dict_set_steal(dict, "base_cache", Py_BuildValue("{s:K,s:K,s:d}",
+                   "hits", (unsigned PY_LONG_LONG) stats.base_cache_hits,
+                   "misses", (unsigned PY_LONG_LONG) stats.base_cache_misses,
+                   "hit_rate", lookups ? (double) stats.base_cache_hits / lookups : 0.0));
+
+    if((sub = PyDict_New())) {
+        for(i = 0; i < STATS_NOPS; i++) {
+            dict_set_steal(sub, stats_op_names[i], Py_BuildValue("{s:K,s:K,s:d,s:N}",
+                           "calls", (unsigned PY_LONG_LONG) stats.calls[i],
+                           "errors", (unsigned PY_LONG_LONG) stats.errors[i],
+                           "total_us", stats.latency_ns[i] / 1000.0,
+                           "histogram_us", stats_histogram(stats.latency[i])));
+        }
+        dict_set_steal(dict, "latency", sub);
+    }
+
+    dict_set_steal(dict, "verify", Py_BuildValue("{s:K,s:K,s:K,s:d,s:d,s:s}",
+                   "objects", (unsigned PY_LONG_LONG) stats.verify_objects,
+                   "bytes", (unsigned PY_LONG_LONG) stats.verify_bytes,
+                   "failures", (unsigned PY_LONG_LONG) stats.verify_failures,
+                   "total_us", stats.verify_ns / 1000.0,
+                   "mb_per_s", stats.verify_ns ? stats.verify_bytes * 1e3 / stats.verify_ns : 0.0,
+                   "sha1", sha1_implementation()));
+
+    dict_set_steal(dict, "packs_skipped", PyLong_FromUnsignedLongLong(stats.packs_skipped));
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(dict);
+        return NULL;
+    }
+    return dict;
+}
+
+static PyObject *gu_reset_stats(PyObject *self, PyObject *args)
+{
+    stats_reset();
+    Py_RETURN_NONE;
+}
+
+static PyObject *gu_trace_start(PyObject *self, PyObject *args)
+{
+    char *path;
+
+    if(!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+    if(trace_start(path) != 0)
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    Py_RETURN_NONE;
+}
+
+static PyObject *gu_trace_stop(PyObject *self, PyObject *args)
+{
+    if(trace_stop() != 0)
+        return PyErr_SetFromErrno(PyExc_IOError);
+    Py_RETURN_NONE;
+}
+
+static PyObject *gu_parse_commit(PyObject *self, PyObject *args)
+{
+    Py_buffer view;
+    unsigned char *data;
+
+    if(!PyArg_ParseTuple(args, "s*", &view))
+        return NULL;
+    if(!(data = malloc(view.len + 1))) {
+        PyBuffer_Release(&view);
+        return PyErr_NoMemory();
+    }
+    memcpy(data, view.buf, view.len);
+    data[view.len] = '\0';
+    PyBuffer_Release(&view);
+    return commit_from_data(data, view.len, NULL);
+}
+
+static PyObject *gu_diff(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"old", "new", "algorithm", "context", "unified", "max_bytes", "budget_ms", NULL};
+    char *algorithm = "myers";
+    int context = DIFF_CONTEXT, unified = 0, budget_ms = 0, status;
+    Py_ssize_t max_bytes = DIFF_MAX_BYTES;
+    Py_buffer old_view, new_view;
+    struct diff_options opts;
+    struct diff_result res;
+    PyObject *result;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s*s*|siini", kwlist, &old_view, &new_view, &algorithm,
+                                    &context, &unified, &max_bytes, &budget_ms))
+        return NULL;
+    if(diff_options_from_args(algorithm, context, max_bytes, budget_ms, &opts) != 0) {
+        PyBuffer_Release(&old_view);
+        PyBuffer_Release(&new_view);
+        return NULL;
+    }
+
+    // the buffers belong to objects in args, so they'll stay put
+    Py_BEGIN_ALLOW_THREADS
+    status = diff_buffers(old_view.buf, old_view.len, new_view.buf, new_view.len, &opts, &res);
+    Py_END_ALLOW_THREADS
+
+    result = diff_result_to_pyobject(&res, status, unified);
+    diff_release(&res);
+    PyBuffer_Release(&old_view);
+    PyBuffer_Release(&new_view);
+    return result;
+}
+
+static PyObject *gu_verify_pack(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"pack", "idx", "threads", "cache_mb", NULL};
+    char *pack_location, *idx_location = NULL;
+    char *default_idx = NULL;
+    int threads = 0, cache_mb = 64, ret;
+    struct verify_result *result;
+    PyObject *bad, *retObj;
+    uint32_t i;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|zii", kwlist, &pack_location, &idx_location, &threads, &cache_mb))
+        return NULL;
+
+    // default to the idx next to the pack
+    if(!idx_location) {
+        if(!(idx_location = default_idx = pack_idx_location(pack_location))) {
+            PyErr_SetString(PyExc_ValueError, "pack file name doesn't end in .pack; pass idx explicitly");
+            return NULL;
+        }
+    }
+
+    if(!(result = malloc(sizeof(struct verify_result)))) {
+        free(default_idx);
+        return PyErr_NoMemory();
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = verify_pack(pack_location, idx_location, threads, (size_t) cache_mb << 20, result);
+    Py_END_ALLOW_THREADS
+    free(default_idx);
+
+    if(ret != 0) {
+        free(result);
+        PyErr_SetString(PyExc_Exception, "failed to load the pack or idx file for verification.");
+        return NULL;
+    }
+
+    if(!(bad = PyList_New(0))) {
+        free(result);
+        return NULL;
+    }
+    for(i = 0; i < result->nbad; i++) {
+        PyObject *hex = PyString_FromString(sha1_to_hex(result->bad[i]));
+        if(!hex || PyList_Append(bad, hex) != 0) {
+            Py_XDECREF(hex);
+            Py_DECREF(bad);
+            free(result);
+            return NULL;
+        }
+        Py_DECREF(hex);
+    }
+
+    retObj = Py_BuildValue("{s:O,s:I,s:I,s:O,s:O,s:O,s:O,s:I,s:I,s:I,s:N,s:i,s:d}",
+                           "ok", verify_ok(result) ? Py_True : Py_False,
+                           "objects", result->objects,
+                           "checked", result->checked,
+                           "pack_checksum_ok", result->pack_checksum_ok ? Py_True : Py_False,
+                           "idx_checksum_ok", result->idx_checksum_ok ? Py_True : Py_False,
+                           "idx_matches_pack", result->idx_matches_pack ? Py_True : Py_False,
+                           "has_crc", result->has_crc ? Py_True : Py_False,
+                           "crc_errors", result->crc_errors,
+                           "hash_errors", result->hash_errors,
+                           "read_errors", result->read_errors,
+                           "bad", bad,
+                           "threads", result->threads,
+                           "seconds", result->seconds);
+    free(result);
+    return retObj;
+}
+
+static PyObject *gu_index_pack(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"pack", "idx", "rev", "threads", NULL};
+    char *pack_location, *idx_location = NULL;
+    char *default_idx = NULL, *rev_location = NULL;
+    int write_rev = 0, threads = 0, ret;
+    struct index_pack_result result;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|zii", kwlist, &pack_location, &idx_location, &write_rev, &threads))
+        return NULL;
+
+    if(!idx_location) {
+        if(!(idx_location = default_idx = pack_idx_location(pack_location))) {
+            PyErr_SetString(PyExc_ValueError, "pack file name doesn't end in .pack; pass idx explicitly");
+            return NULL;
+        }
+    }
+    if(write_rev && !(rev_location = pack_rev_location(pack_location))) {
+        free(default_idx);
+        PyErr_SetString(PyExc_ValueError, "pack file name doesn't end in .pack; can't name the .rev");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = index_pack(pack_location, idx_location, rev_location, threads, &result);
+    Py_END_ALLOW_THREADS
+    free(default_idx);
+    free(rev_location);
+
+    if(ret != 0) {
+        PyErr_Format(PyExc_Exception, "failed to index the pack: %s.", result.error);
+        return NULL;
+    }
+
+    return Py_BuildValue("{s:I,s:I,s:I,s:i,s:d,s:s}",
+                         "objects", result.objects,
+                         "deltas", result.deltas,
+                         "max_depth", result.max_depth,
+                         "threads", result.threads,
+                         "seconds", result.seconds,
+                         "pack_checksum", sha1_to_hex(result.pack_checksum));
+}
+
+static PyObject *gu_iter_pack(PyObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"pack", "idx", "cache_mb", NULL};
+    char *pack_location, *idx_location = NULL;
+    int cache_mb = 64;
+    PackIteratorObject *iter;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "s|zi", kwlist, &pack_location, &idx_location, &cache_mb))
+        return NULL;
+
+    if(!(iter = PyObject_New(PackIteratorObject, &PackIteratorType)))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    iter->e = pack_enum_open(pack_location, idx_location, (size_t) cache_mb << 20);
+    Py_END_ALLOW_THREADS
+
+    if(!iter->e) {
+        Py_DECREF(iter);
+        PyErr_SetString(PyExc_Exception, "failed to load the pack or idx file.");
+        return NULL;
+    }
+    return (PyObject *)iter;
+}
+
 static PyMethodDef git_util_methods[] = {
     {"loose_get_object", gu_loose_get_object, METH_VARARGS, "Doc..."},
     {"pack_idx_read", gu_pack_idx_read, METH_VARARGS, "Doc..."},
     {"pack_get_object", gu_pack_get_object, METH_VARARGS, "Doc..."},
+    {"stats", gu_stats, METH_NOARGS,
+        "Returns libgitread's counters and latency histograms (summed over all threads) as a dict."},
+    {"reset_stats", gu_reset_stats, METH_NOARGS, "Starts all counters returned by stats() over from zero."},
+    {"trace_start", gu_trace_start, METH_VARARGS,
+        "trace_start(path)\n\n"
+        "Records the Repo calls that read objects from now on, with what they were\n"
+        "asked for, when and how long they took, to a file the replay tool can re-issue\n"
+        "against a copy of the repository: commit, read_many, read_range,\n"
+        "resolve_path, last_modified, blame, ls_tree, diff, is_ancestor, merge_bases,\n"
+        "ahead_behind, count_reachable, walk, grep and archive. refs, resolve_ref,\n"
+        "peel_ref and head aren't recorded, since they're answered from the ref files\n"
+        "and a copy's refs won't match; the calls that take a ref record the sha1 it\n"
+        "resolved to instead. refresh isn't either, as it depends on the live pack\n"
+        "directory, and nor are ObjectClient calls (they go to objserver) or the\n"
+        "module's own functions. A call retried after a repack is recorded once per\n"
+        "try. A %p in path becomes the process id, and forked children trace to their\n"
+        "own files. Setting GITUTIL_TRACE=path does this on import."},
+    {"trace_stop", gu_trace_stop, METH_NOARGS,
+        "Writes out the rest of the trace and stops; it's also done at exit. Raises\n"
+        "IOError if any of it couldn't be written."},
+    {"diff", (PyCFunction)gu_diff, METH_VARARGS | METH_KEYWORDS,
+        "diff(old, new, algorithm='myers', context=3, unified=False, max_bytes=16MB, budget_ms=0)\n"
+        "    -> (kind, added, removed, hunks)\n\n"
+        "Repo.diff() for two strings or ObjectBuffers."},
+    {"verify_pack", (PyCFunction)gu_verify_pack, METH_VARARGS | METH_KEYWORDS,
+        "verify_pack(pack, idx=None, threads=0, cache_mb=64) -> dict\n\n"
+        "Checks the pack and idx checksums, each object's CRC32 (v2 idx) and that every\n"
+        "object hashes to its id. threads=0 uses one worker per CPU."},
+    {"index_pack", (PyCFunction)gu_index_pack, METH_VARARGS | METH_KEYWORDS,
+        "index_pack(pack, idx=None, rev=False, threads=0) -> dict\n\n"
+        "Writes a version 2 idx for a pack (next to it unless idx is given) and, with\n"
+        "rev=True, a .rev reverse index. threads=0 uses one worker per CPU."},
+    {"parse_commit", gu_parse_commit, METH_VARARGS,
+        "parse_commit(data) -> Commit\n\n"
+        "Parses a commit's raw data (a string or ObjectBuffer)."},
+    {"iter_pack", (PyCFunction)gu_iter_pack, METH_VARARGS | METH_KEYWORDS,
+        "iter_pack(pack, idx=None, cache_mb=64) -> iterator of (sha1, type, size, data)\n\n"
+        "Reads every object in the pack once, in pack order, keeping up to cache_mb of\n"
+        "delta bases. Much faster than looking objects up one at a time."},
     {NULL, NULL, 0, NULL}
 };
 
 PyMODINIT_FUNC initgitutil(void)
 {
     PyObject *m;
+    char *trace_path;
     
     // initial type setup
     if(PyType_Ready(&PackIdxType) < 0)
         return;
+    if(PyType_Ready(&ObjectBufferType) < 0)
+        return;
+    if(PyType_Ready(&PackIteratorType) < 0)
+        return;
+    if(PyType_Ready(&RepoType) < 0)
+        return;
+    if(PyType_Ready(&WalkIteratorType) < 0)
+        return;
+    if(PyType_Ready(&GrepIteratorType) < 0)
+        return;
+    if(PyType_Ready(&ObjectClientType) < 0)
+        return;
+    if(PyType_Ready(&CommitType) < 0)
+        return;
     
     m = Py_InitModule("gitutil", git_util_methods);
     
@@ -320,4 +3465,21 @@ PyMODINIT_FUNC initgitutil(void)
     // now actually add the type
     Py_INCREF(&PackIdxType);
     PyModule_AddObject(m, "PackIdx", (PyObject *)&PackIdxType);
+    Py_INCREF(&ObjectBufferType);
+    PyModule_AddObject(m, "ObjectBuffer", (PyObject *)&ObjectBufferType);
+    Py_INCREF(&RepoType);
+    PyModule_AddObject(m, "Repo", (PyObject *)&RepoType);
+    Py_INCREF(&ObjectClientType);
+    PyModule_AddObject(m, "ObjectClient", (PyObject *)&ObjectClientType);
+    Py_INCREF(&CommitType);
+    PyModule_AddObject(m, "Commit", (PyObject *)&CommitType);
+
+    if(!(CorruptObjectError = PyErr_NewException("gitutil.CorruptObjectError", NULL, NULL)))
+        return;
+    Py_INCREF(CorruptObjectError);
+    PyModule_AddObject(m, "CorruptObjectError", CorruptObjectError);
+
+    // tracing a service from the start shouldn't need its code changed
+    if((trace_path = getenv("GITUTIL_TRACE")) && *trace_path && trace_start(trace_path) != 0)
+        fprintf(stderr, "gitutil: can't trace to %s: %s\n", trace_path, strerror(errno));
 }
\ No newline at end of file
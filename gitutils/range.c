@@ -0,0 +1,710 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "libgitread.h"
+#include "odb.h"
+#include "stats.h"
+#include "range.h"
+
+// Reading part of an object without reading all of it.
+//
+// A whole (undeltified) object is inflated only as far as the end of the
+// range, through a ring of RANGE_WINDOW bytes, so what comes before the range
+// costs inflate time but no memory. To skip even that, big objects are
+// checkpointed every RANGE_CHECKPOINT_SPAN bytes as they're inflated: where a
+// deflate block starts, in bytes and bits, and the window of output before
+// it, which is all inflate needs to pick up from there (as in zlib's
+// examples/zran.c). A range_index keeps them for later reads of the object.
+//
+// A delta is applied only as far as its ops overlap the range: inserts come
+// straight out of the delta, and copies become reads of the base, which may
+// be a delta too. Copies mostly go forward through the base, so each base
+// keeps its reader, and its place in the zlib stream, from one to the next.
+
+#define RANGE_BUCKETS 1024
+#define RANGE_LOOSE UINT64_MAX           // the offset loose objects are indexed under
+#define RANGE_INPUT_SLICE (1U << 30)     // zlib counts input in 32 bits
+
+struct checkpoint {
+    uint64_t out;        // stream position inflate restarts at
+    uint64_t in;         // where the next compressed byte is in the source
+    int bits;            // bits of the byte before in that are still to be read
+    unsigned char window[RANGE_WINDOW]; // the output just before out
+};
+
+// One object's checkpoints, in stream order. They're only ever appended and
+// each is allocated on its own, so a reader can use one after letting go of
+// the lock.
+struct checkpoints {
+    unsigned char key[20];   // the pack's checksum, or a loose object's id
+    uint64_t offset;         // in the pack, or RANGE_LOOSE
+    struct checkpoint **points;
+    uint32_t count, alloc;
+    unsigned int refs;       // the index's, plus one per reader using them
+    int indexed;             // still in the index
+    struct checkpoints *hash_next;
+    struct checkpoints *older, *newer;
+};
+
+struct range_index {
+    struct checkpoints *buckets[RANGE_BUCKETS];
+    struct checkpoints *oldest, *newest;
+    size_t bytes, max_bytes;
+    pthread_mutex_t lock;
+};
+
+struct range_reader {
+    struct range_index *index;   // may be NULL; checkpoints then last as long as the reader
+    unsigned int type;
+    uint64_t size;
+
+    // a delta: its ops, and a reader for the base they copy from
+    unsigned char *delta;
+    unsigned long delta_size;
+    unsigned long ops;           // where the ops start, past the two sizes
+    uint64_t base_size;
+    struct range_reader *base;
+    unsigned long resume_op;     // the first op not wholly before the last read
+    uint64_t resume_pos;         // where its output starts
+
+    // a whole object: its zlib stream
+    const unsigned char *src;
+    uint64_t src_size;
+    uint64_t skip;               // a loose object's header, which the stream starts with
+    int store;                   // STATS_LOOSE or STATS_PACKED
+    void *map;                   // loose objects' files; unmapped on close
+    size_t map_size;
+    z_stream zst;
+    int live;                    // zst is part way through the stream, at out
+    uint64_t out;                // stream position of the next byte inflated
+    uint64_t next_checkpoint;
+    unsigned char *ring;         // the last RANGE_WINDOW bytes inflated, at out % RANGE_WINDOW
+    struct checkpoints *points;  // NULL for objects too small to checkpoint
+};
+
+struct range_index *range_index_new(size_t max_bytes)
+{
+    struct range_index *index;
+
+    if(!(index = calloc(1, sizeof(struct range_index))))
+        return NULL;
+    index->max_bytes = max_bytes;
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+static void checkpoints_free(struct checkpoints *cps)
+{
+    uint32_t i;
+
+    for(i = 0; i < cps->count; i++)
+        free(cps->points[i]);
+    free(cps->points);
+    free(cps);
+}
+
+static size_t checkpoints_bytes(const struct checkpoints *cps)
+{
+    return sizeof(struct checkpoints) + (size_t) cps->count * sizeof(struct checkpoint);
+}
+
+static unsigned int index_bucket(const unsigned char *key, uint64_t offset)
+{
+    uint32_t h;
+
+    memcpy(&h, key, sizeof(h));
+    return (h ^ (uint32_t) offset ^ (uint32_t) (offset >> 32)) % RANGE_BUCKETS;
+}
+
+// Drops an entry from the index; readers still using it keep it alive.
+static void index_evict(struct range_index *index, struct checkpoints *cps)
+{
+    struct checkpoints **p = &index->buckets[index_bucket(cps->key, cps->offset)];
+
+    while(*p != cps)
+        p = &(*p)->hash_next;
+    *p = cps->hash_next;
+    if(cps->older)
+        cps->older->newer = cps->newer;
+    else
+        index->oldest = cps->newer;
+    if(cps->newer)
+        cps->newer->older = cps->older;
+    else
+        index->newest = cps->older;
+    index->bytes -= checkpoints_bytes(cps);
+    cps->indexed = 0;
+    if(--cps->refs == 0)
+        checkpoints_free(cps);
+}
+
+void range_index_free(struct range_index *index)
+{
+    if(!index)
+        return;
+    while(index->oldest)
+        index_evict(index, index->oldest);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+// The checkpoints for an object, with a reference for the caller. Without an
+// index they're the caller's alone.
+static struct checkpoints *checkpoints_get(struct range_index *index, const unsigned char *key, uint64_t offset)
+{
+    struct checkpoints *cps;
+    unsigned int bucket;
+
+    if(!index)
+        return calloc(1, sizeof(struct checkpoints));
+
+    bucket = index_bucket(key, offset);
+    pthread_mutex_lock(&index->lock);
+    for(cps = index->buckets[bucket]; cps; cps = cps->hash_next) {
+        if(cps->offset == offset && memcmp(cps->key, key, 20) == 0)
+            break;
+    }
+    if(!cps && (cps = calloc(1, sizeof(struct checkpoints)))) {
+        memcpy(cps->key, key, 20);
+        cps->offset = offset;
+        cps->refs = 1;
+        cps->indexed = 1;
+        cps->hash_next = index->buckets[bucket];
+        index->buckets[bucket] = cps;
+        cps->older = index->newest;
+        if(index->newest)
+            index->newest->newer = cps;
+        else
+            index->oldest = cps;
+        index->newest = cps;
+        index->bytes += checkpoints_bytes(cps);
+    }
+    if(cps)
+        cps->refs++;
+    pthread_mutex_unlock(&index->lock);
+    return cps;
+}
+
+static void checkpoints_put(struct range_index *index, struct checkpoints *cps)
+{
+    if(!index) {
+        checkpoints_free(cps);
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    if(--cps->refs == 0)
+        checkpoints_free(cps);
+    pthread_mutex_unlock(&index->lock);
+}
+
+// Adds a checkpoint past the last one, then evicts the oldest objects' until
+// the index is back under budget. One that another reader got to first is
+// dropped.
+static void checkpoints_add(struct range_index *index, struct checkpoints *cps, struct checkpoint *cp)
+{
+    struct checkpoint **grown;
+
+    if(index)
+        pthread_mutex_lock(&index->lock);
+    if(cps->count && cp->out <= cps->points[cps->count - 1]->out) {
+        free(cp);
+        cp = NULL;
+    } else if(cps->count == cps->alloc) {
+        cps->alloc = cps->alloc ? cps->alloc * 2 : 16;
+        if(!(grown = realloc(cps->points, sizeof(struct checkpoint *) * cps->alloc))) {
+            cps->alloc = cps->count;
+            free(cp);
+            cp = NULL;
+        } else {
+            cps->points = grown;
+        }
+    }
+    if(cp) {
+        cps->points[cps->count++] = cp;
+        if(cps->indexed)
+            index->bytes += sizeof(struct checkpoint);
+    }
+    while(index && index->bytes > index->max_bytes && index->oldest && index->oldest != cps)
+        index_evict(index, index->oldest);
+    if(index)
+        pthread_mutex_unlock(&index->lock);
+}
+
+// The last checkpoint at or before pos, if any.
+static const struct checkpoint *checkpoints_find(struct range_index *index, struct checkpoints *cps, uint64_t pos)
+{
+    const struct checkpoint *found = NULL;
+    uint32_t lo = 0, hi, mid;
+
+    if(index)
+        pthread_mutex_lock(&index->lock);
+    hi = cps->count;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(cps->points[mid]->out <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if(lo)
+        found = cps->points[lo - 1];
+    if(index)
+        pthread_mutex_unlock(&index->lock);
+    return found;
+}
+
+static uint64_t checkpoints_end(struct range_index *index, struct checkpoints *cps)
+{
+    uint64_t end = 0;
+
+    if(index)
+        pthread_mutex_lock(&index->lock);
+    if(cps->count)
+        end = cps->points[cps->count - 1]->out;
+    if(index)
+        pthread_mutex_unlock(&index->lock);
+    return end;
+}
+
+// Starts inflating again, from cp or from the beginning of the stream.
+static int stream_restart(struct range_reader *r, const struct checkpoint *cp)
+{
+    uint64_t pos;
+
+    if(r->live)
+        inflateEnd(&r->zst);
+    r->live = 0;
+    memset(&r->zst, 0, sizeof(r->zst));
+
+    if(!cp) {
+        r->zst.next_in = (unsigned char *) r->src;
+        if(inflateInit(&r->zst) != Z_OK)
+            return -1;
+        r->out = 0;
+    } else {
+        // the zlib header is long gone; what's left is raw deflate
+        r->zst.next_in = (unsigned char *) r->src + cp->in;
+        if(inflateInit2(&r->zst, -15) != Z_OK)
+            return -1;
+        if((cp->bits && inflatePrime(&r->zst, cp->bits, r->src[cp->in - 1] >> (8 - cp->bits)) != Z_OK) ||
+           inflateSetDictionary(&r->zst, cp->window, RANGE_WINDOW) != Z_OK) {
+            inflateEnd(&r->zst);
+            return -1;
+        }
+        pos = cp->out % RANGE_WINDOW;
+        memcpy(r->ring + pos, cp->window, RANGE_WINDOW - pos);
+        memcpy(r->ring, cp->window + RANGE_WINDOW - pos, pos);
+        r->out = cp->out;
+    }
+    r->live = 1;
+    if(r->points)
+        r->next_checkpoint = checkpoints_end(r->index, r->points) + RANGE_CHECKPOINT_SPAN;
+    return 0;
+}
+
+static void stream_checkpoint(struct range_reader *r)
+{
+    struct checkpoint *cp;
+    unsigned int pos = r->out % RANGE_WINDOW;
+
+    r->next_checkpoint = r->out + RANGE_CHECKPOINT_SPAN;
+    if(!(cp = malloc(sizeof(struct checkpoint))))
+        return;
+    cp->out = r->out;
+    cp->in = r->zst.next_in - r->src;
+    cp->bits = r->zst.data_type & 7;
+    memcpy(cp->window, r->ring + pos, RANGE_WINDOW - pos);
+    memcpy(cp->window + RANGE_WINDOW - pos, r->ring, pos);
+    checkpoints_add(r->index, r->points, cp);
+}
+
+// Inflates on to stream position end, copying whatever falls in [start, end)
+// to out.
+static int stream_inflate(struct range_reader *r, uint64_t start, uint64_t end, unsigned char *out)
+{
+    uint64_t in, lo, hi, total = r->skip + r->size;
+    unsigned int pos, room, produced, consumed;
+    int status, flush;
+
+    while(r->out < end) {
+        if(r->zst.avail_in == 0) {
+            in = r->zst.next_in - r->src;
+            if(in >= r->src_size)
+                return -1;
+            r->zst.avail_in = (r->src_size - in > RANGE_INPUT_SLICE) ? RANGE_INPUT_SLICE : r->src_size - in;
+        }
+        pos = r->out % RANGE_WINDOW;
+        room = RANGE_WINDOW - pos;
+        r->zst.next_out = r->ring + pos;
+        r->zst.avail_out = room;
+        consumed = r->zst.avail_in;
+        // stop at deflate block boundaries once a checkpoint is due
+        flush = (r->points && r->out >= r->next_checkpoint) ? Z_BLOCK : Z_NO_FLUSH;
+
+        status = inflate(&r->zst, flush);
+        produced = room - r->zst.avail_out;
+        consumed -= r->zst.avail_in;
+        STATS_ADD(bytes_read[r->store], consumed);
+        STATS_ADD(bytes_inflated[r->store], produced);
+        if((status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) ||
+           (status == Z_BUF_ERROR && r->zst.avail_in) || r->out + produced > total)
+            return -1;
+
+        lo = (r->out > start) ? r->out : start;
+        hi = (r->out + produced < end) ? r->out + produced : end;
+        if(lo < hi)
+            memcpy(out + (lo - start), r->ring + lo % RANGE_WINDOW, hi - lo);
+        r->out += produced;
+
+        if(status == Z_STREAM_END) {
+            inflateEnd(&r->zst);
+            r->live = 0;
+            return (r->out == total) ? 0 : -1;
+        }
+        if(flush == Z_BLOCK && (r->zst.data_type & 128) && !(r->zst.data_type & 64))
+            stream_checkpoint(r);
+    }
+    return 0;
+}
+
+static int stream_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out)
+{
+    const struct checkpoint *cp = NULL;
+    uint64_t target = r->skip + start;
+    uint64_t kept = (r->out > RANGE_WINDOW) ? r->out - RANGE_WINDOW : 0;
+    unsigned int pos;
+    uint64_t n;
+
+    if(r->points)
+        cp = checkpoints_find(r->index, r->points, target);
+    // go back if the range has already left the ring, and jump ahead when
+    // that's quicker than inflating the way there
+    if((!r->live && r->out < target + len) || target < kept ||
+       (cp && cp->out > r->out + RANGE_WINDOW)) {
+        if(stream_restart(r, cp) != 0)
+            return -1;
+    }
+    // a delta's copies often overlap or back up a little; that part is
+    // still in the ring
+    while(target < r->out && len) {
+        pos = target % RANGE_WINDOW;
+        n = RANGE_WINDOW - pos;
+        if(n > r->out - target)
+            n = r->out - target;
+        if(n > len)
+            n = len;
+        memcpy(out, r->ring + pos, n);
+        out += n;
+        target += n;
+        len -= n;
+    }
+    if(!len)
+        return 0;
+    return stream_inflate(r, target, target + len, out);
+}
+
+static int delta_varint(const unsigned char **p, const unsigned char *end, uint64_t *value)
+{
+    unsigned int shift = 0;
+
+    *value = 0;
+    do {
+        if(*p >= end || shift > 63)
+            return -1;
+        *value |= (uint64_t) (**p & 0x7f) << shift;
+        shift += 7;
+    } while(*(*p)++ & 0x80);
+    return 0;
+}
+
+static int reader_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out);
+
+// Applies the delta's ops that overlap the range.
+static int delta_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out)
+{
+    const unsigned char *d = r->delta, *end = d + r->delta_size, *p, *insert = NULL;
+    uint64_t pos, stop = start + len, lo, hi, cp_off, cp_size;
+    unsigned char cmd;
+    int i;
+
+    if(r->resume_pos <= start) {
+        p = d + r->resume_op;
+        pos = r->resume_pos;
+    } else {
+        p = d + r->ops;
+        pos = 0;
+    }
+
+    while(pos < stop) {
+        if(p >= end)
+            return -1; // the ops ran out before the result did
+        cmd = *p++;
+        if(cmd & 0x80) {
+            cp_off = 0;
+            cp_size = 0;
+            for(i = 0; i < 4; i++) {
+                if(cmd & (1 << i)) {
+                    if(p >= end)
+                        return -1;
+                    cp_off |= (uint64_t) *p++ << (8 * i);
+                }
+            }
+            for(i = 0; i < 3; i++) {
+                if(cmd & (0x10 << i)) {
+                    if(p >= end)
+                        return -1;
+                    cp_size |= (uint64_t) *p++ << (8 * i);
+                }
+            }
+            if(cp_size == 0)
+                cp_size = 0x10000;
+            if(cp_off + cp_size > r->base_size)
+                return -1;
+        } else if(cmd) {
+            if((uint64_t) (end - p) < cmd)
+                return -1;
+            cp_size = cmd;
+            insert = p;
+            p += cmd;
+        } else {
+            return -1; // reserved
+        }
+        if(pos + cp_size > r->size)
+            return -1;
+
+        if(pos + cp_size <= start) {
+            // wholly before the range, so later reads can start after it
+            pos += cp_size;
+            r->resume_op = p - d;
+            r->resume_pos = pos;
+            continue;
+        }
+        lo = (pos > start) ? pos : start;
+        hi = (pos + cp_size < stop) ? pos + cp_size : stop;
+        if(cmd & 0x80) {
+            if(reader_read(r->base, cp_off + (lo - pos), hi - lo, out + (lo - start)) != 0)
+                return -1;
+        } else {
+            memcpy(out + (lo - start), insert + (lo - pos), hi - lo);
+        }
+        pos += cp_size;
+    }
+    return 0;
+}
+
+static int reader_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out)
+{
+    if(!len)
+        return 0;
+    if(r->delta)
+        return delta_read(r, start, len, out);
+    return stream_read(r, start, len, out);
+}
+
+// Reads [start, start + len) of the object into out, or as much of it as
+// there is; *got is set to how much that was.
+int range_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out, uint64_t *got)
+{
+    *got = 0;
+    if(start >= r->size)
+        return 0;
+    if(len > r->size - start)
+        len = r->size - start;
+    if(reader_read(r, start, len, out) != 0)
+        return -1;
+    *got = len;
+    return 0;
+}
+
+void range_close(struct range_reader *r)
+{
+    if(!r)
+        return;
+    range_close(r->base);
+    free(r->delta);
+    if(r->live)
+        inflateEnd(&r->zst);
+    free(r->ring);
+    if(r->map)
+        munmap(r->map, r->map_size);
+    if(r->points)
+        checkpoints_put(r->index, r->points);
+    free(r);
+}
+
+static int stream_init(struct range_reader *r, const unsigned char *key, uint64_t offset)
+{
+    if(!(r->ring = malloc(RANGE_WINDOW)))
+        return -1;
+    if(r->skip + r->size >= RANGE_CHECKPOINT_MIN)
+        r->points = checkpoints_get(r->index, key, offset); // without them we're just slower
+    return 0;
+}
+
+static int open_packed(const struct pack *pack, const struct idx *idx, uint64_t offset,
+                       struct range_index *index, unsigned int depth, struct range_reader **reader)
+{
+    struct range_reader *r;
+    struct pack_entry entry;
+    const unsigned char *p, *end;
+    uint64_t base_offset;
+    uint32_t pos;
+
+    *reader = NULL;
+    if(depth > PACK_MAX_DELTA_CHAIN || pack_entry_header(pack, offset, &entry) != 0)
+        return -1;
+    if(!(r = calloc(1, sizeof(struct range_reader))))
+        return -1;
+    r->index = index;
+    r->store = STATS_PACKED;
+
+    if(entry.type != OFS_DELTA && entry.type != REF_DELTA) {
+        r->type = entry.type;
+        r->size = entry.size;
+        r->src = pack->data + entry.data_offset;
+        r->src_size = pack->size - 20 - entry.data_offset;
+        if(stream_init(r, pack->data + pack->size - 20, offset) != 0) {
+            range_close(r);
+            return -1;
+        }
+        *reader = r;
+        return 0;
+    }
+
+    if(entry.type == OFS_DELTA) {
+        base_offset = entry.base_offset;
+    } else {
+        if(!idx || idx_find(idx, entry.base_sha1, &pos) != 0) {
+            free(r);
+            return -1;
+        }
+        base_offset = idx_offset(idx, pos);
+    }
+    // the delta is inflated whole; it's the result we don't want to build
+    if(pack_inflate_entry(pack, &entry, &r->delta, NULL) != 0) {
+        free(r);
+        return -1;
+    }
+    r->delta_size = entry.size;
+    p = r->delta;
+    end = p + r->delta_size;
+    if(r->delta_size < DELTA_SIZE_MIN || delta_varint(&p, end, &r->base_size) != 0 ||
+       delta_varint(&p, end, &r->size) != 0 ||
+       open_packed(pack, idx, base_offset, index, depth + 1, &r->base) != 0 ||
+       r->base->size != r->base_size) {
+        range_close(r);
+        return -1;
+    }
+    r->type = r->base->type;
+    r->ops = p - r->delta;
+    r->resume_op = r->ops;
+    r->resume_pos = 0;
+    *reader = r;
+    return 0;
+}
+
+// Opens the packed object at offset for reading ranges of. REF_DELTA bases
+// are looked up in idx. The index, which may be NULL, keeps checkpoints of
+// big objects between readers; it must outlive the reader.
+int range_open_packed(const struct pack *pack, const struct idx *idx, uint64_t offset,
+                      struct range_index *index, struct range_reader **reader,
+                      unsigned int *type, uint64_t *size)
+{
+    if(open_packed(pack, idx, offset, index, 0, reader) != 0)
+        return -1;
+    *type = (*reader)->type;
+    *size = (*reader)->size;
+    return 0;
+}
+
+static int open_loose(const struct odb *odb, const unsigned char *sha1, struct range_index *index,
+                      struct range_reader **reader)
+{
+    struct range_reader *r;
+    struct git_object g_obj;
+    unsigned char header[LOOSE_HEADER_MAX];
+    struct stat st;
+    z_stream zst;
+    char *path;
+    int fd, status, header_len;
+
+    *reader = NULL;
+    if(!(path = malloc(strlen(odb->objects_dir) + 43)))
+        return -1;
+    odb_loose_path(odb, sha1, path);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || st.st_size == 0 || !(r = calloc(1, sizeof(struct range_reader)))) {
+        close(fd);
+        return -1;
+    }
+    r->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(r->map == MAP_FAILED) {
+        free(r);
+        return -1;
+    }
+    r->map_size = st.st_size;
+    r->index = index;
+    r->store = STATS_LOOSE;
+    r->src = r->map;
+    r->src_size = st.st_size;
+
+    memset(&zst, 0, sizeof(zst));
+    zst.next_in = (unsigned char *) r->src;
+    zst.avail_in = (r->src_size > RANGE_INPUT_SLICE) ? RANGE_INPUT_SLICE : r->src_size;
+    zst.next_out = header;
+    zst.avail_out = sizeof(header);
+    if(inflateInit(&zst) != Z_OK) {
+        range_close(r);
+        return -1;
+    }
+    status = inflate(&zst, Z_SYNC_FLUSH);
+    header_len = (status == Z_OK || status == Z_STREAM_END) ?
+                 loose_parse_header(header, sizeof(header) - zst.avail_out, &g_obj) : -1;
+    inflateEnd(&zst);
+    if(header_len < 0) {
+        range_close(r);
+        return -1;
+    }
+    r->type = g_obj.type;
+    r->size = g_obj.size;
+    r->skip = header_len;
+    if(stream_init(r, sha1, RANGE_LOOSE) != 0) {
+        range_close(r);
+        return -1;
+    }
+    *reader = r;
+    return 0;
+}
+
+// Opens an object for reading ranges of, wherever it is; see
+// range_open_packed().
+int range_open(const struct odb *odb, const unsigned char *sha1, struct range_index *index,
+               struct range_reader **reader, unsigned int *type, uint64_t *size)
+{
+    struct odb_location loc;
+
+    *reader = NULL;
+    if(odb_find(odb, sha1, &loc) != 0)
+        return -1;
+    if(loc.pack >= 0)
+        return range_open_packed(odb->packs[loc.pack], odb->idxs[loc.pack], loc.offset, index,
+                                 reader, type, size);
+    if(open_loose(odb, sha1, index, reader) != 0)
+        return -1;
+    *type = (*reader)->type;
+    *size = (*reader)->size;
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct pack;
+struct idx;
+struct range_index;
+struct range_reader;
+
+#define RANGE_WINDOW 32768                 // zlib's window; what a checkpoint has to keep
+#define RANGE_CHECKPOINT_SPAN (1 << 20)    // inflated bytes between checkpoints
+#define RANGE_CHECKPOINT_MIN (4 << 20)     // smaller objects get none; inflating them is quick anyway
+#define RANGE_INDEX_BYTES (64 << 20)
+
+struct range_index *range_index_new(size_t max_bytes);
+void range_index_free(struct range_index *index);
+
+int range_open(const struct odb *odb, const unsigned char *sha1, struct range_index *index,
+               struct range_reader **reader, unsigned int *type, uint64_t *size);
+int range_open_packed(const struct pack *pack, const struct idx *idx, uint64_t offset,
+                      struct range_index *index, struct range_reader **reader,
+                      unsigned int *type, uint64_t *size);
+int range_read(struct range_reader *r, uint64_t start, uint64_t len, unsigned char *out, uint64_t *got);
+void range_close(struct range_reader *r);
+
+
+#endif
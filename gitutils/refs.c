@@ -0,0 +1,778 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "libgitread.h"
+#include "odb.h"
+#include "refs.h"
+
+#define REFS_MAX_DEPTH 5 // symbolic refs and tags of tags; git gives up at 5 too
+
+// The rules git uses to turn "master" into "refs/heads/master", in order.
+static const char *dwim_rules[] = {
+    "%s",
+    "refs/%s",
+    "refs/tags/%s",
+    "refs/heads/%s",
+    "refs/remotes/%s",
+    "refs/remotes/%s/HEAD",
+    NULL
+};
+
+static char *copy_string(const char *s, size_t len)
+{
+    char *copy;
+
+    if(!(copy = malloc(len + 1)))
+        return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Ref names become paths under the git dir, so keep them there.
+static int ref_name_ok(const char *name)
+{
+    const char *p;
+
+    if(!*name || *name == '/')
+        return 0;
+    for(p = name; *p; p++) {
+        if((unsigned char) *p < 0x20 || *p == '\\' || (*p == '.' && p[1] == '.'))
+            return 0;
+    }
+    return 1;
+}
+
+static void stamp_set(struct file_stamp *stamp, const struct stat *st)
+{
+    stamp->exists = 1;
+    stamp->dev = st->st_dev;
+    stamp->ino = st->st_ino;
+    stamp->size = st->st_size;
+    stamp->mtime = st->st_mtime;
+}
+
+// A file changed in the same second we read it can change again without its
+// mtime moving, so stamps that recent never count as fresh.
+static int stamp_changed(const char *path, const struct file_stamp *stamp, time_t loaded)
+{
+    struct stat st;
+
+    if(stat(path, &st) != 0)
+        return stamp->exists;
+    return !stamp->exists || st.st_dev != stamp->dev || st.st_ino != stamp->ino ||
+           st.st_size != stamp->size || st.st_mtime != stamp->mtime || st.st_mtime >= loaded;
+}
+
+// Compares a packed-refs name (not \0 terminated) with a C string.
+static int compare_name(const unsigned char *name, size_t len, const char *key)
+{
+    size_t key_len = strlen(key);
+    int cmp = memcmp(name, key, len < key_len ? len : key_len);
+
+    if(cmp)
+        return cmp;
+    return (len > key_len) - (len < key_len);
+}
+
+// Parses the packed-refs record at p: "<40 hex> <name>\n", maybe followed by
+// "^<40 hex>\n" giving what the tag peels to. Returns where the next record
+// starts, or NULL if this one is malformed.
+static const unsigned char *packed_record(const struct ref_store *refs, const unsigned char *p,
+                                          const unsigned char **name, size_t *name_len,
+                                          unsigned char *sha1, unsigned char *peeled, unsigned int *flags)
+{
+    const unsigned char *end = refs->packed + refs->packed_size, *nl;
+
+    if(end - p < 43 || p[40] != ' ' || hex_to_sha1((const char *) p, sha1) != 0)
+        return NULL;
+    if(!(nl = memchr(p + 41, '\n', end - p - 41)))
+        return NULL;
+    *name = p + 41;
+    *name_len = nl - *name;
+    p = nl + 1;
+
+    *flags = 0;
+    if(p < end && *p == '^') {
+        if(end - p < 42 || p[41] != '\n' || hex_to_sha1((const char *) p + 1, peeled) != 0)
+            return NULL;
+        *flags = REF_PEELED;
+        p += 42;
+    } else if(refs->packed_peeled == 2 ||
+              (refs->packed_peeled == 1 && *name_len > 10 && memcmp(*name, "refs/tags/", 10) == 0)) {
+        // a ref the writer would have peeled if it were a tag
+        memcpy(peeled, sha1, 20);
+        *flags = REF_PEELED;
+    }
+    return p;
+}
+
+// Backs up from anywhere in a record to where it starts.
+static const unsigned char *record_start(const unsigned char *start, const unsigned char *p)
+{
+    while(p > start && p[-1] != '\n')
+        p--;
+    if(*p == '^' && p > start) {
+        p--;
+        while(p > start && p[-1] != '\n')
+            p--;
+    }
+    return p;
+}
+
+// Binary searches packed-refs, in place, for name.
+static int packed_find(const struct ref_store *refs, const char *name, struct ref *ref)
+{
+    const unsigned char *lo, *hi, *rec, *next, *rec_name;
+    size_t name_len;
+    unsigned int flags;
+    int cmp;
+
+    if(!refs->packed)
+        return -1;
+
+    lo = refs->packed_start;
+    hi = refs->packed + refs->packed_size;
+    while(lo < hi) {
+        rec = record_start(lo, lo + (hi - lo) / 2);
+        if(!(next = packed_record(refs, rec, &rec_name, &name_len, ref->sha1, ref->peeled, &flags)))
+            return -1;
+        cmp = compare_name(rec_name, name_len, name);
+        if(cmp == 0) {
+            ref->flags |= flags;
+            return 0;
+        }
+        if(cmp < 0)
+            lo = next;
+        else
+            hi = rec;
+    }
+    return -1;
+}
+
+static int has_trait(const unsigned char *p, const unsigned char *end, const char *trait)
+{
+    const unsigned char *word;
+    size_t len = strlen(trait);
+
+    while(p < end) {
+        while(p < end && *p == ' ')
+            p++;
+        word = p;
+        while(p < end && *p != ' ')
+            p++;
+        if((size_t) (p - word) == len && memcmp(word, trait, len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static void packed_unload(struct ref_store *refs)
+{
+    if(refs->packed) {
+        if(refs->packed_mapped)
+            munmap(refs->packed, refs->packed_size);
+        else
+            free(refs->packed);
+    }
+    refs->packed = NULL;
+    refs->packed_start = NULL;
+    refs->packed_size = 0;
+}
+
+struct packed_line {
+    const unsigned char *start;
+    size_t len;                  // the record, ^ line included
+    const unsigned char *name;
+    size_t name_len;
+};
+
+static int compare_packed_lines(const void *a, const void *b)
+{
+    const struct packed_line *x = a, *y = b;
+    int cmp = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+
+    if(cmp)
+        return cmp;
+    return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+// Files written before git learned the "sorted" trait may be in any order;
+// sort them into a copy once so lookups can still binary search.
+static int packed_sort(struct ref_store *refs)
+{
+    struct packed_line *lines = NULL, *grown;
+    const unsigned char *p, *end = refs->packed + refs->packed_size, *next;
+    unsigned char sha1[20], peeled[20], *sorted, *out;
+    unsigned int flags;
+    uint32_t n = 0, alloc = 0, i;
+
+    for(p = refs->packed_start; p < end; p = next) {
+        if(n == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            if(!(grown = realloc(lines, sizeof(struct packed_line) * alloc))) {
+                free(lines);
+                return -1;
+            }
+            lines = grown;
+        }
+        if(!(next = packed_record(refs, p, &lines[n].name, &lines[n].name_len, sha1, peeled, &flags))) {
+            free(lines);
+            return -1;
+        }
+        lines[n].start = p;
+        lines[n].len = next - p;
+        n++;
+    }
+    qsort(lines, n, sizeof(struct packed_line), compare_packed_lines);
+
+    if(!(sorted = malloc(end - refs->packed_start + 1))) {
+        free(lines);
+        return -1;
+    }
+    for(i = 0, out = sorted; i < n; i++) {
+        memcpy(out, lines[i].start, lines[i].len);
+        out += lines[i].len;
+    }
+    free(lines);
+
+    packed_unload(refs);
+    refs->packed = sorted;
+    refs->packed_size = out - sorted;
+    refs->packed_start = sorted;
+    refs->packed_mapped = 0;
+    return 0;
+}
+
+static int packed_load(struct ref_store *refs)
+{
+    struct stat st;
+    unsigned char *data;
+    const unsigned char *nl;
+    int fd, sorted = 0;
+
+    refs->packed_loaded = time(NULL);
+    memset(&refs->packed_stamp, 0, sizeof(struct file_stamp));
+    refs->packed_peeled = 0;
+
+    if((fd = open(refs->packed_path, O_RDONLY)) < 0)
+        return 0; // no packed refs at all
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    stamp_set(&refs->packed_stamp, &st);
+    if(st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return -1;
+    refs->packed = data;
+    refs->packed_size = st.st_size;
+    refs->packed_mapped = 1;
+    refs->packed_start = data;
+
+    if(refs->packed_size > 17 && memcmp(data, "# pack-refs with:", 17) == 0) {
+        if(!(nl = memchr(data, '\n', refs->packed_size))) {
+            packed_unload(refs);
+            return -1;
+        }
+        if(has_trait(data + 17, nl, "fully-peeled"))
+            refs->packed_peeled = 2;
+        else if(has_trait(data + 17, nl, "peeled"))
+            refs->packed_peeled = 1;
+        sorted = has_trait(data + 17, nl, "sorted");
+        refs->packed_start = nl + 1;
+    }
+
+    if(!sorted && packed_sort(refs) != 0) {
+        packed_unload(refs);
+        return -1;
+    }
+    return 0;
+}
+
+// Reloads packed-refs if it has changed. A malformed file is reported and
+// then treated as empty until it changes again.
+static void packed_refresh(struct ref_store *refs)
+{
+    if(!stamp_changed(refs->packed_path, &refs->packed_stamp, refs->packed_loaded))
+        return;
+    packed_unload(refs);
+    refs->all_valid = 0;
+    if(packed_load(refs) != 0)
+        printf("Ignoring %s: failed to read it.\n", refs->packed_path);
+}
+
+// Reads the loose ref <git dir>/<name>. For a symbolic ref, *target is set to
+// a malloc()'d copy of the name it points at. Returns -1 if there's no such
+// ref (directories, and files that don't hold one, included).
+static int loose_read(const struct ref_store *refs, const char *name, unsigned char *sha1, char **target)
+{
+    char *path, buf[1024], *p, *end;
+    ssize_t n = 0, len = 0;
+    int fd;
+
+    *target = NULL;
+    if(!(path = malloc(strlen(refs->git_dir) + strlen(name) + 2)))
+        return -1;
+    sprintf(path, "%s/%s", refs->git_dir, name);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return -1;
+    while(len < (ssize_t) sizeof(buf) - 1 && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    close(fd);
+    if(n < 0)
+        return -1;
+    buf[len] = '\0';
+
+    if(len >= 4 && memcmp(buf, "ref:", 4) == 0) {
+        for(p = buf + 4; *p == ' ' || *p == '\t'; p++)
+            ;
+        for(end = p + strlen(p); end > p && isspace((unsigned char) end[-1]); end--)
+            ;
+        if(end == p || !(*target = copy_string(p, end - p)))
+            return -1;
+        return 0;
+    }
+    if(len < 40 || hex_to_sha1(buf, sha1) != 0 || (len > 40 && !isspace((unsigned char) buf[40])))
+        return -1;
+    return 0;
+}
+
+static void loose_free(struct ref_store *refs)
+{
+    uint32_t i;
+
+    for(i = 0; i < refs->nloose; i++) {
+        free((char *) refs->loose[i].name);
+        free((char *) refs->loose[i].target);
+    }
+    for(i = 0; i < refs->ndirs; i++)
+        free(refs->dirs[i].path);
+    free(refs->loose);
+    free(refs->dirs);
+    refs->loose = NULL;
+    refs->dirs = NULL;
+    refs->nloose = refs->loose_alloc = 0;
+    refs->ndirs = refs->dirs_alloc = 0;
+    refs->loose_valid = 0;
+}
+
+static int add_loose(struct ref_store *refs, const char *name, const unsigned char *sha1, char *target)
+{
+    struct ref *grown, *ref;
+
+    if(refs->nloose == refs->loose_alloc) {
+        refs->loose_alloc = refs->loose_alloc ? refs->loose_alloc * 2 : 64;
+        if(!(grown = realloc(refs->loose, sizeof(struct ref) * refs->loose_alloc))) {
+            free(target);
+            return -1;
+        }
+        refs->loose = grown;
+    }
+    ref = &refs->loose[refs->nloose];
+    memset(ref, 0, sizeof(struct ref));
+    if(!(ref->name = copy_string(name, strlen(name)))) {
+        free(target);
+        return -1;
+    }
+    ref->target = target;
+    ref->flags = REF_LOOSE | (target ? REF_SYMBOLIC : 0);
+    if(!target)
+        memcpy(ref->sha1, sha1, 20);
+    refs->nloose++;
+    return 0;
+}
+
+static int add_dir_stamp(struct ref_store *refs, const char *path, const struct stat *st)
+{
+    struct ref_dir_stamp *grown;
+
+    if(refs->ndirs == refs->dirs_alloc) {
+        refs->dirs_alloc = refs->dirs_alloc ? refs->dirs_alloc * 2 : 16;
+        if(!(grown = realloc(refs->dirs, sizeof(struct ref_dir_stamp) * refs->dirs_alloc)))
+            return -1;
+        refs->dirs = grown;
+    }
+    if(!(refs->dirs[refs->ndirs].path = copy_string(path, strlen(path))))
+        return -1;
+    stamp_set(&refs->dirs[refs->ndirs].stamp, st);
+    refs->ndirs++;
+    return 0;
+}
+
+// Collects the loose refs under path. Each directory is stamped before it is
+// read, so anything that changes while we're at it shows up next time.
+static int loose_scan(struct ref_store *refs, const char *path)
+{
+    size_t len = strlen(path), name_len, git_dir_len = strlen(refs->git_dir);
+    unsigned char sha1[20];
+    struct dirent *de;
+    struct stat st;
+    char *child, *target;
+    DIR *dir;
+    int ret = 0;
+
+    if(stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return 0;
+    if(add_dir_stamp(refs, path, &st) != 0)
+        return -1;
+    if(!(dir = opendir(path)))
+        return 0;
+
+    while(ret == 0 && (de = readdir(dir))) {
+        name_len = strlen(de->d_name);
+        if(de->d_name[0] == '.' || (name_len > 5 && strcmp(de->d_name + name_len - 5, ".lock") == 0))
+            continue;
+        if(!(child = malloc(len + name_len + 2))) {
+            ret = -1;
+            break;
+        }
+        sprintf(child, "%s/%s", path, de->d_name);
+        if(stat(child, &st) == 0) {
+            if(S_ISDIR(st.st_mode))
+                ret = loose_scan(refs, child);
+            else if(S_ISREG(st.st_mode) && loose_read(refs, child + git_dir_len + 1, sha1, &target) == 0)
+                ret = add_loose(refs, child + git_dir_len + 1, sha1, target);
+        }
+        free(child);
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+static int compare_refs(const void *a, const void *b)
+{
+    return strcmp(((const struct ref *) a)->name, ((const struct ref *) b)->name);
+}
+
+static int loose_refresh(struct ref_store *refs)
+{
+    char *path;
+    uint32_t i;
+    int ret;
+
+    if(refs->loose_valid) {
+        for(i = 0; i < refs->ndirs; i++) {
+            if(stamp_changed(refs->dirs[i].path, &refs->dirs[i].stamp, refs->loose_loaded))
+                break;
+        }
+        if(i == refs->ndirs)
+            return 0;
+    }
+
+    loose_free(refs);
+    refs->all_valid = 0;
+    refs->loose_loaded = time(NULL);
+    if(!(path = malloc(strlen(refs->git_dir) + sizeof("/refs"))))
+        return -1;
+    sprintf(path, "%s/refs", refs->git_dir);
+    ret = loose_scan(refs, path);
+    free(path);
+    if(ret != 0) {
+        loose_free(refs);
+        return -1;
+    }
+    qsort(refs->loose, refs->nloose, sizeof(struct ref), compare_refs);
+    refs->loose_valid = 1;
+    return 0;
+}
+
+static const struct ref *loose_find(const struct ref_store *refs, const char *name)
+{
+    uint32_t lo = 0, hi = refs->nloose, mi;
+    int cmp;
+
+    while(lo < hi) {
+        mi = lo + (hi - lo) / 2;
+        cmp = strcmp(refs->loose[mi].name, name);
+        if(cmp == 0)
+            return &refs->loose[mi];
+        if(cmp < 0)
+            lo = mi + 1;
+        else
+            hi = mi;
+    }
+    return NULL;
+}
+
+// Resolves a symbolic ref against the cached refs rather than the files.
+static int resolve_cached(const struct ref_store *refs, const char *name, struct ref *ref)
+{
+    const struct ref *loose;
+    int depth;
+
+    for(depth = 0; depth < REFS_MAX_DEPTH; depth++) {
+        if(!(loose = loose_find(refs, name)))
+            return packed_find(refs, name, ref);
+        if(!(loose->flags & REF_SYMBOLIC)) {
+            memcpy(ref->sha1, loose->sha1, 20);
+            return 0;
+        }
+        name = loose->target;
+    }
+    return -1;
+}
+
+// Merges the packed and loose refs into one sorted list, loose winning.
+static int build_all(struct ref_store *refs)
+{
+    const unsigned char *p = refs->packed_start, *end = refs->packed ? refs->packed + refs->packed_size : NULL;
+    const unsigned char *next, *name;
+    unsigned char sha1[20], peeled[20];
+    unsigned int flags;
+    size_t name_len, names_size = 0;
+    uint32_t npacked = 0, i = 0;
+    struct ref *out;
+    char *names;
+    int cmp;
+
+    free(refs->all);
+    free(refs->all_names);
+    refs->all = NULL;
+    refs->all_names = NULL;
+    refs->nall = 0;
+
+    for(p = refs->packed_start; p && p < end; p = next) {
+        if(!(next = packed_record(refs, p, &name, &name_len, sha1, peeled, &flags))) {
+            printf("Ignoring %s: malformed line at offset %lu.\n", refs->packed_path,
+                   (unsigned long) (p - refs->packed));
+            packed_unload(refs);
+            end = NULL;
+            npacked = names_size = 0;
+            break;
+        }
+        npacked++;
+        names_size += name_len + 1;
+    }
+
+    refs->all = malloc(sizeof(struct ref) * (npacked + refs->nloose + 1));
+    refs->all_names = names = malloc(names_size + 1);
+    if(!refs->all || !names)
+        return -1;
+
+    p = refs->packed_start;
+    while((p && p < end) || i < refs->nloose) {
+        out = &refs->all[refs->nall];
+        memset(out, 0, sizeof(struct ref));
+        cmp = 1;
+        if(p && p < end) {
+            next = packed_record(refs, p, &name, &name_len, out->sha1, out->peeled, &out->flags);
+            cmp = (i < refs->nloose) ? compare_name(name, name_len, refs->loose[i].name) : -1;
+        }
+
+        if(cmp < 0) {
+            memcpy(names, name, name_len);
+            names[name_len] = '\0';
+            out->name = names;
+            names += name_len + 1;
+            refs->nall++;
+            p = next;
+            continue;
+        }
+
+        if(cmp == 0)
+            p = next; // a loose ref overrides its packed copy
+        memset(out, 0, sizeof(struct ref));
+        out->name = refs->loose[i].name;
+        out->target = refs->loose[i].target;
+        out->flags = refs->loose[i].flags;
+        memcpy(out->sha1, refs->loose[i].sha1, 20);
+        i++;
+        if(!(out->flags & REF_SYMBOLIC) || resolve_cached(refs, out->target, out) == 0)
+            refs->nall++; // symbolic refs to refs that don't exist are left out
+    }
+
+    refs->all_valid = 1;
+    return 0;
+}
+
+struct ref_store *refs_open(const char *git_dir)
+{
+    struct ref_store *refs;
+
+    if(!(refs = calloc(1, sizeof(struct ref_store))))
+        return NULL;
+    refs->git_dir = copy_string(git_dir, strlen(git_dir));
+    refs->packed_path = malloc(strlen(git_dir) + sizeof("/packed-refs"));
+    if(!refs->git_dir || !refs->packed_path) {
+        refs_close(refs);
+        return NULL;
+    }
+    sprintf(refs->packed_path, "%s/packed-refs", git_dir);
+
+    if(packed_load(refs) != 0)
+        printf("Ignoring %s: failed to read it.\n", refs->packed_path);
+    return refs;
+}
+
+void refs_close(struct ref_store *refs)
+{
+    if(!refs)
+        return;
+
+    packed_unload(refs);
+    loose_free(refs);
+    free(refs->all);
+    free(refs->all_names);
+    free(refs->packed_path);
+    free(refs->git_dir);
+    free(refs);
+}
+
+// Reads one ref by its full name ("HEAD", "refs/heads/master"), following
+// symbolic refs; ref->target is set to the ref that name points at directly.
+// Loose refs are read straight from their files, so this never waits for a
+// scan of refs/. Returns 0 if found, 1 for a symbolic ref to a ref that
+// doesn't exist yet (HEAD on an unborn branch) and -1 otherwise. Call
+// refs_release() afterwards whatever it returns.
+int refs_read(struct ref_store *refs, const char *name, struct ref *ref)
+{
+    const char *current = name;
+    char *target, *hop = NULL;  // hop holds names past the first one
+    int depth, ret = -1;
+
+    memset(ref, 0, sizeof(struct ref));
+    if(!ref_name_ok(name) || !(ref->name = copy_string(name, strlen(name))))
+        return -1;
+    packed_refresh(refs);
+
+    for(depth = 0; depth < REFS_MAX_DEPTH; depth++) {
+        if(loose_read(refs, current, ref->sha1, &target) != 0) {
+            if(packed_find(refs, current, ref) == 0)
+                ret = 0;
+            else if(ref->flags & REF_SYMBOLIC)
+                ret = 1;
+            break;
+        }
+        if(!target) {
+            ref->flags |= REF_LOOSE;
+            ret = 0;
+            break;
+        }
+        if(!ref_name_ok(target)) {
+            free(target);
+            break;
+        }
+        if(ref->target) {
+            free(hop);
+            hop = target;
+        } else {
+            ref->target = target;
+            ref->flags |= REF_SYMBOLIC;
+        }
+        current = target;
+    }
+
+    free(hop);
+    return ret;
+}
+
+// Reads a ref the way git reads one on the command line: "master" may be
+// refs/heads/master, "v1.0" refs/tags/v1.0, "origin" refs/remotes/origin/HEAD.
+int refs_dwim(struct ref_store *refs, const char *name, struct ref *ref)
+{
+    char *full;
+    int i, ret;
+
+    for(i = 0; dwim_rules[i]; i++) {
+        if(!(full = malloc(strlen(dwim_rules[i]) + strlen(name) + 1)))
+            return -1;
+        sprintf(full, dwim_rules[i], name);
+        ret = refs_read(refs, full, ref);
+        free(full);
+        if(ret == 0)
+            return 0;
+        refs_release(ref);
+    }
+    return -1;
+}
+
+void refs_release(struct ref *ref)
+{
+    free((char *) ref->name);
+    free((char *) ref->target);
+    ref->name = NULL;
+    ref->target = NULL;
+}
+
+// What the ref finally points at once annotated tags are peeled off. Refs
+// from packed-refs nearly always know this already; otherwise the tags are
+// read from odb, which may be NULL to forbid that.
+int refs_peel(const struct ref *ref, struct odb *odb, unsigned char *peeled)
+{
+    struct git_object g_obj;
+    const unsigned char *p;
+    unsigned char sha1[20];
+    int depth;
+
+    if(ref->flags & REF_PEELED) {
+        memcpy(peeled, ref->peeled, 20);
+        return 0;
+    }
+    if(!odb)
+        return -1;
+
+    memcpy(sha1, ref->sha1, 20);
+    for(depth = 0; depth < REFS_MAX_DEPTH; depth++) {
+        if(odb_read(odb, sha1, &g_obj, NULL) != 0)
+            return -1;
+        if(g_obj.type != TAG) {
+            free(g_obj.mem_data);
+            memcpy(peeled, sha1, 20);
+            return 0;
+        }
+        p = g_obj.mem_data;
+        if(parse_header_sha1(&p, g_obj.mem_data + g_obj.size, "object", sha1) != 0) {
+            free(g_obj.mem_data);
+            return -1;
+        }
+        free(g_obj.mem_data);
+    }
+    return -1;
+}
+
+// Calls fn for every ref whose name starts with prefix, in name order. Refs
+// are re-read first if packed-refs or any directory under refs/ has changed.
+int refs_for_each(struct ref_store *refs, const char *prefix, ref_fn fn, void *cb_data)
+{
+    size_t len = strlen(prefix);
+    uint32_t lo = 0, hi, mi;
+    int ret;
+
+    packed_refresh(refs);
+    if(loose_refresh(refs) != 0)
+        return -1;
+    if(!refs->all_valid && build_all(refs) != 0)
+        return -1;
+
+    for(hi = refs->nall; lo < hi; ) {
+        mi = lo + (hi - lo) / 2;
+        if(strcmp(refs->all[mi].name, prefix) < 0)
+            lo = mi + 1;
+        else
+            hi = mi;
+    }
+    for(; lo < refs->nall && strncmp(refs->all[lo].name, prefix, len) == 0; lo++) {
+        if((ret = fn(&refs->all[lo], cb_data)) > 0)
+            return ret;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef REFS_H
+#define REFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct odb;
+
+#define REF_PEELED   1  // peeled is known; it equals sha1 when the ref isn't a tag
+#define REF_SYMBOLIC 2  // the ref points at another one, named by target
+#define REF_LOOSE    4  // read from its own file rather than from packed-refs
+
+struct ref {
+    const char *name;
+    const char *target;          // the ref a symbolic ref finally resolves to
+    unsigned char sha1[20];
+    unsigned char peeled[20];    // what an annotated tag points at
+    unsigned int flags;
+};
+
+// Enough of a stat() to tell whether a file or directory has changed.
+struct file_stamp {
+    int exists;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+};
+
+struct ref_dir_stamp {
+    char *path;
+    struct file_stamp stamp;
+};
+
+// A repository's refs. packed-refs is mmap'd and binary searched in place;
+// loose refs override it. Both are cached and checked against the files'
+// stamps before each use, so a store can be kept open for as long as the
+// repository is. Not thread safe.
+struct ref_store {
+    char *git_dir;
+    char *packed_path;
+
+    // packed-refs, from just after its header to the end
+    unsigned char *packed;
+    size_t packed_size;
+    int packed_mapped;           // otherwise it was sorted into a malloc()'d copy
+    const unsigned char *packed_start;
+    int packed_peeled;           // 1: tags have ^ lines where needed, 2: every ref does
+    struct file_stamp packed_stamp;
+    time_t packed_loaded;
+
+    // every loose ref under refs/, sorted, and the directories they were found in
+    struct ref *loose;
+    uint32_t nloose, loose_alloc;
+    struct ref_dir_stamp *dirs;
+    uint32_t ndirs, dirs_alloc;
+    int loose_valid;
+    time_t loose_loaded;
+
+    // both merged, for listing
+    struct ref *all;
+    uint32_t nall;
+    char *all_names;
+    int all_valid;
+};
+
+// Called for each ref by refs_for_each(); return a positive value to stop.
+// The ref is only valid during the call.
+typedef int (*ref_fn)(const struct ref *ref, void *cb_data);
+
+struct ref_store *refs_open(const char *git_dir);
+void refs_close(struct ref_store *refs);
+
+int refs_read(struct ref_store *refs, const char *name, struct ref *ref);
+int refs_dwim(struct ref_store *refs, const char *name, struct ref *ref);
+void refs_release(struct ref *ref);
+int refs_peel(const struct ref *ref, struct odb *odb, unsigned char *peeled);
+int refs_for_each(struct ref_store *refs, const char *prefix, ref_fn fn, void *cb_data);
+
+
+#endif
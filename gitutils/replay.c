@@ -0,0 +1,524 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libgitread.h"
+#include "odb.h"
+#include "tree.h"
+#include "walk.h"
+#include "bitmap.h"
+#include "commitgraph.h"
+#include "ancestry.h"
+#include "lastmod.h"
+#include "blame.h"
+#include "lstree.h"
+#include "range.h"
+#include "diff.h"
+#include "grep.h"
+#include "archive.h"
+#include "trace.h"
+
+// Re-issues a trace recorded with gitutil.trace_start() against a copy of the
+// repository, the way the Python module would have made the calls, and says
+// how long they took.
+//
+// Calls are taken in the order they started by a pool of threads. With a
+// speed-up each is issued when it's due, that many times faster than it was
+// recorded, whether or not the ones before it have finished, so a build that
+// can't keep up falls behind rather than slowing the traffic down; without
+// one the threads go as fast as they can. Either way what's timed is the call
+// itself.
+//
+// Results are written to stdout as one JSON object per line, a line per op and
+// one for the whole run:
+//  {"replay":"blame","ops":120,"errors":0,"seconds":1.52,"p50_us":...,"p90_us":...,"p99_us":...,
+//   "max_us":...,"recorded_p50_us":...,"recorded_p99_us":...}
+//  {"replay":"total","ops":5000,"errors":0,"seconds":3.1,"ops_per_sec":...,"recorded_seconds":...,
+//   "p50_us":...,"p90_us":...,"p99_us":...,"max_us":...,"max_behind_ms":...}
+//
+// Build with "make replay".
+
+struct replay {
+    struct odb *odb;
+    struct tree_resolver *paths;
+    struct commit_graph *graph;          // NULL if there isn't one
+    struct bitmap_index *bitmap;         // NULL if there isn't one
+    struct range_index *ranges;
+    const struct trace *trace;
+    double speedup;                      // 0 for as fast as possible
+    int cache_mb;                        // used instead of what was recorded if >= 0
+    uint64_t started_ns;
+    uint32_t next;                       // the next call to take
+    double *latency;                     // per call, in seconds
+    unsigned char *failed;
+};
+
+struct replay_worker {
+    struct replay *rp;
+    pthread_t thread;
+    uint64_t behind_ns;                  // the furthest behind a call it took was
+};
+
+// What each op can't do without; a trace that has less is corrupt.
+static const uint32_t min_oids[TRACE_NOPS] = { 1, 0, 1, 1, 1, 1, 1, 2, 2, 1, 2, 0, 0, 1, 1 };
+static const uint32_t min_strs[TRACE_NOPS] = { 0, 0, 0, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 2, 2 };
+
+static int64_t num(const struct trace_call *c, uint32_t i)
+{
+    return i < c->nnums ? c->nums[i] : 0;
+}
+
+static int discard(const void *data, size_t len, void *cb_data)
+{
+    *(uint64_t *) cb_data += len;
+    return 0;
+}
+
+static int replay_read_many(struct replay *rp, const struct trace_call *c)
+{
+    struct git_object *objects;
+    int cache_mb = rp->cache_mb >= 0 ? rp->cache_mb : (int) num(c, 0), ret;
+    uint32_t i;
+
+    if(!(objects = malloc(sizeof(*objects) * (c->noids ? c->noids : 1))))
+        return -1;
+    ret = odb_read_many(rp->odb, c->oids, c->noids, objects, cache_mb > 0 ? (size_t) cache_mb << 20 : 0);
+    if(ret >= 0) {
+        for(i = 0; i < c->noids; i++)
+            free(objects[i].mem_data);
+    }
+    free(objects);
+    return ret < 0 ? -1 : 0;
+}
+
+static int replay_read_range(struct replay *rp, const struct trace_call *c)
+{
+    struct range_reader *reader;
+    uint64_t offset = num(c, 0), length = num(c, 1), size, got;
+    unsigned char *buf;
+    unsigned int type;
+    int ret;
+
+    if(range_open(rp->odb, c->oids[0], rp->ranges, &reader, &type, &size) != 0)
+        return 0;
+    if(offset > size)
+        offset = size;
+    if(length > size - offset)
+        length = size - offset;
+    if(!(buf = malloc(length + 1))) {
+        range_close(reader);
+        return -1;
+    }
+    ret = range_read(reader, offset, length, buf, &got);
+    range_close(reader);
+    free(buf);
+    return ret != 0 ? -1 : 0;
+}
+
+// As Repo.diff() reads each side.
+static int diff_side(const struct odb *odb, const unsigned char *sha1, size_t max_bytes, struct git_object *g_obj)
+{
+    uint64_t size;
+
+    g_obj->mem_data = NULL;
+    g_obj->type = BLOB;
+    g_obj->size = 0;
+    if(!sha1)
+        return 0;
+    if(odb_object_size(odb, sha1, &size) != 0)
+        return 1;
+    if(max_bytes && size > max_bytes)
+        return DIFF_TOO_BIG;
+    if(odb_read(odb, sha1, g_obj, NULL) != 0) {
+        g_obj->mem_data = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+static int replay_diff(struct replay *rp, const struct trace_call *c)
+{
+    struct git_object g_obj[2];
+    struct diff_options opts;
+    struct diff_result res;
+    int given = num(c, 0), ret[2], status = 0, i;
+    char *unified;
+    size_t len;
+
+    diff_options_init(&opts);
+    opts.algorithm = num(c, 1);
+    opts.context = num(c, 2);
+    opts.max_bytes = num(c, 4);
+    opts.budget_ms = num(c, 5);
+    memset(&res, 0, sizeof(res));
+    for(i = 0; i < 2; i++)
+        ret[i] = diff_side(rp->odb, (given & (1 << i)) ? c->oids[i] : NULL, opts.max_bytes, &g_obj[i]);
+    if(ret[0] == 0 && ret[1] == 0 && g_obj[0].type == BLOB && g_obj[1].type == BLOB) {
+        status = diff_buffers(g_obj[0].mem_data ? g_obj[0].mem_data : (unsigned char *) "", g_obj[0].size,
+                              g_obj[1].mem_data ? g_obj[1].mem_data : (unsigned char *) "", g_obj[1].size,
+                              &opts, &res);
+        if(status == DIFF_TEXT && num(c, 3)) {
+            len = diff_unified(&res, NULL, 0);
+            if((unified = malloc(len + 1)))
+                diff_unified(&res, unified, len + 1);
+            free(unified);
+        }
+    }
+    diff_release(&res);
+    free(g_obj[0].mem_data);
+    free(g_obj[1].mem_data);
+    return status < 0 ? -1 : 0;
+}
+
+static int replay_ancestry(struct replay *rp, const struct trace_call *c)
+{
+    unsigned char (*bases)[20];
+    uint32_t ahead, behind;
+    struct ancestry *a;
+    int ret, nbases;
+
+    if(!(a = ancestry_new(rp->odb, rp->graph)))
+        return -1;
+    if(c->op == TRACE_IS_ANCESTOR) {
+        ret = ancestry_is_ancestor(a, c->oids[0], c->oids[1]);
+    } else if(c->op == TRACE_AHEAD_BEHIND) {
+        ret = ancestry_ahead_behind(a, c->oids[0], c->oids[1], &ahead, &behind);
+    } else {
+        ret = ancestry_merge_bases(a, c->oids[0], c->oids + 1, c->noids - 1, &bases, &nbases);
+        if(ret >= 0)
+            free(bases);
+    }
+    ancestry_free(a);
+    return ret < 0 ? -1 : 0;
+}
+
+// Takes as many objects as the caller did, or all of them.
+static int replay_walk(struct replay *rp, const struct trace_call *c)
+{
+    int ninclude = num(c, 0), cache_mb = rp->cache_mb >= 0 ? rp->cache_mb : (int) num(c, 1), status, ret = 0;
+    int64_t taken = num(c, 2), n;
+    const unsigned char *sha1;
+    const char *path;
+    unsigned int type;
+    struct walk *w;
+
+    if(ninclude < 0 || (uint32_t) ninclude > c->noids)
+        return -1;
+    if(!(w = walk_new(rp->odb, c->oids, ninclude, c->oids + ninclude, c->noids - ninclude,
+                      (size_t) cache_mb << 20)))
+        return -1;
+    for(n = 0; taken < 0 || n < taken; n++) {
+        if((status = walk_next(w, &sha1, &type, &path)) == 0)
+            break;
+        if(status < 0)
+            ret = -1;
+    }
+    walk_free(w);
+    return ret;
+}
+
+static int replay_grep(struct replay *rp, const struct trace_call *c)
+{
+    struct grep_options opts;
+    struct grep_match m;
+    struct grep *g;
+    int64_t taken = num(c, 4), n;
+    int status, ret;
+
+    grep_options_init(&opts);
+    opts.flags = num(c, 0);
+    opts.max_matches = num(c, 1);
+    opts.max_bytes = num(c, 2);
+    opts.threads = num(c, 3);
+    if((ret = grep_start(rp->odb, rp->paths, c->oids[0], c->strs[0], c->strs[1], &opts, &g)) != 0)
+        return ret == 1 ? 0 : -1;
+    for(n = 0; taken < 0 || n < taken; n++) {
+        if((status = grep_next(g, &m)) > 0)
+            break;
+        if(status < 0)
+            ret = -1;
+    }
+    grep_free(g);
+    return ret;
+}
+
+static int replay_call(struct replay *rp, const struct trace_call *c)
+{
+    struct git_object g_obj;
+    struct archive_options opts;
+    struct bitmap_counts counts;
+    unsigned char sha1[20];
+    unsigned int mode;
+    struct lastmod lm;
+    struct lstree ls;
+    struct blame b;
+    uint64_t bytes = 0;
+    int64_t start, end;
+    int ret;
+
+    if(c->noids < min_oids[c->op] || c->nstrs < min_strs[c->op])
+        return -1;
+
+    switch(c->op) {
+    case TRACE_COMMIT:
+        if((ret = odb_read(rp->odb, c->oids[0], &g_obj, NULL)) == 0)
+            free(g_obj.mem_data);
+        return ret == GITREAD_CORRUPT ? -1 : 0;
+    case TRACE_READ_MANY:
+        return replay_read_many(rp, c);
+    case TRACE_READ_RANGE:
+        return replay_read_range(rp, c);
+    case TRACE_RESOLVE_PATH:
+        return tree_resolve_path(rp->paths, rp->odb, c->oids[0], c->strs[0], &mode, sha1) < 0 ? -1 : 0;
+    case TRACE_LAST_MODIFIED:
+        ret = lastmod_dir(rp->odb, rp->paths, c->oids[0], c->strs[0], num(c, 0), &lm);
+        lastmod_release(&lm);
+        return ret < 0 ? -1 : 0;
+    case TRACE_BLAME:
+        start = num(c, 0);
+        end = num(c, 1);
+        if(start < 1 || (end && end < start))
+            return -1;
+        ret = blame_file(rp->odb, rp->paths, c->oids[0], c->strs[0], start - 1, end ? end - start + 1 : 0,
+                         num(c, 2), &b);
+        blame_release(&b);
+        return ret < 0 ? -1 : 0;
+    case TRACE_LS_TREE:
+        if((ret = lstree_walk(rp->odb, rp->paths, c->oids[0], c->strs[0], num(c, 0), num(c, 1), num(c, 2),
+                              &ls)) == 0)
+            lstree_release(&ls);
+        return ret < 0 ? -1 : 0;
+    case TRACE_DIFF:
+        return replay_diff(rp, c);
+    case TRACE_IS_ANCESTOR:
+    case TRACE_MERGE_BASES:
+    case TRACE_AHEAD_BEHIND:
+        return replay_ancestry(rp, c);
+    case TRACE_COUNT_REACHABLE:
+        if(!rp->bitmap || num(c, 0) < 0 || (uint64_t) num(c, 0) > c->noids)
+            return -1;
+        return bitmap_count_reachable(rp->bitmap, c->oids, num(c, 0), c->oids + num(c, 0),
+                                      c->noids - num(c, 0), &counts) != 0 ? -1 : 0;
+    case TRACE_WALK:
+        return replay_walk(rp, c);
+    case TRACE_GREP:
+        return replay_grep(rp, c);
+    case TRACE_ARCHIVE:
+        archive_options_init(&opts);
+        opts.base = c->strs[1];
+        opts.format = num(c, 0);
+        opts.level = num(c, 1);
+        opts.threads = num(c, 2);
+        ret = archive_write(rp->odb, rp->paths, c->oids[0], c->strs[0], &opts, discard, &bytes);
+        return ret < 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+static void *worker(void *data)
+{
+    struct replay_worker *w = data;
+    struct replay *rp = w->rp;
+    const struct trace_call *c;
+    struct timespec ts;
+    uint64_t due, now;
+    uint32_t i;
+
+    while((i = __sync_fetch_and_add(&rp->next, 1)) < rp->trace->ncalls) {
+        c = &rp->trace->calls[i];
+        if(rp->speedup > 0) {
+            due = rp->started_ns + (uint64_t) (c->start_ns / rp->speedup);
+            now = trace_clock();
+            if(now < due) {
+                ts.tv_sec = due / 1000000000ULL;
+                ts.tv_nsec = due % 1000000000ULL;
+                while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                    ;
+            } else if(now - due > w->behind_ns) {
+                w->behind_ns = now - due;
+            }
+        }
+        now = trace_clock();
+        rp->failed[i] = (replay_call(rp, c) != 0);
+        rp->latency[i] = (trace_clock() - now) / 1e9;
+    }
+    return NULL;
+}
+
+/////////////////////////////////////////////////////////////////////
+// reporting
+/////////////////////////////////////////////////////////////////////
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, uint32_t n, double p)
+{
+    if(n == 0)
+        return 0;
+    return sorted[(uint32_t) (p * (n - 1) + 0.5)];
+}
+
+// One line for the calls to op, or for all of them if it's -1, with how long
+// they took when they were recorded; lat and recorded are scratch space. The
+// whole run took seconds, and the recording recorded_seconds.
+static void report(const struct replay *rp, int op, double seconds, double recorded_seconds, double behind_ms,
+                   double *lat, double *recorded)
+{
+    const struct trace *t = rp->trace;
+    uint32_t i, n = 0, errors = 0;
+    double total = 0;
+
+    for(i = 0; i < t->ncalls; i++) {
+        if(op >= 0 && t->calls[i].op != op)
+            continue;
+        lat[n] = rp->latency[i];
+        recorded[n] = t->calls[i].latency_ns / 1e9;
+        total += lat[n];
+        errors += rp->failed[i];
+        n++;
+    }
+    if(op >= 0 && n == 0)
+        return;
+    qsort(lat, n, sizeof(double), compare_doubles);
+    qsort(recorded, n, sizeof(double), compare_doubles);
+
+    printf("{\"replay\":\"%s\",\"ops\":%u,\"errors\":%u", op >= 0 ? trace_op_names[op] : "total", n, errors);
+    if(op >= 0)
+        printf(",\"seconds\":%.6f", total);
+    else
+        printf(",\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"recorded_seconds\":%.6f", seconds,
+               seconds > 0 ? n / seconds : 0, recorded_seconds);
+    printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f",
+           percentile(lat, n, 0.50) * 1e6, percentile(lat, n, 0.90) * 1e6,
+           percentile(lat, n, 0.99) * 1e6, n ? lat[n - 1] * 1e6 : 0);
+    printf(",\"recorded_p50_us\":%.3f,\"recorded_p99_us\":%.3f",
+           percentile(recorded, n, 0.50) * 1e6, percentile(recorded, n, 0.99) * 1e6);
+    if(op < 0)
+        printf(",\"max_behind_ms\":%.3f", behind_ms);
+    printf("}\n");
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-t threads] [-s speed-up] [-c cache MB] [-m path memo slots] [-r range index MB]\n"
+           "          [-V] <git dir> <trace>\n"
+           "  -t  threads issuing calls (default: 1)\n"
+           "  -s  issue calls when they're due, this many times faster than recorded; 0 (the\n"
+           "      default) goes as fast as possible\n"
+           "  -c  delta base cache for read_many and walk, instead of what each call asked for\n"
+           "  -V  check every object read hashes to its id\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay rp;
+    struct replay_worker *workers;
+    struct trace trace;
+    double *lat, *recorded, seconds, recorded_seconds = 0, behind = 0;
+    size_t range_mb = RANGE_INDEX_BYTES >> 20;
+    uint32_t memo_slots = TREE_MEMO_DEFAULT, i;
+    int threads = 1, verify = 0, opt, t, started = 0, op;
+
+    memset(&rp, 0, sizeof(rp));
+    rp.cache_mb = -1;
+    while((opt = getopt(argc, argv, "t:s:c:m:r:Vh")) != -1) {
+        switch(opt) {
+        case 't': threads = atoi(optarg); break;
+        case 's': rp.speedup = atof(optarg); break;
+        case 'c': rp.cache_mb = atoi(optarg); break;
+        case 'm': memo_slots = strtoul(optarg, NULL, 10); break;
+        case 'r': range_mb = strtoul(optarg, NULL, 10); break;
+        case 'V': verify = 1; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(argc - optind != 2 || threads < 1 || rp.speedup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(trace_load(argv[optind + 1], &trace) != 0) {
+        printf("Failed to read the trace %s: %s\n", argv[optind + 1],
+               errno == EINVAL ? "it isn't one, or it's corrupt" : strerror(errno));
+        return 1;
+    }
+    if(!(rp.odb = odb_open(argv[optind]))) {
+        printf("Failed to open the object store in %s.\n", argv[optind]);
+        return 1;
+    }
+    odb_set_verify(rp.odb, verify);
+    rp.graph = commit_graph_open(rp.odb->objects_dir);
+    for(i = 0; i < trace.ncalls && trace.calls[i].op != TRACE_COUNT_REACHABLE; i++)
+        ;
+    if(i < trace.ncalls)
+        rp.bitmap = bitmap_open(rp.odb);
+    rp.paths = tree_resolver_new(memo_slots);
+    rp.ranges = range_index_new(range_mb << 20);
+    rp.trace = &trace;
+    rp.latency = calloc(trace.ncalls + 1, sizeof(double));
+    rp.failed = calloc(trace.ncalls + 1, 1);
+    lat = malloc(sizeof(double) * (trace.ncalls + 1));
+    recorded = malloc(sizeof(double) * (trace.ncalls + 1));
+    workers = calloc(threads, sizeof(*workers));
+    if(!rp.paths || !rp.ranges || !rp.latency || !rp.failed || !lat || !recorded || !workers) {
+        printf("Out of memory.\n");
+        return 1;
+    }
+    for(i = 0; i < trace.ncalls; i++) {
+        seconds = (trace.calls[i].start_ns + trace.calls[i].latency_ns) / 1e9;
+        if(seconds > recorded_seconds)
+            recorded_seconds = seconds;
+    }
+
+    printf("{\"replay\":\"config\",\"calls\":%u,\"truncated\":%d,\"threads\":%d,\"speedup\":%g"
+           ",\"cache_mb\":%d,\"memo_slots\":%u,\"range_mb\":%zu,\"commit_graph\":%d,\"bitmap\":%d}\n",
+           trace.ncalls, trace.truncated, threads, rp.speedup, rp.cache_mb, memo_slots, range_mb,
+           rp.graph != NULL, rp.bitmap != NULL);
+    fflush(stdout);
+
+    rp.started_ns = trace_clock();
+    for(t = 0; t < threads; t++) {
+        workers[t].rp = &rp;
+        if(pthread_create(&workers[t].thread, NULL, worker, &workers[t]) != 0)
+            break;
+        started++;
+    }
+    if(!started) {
+        printf("Failed to start any threads.\n");
+        return 1;
+    }
+    for(t = 0; t < started; t++) {
+        pthread_join(workers[t].thread, NULL);
+        if(workers[t].behind_ns / 1e6 > behind)
+            behind = workers[t].behind_ns / 1e6;
+    }
+    seconds = (trace_clock() - rp.started_ns) / 1e9;
+
+    for(op = 0; op < TRACE_NOPS; op++)
+        report(&rp, op, 0, 0, 0, lat, recorded);
+    report(&rp, -1, seconds, recorded_seconds, behind, lat, recorded);
+
+    free(workers);
+    free(lat);
+    free(recorded);
+    free(rp.latency);
+    free(rp.failed);
+    range_index_free(rp.ranges);
+    tree_resolver_free(rp.paths);
+    bitmap_close(rp.bitmap);
+    commit_graph_close(rp.graph);
+    odb_close(rp.odb);
+    trace_release(&trace);
+    return 0;
+}
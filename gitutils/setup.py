@@ -1,5 +1,5 @@
 from distutils.core import setup, Extension
 
 setup(version = '0.1', description = 'Wrapper for libgitread; a tiny C library for reading git objects.',
-    ext_modules = [Extension('gitutil', sources = ['pygitutil.c', 'libgitread.c', 'filecache.c'], libraries = ['z'])]
+    ext_modules = [Extension('gitutil', sources = ['pygitutil.c', 'libgitread.c', 'filecache.c', 'stats.c', 'sha1.c', 'basecache.c', 'verify.c', 'enumerate.c', 'odb.c', 'walk.c', 'oidmap.c', 'bitmap.c', 'indexpack.c', 'refs.c', 'objclient.c', 'commit.c', 'tree.c', 'lastmod.c', 'commitgraph.c', 'ancestry.c', 'lstree.c', 'range.c', 'diff.c', 'blame.c', 'grep.c', 'archive.c', 'trace.c'], libraries = ['z', 'pthread'])]
 )
\ No newline at end of file
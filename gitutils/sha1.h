@@ -0,0 +1,22 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct sha1_ctx {
+    uint32_t h[5];
+    uint64_t length; // total bytes hashed so far
+    unsigned char block[64];
+    void (*blocks)(uint32_t *h, const unsigned char *data, size_t nblocks);
+};
+
+void sha1_init(struct sha1_ctx *ctx);
+void sha1_update(struct sha1_ctx *ctx, const void *data, size_t len);
+void sha1_final(unsigned char *out, struct sha1_ctx *ctx);
+void sha1_buffer(const void *data, size_t len, unsigned char *out);
+void sha1_use_hardware(int enable);
+const char *sha1_implementation(void);
+
+
+#endif
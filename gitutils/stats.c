@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+#define STATS_NFIELDS (sizeof(struct gu_stats) / sizeof(uint64_t))
+
+const char *stats_op_names[STATS_NOPS] = {
+    "pack_get_object",
+    "loose_get_object",
+    "pack_idx_read",
+    "load_idx",
+    "pack_read_object",
+};
+
+struct stats_thread {
+    struct gu_stats counters; // must stay first
+    struct stats_thread *prev;
+    struct stats_thread *next;
+};
+
+#ifndef GITREAD_NO_STATS
+__thread struct gu_stats *stats_local = NULL;
+#endif
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static struct stats_thread *stats_threads = NULL;
+static struct gu_stats stats_retired;  // counters from threads that have exited
+static struct gu_stats stats_baseline; // subtracted from every snapshot; set by stats_reset()
+
+static void stats_add(struct gu_stats *to, const struct gu_stats *from)
+{
+    uint64_t *t = (uint64_t *) to;
+    const uint64_t *f = (const uint64_t *) from;
+    unsigned int i;
+
+    for(i = 0; i < STATS_NFIELDS; i++)
+        t[i] += f[i];
+}
+
+// Runs when a thread that has recorded something exits: fold its counters into
+// the retired totals so they survive, and drop it from the list.
+static void stats_thread_exit(void *data)
+{
+    struct stats_thread *thread = data;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_add(&stats_retired, &thread->counters);
+    if(thread->prev)
+        thread->prev->next = thread->next;
+    else
+        stats_threads = thread->next;
+    if(thread->next)
+        thread->next->prev = thread->prev;
+    pthread_mutex_unlock(&stats_lock);
+    free(thread);
+}
+
+static void stats_init_key(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+// First use on a thread: allocate its counters and register them.
+struct gu_stats *stats_local_slow(void)
+{
+    static struct gu_stats dummy; // only used if we are out of memory
+    struct stats_thread *thread;
+
+    pthread_once(&stats_once, stats_init_key);
+    if(!(thread = calloc(1, sizeof(struct stats_thread))))
+        return &dummy;
+
+    pthread_mutex_lock(&stats_lock);
+    thread->next = stats_threads;
+    if(stats_threads)
+        stats_threads->prev = thread;
+    stats_threads = thread;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, thread);
+#ifndef GITREAD_NO_STATS
+    stats_local = &thread->counters;
+#endif
+    return &thread->counters;
+}
+
+static void stats_sum(struct gu_stats *out)
+{
+    struct stats_thread *thread;
+
+    memcpy(out, &stats_retired, sizeof(struct gu_stats));
+    for(thread = stats_threads; thread; thread = thread->next)
+        stats_add(out, &thread->counters);
+}
+
+// Other threads keep counting while we sum, so a snapshot is only consistent
+// per counter, which is all a metrics scraper needs.
+void stats_snapshot(struct gu_stats *out)
+{
+    uint64_t *o = (uint64_t *) out;
+    const uint64_t *b = (const uint64_t *) &stats_baseline;
+    unsigned int i;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(out);
+    for(i = 0; i < STATS_NFIELDS; i++)
+        o[i] -= b[i];
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Per-thread counters belong to their threads, so rather than zeroing them
+// underneath a running reader we remember where they were.
+void stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_sum(&stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_record_latency(int op, uint64_t start_ns, int failed)
+{
+#ifndef GITREAD_NO_STATS
+    struct gu_stats *stats = stats_get();
+    uint64_t elapsed = stats_now_ns() - start_ns;
+    uint64_t us = elapsed / 1000;
+    int bucket = us ? 64 - __builtin_clzll(us) : 0;
+
+    if(bucket >= STATS_LATENCY_BUCKETS)
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    stats->calls[op]++;
+    stats->latency_ns[op] += elapsed;
+    stats->latency[op][bucket]++;
+    if(failed)
+        stats->errors[op]++;
+#endif
+}
+
+void stats_record_delta_depth(unsigned int depth)
+{
+#ifndef GITREAD_NO_STATS
+    if(depth >= STATS_DELTA_DEPTH_BUCKETS)
+        depth = STATS_DELTA_DEPTH_BUCKETS - 1;
+    stats_get()->delta_depth[depth]++;
+#endif
+}
+
+void stats_record_verify(uint64_t bytes, uint64_t start_ns, int failed)
+{
+#ifndef GITREAD_NO_STATS
+    struct gu_stats *stats = stats_get();
+
+    stats->verify_objects++;
+    stats->verify_bytes += bytes;
+    stats->verify_ns += stats_now_ns() - start_ns;
+    if(failed)
+        stats->verify_failures++;
+#endif
+}
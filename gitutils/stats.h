@@ -0,0 +1,90 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+// Counters are kept per thread and only summed when someone asks for them,
+// so the hot paths never touch shared cache lines or take a lock. Build with
+// -DGITREAD_NO_STATS to compile all of it out.
+
+#define STATS_DELTA_DEPTH_BUCKETS 64   // the last bucket collects everything deeper
+#define STATS_LATENCY_BUCKETS 32       // bucket n holds calls taking < 2^n microseconds
+
+enum stats_store {
+    STATS_LOOSE = 0,
+    STATS_PACKED,
+    STATS_NSTORES
+};
+
+enum stats_op {
+    STATS_OP_PACK_GET_OBJECT = 0,
+    STATS_OP_LOOSE_GET_OBJECT,
+    STATS_OP_PACK_IDX_READ,
+    STATS_OP_LOAD_IDX,
+    STATS_OP_PACK_READ_OBJECT,
+    STATS_NOPS
+};
+
+struct gu_stats {
+    uint64_t objects[STATS_NSTORES][8];     // indexed by object type
+    uint64_t bytes_read[STATS_NSTORES];     // compressed bytes handed to zlib
+    uint64_t bytes_inflated[STATS_NSTORES];
+    uint64_t delta_depth[STATS_DELTA_DEPTH_BUCKETS];
+    uint64_t idx_lookups;
+    uint64_t idx_probes;
+    uint64_t file_cache_opens;              // files actually fopen()'d
+    uint64_t file_cache_hits;               // requests served by an already open file
+    uint64_t base_cache_hits;
+    uint64_t base_cache_misses;
+    uint64_t errors[STATS_NOPS];
+    uint64_t calls[STATS_NOPS];
+    uint64_t latency_ns[STATS_NOPS];        // total time spent
+    uint64_t latency[STATS_NOPS][STATS_LATENCY_BUCKETS];
+    uint64_t verify_objects;                // objects checked against their ids
+    uint64_t verify_bytes;
+    uint64_t verify_ns;                     // time spent hashing them
+    uint64_t verify_failures;
+    uint64_t packs_skipped;                 // ones a refresh couldn't load, as while being written
+};
+
+extern const char *stats_op_names[STATS_NOPS];
+
+struct gu_stats *stats_local_slow(void);
+void stats_snapshot(struct gu_stats *out);
+void stats_reset(void);
+uint64_t stats_now_ns(void);
+void stats_record_latency(int op, uint64_t start_ns, int failed);
+void stats_record_delta_depth(unsigned int depth);
+void stats_record_verify(uint64_t bytes, uint64_t start_ns, int failed);
+
+#ifndef GITREAD_NO_STATS
+
+extern __thread struct gu_stats *stats_local;
+
+static inline struct gu_stats *stats_get(void)
+{
+    if(stats_local)
+        return stats_local;
+    return stats_local_slow();
+}
+
+#define STATS_ADD(field, n) (stats_get()->field += (n))
+#define STATS_INC(field) STATS_ADD(field, 1)
+#define STATS_START() stats_now_ns()
+#define STATS_END(op, start, failed) stats_record_latency((op), (start), (failed))
+#define STATS_DELTA_DEPTH(depth) stats_record_delta_depth(depth)
+#define STATS_VERIFY(bytes, start, failed) stats_record_verify((bytes), (start), (failed))
+
+#else
+
+#define STATS_ADD(field, n) ((void) 0)
+#define STATS_INC(field) ((void) 0)
+#define STATS_START() 0
+#define STATS_END(op, start, failed) ((void) (start))
+#define STATS_DELTA_DEPTH(depth) ((void) 0)
+#define STATS_VERIFY(bytes, start, failed) ((void) (start))
+
+#endif
+
+
+#endif
@@ -0,0 +1,115 @@
+#!/usr/bin/env python2
+# Tests for the gitutil module against a small repository made with git.
+# Run "make test", or build the module and run this with it on the path.
+
+import hashlib
+import os
+import shutil
+import struct
+import subprocess
+import tempfile
+import unittest
+import zlib
+
+import gitutil
+
+
+def git(repo, *args):
+    return subprocess.check_output(('git', '-C', repo) + args).strip()
+
+
+def varint(n):
+    out = ''
+    while n > 0x7f:
+        out += chr(n & 0x7f | 0x80)
+        n >>= 7
+    return out + chr(n)
+
+
+# A pack of the blob "hi" and an OFS_DELTA against it made of delta, which
+# has to be under 16 bytes to fit the one byte entry header.
+def delta_pack(delta):
+    blob = chr(0x32) + zlib.compress('hi')
+    data = 'PACK' + struct.pack('>II', 2, 2) + blob
+    data += chr(0x60 | len(delta)) + chr(len(blob)) + zlib.compress(delta)
+    return data + hashlib.sha1(data).digest()
+
+
+class RepoTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.dir = tempfile.mkdtemp()
+        git(cls.dir, 'init', '-q')
+        git(cls.dir, 'config', 'user.email', 'test@example.com')
+        git(cls.dir, 'config', 'user.name', 'test')
+        with open(os.path.join(cls.dir, 'f.txt'), 'w') as f:
+            f.write('blob contents')
+        git(cls.dir, 'add', 'f.txt')
+        git(cls.dir, 'commit', '-q', '-m', 'one')
+        cls.blob = git(cls.dir, 'rev-parse', 'HEAD:f.txt')
+        cls.repo = gitutil.Repo(os.path.join(cls.dir, '.git'))
+
+    @classmethod
+    def tearDownClass(cls):
+        shutil.rmtree(cls.dir)
+
+    def test_buffer_compares_as_str(self):
+        data = self.repo.read_many([self.blob])[0][2]
+        self.assertTrue(data == 'blob contents')
+        self.assertTrue('blob contents' == data)
+        self.assertFalse(data != 'blob contents')
+        self.assertTrue(data != 'blob')
+        self.assertTrue(data == self.repo.read_many([self.blob])[0][2])
+        self.assertTrue('blob' < data < 'blob contents!')
+        self.assertFalse(data == 1)
+        self.assertEqual(hash(data), hash('blob contents'))
+        self.assertIn(data, set(['blob contents']))
+
+    def test_read_range(self):
+        type, size, data = self.repo.read_range(self.blob, 2, 5)
+        self.assertEqual(size, 13)
+        self.assertEqual(str(data), 'ob co')
+        self.assertEqual(str(self.repo.read_range(self.blob, 10, 100)[2]), 'nts')
+        self.assertEqual(str(self.repo.read_range(self.blob, 100, 5)[2]), '')
+
+    def test_read_range_negative(self):
+        self.assertRaises(ValueError, self.repo.read_range, self.blob, 2, -5)
+        self.assertRaises(ValueError, self.repo.read_range, self.blob, -1, 5)
+
+
+class IndexPackTest(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.mkdtemp()
+
+    def tearDown(self):
+        shutil.rmtree(self.dir)
+
+    def index(self, delta):
+        path = os.path.join(self.dir, 'test.pack')
+        with open(path, 'wb') as f:
+            f.write(delta_pack(delta))
+        return gitutil.index_pack(path)
+
+    def test_delta(self):
+        # copy "hi", then insert "!"
+        self.assertEqual(self.index(varint(2) + varint(3) + '\x90\x02\x01!')['deltas'], 1)
+
+    def test_delta_result_too_big(self):
+        self.assertRaisesRegexp(Exception, 'failed to resolve the delta at offset 23', self.index,
+                                varint(2) + varint(0xfffffff0) + '\x01A')
+
+    def test_bad_checksum(self):
+        data = delta_pack(varint(2) + varint(2) + '\x90\x02')
+        path = os.path.join(self.dir, 'test.pack')
+        with open(path, 'wb') as f:
+            f.write(data[:-1] + chr(ord(data[-1]) ^ 1))
+        self.assertRaisesRegexp(Exception, "checksum doesn't match", gitutil.index_pack, path)
+
+    def test_delta_header_past_end(self):
+        self.assertRaises(Exception, self.index, varint(2) + '\xff' * 5)
+
+
+if __name__ == '__main__':
+    unittest.main()
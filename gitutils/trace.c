@@ -0,0 +1,517 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+// The trace file is TRACE_MAGIC, then varints for TRACE_VERSION and the wall
+// clock time tracing started (in seconds), then one record per call:
+//
+//     op, flags                        a byte each
+//     thread, start_ns, latency_ns     varints; start_ns is since tracing started
+//     noids, then noids 20 byte oids
+//     nstrs (a byte), then for each a varint length, the bytes and a \0
+//     nnums (a byte), then each as a zigzag varint
+//
+// Records are kept in a buffer and written out whole, so a file cut short by
+// a crash loses at most its last TRACE_BUFFER bytes and still reads back. A
+// path with "%p" in it has the process id put there; a child forked while
+// tracing goes on tracing to its own file if there's a %p, and stops if not,
+// since it would otherwise write over its parent's.
+
+const char *trace_op_names[TRACE_NOPS] = {
+    "commit",
+    "read_many",
+    "read_range",
+    "resolve_path",
+    "last_modified",
+    "blame",
+    "ls_tree",
+    "diff",
+    "is_ancestor",
+    "merge_bases",
+    "ahead_behind",
+    "count_reachable",
+    "walk",
+    "grep",
+    "archive",
+};
+
+// read without the lock by trace_begin(); only written with it
+int trace_enabled = 0;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static int trace_fd = -1;
+static char *trace_path;           // as given to trace_start()
+static uint64_t trace_started_ns;
+static int trace_error;            // errno from a failed write, reported by trace_stop()
+static unsigned char trace_buf[TRACE_BUFFER];
+static size_t trace_len;
+static uint32_t trace_nthreads;
+static __thread uint32_t trace_thread;
+
+uint64_t trace_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t put_varint(unsigned char *out, uint64_t n)
+{
+    size_t len = 0;
+
+    while(n >= 0x80) {
+        out[len++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    out[len++] = n;
+    return len;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+    ssize_t n;
+
+    while(len > 0) {
+        if((n = write(fd, data, len)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// With the lock held. A failed write stops the trace; the error waits for
+// trace_stop().
+static void trace_flush(const unsigned char *data, size_t len)
+{
+    if(trace_fd < 0 || trace_error)
+        return;
+    if(write_all(trace_fd, data, len) != 0) {
+        trace_error = errno;
+        __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// With the lock held.
+static int trace_open(const char *path)
+{
+    unsigned char header[32];
+    char name[4096];
+    size_t len = 0;
+    const char *p;
+    int fd;
+
+    for(p = path; *p && len < sizeof(name) - 24; p++) {
+        if(p[0] == '%' && p[1] == 'p') {
+            len += snprintf(name + len, sizeof(name) - len, "%ld", (long) getpid());
+            p++;
+        } else {
+            name[len++] = *p;
+        }
+    }
+    if(*p) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    name[len] = '\0';
+
+    if((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    memcpy(header, TRACE_MAGIC, 8);
+    len = 8;
+    len += put_varint(header + len, TRACE_VERSION);
+    len += put_varint(header + len, time(NULL));
+    if(write_all(fd, header, len) != 0) {
+        close(fd);
+        return -1;
+    }
+    trace_fd = fd;
+    trace_len = 0;
+    trace_error = 0;
+    trace_started_ns = trace_clock();
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// With the lock held. Returns -1 with errno set if anything failed to write.
+static int trace_close(void)
+{
+    int error;
+
+    if(trace_fd < 0)
+        return 0;
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+    trace_flush(trace_buf, trace_len);
+    trace_len = 0;
+    if(close(trace_fd) != 0 && !trace_error)
+        trace_error = errno;
+    trace_fd = -1;
+    if((error = trace_error)) {
+        trace_error = 0;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_atfork_prepare(void)
+{
+    pthread_mutex_lock(&trace_lock);
+}
+
+static void trace_atfork_parent(void)
+{
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// What's buffered is the parent's to write, and so is the file.
+static void trace_atfork_child(void)
+{
+    if(trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        trace_len = 0;
+        __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELAXED);
+        if(strstr(trace_path, "%p"))
+            trace_open(trace_path);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_exit(void)
+{
+    trace_stop();
+}
+
+static void trace_init(void)
+{
+    pthread_atfork(trace_atfork_prepare, trace_atfork_parent, trace_atfork_child);
+    atexit(trace_exit);
+}
+
+// Starts writing a trace to path, ending any trace already going. Returns 0,
+// or -1 with errno set.
+int trace_start(const char *path)
+{
+    char *copy;
+    int ret;
+
+    pthread_once(&trace_once, trace_init);
+    if(!(copy = strdup(path)))
+        return -1;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_close();
+    free(trace_path);
+    trace_path = copy;
+    ret = trace_open(path);
+    pthread_mutex_unlock(&trace_lock);
+    return ret;
+}
+
+// Writes out what's left and closes the file. Returns -1 with errno set if
+// any of the trace failed to write.
+int trace_stop(void)
+{
+    int ret;
+
+    pthread_mutex_lock(&trace_lock);
+    ret = trace_close();
+    pthread_mutex_unlock(&trace_lock);
+    return ret;
+}
+
+static size_t encode_call(unsigned char *out, const struct trace_call *call)
+{
+    size_t len = 0, n;
+    uint32_t i;
+    int64_t v;
+
+    out[len++] = call->op;
+    out[len++] = call->flags;
+    len += put_varint(out + len, call->thread);
+    len += put_varint(out + len, call->start_ns);
+    len += put_varint(out + len, call->latency_ns);
+    len += put_varint(out + len, call->noids);
+    memcpy(out + len, call->oids, 20 * call->noids);
+    len += 20 * call->noids;
+    out[len++] = call->nstrs;
+    for(i = 0; i < call->nstrs; i++) {
+        n = strlen(call->strs[i]);
+        len += put_varint(out + len, n);
+        memcpy(out + len, call->strs[i], n + 1);
+        len += n + 1;
+    }
+    out[len++] = call->nnums;
+    for(i = 0; i < call->nnums; i++) {
+        v = call->nums[i];
+        len += put_varint(out + len, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+    }
+    return len;
+}
+
+// Adds a call to the trace. Its start_ns is from trace_begin(), and its
+// thread is filled in.
+void trace_record(const struct trace_call *call)
+{
+    struct trace_call c = *call;
+    unsigned char *big = NULL;
+    size_t bound, len;
+    uint32_t i;
+
+    if(c.nstrs > TRACE_MAX_STRS || c.nnums > TRACE_MAX_NUMS)
+        return;
+    bound = 2 + 5 * 10 + 20 * (size_t) c.noids + 2 + 10 * c.nnums;
+    for(i = 0; i < c.nstrs; i++)
+        bound += 10 + strlen(c.strs[i]) + 1;
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_fd < 0 || trace_error) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    if(!trace_thread)
+        trace_thread = ++trace_nthreads;
+    c.thread = trace_thread;
+    // a call that began before tracing did counts as starting with it
+    c.start_ns = c.start_ns > trace_started_ns ? c.start_ns - trace_started_ns : 0;
+
+    if(trace_len + bound > TRACE_BUFFER) {
+        trace_flush(trace_buf, trace_len);
+        trace_len = 0;
+    }
+    if(bound <= TRACE_BUFFER) {
+        trace_len += encode_call(trace_buf + trace_len, &c);
+    } else if((big = malloc(bound))) {
+        len = encode_call(big, &c);
+        trace_flush(big, len);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    free(big);
+}
+
+// trace_end()'s slow path: the call took from its start_ns until now.
+void trace_finish(struct trace_call *call, int failed)
+{
+    call->latency_ns = trace_clock() - call->start_ns;
+    call->flags = failed ? TRACE_FAILED : 0;
+    trace_record(call);
+}
+
+// A copy of a call and everything it points to, in one allocation.
+static struct trace_call *trace_call_copy(const struct trace_call *call)
+{
+    struct trace_call *copy;
+    size_t size = sizeof(*copy) + 20 * (size_t) call->noids, n;
+    unsigned char *p;
+    uint32_t i;
+
+    for(i = 0; i < call->nstrs; i++)
+        size += strlen(call->strs[i]) + 1;
+    if(!(copy = malloc(size)))
+        return NULL;
+    *copy = *call;
+    p = (unsigned char *) (copy + 1);
+    memcpy(p, call->oids, 20 * call->noids);
+    copy->oids = (const unsigned char (*)[20]) p;
+    p += 20 * call->noids;
+    for(i = 0; i < call->nstrs; i++) {
+        n = strlen(call->strs[i]) + 1;
+        memcpy(p, call->strs[i], n);
+        copy->strs[i] = (const char *) p;
+        p += n;
+    }
+    return copy;
+}
+
+// For a call that carries on after it returns, like an iterator: a copy of it,
+// with the time taken so far, to add to and trace_record() when it's done;
+// free() it afterwards. NULL if tracing is off (or out of memory).
+struct trace_call *trace_defer(struct trace_call *call)
+{
+    if(!call->start_ns)
+        return NULL;
+    call->latency_ns = trace_clock() - call->start_ns;
+    call->flags = 0;
+    return trace_call_copy(call);
+}
+
+/////////////////////////////////////////////////////////////////////
+// reading a trace back
+/////////////////////////////////////////////////////////////////////
+
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+// Returns 0, or -1 if the data runs out first.
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *n)
+{
+    int shift = 0;
+
+    *n = 0;
+    while(*p < end && shift < 64) {
+        *n |= (uint64_t) (**p & 0x7f) << shift;
+        if(!(*(*p)++ & 0x80))
+            return 0;
+        shift += 7;
+    }
+    return -1;
+}
+
+// Returns 0, 1 if the data runs out partway through, or -1 if it's not a call.
+static int decode_call(const unsigned char **pos, const unsigned char *end, struct trace_call *call)
+{
+    const unsigned char *p = *pos;
+    uint64_t n, v;
+    uint32_t i;
+
+    memset(call, 0, sizeof(*call));
+    if(end - p < 2)
+        return 1;
+    call->op = *p++;
+    call->flags = *p++;
+    if(call->op >= TRACE_NOPS)
+        return -1;
+    if(get_varint(&p, end, &n) != 0)
+        return 1;
+    call->thread = n;
+    if(get_varint(&p, end, &call->start_ns) != 0 || get_varint(&p, end, &call->latency_ns) != 0 ||
+       get_varint(&p, end, &n) != 0)
+        return 1;
+    if(n > (uint64_t) (end - p) / 20)
+        return 1;
+    call->noids = n;
+    call->oids = (const unsigned char (*)[20]) p;
+    p += 20 * n;
+
+    if(p == end)
+        return 1;
+    if((call->nstrs = *p++) > TRACE_MAX_STRS)
+        return -1;
+    for(i = 0; i < call->nstrs; i++) {
+        if(get_varint(&p, end, &n) != 0 || n >= (uint64_t) (end - p))
+            return 1;
+        if(p[n] != '\0')
+            return -1;
+        call->strs[i] = (const char *) p;
+        p += n + 1;
+    }
+
+    if(p == end)
+        return 1;
+    if((call->nnums = *p++) > TRACE_MAX_NUMS)
+        return -1;
+    for(i = 0; i < call->nnums; i++) {
+        if(get_varint(&p, end, &v) != 0)
+            return 1;
+        call->nums[i] = (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+    }
+    *pos = p;
+    return 0;
+}
+
+static int compare_calls(const void *a, const void *b)
+{
+    const struct trace_call *x = a, *y = b;
+
+    if(x->start_ns != y->start_ns)
+        return x->start_ns < y->start_ns ? -1 : 1;
+    return (x->thread > y->thread) - (x->thread < y->thread);
+}
+
+// Reads a whole trace. Returns 0, or -1 with errno set (EINVAL if it isn't
+// a trace); trace_release() it either way.
+int trace_load(const char *path, struct trace *t)
+{
+    const unsigned char *p, *end;
+    struct trace_call *grown;
+    uint32_t alloc = 0;
+    struct stat st;
+    uint64_t n;
+    ssize_t got;
+    size_t len = 0;
+    int fd, ret;
+
+    memset(t, 0, sizeof(*t));
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if(fstat(fd, &st) != 0 || !(t->data = malloc(st.st_size ? st.st_size : 1))) {
+        close(fd);
+        return -1;
+    }
+    while(len < (size_t) st.st_size) {
+        if((got = read(fd, t->data + len, st.st_size - len)) <= 0) {
+            if(got < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        len += got;
+    }
+    close(fd);
+    t->size = len;
+
+    p = t->data;
+    end = p + len;
+    if(len < 8 || memcmp(p, TRACE_MAGIC, 8) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    p += 8;
+    if(get_varint(&p, end, &n) != 0 || n != TRACE_VERSION || get_varint(&p, end, &t->started) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while(p < end) {
+        if(!(grown = grow(t->calls, &alloc, t->ncalls + 1, sizeof(*t->calls))))
+            return -1;
+        t->calls = grown;
+        if((ret = decode_call(&p, end, &t->calls[t->ncalls])) != 0) {
+            if(ret < 0) {
+                errno = EINVAL;
+                return -1;
+            }
+            t->truncated = 1;
+            break;
+        }
+        t->ncalls++;
+    }
+    // calls are written when they end, so a long one comes after shorter ones it began before
+    qsort(t->calls, t->ncalls, sizeof(*t->calls), compare_calls);
+    return 0;
+}
+
+void trace_release(struct trace *t)
+{
+    free(t->calls);
+    free(t->data);
+    t->calls = NULL;
+    t->data = NULL;
+    t->ncalls = 0;
+}
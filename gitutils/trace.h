@@ -0,0 +1,136 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A record of the calls made into the library, for replaying them later with
+// the replay tool. Tracing is off until trace_start(); while it's off a call
+// costs one load of a flag. Build with -DGITREAD_NO_TRACE to compile the
+// hooks out altogether.
+
+#define TRACE_MAGIC "GUTRACE1"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (1 << 16)      // written out when this much has built up
+#define TRACE_MAX_STRS 2
+#define TRACE_MAX_NUMS 8
+
+#define TRACE_FAILED 1              // the call raised an error
+
+// What each call's oids, strs and nums are. Nothing that was only a ref name
+// is kept: it's the sha1 it resolved to, since refs move and a copy of the
+// repository won't have the same ones. For the same reason the ref lookups
+// themselves aren't traced, nor is refreshing the pack list, which depends on
+// the live pack directory; only the calls that read objects are.
+enum trace_op {
+    TRACE_COMMIT = 0,       // sha1
+    TRACE_READ_MANY,        // sha1s; cache_mb
+    TRACE_READ_RANGE,       // sha1; offset, length
+    TRACE_RESOLVE_PATH,     // start; path
+    TRACE_LAST_MODIFIED,    // start; path; budget_ms
+    TRACE_BLAME,            // commit; path; start, end, budget_ms
+    TRACE_LS_TREE,          // start; path; depth, lstree flags, threads
+    TRACE_DIFF,             // old, new (zeros if None); which were given (1 old, 2 new), algorithm,
+                            // context, unified, max_bytes, budget_ms
+    TRACE_IS_ANCESTOR,      // ancestor, descendant
+    TRACE_MERGE_BASES,      // one, others...
+    TRACE_AHEAD_BEHIND,     // one, two
+    TRACE_COUNT_REACHABLE,  // include..., exclude...; how many are include
+    TRACE_WALK,             // include..., exclude...; how many are include, cache_mb, objects taken
+    TRACE_GREP,             // start; path, pattern; grep flags, max_matches, max_bytes, threads, matches taken
+    TRACE_ARCHIVE,          // start; path, prefix; format, level, threads
+    TRACE_NOPS
+};
+
+extern const char *trace_op_names[TRACE_NOPS];
+
+struct trace_call {
+    int op;
+    int flags;
+    uint32_t thread;             // numbered from 1 in the order they first made a call
+    uint64_t start_ns;           // from trace_begin(); in a loaded trace, since tracing started
+    uint64_t latency_ns;
+    const unsigned char (*oids)[20];
+    uint32_t noids;
+    const char *strs[TRACE_MAX_STRS];
+    uint32_t nstrs;
+    int64_t nums[TRACE_MAX_NUMS];
+    uint32_t nnums;
+};
+
+// A whole trace read back, sorted by start time. The calls' oids and strs
+// point into data.
+struct trace {
+    struct trace_call *calls;
+    uint32_t ncalls;
+    int truncated;               // it ends partway through a call, as when the process died
+    uint64_t started;            // the wall clock time tracing started, in seconds
+    unsigned char *data;
+    size_t size;
+};
+
+int trace_start(const char *path);
+int trace_stop(void);
+uint64_t trace_clock(void);
+void trace_record(const struct trace_call *call);
+void trace_finish(struct trace_call *call, int failed);
+struct trace_call *trace_defer(struct trace_call *call);
+
+int trace_load(const char *path, struct trace *t);
+void trace_release(struct trace *t);
+
+// Sets what a call was asked for; either string may be NULL. Numbers are
+// added after with trace_num().
+static inline void trace_args(struct trace_call *call, const void *oids, uint32_t noids, const char *s0,
+                              const char *s1)
+{
+    call->oids = (const unsigned char (*)[20]) oids;
+    call->noids = noids;
+    call->strs[0] = s0;
+    call->strs[1] = s1;
+    call->nstrs = s1 ? 2 : s0 ? 1 : 0;
+    call->nnums = 0;
+}
+
+static inline void trace_num(struct trace_call *call, int64_t n)
+{
+    if(call->nnums < TRACE_MAX_NUMS)
+        call->nums[call->nnums++] = n;
+}
+
+#ifndef GITREAD_NO_TRACE
+
+extern int trace_enabled;
+
+// Starts timing a call. start_ns stays 0 if tracing is off, and then
+// trace_end() does nothing.
+static inline void trace_begin(struct trace_call *call, int op)
+{
+    call->op = op;
+    call->start_ns = __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED) ? trace_clock() : 0;
+}
+
+static inline void trace_end(struct trace_call *call, int failed)
+{
+    if(call->start_ns)
+        trace_finish(call, failed);
+}
+
+#else
+
+static inline void trace_begin(struct trace_call *call, int op)
+{
+    call->op = op;
+    call->start_ns = 0;
+}
+
+static inline void trace_end(struct trace_call *call, int failed)
+{
+    (void) call;
+    (void) failed;
+}
+
+#endif
+
+
+#endif
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "odb.h"
+#include "commit.h"
+#include "tree.h"
+
+struct tree_resolver *tree_resolver_new(uint32_t nslots)
+{
+    struct tree_resolver *r;
+    uint32_t n = 1;
+
+    while(n < nslots && n < (1U << 30))
+        n <<= 1;
+    if(!(r = calloc(1, sizeof(struct tree_resolver))))
+        return NULL;
+    if(!(r->slots = calloc(n, sizeof(struct tree_memo_entry)))) {
+        free(r);
+        return NULL;
+    }
+    if(pthread_mutex_init(&r->lock, NULL) != 0) {
+        free(r->slots);
+        free(r);
+        return NULL;
+    }
+    r->nslots = n;
+    return r;
+}
+
+void tree_resolver_free(struct tree_resolver *r)
+{
+    uint32_t i;
+
+    if(!r)
+        return;
+    for(i = 0; i < r->nslots; i++)
+        free(r->slots[i].name);
+    pthread_mutex_destroy(&r->lock);
+    free(r->slots);
+    free(r);
+}
+
+static uint32_t memo_hash(const unsigned char *tree, const char *name, size_t name_len)
+{
+    uint32_t h;
+    size_t i;
+
+    // the id is already random; FNV-1a folds the name in
+    memcpy(&h, tree, sizeof(h));
+    h ^= 2166136261U;
+    for(i = 0; i < name_len; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619U;
+    return h;
+}
+
+static int memo_get(struct tree_resolver *r, const unsigned char *tree, const char *name, size_t name_len,
+                    unsigned int *mode, unsigned char *sha1)
+{
+    struct tree_memo_entry *e = &r->slots[memo_hash(tree, name, name_len) & (r->nslots - 1)];
+    int ret = -1;
+
+    pthread_mutex_lock(&r->lock);
+    if(e->name && e->name_len == name_len && memcmp(e->tree, tree, 20) == 0 &&
+       memcmp(e->name, name, name_len) == 0) {
+        *mode = e->mode;
+        memcpy(sha1, e->sha1, 20);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+static void memo_put(struct tree_resolver *r, const unsigned char *tree, const char *name, size_t name_len,
+                     unsigned int mode, const unsigned char *sha1)
+{
+    struct tree_memo_entry *e = &r->slots[memo_hash(tree, name, name_len) & (r->nslots - 1)];
+    char *copy;
+
+    // copied before taking the lock; on failure the lookup just isn't remembered
+    if(!(copy = malloc(name_len + 1)))
+        return;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+
+    pthread_mutex_lock(&r->lock);
+    free(e->name);
+    memcpy(e->tree, tree, 20);
+    e->name = copy;
+    e->name_len = name_len;
+    e->mode = mode;
+    memcpy(e->sha1, sha1, 20);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Looks name up in a raw tree. Entries are sorted, with trees ordered as if
+// their names ended in '/', so the scan can stop at the first entry that
+// differs from name before either runs out: everything after it sorts later
+// too. This is how git's find_tree_entry() does it. Returns 0 if it's there,
+// 1 if it isn't, and -1 if the tree is malformed.
+int tree_find_entry(const unsigned char *data, unsigned long size, const char *name, size_t name_len,
+                    unsigned int *mode, unsigned char *sha1)
+{
+    unsigned long pos = 0;
+    unsigned int m;
+    const char *entry;
+    size_t entry_len;
+    const unsigned char *entry_sha1;
+    int cmp;
+
+    while(pos < size) {
+        if(tree_next_entry(data, size, &pos, &m, &entry, &entry_len, &entry_sha1) != 0)
+            return -1;
+        cmp = memcmp(entry, name, entry_len < name_len ? entry_len : name_len);
+        if(cmp > 0)
+            return 1;
+        if(cmp == 0 && entry_len == name_len) {
+            *mode = m;
+            memcpy(sha1, entry_sha1, 20);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Finds the root tree of a commit, a tree (itself) or a tag pointing at
+// either. Returns 1 if start is some other kind of object.
+static int root_tree(struct tree_resolver *r, const struct odb *odb, const unsigned char *start,
+                     unsigned char *tree)
+{
+    struct git_object g_obj;
+    struct commit commit;
+    const unsigned char *p;
+    unsigned char sha1[20];
+    unsigned int mode;
+    int depth, ret = 1;
+
+    if(memo_get(r, start, "", 0, &mode, tree) == 0)
+        return mode ? 0 : 1;
+
+    memcpy(sha1, start, 20);
+    for(depth = 0; depth < TREE_MAX_TAG_DEPTH; depth++) {
+        if(odb_read(odb, sha1, &g_obj, NULL) != 0)
+            return -1;
+        if(g_obj.type == TAG) {
+            p = g_obj.mem_data;
+            ret = parse_header_sha1(&p, g_obj.mem_data + g_obj.size, "object", sha1);
+            free(g_obj.mem_data);
+            if(ret != 0)
+                return -1;
+            continue;
+        }
+
+        if(g_obj.type == TREE) {
+            memcpy(tree, sha1, 20);
+            ret = 0;
+        } else if(g_obj.type == COMMIT) {
+            if(commit_parse(g_obj.mem_data, g_obj.size, &commit) != 0) {
+                free(g_obj.mem_data);
+                return -1;
+            }
+            memcpy(tree, commit.tree, 20);
+            ret = 0;
+        } else {
+            memset(tree, 0, 20);
+            ret = 1;
+        }
+        free(g_obj.mem_data);
+        memo_put(r, start, "", 0, ret == 0 ? S_IFTREE : 0, tree);
+        return ret;
+    }
+    return -1;
+}
+
+// Like tree_resolve_path(), for a start that's known to be a tree. cache, if
+// given, is a private base cache for reading the trees along the way.
+int tree_lookup_path(struct tree_resolver *r, const struct odb *odb, const unsigned char *root,
+                     const char *path, struct base_cache *cache, unsigned int *mode, unsigned char *sha1)
+{
+    struct git_object g_obj;
+    unsigned char tree[20], next[20];
+    unsigned int m = S_IFTREE, next_mode;
+    size_t len;
+    int ret;
+
+    memcpy(tree, root, 20);
+    while(*path) {
+        if(*path == '/') {
+            path++;
+            continue;
+        }
+        for(len = 0; path[len] && path[len] != '/'; len++)
+            ;
+        if(m != S_IFTREE)
+            return 1; // a file (or submodule) with more path after it
+
+        if(memo_get(r, tree, path, len, &next_mode, next) != 0) {
+            if(odb_read(odb, tree, &g_obj, cache) != 0)
+                return -1;
+            if(g_obj.type != TREE) {
+                free(g_obj.mem_data);
+                return -1;
+            }
+            ret = tree_find_entry(g_obj.mem_data, g_obj.size, path, len, &next_mode, next);
+            free(g_obj.mem_data);
+            if(ret < 0)
+                return -1;
+            if(ret > 0) {
+                next_mode = 0;
+                memset(next, 0, 20);
+            }
+            memo_put(r, tree, path, len, next_mode, next);
+        }
+        if(!next_mode)
+            return 1;
+
+        m = next_mode;
+        memcpy(tree, next, 20);
+        path += len;
+    }
+
+    *mode = m;
+    memcpy(sha1, tree, 20);
+    return 0;
+}
+
+// Resolves path ("a/b/c"; empty components are ignored) within start, a
+// commit, tree or tag, like "git rev-parse start:path". An empty path is the
+// root tree. Each step is first looked for among the ones remembered, so only
+// trees not seen before are read. Returns 0 with the entry's mode and id, 1 if
+// there's no such path, and -1 if an object along the way is missing or
+// malformed.
+int tree_resolve_path(struct tree_resolver *r, const struct odb *odb, const unsigned char *start,
+                      const char *path, unsigned int *mode, unsigned char *sha1)
+{
+    unsigned char tree[20];
+    int ret;
+
+    if((ret = root_tree(r, odb, start, tree)) != 0)
+        return ret;
+    return tree_lookup_path(r, odb, tree, path, NULL, mode, sha1);
+}
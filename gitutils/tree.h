@@ -0,0 +1,45 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct odb;
+struct base_cache;
+
+#define TREE_MEMO_DEFAULT 65536
+#define TREE_MAX_TAG_DEPTH 32 // tags of tags of ...; anything deeper is a loop
+
+// One remembered step of a path lookup: name in tree is (mode, sha1), or
+// isn't there at all (mode 0). A commit or tag with an empty name maps to its
+// root tree.
+struct tree_memo_entry {
+    unsigned char tree[20];
+    char *name;          // NULL for an empty slot
+    size_t name_len;
+    unsigned int mode;
+    unsigned char sha1[20];
+};
+
+// Resolves paths within commits and trees, remembering what it has looked up
+// in a fixed number of slots; a new lookup simply replaces whatever was in
+// its slot. Everything remembered is keyed by object id, so it stays right
+// whichever snapshot of the packs later lookups use. Thread safe.
+struct tree_resolver {
+    struct tree_memo_entry *slots;
+    uint32_t nslots;     // a power of two
+    pthread_mutex_t lock;
+};
+
+struct tree_resolver *tree_resolver_new(uint32_t nslots);
+void tree_resolver_free(struct tree_resolver *r);
+int tree_find_entry(const unsigned char *data, unsigned long size, const char *name, size_t name_len,
+                    unsigned int *mode, unsigned char *sha1);
+int tree_lookup_path(struct tree_resolver *r, const struct odb *odb, const unsigned char *root,
+                     const char *path, struct base_cache *cache, unsigned int *mode, unsigned char *sha1);
+int tree_resolve_path(struct tree_resolver *r, const struct odb *odb, const unsigned char *start,
+                      const char *path, unsigned int *mode, unsigned char *sha1);
+
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "sha1.h"
+#include "stats.h"
+#include "verify.h"
+
+// Pack verification, the moral equivalent of "git verify-pack".
+//
+// The trailing checksums have to be computed front to back, so one thread does
+// nothing but that. The objects themselves are sorted by offset and cut into
+// contiguous byte ranges, one per worker. Deltas point backwards (OFS_DELTA
+// always does, and git writes REF_DELTA bases first too), so a worker walking
+// its range in order meets each base before its deltas; with a per-worker base
+// cache every base is inflated once per range instead of once per delta.
+
+struct verify_job {
+    const struct pack *pack;
+    const struct idx *idx;
+    const struct pack_order_entry *entries;
+    uint32_t first;
+    uint32_t last;   // exclusive
+    size_t cache_bytes;
+    struct verify_result *result;
+    pthread_mutex_t *lock;
+};
+
+static void report_bad(struct verify_job *job, const unsigned char *sha1, uint32_t *counter)
+{
+    pthread_mutex_lock(job->lock);
+    (*counter)++;
+    if(job->result->nbad < VERIFY_MAX_BAD)
+        memcpy(job->result->bad[job->result->nbad++], sha1, 20);
+    pthread_mutex_unlock(job->lock);
+}
+
+static void *verify_range(void *data)
+{
+    struct verify_job *job = data;
+    const struct pack_order_entry *entry;
+    struct base_cache *cache;
+    struct git_object g_obj;
+    unsigned char sha1[20];
+    const unsigned char *expected;
+    uint32_t i, crc, checked = 0;
+
+    cache = base_cache_new(job->cache_bytes);
+
+    for(i = job->first; i < job->last; i++) {
+        entry = &job->entries[i];
+        expected = idx_sha1(job->idx, entry->pos);
+
+        // the CRC covers the raw entry, header included, so it catches damage
+        // even in entries we never need to inflate twice
+        if(idx_crc32(job->idx, entry->pos, &crc) == 0) {
+            uLong actual = crc32(0L, Z_NULL, 0);
+            uint64_t offset = entry->offset;
+            while(offset < entry->end) {
+                uInt n = (entry->end - offset > 0x40000000) ? 0x40000000 : entry->end - offset;
+                actual = crc32(actual, job->pack->data + offset, n);
+                offset += n;
+            }
+            if(actual != crc)
+                report_bad(job, expected, &job->result->crc_errors);
+        }
+
+        if(pack_read_object(job->pack, job->idx, entry->offset, &g_obj, cache, entry->is_base) != 0) {
+            report_bad(job, expected, &job->result->read_errors);
+            continue;
+        }
+        if(hash_git_object(g_obj.type, g_obj.mem_data, g_obj.size, sha1) != 0 || memcmp(sha1, expected, 20) != 0)
+            report_bad(job, expected, &job->result->hash_errors);
+        free(g_obj.mem_data);
+        checked++;
+    }
+
+    base_cache_free(cache);
+
+    pthread_mutex_lock(job->lock);
+    job->result->checked += checked;
+    pthread_mutex_unlock(job->lock);
+    return NULL;
+}
+
+struct checksum_job {
+    const struct pack *pack;
+    const struct idx *idx;
+    struct verify_result *result;
+};
+
+static void *verify_checksums(void *data)
+{
+    struct checksum_job *job = data;
+    unsigned char sha1[20];
+    const unsigned char *pack_trailer = job->pack->data + job->pack->size - 20;
+
+    sha1_buffer(job->idx->data, job->idx->size - 20, sha1);
+    job->result->idx_checksum_ok = memcmp(sha1, job->idx->data + job->idx->size - 20, 20) == 0;
+    job->result->idx_matches_pack = memcmp(idx_pack_checksum(job->idx), pack_trailer, 20) == 0;
+
+    sha1_buffer(job->pack->data, job->pack->size - 20, sha1);
+    job->result->pack_checksum_ok = memcmp(sha1, pack_trailer, 20) == 0;
+    return NULL;
+}
+
+// Checks everything we can about a pack and its idx, using up to threads
+// workers (0 means one per CPU) with cache_bytes of delta bases each.
+// Returns -1 only if the files can't be loaded at all; problems with their
+// contents are reported in result (see verify_ok()).
+int verify_pack(char *pack_location, char *idx_location, int threads, size_t cache_bytes,
+                struct verify_result *result)
+{
+    struct pack *pack;
+    struct idx *idx;
+    struct pack_order_entry *entries;
+    struct verify_job *jobs;
+    struct checksum_job checksum_job;
+    pthread_t checksum_thread, *workers;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t start = stats_now_ns(), per_thread, boundary;
+    uint32_t i;
+    int t, started;
+
+    memset(result, 0, sizeof(struct verify_result));
+
+    if(!(pack = load_pack(pack_location)))
+        return -1;
+    if(!(idx = load_idx(idx_location))) {
+        unload_pack(pack);
+        return -1;
+    }
+    result->objects = idx->entries;
+    result->has_crc = (idx->version == 2);
+
+    if(threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads <= 0)
+        threads = 1;
+    if((uint32_t) threads > idx->entries)
+        threads = idx->entries ? idx->entries : 1;
+    result->threads = threads;
+
+    jobs = malloc(sizeof(struct verify_job) * threads);
+    workers = malloc(sizeof(pthread_t) * threads);
+    if(!jobs || !workers) {
+        free(jobs);
+        free(workers);
+        unload_idx(idx);
+        unload_pack(pack);
+        return -1;
+    }
+
+    // the checksums don't depend on anything else, so start them right away
+    checksum_job.pack = pack;
+    checksum_job.idx = idx;
+    checksum_job.result = result;
+    started = pthread_create(&checksum_thread, NULL, verify_checksums, &checksum_job) == 0;
+    if(!started)
+        verify_checksums(&checksum_job);
+
+    if(pack->entries != idx->entries)
+        result->read_errors++; // they can't both be right
+
+    // this also marks the delta bases, so only they take up cache space
+    if(!(entries = pack_order(pack, idx))) {
+        result->read_errors++;
+        threads = 0; // out of memory; report nothing checked
+    }
+
+    // split by bytes rather than by count; big blobs cluster at the end of packs
+    per_thread = (entries && idx->entries) ? (pack->size - 20 - entries[0].offset) / threads + 1 : 0;
+    for(t = 0, i = 0; t < threads; t++) {
+        jobs[t].pack = pack;
+        jobs[t].idx = idx;
+        jobs[t].entries = entries;
+        jobs[t].cache_bytes = cache_bytes;
+        jobs[t].result = result;
+        jobs[t].lock = &lock;
+        jobs[t].first = i;
+        boundary = idx->entries ? entries[0].offset + per_thread * (t + 1) : 0;
+        while(i < idx->entries && (entries[i].offset < boundary || t == threads - 1))
+            i++;
+        jobs[t].last = i;
+    }
+
+    for(t = 0; t < threads; t++) {
+        if(pthread_create(&workers[t], NULL, verify_range, &jobs[t]) != 0) {
+            verify_range(&jobs[t]);
+            workers[t] = pthread_self();
+        }
+    }
+    for(t = 0; t < threads; t++) {
+        if(!pthread_equal(workers[t], pthread_self()))
+            pthread_join(workers[t], NULL);
+    }
+    if(started)
+        pthread_join(checksum_thread, NULL);
+
+    result->seconds = (stats_now_ns() - start) / 1e9;
+
+    free(entries);
+    free(jobs);
+    free(workers);
+    unload_idx(idx);
+    unload_pack(pack);
+    return 0;
+}
+
+int verify_ok(const struct verify_result *result)
+{
+    return result->pack_checksum_ok && result->idx_checksum_ok && result->idx_matches_pack &&
+           result->checked == result->objects && !result->crc_errors && !result->hash_errors &&
+           !result->read_errors;
+}
@@ -0,0 +1,27 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#define VERIFY_MAX_BAD 100
+
+struct verify_result {
+    uint32_t objects;
+    uint32_t checked;
+    int pack_checksum_ok;   // the pack's trailing sha1 matches its contents
+    int idx_checksum_ok;    // likewise for the idx
+    int idx_matches_pack;   // the idx was written for this pack
+    int has_crc;            // only version 2 idx files carry CRC32s
+    uint32_t crc_errors;
+    uint32_t hash_errors;   // objects whose content doesn't hash to their id
+    uint32_t read_errors;   // objects that couldn't be read at all
+    uint32_t nbad;
+    unsigned char bad[VERIFY_MAX_BAD][20]; // the first nbad bad object ids
+    int threads;
+    double seconds;
+};
+
+int verify_pack(char *pack_location, char *idx_location, int threads, size_t cache_bytes,
+                struct verify_result *result);
+int verify_ok(const struct verify_result *result);
+
+
+#endif
@@ -0,0 +1,704 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "libgitread.h"
+#include "basecache.h"
+#include "odb.h"
+#include "oidmap.h"
+#include "walk.h"
+#include "commit.h"
+
+// The reachable-object walk behind "rev-list --objects".
+//
+// First the commits: a date-ordered queue is walked back from the tips,
+// excluded (uninteresting) commits passing their flag on to their parents,
+// until nothing interesting is left in the queue. Then the trees of the
+// uninteresting commits right at the edge are marked as seen, and finally the
+// trees of the interesting commits are walked, skipping anything already
+// seen. Blobs are never read at all.
+//
+// "Seen" is one bit per idx position for packed objects, plus a hash set for
+// the few loose ones, so marking a whole repository costs a few bits per
+// object rather than a hash table entry.
+
+#define WALK_UNINTERESTING 1
+#define WALK_IN_QUEUE      2
+#define WALK_PARSED        4 // its parents have been loaded
+#define WALK_EDGE          8 // its tree has been marked as seen
+
+#define WALK_SLOP 5 // keep going this long after the queue looks all uninteresting; clocks skew
+
+struct walk_commit {
+    unsigned char sha1[20];
+    unsigned char tree[20];
+    uint64_t date;
+    uint32_t parents;   // index of the first parent in walk->parent_ids
+    uint32_t nparents;
+    int flags;
+};
+
+struct walk_root {
+    unsigned char sha1[20];
+    unsigned int type;
+};
+
+struct walk_frame {
+    unsigned char sha1[20]; // the tree being listed
+    unsigned char *data;
+    unsigned long size;
+    unsigned long pos;
+    size_t path_len;        // length of the tree's own path
+};
+
+enum walk_phase {
+    WALK_COMMITS,
+    WALK_TREES,
+    WALK_DONE
+};
+
+struct walk {
+    struct odb *odb;
+    struct base_cache *cache;
+
+    uint8_t **pack_seen;
+    struct oid_map loose_seen;
+
+    struct oid_map commit_map;   // id -> index in commits
+    struct walk_commit *commits;
+    uint32_t ncommits, commits_alloc;
+    unsigned char (*parent_ids)[20];
+    uint32_t nparent_ids, parent_ids_alloc;
+
+    uint32_t *queue;             // a max-heap on date
+    uint32_t nqueue, queue_alloc, queue_interesting;
+
+    uint32_t *order;             // the interesting commits, newest first
+    uint32_t norder, order_alloc;
+    struct walk_root *roots;     // tips that aren't commits
+    uint32_t nroots, roots_alloc;
+
+    enum walk_phase phase;
+    uint32_t next_commit;
+    uint32_t next_root;
+    uint32_t next_tree;
+    struct walk_frame *stack;
+    uint32_t depth, stack_alloc;
+    char *path;
+    size_t path_alloc;
+};
+
+// Makes room for needed items, doubling as it goes. Returns the (possibly
+// moved) array, or NULL if out of memory, in which case array is untouched.
+static void *grow(void *array, uint32_t *alloc, uint32_t needed, size_t item_size)
+{
+    uint32_t n = *alloc ? *alloc : 16;
+
+    if(needed <= *alloc)
+        return array;
+    while(n < needed)
+        n *= 2;
+    if(!(array = realloc(array, n * item_size)))
+        return NULL;
+    *alloc = n;
+    return array;
+}
+
+/////////////////////////////////////////////////////////////////////
+// seen                                                            //
+/////////////////////////////////////////////////////////////////////
+
+// Marks an object as seen. Returns 1 if it already was, 0 if it is newly
+// marked and -1 if it doesn't exist.
+static int mark_seen(struct walk *w, const unsigned char *sha1, struct odb_location *loc)
+{
+    uint8_t *bits, bit;
+
+    if(odb_find(w->odb, sha1, loc) != 0)
+        return -1;
+
+    if(loc->pack < 0) {
+        if(oid_map_get(&w->loose_seen, sha1, NULL) == 0)
+            return 1;
+        return (oid_map_put(&w->loose_seen, sha1, 0) == 0) ? 0 : -1;
+    }
+
+    bits = w->pack_seen[loc->pack];
+    bit = 1 << (loc->pos & 7);
+    if(bits[loc->pos >> 3] & bit)
+        return 1;
+    bits[loc->pos >> 3] |= bit;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// parsing                                                         //
+/////////////////////////////////////////////////////////////////////
+
+// Pulls the tree, parents and committer date out of a commit.
+static int parse_commit(struct walk *w, struct walk_commit *commit, const unsigned char *data, unsigned long size)
+{
+    struct commit parsed;
+    unsigned int i;
+    void *grown;
+
+    if(commit_parse(data, size, &parsed) != 0)
+        return -1;
+    memcpy(commit->tree, parsed.tree, 20);
+    commit->date = parsed.committer.time > 0 ? parsed.committer.time : 0;
+
+    if(!(grown = grow(w->parent_ids, &w->parent_ids_alloc, w->nparent_ids + parsed.nparents, 20)))
+        return -1;
+    w->parent_ids = grown;
+    commit->parents = w->nparent_ids;
+    commit->nparents = parsed.nparents;
+    for(i = 0; i < parsed.nparents; i++)
+        commit_parent(&parsed, i, w->parent_ids[w->nparent_ids++]);
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// commits                                                         //
+/////////////////////////////////////////////////////////////////////
+
+static inline int queue_before(const struct walk *w, uint32_t a, uint32_t b)
+{
+    return w->commits[a].date > w->commits[b].date;
+}
+
+static int queue_push(struct walk *w, uint32_t c)
+{
+    uint32_t i, parent, tmp;
+    void *grown;
+
+    if(!(grown = grow(w->queue, &w->queue_alloc, w->nqueue + 1, sizeof(uint32_t))))
+        return -1;
+    w->queue = grown;
+    i = w->nqueue++;
+    w->queue[i] = c;
+    while(i > 0) {
+        parent = (i - 1) / 2;
+        if(!queue_before(w, w->queue[i], w->queue[parent]))
+            break;
+        tmp = w->queue[i];
+        w->queue[i] = w->queue[parent];
+        w->queue[parent] = tmp;
+        i = parent;
+    }
+
+    w->commits[c].flags |= WALK_IN_QUEUE;
+    if(!(w->commits[c].flags & WALK_UNINTERESTING))
+        w->queue_interesting++;
+    return 0;
+}
+
+static uint32_t queue_pop(struct walk *w)
+{
+    uint32_t top = w->queue[0], i = 0, child, tmp;
+
+    w->queue[0] = w->queue[--w->nqueue];
+    for(;;) {
+        child = 2 * i + 1;
+        if(child >= w->nqueue)
+            break;
+        if(child + 1 < w->nqueue && queue_before(w, w->queue[child + 1], w->queue[child]))
+            child++;
+        if(!queue_before(w, w->queue[child], w->queue[i]))
+            break;
+        tmp = w->queue[i];
+        w->queue[i] = w->queue[child];
+        w->queue[child] = tmp;
+        i = child;
+    }
+
+    w->commits[top].flags &= ~WALK_IN_QUEUE;
+    if(!(w->commits[top].flags & WALK_UNINTERESTING))
+        w->queue_interesting--;
+    return top;
+}
+
+// Returns the index of a commit, reading it in if we haven't yet; -1 if it
+// can't be read. data may hold the commit if the caller already read it.
+static int64_t load_commit(struct walk *w, const unsigned char *id, const unsigned char *data, unsigned long size)
+{
+    struct git_object g_obj;
+    struct walk_commit *commit;
+    unsigned char sha1[20];
+    uint32_t c;
+    void *grown;
+    int ret;
+
+    if(oid_map_get(&w->commit_map, id, &c) == 0)
+        return c;
+    memcpy(sha1, id, 20); // id may point into parent_ids, which parsing can move
+
+    g_obj.mem_data = NULL;
+    if(!data) {
+        if(odb_read(w->odb, sha1, &g_obj, w->cache) != 0 || g_obj.type != COMMIT) {
+            free(g_obj.mem_data);
+            return -1;
+        }
+        data = g_obj.mem_data;
+        size = g_obj.size;
+    }
+
+    if(!(grown = grow(w->commits, &w->commits_alloc, w->ncommits + 1, sizeof(struct walk_commit)))) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+    w->commits = grown;
+    c = w->ncommits;
+    commit = &w->commits[c];
+    memcpy(commit->sha1, sha1, 20);
+    commit->flags = 0;
+    ret = parse_commit(w, commit, data, size);
+    free(g_obj.mem_data);
+    if(ret != 0 || oid_map_put(&w->commit_map, sha1, c) != 0)
+        return -1;
+    w->ncommits++;
+    return c;
+}
+
+// Marks a commit and everything we've loaded behind it as uninteresting.
+static int mark_uninteresting(struct walk *w, uint32_t c)
+{
+    uint32_t *stack = NULL, depth = 0, alloc = 0, i, p;
+    struct walk_commit *commit;
+    void *grown;
+
+    if(w->commits[c].flags & WALK_UNINTERESTING)
+        return 0;
+    if(!(grown = grow(stack, &alloc, 1, sizeof(uint32_t))))
+        return -1;
+    stack = grown;
+    stack[depth++] = c;
+
+    while(depth > 0) {
+        commit = &w->commits[stack[--depth]];
+        if(commit->flags & WALK_UNINTERESTING)
+            continue;
+        commit->flags |= WALK_UNINTERESTING;
+        if(commit->flags & WALK_IN_QUEUE)
+            w->queue_interesting--;
+        if(!(commit->flags & WALK_PARSED))
+            continue;
+
+        for(i = 0; i < commit->nparents; i++) {
+            if(oid_map_get(&w->commit_map, w->parent_ids[commit->parents + i], &p) != 0)
+                continue;
+            if(w->commits[p].flags & WALK_UNINTERESTING)
+                continue;
+            if(!(grown = grow(stack, &alloc, depth + 1, sizeof(uint32_t)))) {
+                free(stack);
+                return -1;
+            }
+            stack = grown;
+            stack[depth++] = p;
+        }
+    }
+
+    free(stack);
+    return 0;
+}
+
+// Walks the commits back from the tips until only uninteresting ones remain,
+// collecting the interesting ones in w->order.
+static int limit_commits(struct walk *w)
+{
+    struct walk_commit *commit;
+    uint32_t c, i, kept;
+    int64_t p;
+    int slop = WALK_SLOP, uninteresting;
+    void *grown;
+
+    while(w->nqueue > 0) {
+        c = queue_pop(w);
+        uninteresting = w->commits[c].flags & WALK_UNINTERESTING;
+
+        for(i = 0; i < w->commits[c].nparents; i++) {
+            // commits can be reallocated while loading, so look them up each time
+            p = load_commit(w, w->parent_ids[w->commits[c].parents + i], NULL, 0);
+            if(p < 0)
+                continue; // a missing parent (a shallow clone, say) ends the history there
+            if(!(w->commits[p].flags & (WALK_IN_QUEUE | WALK_PARSED))) {
+                if(uninteresting)
+                    w->commits[p].flags |= WALK_UNINTERESTING;
+                if(queue_push(w, p) != 0)
+                    return -1;
+            } else if(uninteresting && mark_uninteresting(w, p) != 0) {
+                return -1;
+            }
+        }
+        w->commits[c].flags |= WALK_PARSED;
+
+        if(!uninteresting) {
+            if(!(grown = grow(w->order, &w->order_alloc, w->norder + 1, sizeof(uint32_t))))
+                return -1;
+            w->order = grown;
+            w->order[w->norder++] = c;
+        }
+
+        if(w->queue_interesting == 0) {
+            if(--slop == 0)
+                break;
+        } else {
+            slop = WALK_SLOP;
+        }
+    }
+
+    // something popped early may have turned out to be reachable from an exclude
+    for(i = 0, kept = 0; i < w->norder; i++) {
+        commit = &w->commits[w->order[i]];
+        if(!(commit->flags & WALK_UNINTERESTING))
+            w->order[kept++] = w->order[i];
+    }
+    w->norder = kept;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// trees                                                           //
+/////////////////////////////////////////////////////////////////////
+
+// Marks a tree and everything in it as seen, without reporting any of it.
+// Whatever is missing is simply left unmarked.
+static void mark_tree_seen(struct walk *w, const unsigned char *tree_sha1)
+{
+    struct odb_location loc;
+    struct git_object g_obj;
+    unsigned long pos = 0;
+    unsigned int mode;
+    const char *name;
+    size_t name_len;
+    const unsigned char *sha1;
+
+    if(mark_seen(w, tree_sha1, &loc) != 0)
+        return;
+    if(odb_read_at(w->odb, tree_sha1, &loc, &g_obj, w->cache) != 0)
+        return;
+    if(g_obj.type == TREE) {
+        while(tree_next_entry(g_obj.mem_data, g_obj.size, &pos, &mode, &name, &name_len, &sha1) == 0) {
+            if((mode & 0170000) == S_IFGITLINK)
+                continue;
+            if((mode & 0170000) == S_IFTREE)
+                mark_tree_seen(w, sha1);
+            else
+                mark_seen(w, sha1, &loc);
+        }
+    }
+    free(g_obj.mem_data);
+}
+
+// Reads the object behind a tip, peeling tags. Uninteresting tips get marked;
+// interesting ones are queued (commits) or remembered as roots.
+static int add_tip(struct walk *w, const unsigned char *tip, int uninteresting)
+{
+    struct git_object g_obj;
+    struct odb_location loc;
+    unsigned char sha1[20];
+    const unsigned char *p;
+    void *grown;
+    int64_t c;
+
+    memcpy(sha1, tip, 20);
+    for(;;) {
+        if(odb_read(w->odb, sha1, &g_obj, w->cache) != 0)
+            return -1;
+
+        if(g_obj.type == COMMIT) {
+            c = load_commit(w, sha1, g_obj.mem_data, g_obj.size);
+            free(g_obj.mem_data);
+            if(c < 0)
+                return -1;
+            // excluded tips are queued as well, so their flag spreads to their history
+            if(uninteresting && mark_uninteresting(w, c) != 0)
+                return -1;
+            if(w->commits[c].flags & WALK_IN_QUEUE)
+                return 0;
+            return queue_push(w, c);
+        }
+
+        if(uninteresting && g_obj.type == TREE) {
+            free(g_obj.mem_data);
+            mark_tree_seen(w, sha1);
+            return 0;
+        }
+        if(uninteresting) {
+            mark_seen(w, sha1, &loc);
+        } else {
+            if(!(grown = grow(w->roots, &w->roots_alloc, w->nroots + 1, sizeof(struct walk_root)))) {
+                free(g_obj.mem_data);
+                return -1;
+            }
+            w->roots = grown;
+            memcpy(w->roots[w->nroots].sha1, sha1, 20);
+            w->roots[w->nroots++].type = g_obj.type;
+        }
+
+        if(g_obj.type != TAG) {
+            free(g_obj.mem_data);
+            return 0;
+        }
+
+        // follow the tag to what it points at
+        p = g_obj.mem_data;
+        if(parse_header_sha1(&p, g_obj.mem_data + g_obj.size, "object", sha1) != 0) {
+            free(g_obj.mem_data);
+            return -1;
+        }
+        free(g_obj.mem_data);
+    }
+}
+
+static int set_path(struct walk *w, size_t prefix_len, const char *name, size_t name_len)
+{
+    size_t len = prefix_len + (prefix_len ? 1 : 0) + name_len;
+    char *grown;
+
+    if(len + 1 > w->path_alloc) {
+        if(!(grown = realloc(w->path, len + 64)))
+            return -1;
+        w->path = grown;
+        w->path_alloc = len + 64;
+    }
+    if(prefix_len)
+        w->path[prefix_len++] = '/';
+    memcpy(w->path + prefix_len, name, name_len);
+    w->path[len] = '\0';
+    return 0;
+}
+
+// Reads a tree and pushes it, so its entries come next.
+static int push_tree(struct walk *w, const unsigned char *sha1, const struct odb_location *loc, size_t path_len)
+{
+    struct git_object g_obj;
+    struct walk_frame *frame;
+    void *grown;
+
+    if(!(grown = grow(w->stack, &w->stack_alloc, w->depth + 1, sizeof(struct walk_frame))))
+        return -1;
+    w->stack = grown;
+    if(odb_read_at(w->odb, sha1, loc, &g_obj, w->cache) != 0)
+        return -1;
+    if(g_obj.type != TREE) {
+        free(g_obj.mem_data);
+        return -1;
+    }
+
+    frame = &w->stack[w->depth++];
+    memcpy(frame->sha1, sha1, 20);
+    frame->data = g_obj.mem_data;
+    frame->size = g_obj.size;
+    frame->pos = 0;
+    frame->path_len = path_len;
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+// the walk                                                        //
+/////////////////////////////////////////////////////////////////////
+
+// Sets up a walk of everything reachable from include but not from exclude.
+// The commit part of the walk happens here; trees are read as walk_next()
+// gets to them. Returns NULL if a tip can't be read.
+struct walk *walk_new(struct odb *odb, const unsigned char (*include)[20], int ninclude,
+                      const unsigned char (*exclude)[20], int nexclude, size_t cache_bytes)
+{
+    struct walk *w;
+    uint32_t i, p;
+    int n;
+
+    if(!(w = calloc(1, sizeof(struct walk))))
+        return NULL;
+    w->odb = odb_ref(odb); // the walk may outlive the caller's reference
+    w->phase = WALK_COMMITS;
+    if(!(w->cache = base_cache_new(cache_bytes)) ||
+       !(w->pack_seen = calloc(odb->npacks ? odb->npacks : 1, sizeof(uint8_t *)))) {
+        walk_free(w);
+        return NULL;
+    }
+    for(n = 0; n < odb->npacks; n++) {
+        if(!(w->pack_seen[n] = calloc(odb->idxs[n]->entries / 8 + 1, 1))) {
+            walk_free(w);
+            return NULL;
+        }
+    }
+
+    for(n = 0; n < nexclude; n++) {
+        if(add_tip(w, exclude[n], 1) != 0) {
+            walk_free(w);
+            return NULL;
+        }
+    }
+    for(n = 0; n < ninclude; n++) {
+        if(add_tip(w, include[n], 0) != 0) {
+            walk_free(w);
+            return NULL;
+        }
+    }
+
+    if(limit_commits(w) != 0) {
+        walk_free(w);
+        return NULL;
+    }
+
+    // everything in the trees just behind the boundary is already there
+    for(i = 0; i < w->norder; i++) {
+        struct walk_commit *commit = &w->commits[w->order[i]];
+        for(n = 0; n < (int) commit->nparents; n++) {
+            if(oid_map_get(&w->commit_map, w->parent_ids[commit->parents + n], &p) != 0)
+                continue;
+            if((w->commits[p].flags & (WALK_UNINTERESTING | WALK_EDGE)) == WALK_UNINTERESTING) {
+                w->commits[p].flags |= WALK_EDGE;
+                mark_tree_seen(w, w->commits[p].tree);
+            }
+        }
+    }
+
+    return w;
+}
+
+// Produces the next object: all the commits first, newest first, then the
+// other tips, then the contents of each commit's tree. Returns 1 for an
+// object, 0 at the end and -1 for an object that is missing or can't be
+// parsed; *sha1 is set to it and the walk can carry on past it.
+int walk_next(struct walk *w, const unsigned char **sha1, unsigned int *type, const char **path)
+{
+    struct walk_frame *frame;
+    struct odb_location loc;
+    struct walk_root *root;
+    const unsigned char *entry_sha1;
+    const char *name;
+    size_t name_len;
+    unsigned int mode;
+    int seen;
+
+    for(;;) {
+        if(w->phase == WALK_COMMITS) {
+            if(w->next_commit < w->norder) {
+                *sha1 = w->commits[w->order[w->next_commit++]].sha1;
+                *type = COMMIT;
+                *path = "";
+                return 1;
+            }
+            w->phase = WALK_TREES;
+        }
+        if(w->phase == WALK_DONE)
+            return 0;
+
+        if(w->depth == 0) {
+            // start on the next root
+            if(w->next_root < w->nroots) {
+                root = &w->roots[w->next_root++];
+                *sha1 = root->sha1;
+                *type = root->type;
+            } else if(w->next_tree < w->norder) {
+                *sha1 = w->commits[w->order[w->next_tree++]].tree;
+                *type = TREE;
+            } else {
+                w->phase = WALK_DONE;
+                return 0;
+            }
+            *path = "";
+
+            if((seen = mark_seen(w, *sha1, &loc)) > 0)
+                continue;
+            if(seen < 0)
+                return -1;
+            if(*type == TREE && push_tree(w, *sha1, &loc, 0) != 0)
+                return -1;
+            return 1;
+        }
+
+        frame = &w->stack[w->depth - 1];
+        if(frame->pos >= frame->size) {
+            free(frame->data);
+            w->depth--;
+            continue;
+        }
+        if(tree_next_entry(frame->data, frame->size, &frame->pos, &mode, &name, &name_len, &entry_sha1) != 0) {
+            // a corrupt tree; report it and give up on the rest of it
+            frame->pos = frame->size;
+            *sha1 = frame->sha1;
+            *type = TREE;
+            *path = "";
+            return -1;
+        }
+        if((mode & 0170000) == S_IFGITLINK)
+            continue;
+
+        if(set_path(w, frame->path_len, name, name_len) != 0)
+            return -1;
+        *sha1 = entry_sha1;
+        *type = ((mode & 0170000) == S_IFTREE) ? TREE : BLOB;
+        *path = w->path;
+
+        if((seen = mark_seen(w, entry_sha1, &loc)) > 0)
+            continue;
+        if(seen < 0)
+            return -1;
+        // pushing may move the stack, but entry_sha1 points into frame->data, which stays put
+        if(*type == TREE && push_tree(w, entry_sha1, &loc, strlen(w->path)) != 0)
+            return -1;
+        return 1;
+    }
+}
+
+void walk_free(struct walk *w)
+{
+    int n;
+
+    if(!w)
+        return;
+
+    while(w->depth > 0)
+        free(w->stack[--w->depth].data);
+    free(w->stack);
+    free(w->path);
+    if(w->pack_seen) {
+        for(n = 0; n < w->odb->npacks; n++)
+            free(w->pack_seen[n]);
+        free(w->pack_seen);
+    }
+    oid_map_free(&w->loose_seen);
+    oid_map_free(&w->commit_map);
+    free(w->commits);
+    free(w->parent_ids);
+    free(w->queue);
+    free(w->order);
+    free(w->roots);
+    if(w->cache)
+        base_cache_free(w->cache);
+    odb_close(w->odb);
+    free(w);
+}
+
+// Calls fn for every object reachable from include but not from exclude.
+// Returns 0 when done, -1 if the walk couldn't start or any object was
+// missing (the rest are still reported), or the positive value fn stopped
+// with.
+int walk_objects(struct odb *odb, const unsigned char (*include)[20], int ninclude,
+                 const unsigned char (*exclude)[20], int nexclude, size_t cache_bytes,
+                 walk_fn fn, void *cb_data)
+{
+    struct walk *w;
+    const unsigned char *sha1;
+    const char *path;
+    unsigned int type;
+    int status, ret = 0, stop = 0;
+
+    if(!(w = walk_new(odb, include, ninclude, exclude, nexclude, cache_bytes)))
+        return -1;
+
+    while(!stop && (status = walk_next(w, &sha1, &type, &path)) != 0) {
+        if(status < 0) {
+            ret = -1;
+            continue;
+        }
+        stop = fn(sha1, type, path, cb_data);
+    }
+
+    walk_free(w);
+    return stop ? stop : ret;
+}
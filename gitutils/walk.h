@@ -0,0 +1,26 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct odb;
+struct walk;
+
+// Called once per reachable object, like a line of "git rev-list --objects".
+// path is the path the tree or blob was first found at ("" for commits, tags
+// and root trees) and is only valid during the call. Return a positive value
+// to stop early.
+typedef int (*walk_fn)(const unsigned char *sha1, unsigned int type, const char *path, void *cb_data);
+
+struct walk *walk_new(struct odb *odb, const unsigned char (*include)[20], int ninclude,
+                      const unsigned char (*exclude)[20], int nexclude, size_t cache_bytes);
+int walk_next(struct walk *w, const unsigned char **sha1, unsigned int *type, const char **path);
+void walk_free(struct walk *w);
+
+int walk_objects(struct odb *odb, const unsigned char (*include)[20], int ninclude,
+                 const unsigned char (*exclude)[20], int nexclude, size_t cache_bytes,
+                 walk_fn fn, void *cb_data);
+
+
+#endif